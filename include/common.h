@@ -2,45 +2,181 @@
 #ifndef INCLUDE__COMMON_H
 #define INCLUDE__COMMON_H
 
-#ifdef DEBUG
-#define LOG( format, ...) ( fprintf( stderr, format, ##__VA_ARGS__))
-#else
-#define LOG( format, ...) 
-#endif
-
-#define MEASURE_TIME_MS( timerVar, ...) do { \
-	struct timeval timerVar##_start, timerVar##_end; \
-    long timerVar##_seconds, timerVar##_useconds; \
-    gettimeofday( &timerVar##_start, NULL); \
-    __VA_ARGS__ \
-    gettimeofday( &timerVar##_end, NULL); \
-    timerVar##_seconds  = timerVar##_end.tv_sec  - timerVar##_start.tv_sec; \
-    timerVar##_useconds = timerVar##_end.tv_usec - timerVar##_start.tv_usec; \
-    timerVar = ( timerVar##_seconds * 1000 + timerVar##_useconds / 1000.0); \
-} while (0)
+#include <stdint.h>
+
+#include "logging.h"  // LOG() and its levels
+
+// Phases are timed with traceNowNs() and traceSpan() (see trace.h)
+
+// Every message on a server-worker connection is a MessageHeader 
+// followed by <length> bytes of the payload of the given type
+#define MESSAGE_BENCHMARK  1  // worker -> server, Benchmark
+#define MESSAGE_REQUEST    2  // server -> worker, Request
+#define MESSAGE_RESPONSE   3  // worker -> server, Response
+#define MESSAGE_DONE       4  // server -> worker, no payload: no more requests
+#define MESSAGE_HEARTBEAT  5  // worker -> server, Heartbeat
+#define MESSAGE_CANCEL     6  // server -> worker, Cancel
+#define MESSAGE_ESTIMATE   7  // worker -> server, Estimate
+#define MESSAGE_CHANNEL    8  // worker -> server over a Unix socket, no payload: 
+                              // the fds of a ShmChannel, if any (see shmChannel.h)
+#define MESSAGE_TRACE      9  // server -> worker, TraceQuery: asks for the spans;
+                              // worker -> server, TraceRecords, an empty one last
+
+#define MAX_MESSAGE_LENGTH 1024
+
+struct MessageHeader
+{
+	int type;
+	int length;
+};
+typedef struct MessageHeader MessageHeader;
 
 struct Request
 {
 	double startPoint;
 	double endPoint;
 	double delta;
+	int id;
+	double deadlineMs;  // time the worker has for the request; 0 for no limit
+	// Progressive requests start with a coarse step that is halved 
+	// down to delta, or until the estimated error is below tolerance
+	int isProgressive;
+	double tolerance;
 };
 typedef struct Request Request;
 
+#define RESPONSE_OK                 0
+#define RESPONSE_CANCELLED          1
+#define RESPONSE_DEADLINE_EXCEEDED  2
+#define RESPONSE_REJECTED           3  // the worker's job queue was full
+
+#define PERF_CYCLES         1
+#define PERF_INSTRUCTIONS   2
+#define PERF_BRANCH_MISSES  4
+#define PERF_CACHE_MISSES   8
+
+// Hardware counters summed over the threads that computed a request
+// (see perfCounters.c), user space only; a counter the worker couldn't
+// read is 0 and its bit is clear in validCounters
+struct PerfCounts
+{
+	uint64_t cycles;
+	uint64_t instructions;
+	uint64_t branchMisses;
+	uint64_t cacheMisses;
+	int validCounters;  // PERF_* bits
+};
+typedef struct PerfCounts PerfCounts;
+
 struct Response
 {
 	double timeElapsed;
-	double result;
+	double result;  // partial if the request was stopped
+	int id;  // of the request
+	int status;
+	// On the worker's clock (see trace.h), for the server to estimate
+	// the offset between the two clocks
+	uint64_t receivedNs;  // when the request came in
+	uint64_t sentNs;      // when the response went out
+	PerfCounts perfCounts;  // all 0 unless the worker counts them (-e)
 };
 typedef struct Response Response;
 
+// Asks the worker to drop a request, queued or running; it still
+// answers with a RESPONSE_CANCELLED Response
+struct Cancel
+{
+	int requestId;
+};
+typedef struct Cancel Cancel;
+
+// Sent by a worker after each refinement of a progressive request;
+// the Response comes after the last one
+struct Estimate
+{
+	int requestId;
+	double result;
+	double errorBound;  // estimated from the last two refinements
+	double delta;  // step the estimate was computed with
+};
+typedef struct Estimate Estimate;
+
+#define MAX_THROUGHPUT_POINTS 8
+
+// Sent periodically by a worker, whether it is computing or not
+struct Heartbeat
+{
+	int requestId;  // request being computed for this server, -1 if none
+	double fractionDone;
+	double partialSum;
+	double evaluationsPerSecond;
+};
+typedef struct Heartbeat Heartbeat;
+
 struct Benchmark
 {
 	double timeMs;
 	double delta;
+
+	int numberOfCores;
+	int numberOfThreads;
+	int simdLevel;
+	int numberOfNumaNodes;
+	long l1CacheBytes;
+	long l2CacheBytes;
+	long l3CacheBytes;
+	double cpuQuota;  // in cores; 0 means unlimited
+
+	// CPU layout the worker's threads run on
+	int numberOfPhysicalCores;
+	int numberOfAllowedCpus;
+	int threadsPerCore;
+	int isPinned;
+
+	// Measured throughput (evaluation steps per ms) vs. number of threads
+	int numberOfThroughputPoints;
+	int throughputThreads[ MAX_THROUGHPUT_POINTS];
+	double throughput[ MAX_THROUGHPUT_POINTS];
+
+	// How many requests the worker accepts at a time; the server keeps 
+	// that many chunks in flight so the next one is already there when
+	// the current computation finishes
+	int credits;
 };
 typedef struct Benchmark Benchmark;
 
+// Datagram a server sends to find workers; a worker waits a random
+// time within the reply window before connecting, so that a large 
+// number of them doesn't overflow the server's listen() backlog
+struct Announcement
+{
+	char greeting[ 6];  // "hello"
+	int replyWindowMs;
+};
+typedef struct Announcement Announcement;
+
+// The spans the worker recorded since sinceNs, on its own clock
+struct TraceQuery
+{
+	uint64_t sinceNs;
+};
+typedef struct TraceQuery TraceQuery;
+
+#define TRACE_NAME_LENGTH 16
+
+// A span of a trace (see trace.h), on the clock of whoever recorded it
+struct TraceRecord
+{
+	char name[ TRACE_NAME_LENGTH];
+	uint64_t startNs;
+	uint64_t endNs;
+	long arg;
+	int threadId;
+};
+typedef struct TraceRecord TraceRecord;
+
+#define MAX_TRACE_RECORDS ( MAX_MESSAGE_LENGTH / ( int) sizeof( TraceRecord))
+
 struct Interval
 {
 	double start;
@@ -0,0 +1,52 @@
+
+#ifndef INCLUDE__HARDWARE_H
+#define INCLUDE__HARDWARE_H
+
+#include <stdbool.h>
+
+#define SIMD_NONE    0
+#define SIMD_SSE2    1
+#define SIMD_AVX     2
+#define SIMD_AVX2    3
+#define SIMD_AVX512  4
+#define SIMD_NEON    5
+
+struct HardwareInfo
+{
+  int numberOfCores;
+  int simdLevel;
+  int numberOfNumaNodes;
+  long l1CacheBytes;
+  long l2CacheBytes;
+  long l3CacheBytes;
+  double cpuQuota;  // in cores; 0 when the cgroup sets no limit
+};
+typedef struct HardwareInfo HardwareInfo;
+
+#define MAX_CPUS 1024
+
+struct CpuLayout
+{
+  int numberOfOnlineCpus;
+  int numberOfAllowedCpus;    // in the process' affinity mask
+  int numberOfPhysicalCores;  // distinct cores among the allowed CPUs
+  int threadsPerCore;         // SMT siblings per core
+  int numberOfNodes;          // NUMA nodes among the allowed CPUs
+  int numberOfThreads;        // chosen (or requested) number of threads
+  bool isPinned;
+  // CPU for the i-th thread: one per physical core first,
+  // then the remaining SMT siblings
+  int cpus[ MAX_CPUS];
+  int nodes[ MAX_CPUS];  // NUMA node of cpus[ i]
+};
+typedef struct CpuLayout CpuLayout;
+
+void detectHardware( HardwareInfo *infoOut);
+
+// Picks the number of threads (unless requestedThreads > 0) from the
+// physical cores in the affinity mask and the cgroup CPU quota.
+// CPUs are ordered node by node
+void detectCpuLayout( double cpuQuota, int requestedThreads, CpuLayout *layoutOut);
+const char *simdLevelName( int simdLevel);
+
+#endif  // INCLUDE__HARDWARE_H
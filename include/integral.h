@@ -1,8 +1,61 @@
-
 #ifndef INTEGRAL_H
 #define INTEGRAL_H
 
+#include "common.h"
+
+/* Updated by the threads as they go, readable while integrating */
+struct IntegrationProgress {
+  long total_steps;
+  long steps_done;
+  double partial_sum;
+  int evaluations_per_step;  /* of f: 2, or 1 with midpoints_only */
+};
+typedef struct IntegrationProgress IntegrationProgress;
+
+#define INTEGRATION_CANCELLED 5
+#define INTEGRATION_DEADLINE_EXCEEDED 6
+
+/* Checked by the threads at every block boundary; stop_reason becomes
+ * INTEGRATION_CANCELLED or INTEGRATION_DEADLINE_EXCEEDED once they stop */
+struct CancellationToken {
+  int stop_reason;
+  double deadline;  /* CLOCK_MONOTONIC time in seconds, 0 for none */
+};
+typedef struct CancellationToken CancellationToken;
+
+struct IntegrationOptions {
+  int n_threads;
+  /* CPU to pin each thread to, or NULL to leave threads unpinned */
+  const int *cpus;
+  /* NUMA node of each thread, or NULL. Threads of each node form a
+   * sub-pool that gets its share of the interval and allocates its
+   * own state on the node */
+  const int *nodes;
+  /* Progress to report into, or NULL */
+  IntegrationProgress *progress;
+  /* Cancellation and deadline, or NULL */
+  CancellationToken *cancellation;
+  /* Hardware counters of every thread's work to add into, or NULL
+   * not to count them (see perfCounters.h) */
+  PerfCounts *perf_counts;
+  /* After each block, every thread idles (slowdown - 1) times as long
+   * as the block took, to play a slower machine; 0 or 1 not to */
+  double slowdown;
+  /* Non-zero to sum f only at the middle of each step (the midpoint
+   * rule): the points that halving a trapezoid step adds */
+  int midpoints_only;
+};
+typedef struct IntegrationOptions IntegrationOptions;
+
 int integrate(double (*f)(double), double a, double b, 
   int n_threads, double delta, double *res);
 
-#endif  // INTEGRAL_H 
\ No newline at end of file
+/* Returns INTEGRATION_CANCELLED or INTEGRATION_DEADLINE_EXCEEDED,
+ * with the partial sum in res, if the integration was stopped */
+int integrate_with_options(double (*f)(double), double a, double b, 
+  double delta, const IntegrationOptions *options, double *res);
+
+/* Safe to call from any thread, before or during the integration */
+void cancel_integration(CancellationToken *token);
+
+#endif  // INTEGRAL_H
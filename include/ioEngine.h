@@ -0,0 +1,68 @@
+
+#ifndef INCLUDE__IO_ENGINE_H
+#define INCLUDE__IO_ENGINE_H
+
+#include <stdbool.h>
+
+#include "common.h"
+
+#define IO_ENGINE_EPOLL  0
+#define IO_ENGINE_URING  1
+
+#define IO_EVENT_MESSAGE   0  // a whole message came through a stream
+#define IO_EVENT_CLOSED    1  // a stream ended or failed, and is no longer watched
+#define IO_EVENT_READABLE  2  // a readable fd is ready, or its peer has gone
+#define IO_EVENT_ACCEPTED  3  // a listening socket has a new connection
+
+struct IoEvent
+{
+  int type;
+  int fd;  // the watched one
+  int acceptedSocket;  // IO_EVENT_ACCEPTED; the handler owns it
+  MessageHeader header;  // IO_EVENT_MESSAGE
+  const void *payload;  // IO_EVENT_MESSAGE, valid during the handler only
+};
+typedef struct IoEvent IoEvent;
+
+typedef void ( *IoHandler)( void *context, const IoEvent *event);
+
+struct IoFd;
+struct IoUring;
+
+// The server's event loop over listening sockets, message streams
+// and readable fds, on epoll or io_uring (see ioEngine.c)
+struct IoEngine
+{
+  int kind;
+  int epollFd;  // IO_ENGINE_EPOLL only
+  struct IoUring *ring;  // IO_ENGINE_URING only
+  char *scratch;  // IO_ENGINE_EPOLL: what a recv() brings in
+  struct IoFd *fds;  // indexed by file descriptor
+  int fdCapacity;
+};
+typedef struct IoEngine IoEngine;
+
+// With IO_ENGINE_URING, falls back to epoll if the kernel lacks
+// what the engine needs; kind tells which one it got
+bool initIoEngine( IoEngine *engine, int kind);
+// Waits (up to a second) for the messages already on their way out
+void destroyIoEngine( IoEngine *engine);
+const char *ioEngineName( int kind);
+
+// Each fd is watched in one way at a time
+bool watchListener( IoEngine *engine, int listeningSocket);
+bool watchStream( IoEngine *engine, int socket);  // delivers whole messages
+bool watchReadable( IoEngine *engine, int fd);    // level-triggered
+// Drops what is still queued for the fd, so that it can be closed
+void unwatchFd( IoEngine *engine, int fd);
+
+// To a watched stream. With epoll it is sent right away; with io_uring
+// it waits for the next pollIoEngine() or submitIoEngine(), and
+// the messages to every stream go out in a single system call
+bool queueIoMessage( IoEngine *engine, int socket, int type, const void *payload, int length);
+void submitIoEngine( IoEngine *engine);
+// Waits up to timeoutMs for events, and calls the handler for each of
+// them. Returns their number, or -1 with errno set
+int pollIoEngine( IoEngine *engine, int timeoutMs, IoHandler handler, void *context);
+
+#endif  // INCLUDE__IO_ENGINE_H
@@ -0,0 +1,42 @@
+
+#ifndef INCLUDE__JOB_QUEUE_H
+#define INCLUDE__JOB_QUEUE_H
+
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "common.h"
+
+struct Job
+{
+  int connectionSlot;  // where the result goes back to
+  long connectionId;   // tells a reused slot from the original connection
+  Request request;
+  uint64_t receivedNs;  // on the trace clock
+  double deadlineMs;  // CLOCK_MONOTONIC time in ms, 0 for none
+  Response response;
+  bool isOk;
+  Estimate estimate;  // on the way to the response; the job goes on
+};
+typedef struct Job Job;
+
+// Bounded FIFO of jobs shared between the event loop and the compute thread
+struct JobQueue
+{
+  Job *jobs;
+  int capacity;
+  int head;
+  int length;
+  pthread_mutex_t mutex;
+  pthread_cond_t notEmpty;
+};
+typedef struct JobQueue JobQueue;
+
+bool initJobQueue( JobQueue *queue, int capacity);
+void destroyJobQueue( JobQueue *queue);
+bool tryPushJob( JobQueue *queue, const Job *job);  // false when the queue is full
+bool tryPopJob( JobQueue *queue, Job *jobOut);      // false when the queue is empty
+void popJob( JobQueue *queue, Job *jobOut);         // blocks until there is a job
+bool isJobQueueFull( JobQueue *queue);
+
+#endif  // INCLUDE__JOB_QUEUE_H
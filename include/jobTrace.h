@@ -0,0 +1,37 @@
+
+#ifndef INCLUDE__JOB_TRACE_H
+#define INCLUDE__JOB_TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "workerTable.h"
+
+// The spans of one job, from the server and from each of its
+// workers, on their own clocks until they are written out
+struct JobTrace
+{
+  uint64_t startNs;  // of the job, on the server's clock
+  TraceRecord *records;
+  int *recordWorkers;  // -1 for the server's own
+  int numberOfRecords;
+  int capacity;
+  bool *isWorkerDone;  // has sent all of its spans
+};
+typedef struct JobTrace JobTrace;
+
+bool initJobTrace( JobTrace *trace, int numberOfWorkers, uint64_t startNs);
+void destroyJobTrace( JobTrace *trace);
+bool addTraceRecords( JobTrace *trace, int worker, const TraceRecord *records, int count);
+// The server's own spans that end after the job started
+bool addServerSpans( JobTrace *trace);
+// True once every worker still alive has sent its spans
+bool isJobTraceComplete( const JobTrace *trace, const WorkerTable *workers);
+
+// Chrome's trace event format (chrome://tracing, ui.perfetto.dev):
+// a process per worker, a row per thread, times in microseconds
+// since the start of the job on the server's clock
+bool writeChromeTrace( const JobTrace *trace, const WorkerTable *workers, const char *path);
+
+#endif  // INCLUDE__JOB_TRACE_H
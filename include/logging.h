@@ -0,0 +1,40 @@
+
+#ifndef INCLUDE__LOGGING_H
+#define INCLUDE__LOGGING_H
+
+#include <stdbool.h>
+
+#define LOG_LEVEL_ERROR  0
+#define LOG_LEVEL_WARN   1
+#define LOG_LEVEL_INFO   2  // the default
+#define LOG_LEVEL_DEBUG  3  // every message and request
+
+#define LOG_RING_RECORDS 1024  // per thread; a message that doesn't fit is dropped
+#define LOG_RECORD_LENGTH 256  // of a message's arguments and strings, not of its text
+
+extern int logLevel;
+
+#ifdef DEBUG
+// The arguments are only evaluated when the level is on
+#define LOG_AT( level, format, ...) \
+  do { if ( ( level) <= logLevel) logRecord( format, ##__VA_ARGS__); } while ( 0)
+#else
+#define LOG_AT( level, format, ...) do { } while ( 0)
+#endif
+
+#define LOG( format, ...)       LOG_AT( LOG_LEVEL_INFO, format, ##__VA_ARGS__)
+#define LOG_ERROR( format, ...) LOG_AT( LOG_LEVEL_ERROR, format, ##__VA_ARGS__)
+#define LOG_WARN( format, ...)  LOG_AT( LOG_LEVEL_WARN, format, ##__VA_ARGS__)
+#define LOG_DEBUG( format, ...) LOG_AT( LOG_LEVEL_DEBUG, format, ##__VA_ARGS__)
+
+// "error", "warn", "info" or "debug"; false for anything else
+bool setLogLevel( const char *name);
+
+// Copies the arguments into the calling thread's ring for the logging
+// thread to format later: the format must be a string literal, as only
+// its pointer is kept; %s strings are copied. No %n
+void logRecord( const char *format, ...) __attribute__(( format( printf, 1, 2)));
+// Writes out whatever the threads have logged so far; also at exit()
+void flushLog();
+
+#endif  // INCLUDE__LOGGING_H
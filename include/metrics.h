@@ -0,0 +1,36 @@
+
+#ifndef INCLUDE__METRICS_H
+#define INCLUDE__METRICS_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define MAX_COUNTERS 16
+#define MAX_GAUGES 8
+#define MAX_HISTOGRAMS 8
+#define HISTOGRAM_SUB_BUCKETS 8  // per power of two: a value is known within 12.5%
+#define HISTOGRAM_BUCKETS 320    // up to 2^42 ns, over an hour; longer ones go in the last
+
+// Metrics are defined once, before any thread records them; each
+// define*() returns the id to record with, or -1 when there is no
+// more room (recording with -1 does nothing). Names follow
+// Prometheus': counters end in _total, histograms in _seconds
+int defineCounter( const char *name, const char *help);
+int defineGauge( const char *name, const char *help);
+int defineHistogram( const char *name, const char *help);
+
+void addToCounter( int counter, uint64_t value);
+void setGauge( int gauge, int64_t value);
+void addToGauge( int gauge, int64_t value);
+// Into the calling thread's own buckets: no lock, no shared cache line
+void recordHistogramNs( int histogram, uint64_t valueNs);
+
+// Every metric in Prometheus' text format, histograms summed over the threads
+void writeMetrics( FILE *file);
+// Answers every HTTP request on the TCP port (or the Unix socket if
+// the address starts with '/') with writeMetrics(), from a thread
+// of its own. False if it can't listen
+bool serveMetrics( const char *address);
+
+#endif  // INCLUDE__METRICS_H
@@ -0,0 +1,33 @@
+
+#ifndef INCLUDE__MPSC_QUEUE_H
+#define INCLUDE__MPSC_QUEUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Bounded lock-free FIFO of fixed-size items, for any number of
+// producer threads and a single consumer thread. Each slot carries
+// a sequence number that tells whose turn it is; head and tail sit
+// on separate cache lines so the two sides don't fight over one
+struct MpscQueue
+{
+  char *slots;
+  size_t slotSize;  // the sequence number, then the item
+  size_t itemSize;
+  uint64_t mask;    // capacity - 1
+  char padding[ 32];
+  uint64_t head;    // the consumer's only
+  char headPadding[ 56];
+  uint64_t tail;    // claimed by producers with a compare-and-swap
+  char tailPadding[ 56];
+};
+typedef struct MpscQueue MpscQueue;
+
+// The capacity is rounded up to a power of two
+bool initMpscQueue( MpscQueue *queue, int capacity, size_t itemSize);
+void destroyMpscQueue( MpscQueue *queue);
+bool tryPushMpsc( MpscQueue *queue, const void *item);  // false when the queue is full
+bool tryPopMpsc( MpscQueue *queue, void *itemOut);      // false when it is empty; consumer only
+
+#endif  // INCLUDE__MPSC_QUEUE_H
@@ -0,0 +1,30 @@
+
+#ifndef INCLUDE__PERF_COUNTERS_H
+#define INCLUDE__PERF_COUNTERS_H
+
+#include <stdbool.h>
+
+#include "common.h"
+
+#define NUMBER_OF_PERF_COUNTERS 4
+
+// The counters of one thread, from start to stop
+struct PerfSession
+{
+  int fds[ NUMBER_OF_PERF_COUNTERS];  // -1 for those that couldn't be opened
+  int groupFd;  // the first one opened leads the group
+  int validCounters;
+};
+typedef struct PerfSession PerfSession;
+
+// Starts counting for the calling thread. False if no counter can be
+// opened; once the kernel has refused them (no permission, no PMU),
+// later calls give up without a system call
+bool startPerfCounters( PerfSession *session);
+// Stops, closes, and adds the counts to the totals, which any number
+// of threads may add to at once
+void stopPerfCounters( PerfSession *session, PerfCounts *totalsInOut);
+
+void addPerfCounts( PerfCounts *totalsInOut, const PerfCounts *counts);
+
+#endif  // INCLUDE__PERF_COUNTERS_H
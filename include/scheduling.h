@@ -0,0 +1,97 @@
+
+#ifndef INCLUDE__SCHEDULING_H
+#define INCLUDE__SCHEDULING_H
+
+#include <stdbool.h>
+
+#include "common.h"
+
+// Who computes which chunk, as far as the scheduler knows
+struct ScheduledChunk
+{
+  Interval interval;
+  int worker;  // the chunk was last sent to; -1 if never sent or taken back
+  int speculativeWorker;  // computing a duplicate of the chunk; -1 if none
+  double fractionDone;  // as reported in heartbeats
+  bool isDone;
+  // The scheduler's own: the position in runningChunks, -1 if not
+  // there, and the links of the lists of worker and speculativeWorker
+  int heapPosition;
+  int next[ 2];
+  int previous[ 2];
+};
+typedef struct ScheduledChunk ScheduledChunk;
+
+// The server's dispatch policy, with no I/O, so that the simulator
+// (see simulator.c) makes the very same decisions. Every decision
+// takes time logarithmic in the number of chunks at most, or linear
+// in what it hands out, so that pools of 100k workers stay cheap
+struct Schedule
+{
+  ScheduledChunk *chunks;
+  int numberOfChunks;
+  int numberOfWorkers;
+  bool isStatic;  // chunk i belongs to worker i
+  bool isSpeculative;
+  int nextChunk;
+  int numberOfChunksDone;
+  int *retryChunks;  // taken back from failed workers
+  int numberOfRetryChunks;
+  // Chunks being computed that have no duplicate yet, least done on
+  // top, ties going to the lowest index; kept only if isSpeculative
+  int *runningChunks;
+  int numberOfRunningChunks;
+  // Per worker, the first of the chunks it computes and of the
+  // duplicates it computes, or -1
+  int *firstChunks[ 2];
+  // Workers that asked for a chunk and got none, first come first
+  // served, each at most once
+  int *waitingWorkers;
+  bool *isWaiting;
+  int firstWaiting;
+  int numberOfWaitingWorkers;
+  int waitingRoundLeft;
+};
+typedef struct Schedule Schedule;
+
+// Steps per ms the worker is expected to sustain
+double estimateWorkerThroughput( const Benchmark *benchmark);
+// One interval per worker: equal ones, or with load balancing
+// proportional to the workers' estimated throughput
+void computeIntervalsForWorkers( bool useLoadBalancing, const Benchmark *benchmarks,
+  int numberOfWorkers, Interval interval, Interval *intervalsOut);
+
+// numberOfChunks 0: chunk i is workerIntervals[ i], for worker i;
+// otherwise equal chunks that workers pull as they go. False if out of memory
+bool initSchedule( Schedule *schedule, int numberOfChunks, bool isSpeculative,
+  Interval interval, const Interval *workerIntervals, int numberOfWorkers);
+void destroySchedule( Schedule *schedule);
+
+// Index of the next chunk for the worker, or -1 if there is none, in
+// which case the worker waits (see nextWaitingWorker()). Chunks taken
+// back from failed workers go first, to anyone; an idle worker (with
+// nothing outstanding) may then get a duplicate of the least done
+// running chunk, in which case *isDuplicateOut is set
+int takeChunk( Schedule *schedule, int worker, bool isIdle, bool *isDuplicateOut);
+void assignChunk( Schedule *schedule, int chunk, int worker, bool isDuplicate);
+// Hands the chunk to the next worker that asks
+void requeueChunk( Schedule *schedule, int chunk);
+// The worker turned the chunk down: it goes back as if the worker
+// had failed with it alone
+void returnChunk( Schedule *schedule, int chunk, int worker);
+// What a heartbeat of the worker says; ignored unless it computes the chunk
+void setChunkProgress( Schedule *schedule, int chunk, int worker, double fractionDone);
+// False if the chunk was done already. Otherwise *otherWorkerOut is
+// the worker computing the other copy, to cancel, or -1
+bool completeChunk( Schedule *schedule, int chunk, int worker, int *otherWorkerOut);
+// Takes back the chunks of a worker that failed; a duplicate of one
+// carries on in its place. Then a round of the waiting workers starts
+void failScheduledWorker( Schedule *schedule, int worker);
+// The next worker of the round to ask for chunks again, or -1 once
+// every worker that waited when it started has asked, or there is
+// no chunk left for any of them
+int nextWaitingWorker( Schedule *schedule);
+// For reporting: chunks done count whole, others by their fractionDone
+double scheduleFractionDone( const Schedule *schedule);
+
+#endif  // INCLUDE__SCHEDULING_H
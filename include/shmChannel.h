@@ -0,0 +1,59 @@
+
+#ifndef INCLUDE__SHM_CHANNEL_H
+#define INCLUDE__SHM_CHANNEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common.h"
+
+#define SHM_RING_BYTES ( 256 * 1024)
+
+// Single-producer single-consumer byte ring in shared memory. 
+// head and tail count the bytes ever read and written, and sit on
+// separate cache lines so the two sides don't fight over one
+struct ShmRing
+{
+  uint64_t head;
+  char headPadding[ 56];
+  uint64_t tail;
+  char tailPadding[ 56];
+  char data[ SHM_RING_BYTES];
+};
+typedef struct ShmRing ShmRing;
+
+// A server-worker connection through a memfd holding one ring per
+// direction, with an eventfd per direction to wake the reader up.
+// Messages are framed as on a socket: a MessageHeader and the payload
+struct ShmChannel
+{
+  int memoryFd;
+  void *memory;
+  ShmRing *inbound;
+  ShmRing *outbound;
+  int inboundFd;   // eventfd signalled when inbound has data; poll it
+  int outboundFd;  // eventfd to signal the other side with
+};
+typedef struct ShmChannel ShmChannel;
+
+// Worker side: creates the channel, to be handed to the server with 
+// sendShmChannel() over a Unix socket
+bool createShmChannel( ShmChannel *channel);
+bool sendShmChannel( int socket, const ShmChannel *channel);
+// Server side: receives the MESSAGE_CHANNEL a local worker sends after 
+// its Benchmark; false on failure. *hasChannelOut is false if the 
+// worker couldn't set a channel up and stays on the socket
+bool recvShmChannel( int socket, ShmChannel *channelOut, bool *hasChannelOut);
+void destroyShmChannel( ShmChannel *channel);
+
+// false if the ring is full; the message is then not sent
+bool sendShmMessage( ShmChannel *channel, int type, const void *payload, int length);
+// 1 if a message was received, 0 if there is none, -1 if it is malformed
+int recvShmMessage( ShmChannel *channel, MessageHeader *headerOut, void *payloadOut);
+bool hasShmMessage( const ShmChannel *channel);
+// Bytes of the next message with its header; 0 if there is none, -1 if malformed
+int nextShmMessageSize( const ShmChannel *channel);
+// Resets the wakeup; drain the ring with recvShmMessage() after it
+void clearShmWakeup( ShmChannel *channel);
+
+#endif  // INCLUDE__SHM_CHANNEL_H
@@ -0,0 +1,27 @@
+
+#ifndef INCLUDE__THREAD_SLOTS_H
+#define INCLUDE__THREAD_SLOTS_H
+
+#include <stddef.h>
+
+// The head of a block of memory that one thread at a time writes to:
+// a trace buffer, a log ring, histogram buckets. The blocks are kept
+// in a lock-free list that only ever grows, so a reader can walk it
+// at any time; a thread that exits gives its block back, with what it
+// recorded, to the next thread that claims one
+struct ThreadSlot
+{
+  int isOwned;
+  struct ThreadSlot *next;
+};
+typedef struct ThreadSlot ThreadSlot;
+
+// A block a finished thread gave back, or a new zeroed one of size
+// bytes, which must start with its ThreadSlot; NULL if out of memory
+ThreadSlot *claimThreadSlot( ThreadSlot **slots, size_t size);
+// Gives the block back; fits pthread_key_create() as a destructor
+void releaseThreadSlot( void *slot);
+// The first block of the list, to walk it along next
+ThreadSlot *firstThreadSlot( ThreadSlot **slots);
+
+#endif  // INCLUDE__THREAD_SLOTS_H
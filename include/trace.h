@@ -0,0 +1,37 @@
+
+#ifndef INCLUDE__TRACE_H
+#define INCLUDE__TRACE_H
+
+#include <stdint.h>
+
+#include "common.h"
+
+#define TRACE_BUFFER_SPANS 4096  // per thread; the oldest spans are overwritten
+
+// A named phase of the work, timed on CLOCK_MONOTONIC_RAW
+struct TraceSpan
+{
+  const char *name;  // a string literal: only the pointer is kept
+  uint64_t startNs;
+  uint64_t endNs;
+  long arg;      // e.g. the request id, -1 if none
+  int threadId;  // the kernel's, as in gettid()
+};
+typedef struct TraceSpan TraceSpan;
+
+typedef void ( *TraceVisitor)( void *context, const TraceSpan *span);
+
+uint64_t traceNowNs();
+// Records a span from startNs to now into the calling thread's
+// buffer; returns its length in ns
+uint64_t traceSpan( const char *name, uint64_t startNs, long arg);
+
+// Every span still in the buffers, thread by thread and oldest first.
+// A thread recording at the same time may have its oldest spans torn
+void visitTraceSpans( TraceVisitor visitor, void *context);
+// LOG()s the number, total and longest time of the spans of each name
+void logTraceSummary();
+// For sending; the name is cut to TRACE_NAME_LENGTH - 1 characters
+void makeTraceRecord( const TraceSpan *span, TraceRecord *recordOut);
+
+#endif  // INCLUDE__TRACE_H
@@ -0,0 +1,66 @@
+
+#ifndef INCLUDE__TRANSPORT_H
+#define INCLUDE__TRANSPORT_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "common.h"
+#include "shmChannel.h"
+
+#define TRANSPORT_TCP   0
+#define TRANSPORT_UNIX  1
+#define TRANSPORT_SHM   2  // a Unix socket upgraded with a ShmChannel
+
+// A server-worker connection, whatever carries it
+struct Transport
+{
+  int kind;
+  int socket;  // -1 once closed; with TRANSPORT_SHM only tells the peer has gone
+  ShmChannel *channel;  // TRANSPORT_SHM only
+};
+typedef struct Transport Transport;
+
+// Non-blocking listening sockets; -1 on failure, with errno set
+int listenTcp( int port, int backlog);
+int listenUnix( const char *path, int backlog);  // replaces a stale socket file
+// A peer on a Unix socket is given the loopback address, with port 0
+bool acceptTransport( int listeningSocket, Transport *transportOut, 
+  struct sockaddr_in *peerAddressOut);
+// The same, for a socket accepted elsewhere (see ioEngine.h); it is 
+// left open on failure
+bool adoptTransport( int socket, Transport *transportOut, struct sockaddr_in *peerAddressOut);
+// With isNonBlocking, the connection may still be in progress
+bool connectTransport( const struct sockaddr *address, socklen_t addressLength, 
+  bool isNonBlocking, Transport *transportOut);
+
+// Upgrading a Unix socket to shared memory: the connecting side
+// offers a channel right after its Benchmark (or sends an empty
+// MESSAGE_CHANNEL if this fails), and the accepting side takes it
+bool offerShmChannel( Transport *transport);
+bool acceptShmChannel( Transport *transport);
+
+// The fd to poll for incoming messages: the socket, or the eventfd
+// of the channel (then poll the socket as well, for the peer going away)
+int transportEventFd( const Transport *transport);
+
+// Whole messages. On sockets these block until the message is sent
+// or received; over shared memory they fail if the ring is full
+// (sending) or empty (receiving)
+bool sendMessage( Transport *transport, int type, const void *payload, int length);
+bool recvMessage( Transport *transport, MessageHeader *headerOut, void *payloadOut);
+bool hasBufferedMessage( const Transport *transport);
+void clearTransportWakeup( Transport *transport);
+
+// Byte streams of whole messages, for non-blocking sockets: they
+// return what was transferred, or -1 with errno EAGAIN if nothing can
+// be; recvTransport() returns 0 once the peer has gone. Shared memory
+// only moves whole messages
+ssize_t sendTransport( Transport *transport, const void *bytes, size_t length);
+ssize_t recvTransport( Transport *transport, void *buffer, size_t capacity);
+
+void closeTransport( Transport *transport);
+
+#endif  // INCLUDE__TRANSPORT_H
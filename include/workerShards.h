@@ -0,0 +1,84 @@
+
+#ifndef INCLUDE__WORKER_SHARDS_H
+#define INCLUDE__WORKER_SHARDS_H
+
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "transport.h"
+#include "ioEngine.h"
+#include "mpscQueue.h"
+#include "workerTable.h"
+
+#define SHARD_MESSAGE  0  // to the scheduler: a message from the worker
+#define SHARD_GONE     1  // to the scheduler: the worker's connection failed or ended
+#define SHARD_SEND     2  // to a shard: a message for the worker
+#define SHARD_DROP     3  // to a shard: the worker is dropped, close its transport
+#define SHARD_STOP     4  // to a shard: send what is queued and exit
+
+struct ShardItem
+{
+  int kind;
+  int worker;
+  MessageHeader header;  // SHARD_MESSAGE and SHARD_SEND
+  char payload[ MAX_MESSAGE_LENGTH];
+};
+typedef struct ShardItem ShardItem;
+
+struct WorkerShards;
+
+// An I/O thread with its own event loop over a share of the workers
+struct WorkerShard
+{
+  pthread_t thread;
+  IoEngine engine;
+  struct WorkerShards *shards;
+  MpscQueue outbox;   // from the scheduler
+  int wakeFd;         // eventfd, signalled when the outbox has items
+  bool hasPosts;      // the scheduler's: wakeFd is yet to be signalled
+
+  // The rest belongs to the shard's thread
+  Transport *transports;  // its own copies, indexed by worker
+  int *workerOfFd;
+  int fdCapacity;
+  ShardItem *overflow;  // what the full inbox couldn't take yet
+  int numberOfOverflowItems;
+  int overflowCapacity;
+  bool hasPushed;       // the inbox is to be signalled
+};
+typedef struct WorkerShard WorkerShard;
+
+// The workers, dealt round-robin to the shards. The scheduler thread
+// posts messages for the workers to the shard that owns them, and
+// takes what the workers send from a single inbox. Messages over
+// shared memory are sent by the scheduler itself, as the only
+// producer on the channel; only receiving goes through the shards
+struct WorkerShards
+{
+  WorkerShard *shards;
+  int numberOfShards;
+  int *shardOfWorker;
+  MpscQueue inbox;  // from every shard to the scheduler
+  int wakeFd;       // eventfd, signalled when the inbox has items; watch it readable
+};
+typedef struct WorkerShards WorkerShards;
+
+// The shards take over the workers' transports from the table;
+// engineKind is a wish, as in initIoEngine()
+bool startWorkerShards( WorkerShards *shards, int numberOfShards, int engineKind,
+  const WorkerTable *workers);
+// Joins the threads once what was posted has gone out
+void stopWorkerShards( WorkerShards *shards);
+
+// Both wait for room if the shard's outbox is full. The shards
+// see what was posted after wakeWorkerShards()
+void postToWorker( WorkerShards *shards, int worker, int type, const void *payload, int length);
+void postDropWorker( WorkerShards *shards, int worker);
+void wakeWorkerShards( WorkerShards *shards);
+
+// Call clearShardsWakeup() first, then take items until there are none
+void clearShardsWakeup( WorkerShards *shards);
+bool takeShardItem( WorkerShards *shards, ShardItem *itemOut);
+
+#endif  // INCLUDE__WORKER_SHARDS_H
@@ -0,0 +1,55 @@
+
+#ifndef INCLUDE__WORKER_TABLE_H
+#define INCLUDE__WORKER_TABLE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "common.h"
+#include "transport.h"
+
+// The server's workers, one array per field: the scheduling loops
+// that run over every worker (liveness checks, credits) only touch
+// the few hot arrays, so they stay cache-efficient for 10k+ workers.
+// Grows on the heap as workers join
+struct WorkerTable
+{
+  int numberOfWorkers;
+  int numberOfAliveWorkers;
+  int capacity;
+
+  // Hot: read on every scheduling decision
+  Transport *transports;   // the socket is -1 once the worker is dropped
+  bool *isAlive;
+  int *outstandingChunks;
+  int *credits;            // chunks the worker accepts at a time
+  double *lastHeardMs;
+
+  // Cold: read when a worker joins or for logging
+  struct sockaddr_in *addresses;
+  Benchmark *benchmarks;
+  Interval *intervals;
+  // The worker's trace clock minus the server's, as estimated from the
+  // round trip of a request that took clockRoundTripNs (UINT64_MAX: none yet)
+  int64_t *clockOffsetNs;
+  uint64_t *clockRoundTripNs;
+
+  // Worker of each socket, indexed by the file descriptor (-1 if none)
+  int *workerOfFd;
+  int fdCapacity;
+};
+typedef struct WorkerTable WorkerTable;
+
+bool initWorkerTable( WorkerTable *table, int capacity);
+void destroyWorkerTable( WorkerTable *table);
+int addWorker( WorkerTable *table, Transport transport, struct sockaddr_in address);  // -1 on failure
+int findWorkerByFd( const WorkerTable *table, int fd);                      // -1 if none
+// To be called once the worker's transport is upgraded to shared memory, 
+// so that findWorkerByFd() finds it by its event fd too
+bool trackTransportUpgrade( WorkerTable *table, int worker);
+void dropWorker( WorkerTable *table, int worker);  // closes the transport
+// The same, leaving the transport open to whoever else holds a copy of it
+void retireWorker( WorkerTable *table, int worker);
+
+#endif  // INCLUDE__WORKER_TABLE_H
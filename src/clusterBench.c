@@ -0,0 +1,523 @@
+
+/*
+  clusterBench.c
+
+  Usage:
+  clusterBench [-w <worker counts>] [-t <threads per worker>] [-a]
+               [-s <slowdowns>] [-c <chunk counts>] [-d <deltas>] [-S]
+               [-r <repetitions>] [-p <base port>] [-D <deadline in seconds>]
+               [-b <bin directory>] [-l error|warn|info|debug]
+
+  Description
+
+  End-to-end benchmark of a whole cluster on the local host, for
+  comparing scheduling changes without hand-starting processes on
+  many machines. For each of the <worker counts> (comma-separated,
+  1,2,4 by default), the program starts that many workers from <bin
+  directory> (./bin by default), each with <threads per worker>
+  threads (1 by default), registering with -r at 127.0.0.1:<base
+  port> (7400 by default) and listening on the ports after it. With
+  -a, each worker is pinned to CPUs of its own, <threads per worker>
+  of them, wrapping around the online CPUs. <slowdowns> (1 by
+  default) are given to the workers' -s in turn, e.g. 1,1,1,4 makes
+  every fourth worker a straggler four times slower than it
+  benchmarks.
+
+  Then it runs a server over [0, 1] for every combination of the
+  <chunk counts> (0, one chunk per worker sized by load balancing,
+  and 64 by default) and the <deltas> (1e-8 by default), with and
+  without speculative duplicates (-S only), <repetitions> times
+  each (3 by default). The workers stay up for all the jobs of their
+  count, registering again with every new server. A server that
+  isn't done within <deadline in seconds> (60 by default) gives up.
+
+  Each run is recorded with the server's answer and its error
+  against the exact integral, the time of each phase as the server
+  traces it (discovery, handshake, partition, dispatch, gather; see
+  trace.c), the makespan (from partitioning to the last result) and
+  the wall time of the whole server. The parallel efficiency is the
+  time a single thread of this process takes for the same integral,
+  over the makespan times the threads of the pool; the capacity
+  efficiency divides the threads by their slowdowns first, so it is
+  1 when the scheduler makes the best of the stragglers.
+
+  The results go to the standard output as one JSON document;
+  progress is logged to the standard error.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "common.h"
+#include "integral.h"
+#include "trace.h"
+
+#define MAX_LIST_VALUES 32
+#define MAX_WORKERS 256
+#define MAX_PHASES 16
+#define PHASE_NAME_LENGTH 32
+#define WORKER_BENCHMARK_DELTA 1e-7
+#define POOL_WAITING_SECONDS 10
+
+struct Args
+{
+  int workerCounts[ MAX_LIST_VALUES];
+  int numberOfWorkerCounts;
+  int chunkCounts[ MAX_LIST_VALUES];
+  int numberOfChunkCounts;
+  double deltas[ MAX_LIST_VALUES];
+  int numberOfDeltas;
+  double slowdowns[ MAX_LIST_VALUES];
+  int numberOfSlowdowns;
+  int threadsPerWorker;
+  bool isPinned;
+  bool trySpeculative;
+  int repetitions;
+  int basePort;
+  int deadlineSeconds;
+  const char *binDirectory;
+};
+typedef struct Args Args;
+
+// A line of the server's trace summary
+struct Phase
+{
+  char name[ PHASE_NAME_LENGTH];
+  long count;
+  double totalMs;
+  double maxMs;
+};
+typedef struct Phase Phase;
+
+struct Run
+{
+  bool isOk;
+  double answer;
+  double wallMs;
+  Phase phases[ MAX_PHASES];
+  int numberOfPhases;
+};
+typedef struct Run Run;
+
+static pid_t workerPids[ MAX_WORKERS];
+static int numberOfWorkerPids;
+
+static void printUsageAndDie();
+static void printAndDie( const char *msg);
+static void parseArgumentsOrDie( int argc, char **argv, Args *argsOut);
+static void runMatrix( const Args *args);
+static void stopWorkers();
+
+static double functionToIntegrate( double x)
+{
+  return x * x;
+}
+
+int main( int argc, char **argv)
+{
+  Args args;
+  parseArgumentsOrDie( argc, argv, &args);
+  // A server that dies mustn't take this process with it
+  signal( SIGPIPE, SIG_IGN);
+  atexit( stopWorkers);
+  runMatrix( &args);
+  return 0;
+}
+
+static void printUsageAndDie()
+{
+  flushLog();
+  fprintf( stderr, "Usage: clusterBench [-w <worker counts>] [-t <threads per worker>] [-a]\n"
+    "       [-s <slowdowns>] [-c <chunk counts>] [-d <deltas>] [-S]\n"
+    "       [-r <repetitions>] [-p <base port>] [-D <deadline in seconds>]\n"
+    "       [-b <bin directory>] [-l error|warn|info|debug]\n");
+  exit( EXIT_FAILURE);
+}
+
+static void printAndDie( const char *msg)
+{
+  flushLog();
+  fprintf( stderr, "%s\n", msg);
+  exit( EXIT_FAILURE);
+}
+
+// Comma-separated numbers; the number of them, or 0 if the list is malformed
+static int parseList( const char *text, double *valuesOut)
+{
+  int numberOfValues = 0;
+  const char *next = text;
+  for ( ;;)
+  {
+    char *end;
+    double value = strtod( next, &end);
+    if ( end == next || numberOfValues == MAX_LIST_VALUES)
+      return 0;
+    valuesOut[ numberOfValues ++] = value;
+    if ( *end == '\0')
+      return numberOfValues;
+    if ( *end != ',')
+      return 0;
+    next = end + 1;
+  }
+}
+
+static int parseIntListOrDie( const char *text, int minValue, int *valuesOut, const char *msg)
+{
+  double values[ MAX_LIST_VALUES];
+  int numberOfValues = parseList( text, values);
+  if ( numberOfValues == 0)
+    printAndDie( msg);
+  for ( int i = 0; i < numberOfValues; ++i)
+  {
+    valuesOut[ i] = ( int) values[ i];
+    if ( valuesOut[ i] != values[ i] || valuesOut[ i] < minValue)
+      printAndDie( msg);
+  }
+  return numberOfValues;
+}
+
+static void parseArgumentsOrDie( int argc, char **argv, Args *argsOut)
+{
+  memset( argsOut, 0, sizeof( *argsOut));
+  argsOut->numberOfWorkerCounts = 3;
+  for ( int i = 0; i < argsOut->numberOfWorkerCounts; ++i)
+    argsOut->workerCounts[ i] = 1 << i;
+  argsOut->numberOfChunkCounts = 2;
+  argsOut->chunkCounts[ 0] = 0;
+  argsOut->chunkCounts[ 1] = 64;
+  argsOut->numberOfDeltas = 1;
+  argsOut->deltas[ 0] = 1e-8;
+  argsOut->numberOfSlowdowns = 1;
+  argsOut->slowdowns[ 0] = 1.0;
+  argsOut->threadsPerWorker = 1;
+  argsOut->repetitions = 3;
+  argsOut->basePort = 7400;
+  argsOut->deadlineSeconds = 60;
+  argsOut->binDirectory = "./bin";
+
+  int option;
+  while ( ( option = getopt( argc, argv, "w:t:as:c:d:Sr:p:D:b:l:")) != -1)
+  {
+    switch ( option)
+    {
+      case 'w':
+        argsOut->numberOfWorkerCounts = parseIntListOrDie( optarg, 1, argsOut->workerCounts,
+          "Error: <worker counts> must be positive integers, separated by commas");
+        for ( int i = 0; i < argsOut->numberOfWorkerCounts; ++i)
+          if ( argsOut->workerCounts[ i] > MAX_WORKERS)
+            printAndDie( "Error: at most 256 workers");
+        break;
+      case 't':
+        argsOut->threadsPerWorker = atoi( optarg);
+        if ( argsOut->threadsPerWorker < 1)
+          printAndDie( "Error: <threads per worker> must be a positive integer");
+        break;
+      case 'a':
+        argsOut->isPinned = true;
+        break;
+      case 's':
+        argsOut->numberOfSlowdowns = parseList( optarg, argsOut->slowdowns);
+        if ( argsOut->numberOfSlowdowns == 0)
+          printAndDie( "Error: <slowdowns> must be real numbers, separated by commas");
+        for ( int i = 0; i < argsOut->numberOfSlowdowns; ++i)
+          if ( argsOut->slowdowns[ i] < 1.0)
+            printAndDie( "Error: every slowdown must be at least 1");
+        break;
+      case 'c':
+        argsOut->numberOfChunkCounts = parseIntListOrDie( optarg, 0, argsOut->chunkCounts,
+          "Error: <chunk counts> must be non-negative integers, separated by commas");
+        break;
+      case 'd':
+        argsOut->numberOfDeltas = parseList( optarg, argsOut->deltas);
+        if ( argsOut->numberOfDeltas == 0)
+          printAndDie( "Error: <deltas> must be real numbers, separated by commas");
+        for ( int i = 0; i < argsOut->numberOfDeltas; ++i)
+          if ( argsOut->deltas[ i] <= 0)
+            printAndDie( "Error: every delta must be positive");
+        break;
+      case 'S':
+        argsOut->trySpeculative = true;
+        break;
+      case 'r':
+        argsOut->repetitions = atoi( optarg);
+        if ( argsOut->repetitions < 1)
+          printAndDie( "Error: <repetitions> must be a positive integer");
+        break;
+      case 'p':
+        argsOut->basePort = atoi( optarg);
+        if ( argsOut->basePort < 1 || argsOut->basePort + MAX_WORKERS > 65535)
+          printAndDie( "Error: <base port> must be from 1 to 65279");
+        break;
+      case 'D':
+        argsOut->deadlineSeconds = atoi( optarg);
+        if ( argsOut->deadlineSeconds < 1)
+          printAndDie( "Error: <deadline in seconds> must be a positive integer");
+        break;
+      case 'b':
+        argsOut->binDirectory = optarg;
+        break;
+      case 'l':
+        if ( !setLogLevel( optarg))
+          printAndDie( "Error: the log level must be error, warn, info or debug");
+        break;
+      default:
+        printUsageAndDie();
+    }
+  }
+  if ( optind != argc)
+    printUsageAndDie();
+}
+
+static void redirectToNullOrDie()
+{
+  int nullFd = open( "/dev/null", O_RDWR);
+  if ( nullFd < 0 || dup2( nullFd, STDOUT_FILENO) < 0 || dup2( nullFd, STDERR_FILENO) < 0)
+    _exit( EXIT_FAILURE);
+  close( nullFd);
+}
+
+static void startWorkerOrDie( const Args *args, int index)
+{
+  char path[ 4096];
+  char slowdown[ 32], listeningPort[ 16], serverPort[ 16], threads[ 16], benchmarkDelta[ 32];
+  snprintf( path, sizeof( path), "%s/worker", args->binDirectory);
+  snprintf( slowdown, sizeof( slowdown), "%g", args->slowdowns[ index % args->numberOfSlowdowns]);
+  snprintf( listeningPort, sizeof( listeningPort), "%d", args->basePort + 1 + index);
+  snprintf( serverPort, sizeof( serverPort), "%d", args->basePort);
+  snprintf( threads, sizeof( threads), "%d", args->threadsPerWorker);
+  snprintf( benchmarkDelta, sizeof( benchmarkDelta), "%g", WORKER_BENCHMARK_DELTA);
+  char *argv[] = { path, "-r", "127.0.0.1", "-s", slowdown, listeningPort, serverPort,
+    threads, benchmarkDelta, NULL };
+
+  pid_t pid = fork();
+  if ( pid < 0)
+    printAndDie( "Error: can't start a worker");
+  if ( pid == 0)
+  {
+    if ( args->isPinned)
+    {
+      long numberOfCpus = sysconf( _SC_NPROCESSORS_ONLN);
+      cpu_set_t cpus;
+      CPU_ZERO( &cpus);
+      for ( int i = 0; i < args->threadsPerWorker; ++i)
+        CPU_SET( ( index * args->threadsPerWorker + i) % numberOfCpus, &cpus);
+      sched_setaffinity( 0, sizeof( cpus), &cpus);
+    }
+    redirectToNullOrDie();
+    execv( path, argv);
+    _exit( EXIT_FAILURE);
+  }
+  workerPids[ numberOfWorkerPids ++] = pid;
+}
+
+static void stopWorkers()
+{
+  for ( int i = 0; i < numberOfWorkerPids; ++i)
+    kill( workerPids[ i], SIGTERM);
+  for ( int i = 0; i < numberOfWorkerPids; ++i)
+    waitpid( workerPids[ i], NULL, 0);
+  numberOfWorkerPids = 0;
+}
+
+static void parseTraceLine( const char *line, Run *runInOut)
+{
+  Phase phase;
+  char name[ PHASE_NAME_LENGTH];
+  if ( runInOut->numberOfPhases == MAX_PHASES ||
+       sscanf( line, " %31s %ld span(s), %lf ms in all, %lf ms at most", name, &phase.count,
+         &phase.totalMs, &phase.maxMs) != 4)
+    return;
+  strcpy( phase.name, name);
+  runInOut->phases[ runInOut->numberOfPhases ++] = phase;
+}
+
+// Runs a server to the end; its log goes through the trace summary parser
+static void runServer( const Args *args, int numberOfWorkers, int numberOfChunks, double delta,
+  bool isSpeculative, Run *runOut)
+{
+  memset( runOut, 0, sizeof( *runOut));
+  char path[ 4096];
+  char chunks[ 16], deadline[ 16], port[ 16], deltaText[ 32], workers[ 16], waiting[ 16];
+  snprintf( path, sizeof( path), "%s/server", args->binDirectory);
+  snprintf( chunks, sizeof( chunks), "%d", numberOfChunks);
+  snprintf( deadline, sizeof( deadline), "%d", args->deadlineSeconds);
+  snprintf( port, sizeof( port), "%d", args->basePort);
+  snprintf( deltaText, sizeof( deltaText), "%.17g", delta);
+  snprintf( workers, sizeof( workers), "%d", numberOfWorkers);
+  snprintf( waiting, sizeof( waiting), "%d", POOL_WAITING_SECONDS);
+  char *argv[ 24];
+  int argc = 0;
+  argv[ argc ++] = path;
+  if ( numberOfChunks > 0)
+  {
+    argv[ argc ++] = "-c";
+    argv[ argc ++] = chunks;
+  }
+  if ( isSpeculative)
+    argv[ argc ++] = "-s";
+  char *rest[] = { "-d", deadline, "-l", "info", port, "none", "0", "0", "1", deltaText, "1",
+    workers, waiting, NULL };
+  memcpy( argv + argc, rest, sizeof( rest));
+
+  int outPipe[ 2], errPipe[ 2];
+  if ( pipe( outPipe) < 0 || pipe( errPipe) < 0)
+    printAndDie( "Error: can't create pipes for the server");
+  uint64_t startNs = traceNowNs();
+  pid_t pid = fork();
+  if ( pid < 0)
+    printAndDie( "Error: can't start the server");
+  if ( pid == 0)
+  {
+    dup2( outPipe[ 1], STDOUT_FILENO);
+    dup2( errPipe[ 1], STDERR_FILENO);
+    close( outPipe[ 0]);
+    close( errPipe[ 0]);
+    execv( path, argv);
+    _exit( EXIT_FAILURE);
+  }
+  close( outPipe[ 1]);
+  close( errPipe[ 1]);
+
+  // The answer is a single line written at the end, so reading the
+  // log to its end first can't leave the server blocked on stdout
+  FILE *log = fdopen( errPipe[ 0], "r");
+  char *line = NULL;
+  size_t lineSize = 0;
+  while ( getline( &line, &lineSize, log) > 0)
+  {
+    LOG_DEBUG( "server: %s", line);
+    parseTraceLine( line, runOut);
+  }
+  fclose( log);
+  FILE *out = fdopen( outPipe[ 0], "r");
+  bool hasAnswer = getline( &line, &lineSize, out) > 0 && sscanf( line, "%lf", &runOut->answer) == 1;
+  fclose( out);
+  free( line);
+
+  int status;
+  waitpid( pid, &status, 0);
+  runOut->wallMs = ( traceNowNs() - startNs) / 1e6;
+  runOut->isOk = hasAnswer && WIFEXITED( status) && WEXITSTATUS( status) == 0;
+}
+
+static const Phase *findPhase( const Run *run, const char *name)
+{
+  for ( int i = 0; i < run->numberOfPhases; ++i)
+    if ( strcmp( run->phases[ i].name, name) == 0)
+      return &run->phases[ i];
+  return NULL;
+}
+
+// From partitioning to the last result
+static double makespanMs( const Run *run)
+{
+  static const char *jobPhases[] = { "partition", "dispatch", "gather" };
+  double totalMs = 0.0;
+  for ( int i = 0; i < 3; ++i)
+  {
+    const Phase *phase = findPhase( run, jobPhases[ i]);
+    if ( phase == NULL)
+      return 0.0;
+    totalMs += phase->totalMs;
+  }
+  return totalMs;
+}
+
+static double measureSerialMs( double delta)
+{
+  double result;
+  uint64_t startNs = traceNowNs();
+  integrate( functionToIntegrate, 0.0, 1.0, 1, delta, &result);
+  return ( traceNowNs() - startNs) / 1e6;
+}
+
+static void writeRun( const Args *args, int numberOfWorkers, int numberOfChunks, double delta,
+  bool isSpeculative, int repetition, double serialMs, const Run *run, bool isFirst)
+{
+  double capacity = 0.0;
+  for ( int i = 0; i < numberOfWorkers; ++i)
+    capacity += args->threadsPerWorker / args->slowdowns[ i % args->numberOfSlowdowns];
+  double exact = 1.0 / 3.0;
+  double makespan = makespanMs( run);
+
+  printf( "%s    {\"workers\": %d, \"chunks\": %d, \"delta\": %g, \"speculative\": %s, "
+    "\"repetition\": %d, \"ok\": %s", ( isFirst)? "" : ",\n", numberOfWorkers, numberOfChunks,
+    delta, ( isSpeculative)? "true" : "false", repetition, ( run->isOk)? "true" : "false");
+  if ( run->isOk)
+  {
+    printf( ",\n     \"answer\": %.10f, \"absoluteError\": %.3e, \"relativeError\": %.3e",
+      run->answer, fabs( run->answer - exact), fabs( run->answer - exact) / exact);
+    printf( ",\n     \"makespanMs\": %.3f, \"wallMs\": %.3f, \"serialMs\": %.3f", makespan,
+      run->wallMs, serialMs);
+    if ( makespan > 0)
+      printf( ",\n     \"parallelEfficiency\": %.4f, \"capacityEfficiency\": %.4f",
+        serialMs / ( makespan * numberOfWorkers * args->threadsPerWorker),
+        serialMs / ( makespan * capacity));
+  }
+  printf( ",\n     \"phases\": {");
+  for ( int i = 0; i < run->numberOfPhases; ++i)
+    printf( "%s\"%s\": {\"count\": %ld, \"totalMs\": %.3f, \"maxMs\": %.3f}", ( i == 0)? "" : ", ",
+      run->phases[ i].name, run->phases[ i].count, run->phases[ i].totalMs, run->phases[ i].maxMs);
+  printf( "}}");
+  fflush( stdout);
+}
+
+static void runMatrix( const Args *args)
+{
+  printf( "{\n  \"threadsPerWorker\": %d,\n  \"pinned\": %s,\n  \"slowdowns\": [",
+    args->threadsPerWorker, ( args->isPinned)? "true" : "false");
+  for ( int i = 0; i < args->numberOfSlowdowns; ++i)
+    printf( "%s%g", ( i == 0)? "" : ", ", args->slowdowns[ i]);
+  printf( "],\n  \"runs\": [\n");
+
+  double serialMs[ MAX_LIST_VALUES];
+  for ( int i = 0; i < args->numberOfDeltas; ++i)
+  {
+    serialMs[ i] = measureSerialMs( args->deltas[ i]);
+    LOG( "One thread takes %.3f ms with delta = %g\n", serialMs[ i], args->deltas[ i]);
+  }
+
+  bool isFirst = true;
+  for ( int w = 0; w < args->numberOfWorkerCounts; ++w)
+  {
+    int numberOfWorkers = args->workerCounts[ w];
+    LOG( "Starting %d worker(s)...\n", numberOfWorkers);
+    for ( int i = 0; i < numberOfWorkers; ++i)
+      startWorkerOrDie( args, i);
+    for ( int c = 0; c < args->numberOfChunkCounts; ++c)
+      for ( int d = 0; d < args->numberOfDeltas; ++d)
+        for ( int speculative = 0; speculative <= ( ( args->trySpeculative)? 1 : 0); ++speculative)
+          for ( int r = 0; r < args->repetitions; ++r)
+          {
+            Run run;
+            runServer( args, numberOfWorkers, args->chunkCounts[ c], args->deltas[ d],
+              speculative, &run);
+            if ( run.isOk)
+              LOG( "%d worker(s), %d chunk(s), delta = %g%s: %.3f ms\n", numberOfWorkers,
+                args->chunkCounts[ c], args->deltas[ d], ( speculative)? ", speculative" : "",
+                makespanMs( &run));
+            else
+              LOG_WARN( "%d worker(s), %d chunk(s), delta = %g%s: the server failed\n",
+                numberOfWorkers, args->chunkCounts[ c], args->deltas[ d],
+                ( speculative)? ", speculative" : "");
+            writeRun( args, numberOfWorkers, args->chunkCounts[ c], args->deltas[ d],
+              speculative, r, serialMs[ d], &run, isFirst);
+            isFirst = false;
+          }
+    stopWorkers();
+  }
+  printf( "\n  ]\n}\n");
+  fflush( stdout);
+}
@@ -0,0 +1,318 @@
+
+/*
+  hardware.c
+
+  Detection of the capabilities a worker reports to the server
+  in its Benchmark: cores, SIMD level, NUMA nodes, cache sizes
+  and the CPU quota imposed by cgroups (v2).
+
+  It also lays out the worker's threads: the thread count is
+  derived from the physical cores in the affinity mask and the
+  CPU quota, and each thread gets its own physical core before
+  any SMT sibling is used. CPUs are grouped by NUMA node so the
+  integration can run one sub-pool of threads per node.
+
+  Everything is read from sysfs/procfs; whatever can't be
+  detected is reported as 0.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sched.h>
+
+#include "hardware.h"
+
+#define CGROUP_ROOT "/sys/fs/cgroup"
+
+static bool readFirstLine( const char *path, char *buf, size_t size)
+{
+  FILE *file = fopen( path, "r");
+  if ( !file)
+    return false;
+  bool is_ok = fgets( buf, size, file) != NULL;
+  fclose( file);
+  if ( is_ok)
+    buf[ strcspn( buf, "\n")] = '\0';
+  return is_ok;
+}
+
+static int countNumaNodes()
+{
+  DIR *dir = opendir( "/sys/devices/system/node");
+  if ( !dir)
+    return 1;
+  int numberOfNodes = 0;
+  struct dirent *entry;
+  while ( ( entry = readdir( dir)) != NULL)
+  {
+    if ( strncmp( entry->d_name, "node", 4) == 0 && isdigit( entry->d_name[ 4]))
+      numberOfNodes ++;
+  }
+  closedir( dir);
+  return ( numberOfNodes > 0)? numberOfNodes : 1;
+}
+
+static long parseCacheSize( const char *text)
+{
+  char *endPtr;
+  long size = strtol( text, &endPtr, 10);
+  if ( *endPtr == 'K')
+    size *= 1024;
+  else if ( *endPtr == 'M')
+    size *= 1024 * 1024;
+  return size;
+}
+
+static void readCacheSizes( HardwareInfo *info)
+{
+  for ( int index = 0; ; ++index)
+  {
+    char path[ 128];
+    char level[ 16], type[ 32], size[ 32];
+    snprintf( path, sizeof( path), "/sys/devices/system/cpu/cpu0/cache/index%d/level", index);
+    if ( !readFirstLine( path, level, sizeof( level)))
+      break;
+    snprintf( path, sizeof( path), "/sys/devices/system/cpu/cpu0/cache/index%d/type", index);
+    if ( !readFirstLine( path, type, sizeof( type)) || strcmp( type, "Instruction") == 0)
+      continue;
+    snprintf( path, sizeof( path), "/sys/devices/system/cpu/cpu0/cache/index%d/size", index);
+    if ( !readFirstLine( path, size, sizeof( size)))
+      continue;
+
+    switch ( atoi( level))
+    {
+      case 1: info->l1CacheBytes = parseCacheSize( size); break;
+      case 2: info->l2CacheBytes = parseCacheSize( size); break;
+      case 3: info->l3CacheBytes = parseCacheSize( size); break;
+    }
+  }
+}
+
+static double readCpuQuotaFrom( const char *path)
+{
+  char line[ 64];
+  if ( !readFirstLine( path, line, sizeof( line)))
+    return 0.0;
+  char quota[ 32];
+  long period;
+  if ( sscanf( line, "%31s %ld", quota, &period) != 2 || period <= 0)
+    return 0.0;
+  if ( strcmp( quota, "max") == 0)
+    return 0.0;
+  return atof( quota) / period;
+}
+
+static double readCgroupCpuQuota()
+{
+  // cgroup v2 lists the process' group as "0::<path>" in /proc/self/cgroup
+  char line[ 512];
+  FILE *file = fopen( "/proc/self/cgroup", "r");
+  if ( file)
+  {
+    while ( fgets( line, sizeof( line), file))
+    {
+      if ( strncmp( line, "0::", 3) != 0)
+        continue;
+      line[ strcspn( line, "\n")] = '\0';
+      char path[ 600];
+      snprintf( path, sizeof( path), CGROUP_ROOT "%s/cpu.max", line + 3);
+      fclose( file);
+      double quota = readCpuQuotaFrom( path);
+      if ( quota > 0)
+        return quota;
+      return readCpuQuotaFrom( CGROUP_ROOT "/cpu.max");
+    }
+    fclose( file);
+  }
+  return readCpuQuotaFrom( CGROUP_ROOT "/cpu.max");
+}
+
+static int detectSimdLevel()
+{
+#if defined( __x86_64__) || defined( __i386__)
+  __builtin_cpu_init();
+  if ( __builtin_cpu_supports( "avx512f"))
+    return SIMD_AVX512;
+  if ( __builtin_cpu_supports( "avx2"))
+    return SIMD_AVX2;
+  if ( __builtin_cpu_supports( "avx"))
+    return SIMD_AVX;
+  if ( __builtin_cpu_supports( "sse2"))
+    return SIMD_SSE2;
+  return SIMD_NONE;
+#elif defined( __aarch64__) || defined( __ARM_NEON)
+  return SIMD_NEON;
+#else
+  return SIMD_NONE;
+#endif
+}
+
+void detectHardware( HardwareInfo *infoOut)
+{
+  HardwareInfo info;
+  memset( &info, 0, sizeof( info));
+
+  long numberOfCores = sysconf( _SC_NPROCESSORS_ONLN);
+  info.numberOfCores = ( numberOfCores > 0)? numberOfCores : 1;
+  info.simdLevel = detectSimdLevel();
+  info.numberOfNumaNodes = countNumaNodes();
+  readCacheSizes( &info);
+  info.cpuQuota = readCgroupCpuQuota();
+
+  *infoOut = info;
+}
+
+// Lowest CPU of the core's SMT siblings, used as the core's identity
+static int physicalCoreOf( int cpu)
+{
+  char path[ 128];
+  char siblings[ 256];
+  snprintf( path, sizeof( path), 
+    "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+  if ( !readFirstLine( path, siblings, sizeof( siblings)))
+    return cpu;
+  return atoi( siblings);
+}
+
+// Fills the node of every CPU listed in /sys/devices/system/node/node<N>/cpulist
+// (ranges like "0-3,8-11"); returns the highest node number
+static int readNodesOfCpus( int nodeOfCpuOut[ MAX_CPUS])
+{
+  memset( nodeOfCpuOut, 0, MAX_CPUS * sizeof( int));
+  DIR *dir = opendir( "/sys/devices/system/node");
+  if ( !dir)
+    return 0;
+  int maxNode = 0;
+  struct dirent *entry;
+  while ( ( entry = readdir( dir)) != NULL)
+  {
+    if ( strncmp( entry->d_name, "node", 4) != 0 || !isdigit( entry->d_name[ 4]))
+      continue;
+    int node = atoi( entry->d_name + 4);
+    char path[ 300];
+    char cpuList[ 4096];
+    snprintf( path, sizeof( path), "/sys/devices/system/node/%s/cpulist", entry->d_name);
+    if ( !readFirstLine( path, cpuList, sizeof( cpuList)))
+      continue;
+    if ( node > maxNode)
+      maxNode = node;
+
+    char *range = cpuList;
+    while ( *range)
+    {
+      char *endPtr;
+      int first = strtol( range, &endPtr, 10);
+      int last = first;
+      if ( *endPtr == '-')
+        last = strtol( endPtr + 1, &endPtr, 10);
+      for ( int cpu = first; cpu <= last && cpu < MAX_CPUS; ++cpu)
+        nodeOfCpuOut[ cpu] = node;
+      if ( *endPtr != ',')
+        break;
+      range = endPtr + 1;
+    }
+  }
+  closedir( dir);
+  return maxNode;
+}
+
+void detectCpuLayout( double cpuQuota, int requestedThreads, CpuLayout *layoutOut)
+{
+  CpuLayout layout;
+  memset( &layout, 0, sizeof( layout));
+
+  long numberOfOnlineCpus = sysconf( _SC_NPROCESSORS_ONLN);
+  layout.numberOfOnlineCpus = ( numberOfOnlineCpus > 0)? numberOfOnlineCpus : 1;
+
+  cpu_set_t allowed;
+  CPU_ZERO( &allowed);
+  bool hasAffinity = sched_getaffinity( 0, sizeof( allowed), &allowed) == 0;
+
+  int nodeOfCpu[ MAX_CPUS];
+  int maxNode = readNodesOfCpus( nodeOfCpu);
+  bool isNodeUsed[ MAX_CPUS];
+  memset( isNodeUsed, 0, sizeof( isNodeUsed));
+
+  int allowedCpus[ MAX_CPUS];
+  int cores[ MAX_CPUS];
+  int numberOfAllowedCpus = 0;
+  for ( int cpu = 0; cpu < CPU_SETSIZE && numberOfAllowedCpus < MAX_CPUS; ++cpu)
+  {
+    if ( hasAffinity? !CPU_ISSET( cpu, &allowed) : cpu >= layout.numberOfOnlineCpus)
+      continue;
+    allowedCpus[ numberOfAllowedCpus] = cpu;
+    cores[ numberOfAllowedCpus] = physicalCoreOf( cpu);
+    numberOfAllowedCpus ++;
+    if ( !isNodeUsed[ nodeOfCpu[ cpu]])
+      layout.numberOfNodes ++;
+    isNodeUsed[ nodeOfCpu[ cpu]] = true;
+  }
+
+  // First pass takes one CPU per physical core, the following passes
+  // take the remaining siblings; within a pass CPUs are grouped by node,
+  // so a smaller number of threads stays on as few nodes as possible
+  bool isTaken[ MAX_CPUS];
+  memset( isTaken, 0, sizeof( isTaken));
+  int numberOfOrderedCpus = 0;
+  for ( int pass = 0; numberOfOrderedCpus < numberOfAllowedCpus; ++pass)
+  {
+    bool isCoreUsed[ MAX_CPUS];
+    memset( isCoreUsed, 0, sizeof( isCoreUsed));
+    for ( int node = 0; node <= maxNode; ++node)
+    {
+      for ( int i = 0; i < numberOfAllowedCpus; ++i)
+      {
+        int core = cores[ i] % MAX_CPUS;
+        if ( isTaken[ i] || isCoreUsed[ core] || nodeOfCpu[ allowedCpus[ i]] != node)
+          continue;
+        isTaken[ i] = isCoreUsed[ core] = true;
+        layout.nodes[ numberOfOrderedCpus] = node;
+        layout.cpus[ numberOfOrderedCpus ++] = allowedCpus[ i];
+        if ( pass == 0)
+          layout.numberOfPhysicalCores ++;
+      }
+    }
+    if ( pass == 0)
+      layout.threadsPerCore = 1;
+    else
+      layout.threadsPerCore ++;
+  }
+  layout.numberOfAllowedCpus = numberOfAllowedCpus;
+
+  int numberOfThreads = requestedThreads;
+  if ( numberOfThreads < 1)
+  {
+    numberOfThreads = ( layout.numberOfPhysicalCores > 0)? layout.numberOfPhysicalCores : 1;
+    int quotaThreads = ( int) cpuQuota;
+    if ( quotaThreads < cpuQuota)
+      quotaThreads ++;
+    if ( quotaThreads > 0 && quotaThreads < numberOfThreads)
+      numberOfThreads = quotaThreads;
+  }
+  layout.numberOfThreads = numberOfThreads;
+
+  // Pin only when every thread gets a CPU of its own
+  layout.isPinned = numberOfAllowedCpus > 0 && numberOfThreads <= numberOfAllowedCpus;
+
+  *layoutOut = layout;
+}
+
+const char *simdLevelName( int simdLevel)
+{
+  switch ( simdLevel)
+  {
+    case SIMD_SSE2:   return "sse2";
+    case SIMD_AVX:    return "avx";
+    case SIMD_AVX2:   return "avx2";
+    case SIMD_AVX512: return "avx512";
+    case SIMD_NEON:   return "neon";
+    default:          return "none";
+  }
+}
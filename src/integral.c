@@ -1,39 +1,140 @@
 
+#define _GNU_SOURCE
+
 #include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <errno.h>
+#include <time.h>
 
 #include "integral.h"
+#include "trace.h"
+#include "perfCounters.h"
+
+/* Threads publish their progress and check for cancellation
+ * every BLOCK_STEPS steps */
+#define BLOCK_STEPS (1 << 16)
 
+/* The interval is cut into whole steps up front and every thread gets
+ * a range of them, so no thread drops a partial step at its end */
 struct Task {
   double a;
-  double b;
   double delta;
+  long first_step;
+  long n_steps;
   double (*f)(double);
+  const IntegrationOptions *options;
 };
 typedef struct Task Task;
 
+void cancel_integration(CancellationToken *token)
+{
+  int running = 0;
+  __atomic_compare_exchange_n(&token->stop_reason, &running, INTEGRATION_CANCELLED,
+    false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static double now_seconds()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static bool should_stop(CancellationToken *token)
+{
+  if (__atomic_load_n(&token->stop_reason, __ATOMIC_RELAXED))
+    return true;
+  if (token->deadline <= 0)
+    return false;
+
+  if (now_seconds() < token->deadline)
+    return false;
+  int running = 0;
+  __atomic_compare_exchange_n(&token->stop_reason, &running, INTEGRATION_DEADLINE_EXCEEDED,
+    false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+  return true;
+}
+
+static void add_progress(IntegrationProgress *progress, long steps, double sum)
+{
+  __atomic_fetch_add(&progress->steps_done, steps, __ATOMIC_RELAXED);
+
+  double expected, desired;
+  __atomic_load(&progress->partial_sum, &expected, __ATOMIC_RELAXED);
+  do {
+    desired = expected + sum;
+  } while (!__atomic_compare_exchange(&progress->partial_sum, &expected, &desired,
+             true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/* Sleeps off (slowdown - 1) times the block that started at block_start,
+ * so that the progress reported stays in step with the slowdown */
+static void pace_block(double slowdown, double block_start)
+{
+  double idle = (slowdown - 1.0) * (now_seconds() - block_start);
+  struct timespec pause;
+  pause.tv_sec = (time_t)idle;
+  pause.tv_nsec = (long)((idle - pause.tv_sec) * 1e9);
+  while (nanosleep(&pause, &pause) < 0 && errno == EINTR)
+    ;
+}
+
 static double* thread_integrate(Task *task)
 {
+  uint64_t start_ns = traceNowNs();
   double a = task->a;
-  double b = task->b;
   double delta = task->delta;
+  long step = task->first_step;
+  long end_step = task->first_step + task->n_steps;
   double (*f)(double) = task->f;
+  IntegrationProgress *progress = task->options->progress;
+  CancellationToken *cancellation = task->options->cancellation;
+  PerfCounts *perf_counts = task->options->perf_counts;
+  double slowdown = task->options->slowdown;
+  int midpoints_only = task->options->midpoints_only;
 
   free(task);
   double *ans = (double*)malloc(sizeof(double));
   if (!ans)
     return NULL;
 
+  PerfSession perf;
+  bool is_counting = perf_counts && startPerfCounters(&perf);
+
   double res = 0.0;
-  for (double x = a; x + delta <= b; x += delta) {
-    double y1 = f(x);
-    double y2 = f(x + delta);
-    res += delta * (y2 + y1);
+  while (step < end_step) {
+    double block_start = (slowdown > 1.0)? now_seconds() : 0.0;
+    double block_res = 0.0;
+    long steps = 0;
+    /* x is recomputed from the step number, so rounding doesn't pile up */
+    if (midpoints_only) {
+      for (; steps < BLOCK_STEPS && step < end_step; ++steps, ++step)
+        block_res += delta * f(a + (step + 0.5) * delta);
+    } else {
+      for (; steps < BLOCK_STEPS && step < end_step; ++steps, ++step) {
+        double x = a + step * delta;
+        double y1 = f(x);
+        double y2 = f(x + delta);
+        block_res += delta * (y2 + y1);
+      }
+      block_res /= 2.0;
+    }
+    res += block_res;
+    if (slowdown > 1.0)
+      pace_block(slowdown, block_start);
+    if (progress)
+      add_progress(progress, steps, block_res);
+    if (cancellation && should_stop(cancellation))
+      break;
   }
 
-  *ans = res / 2.0;
+  if (is_counting)
+    stopPerfCounters(&perf, perf_counts);
+  *ans = res;
+  traceSpan("compute thread", start_ns, -1);
 
   return ans;
 }
@@ -41,10 +142,40 @@ static double* thread_integrate(Task *task)
 int integrate(double (*f)(double), double a, double b, 
   int n_threads, double delta, double *res)
 {
-  if (n_threads < 1) {
-    return 1;
-  }
+  IntegrationOptions options;
+  options.n_threads = n_threads;
+  options.cpus = NULL;
+  options.nodes = NULL;
+  options.progress = NULL;
+  options.cancellation = NULL;
+  options.perf_counts = NULL;
+  options.slowdown = 0.0;
+  options.midpoints_only = 0;
+  return integrate_with_options(f, a, b, delta, &options, res);
+}
+
+static int create_thread(pthread_t *handle, const cpu_set_t *cpu_set,
+  void * (*routine)(void *), void *arg)
+{
+  if (cpu_set == NULL)
+    return pthread_create(handle, NULL, routine, arg);
+
+  pthread_attr_t attr;
+  if (pthread_attr_init(&attr))
+    return pthread_create(handle, NULL, routine, arg);
+  pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), cpu_set);
 
+  int create_status = pthread_create(handle, &attr, routine, arg);
+  pthread_attr_destroy(&attr);
+  if (create_status == EINVAL)  /* the CPUs went away: run unpinned */
+    create_status = pthread_create(handle, NULL, routine, arg);
+  return create_status;
+}
+
+static int run_threads(double (*f)(double), double a, double delta, 
+  long first_step, long n_steps, int n_threads, const int *cpus, 
+  const IntegrationOptions *options, double *res)
+{
   pthread_t *threads_handles = (pthread_t*) malloc(n_threads * sizeof(pthread_t));
   if (threads_handles == NULL) {
     return 2;
@@ -53,17 +184,23 @@ int integrate(double (*f)(double), double a, double b,
   Task* tasks[n_threads];
   bool is_ok = true;
 
-  double d = (b - a) / n_threads;
   int i;
   for (i = 0; i < n_threads; ++i) {
     Task *task = (Task*) malloc(sizeof(Task));
-    task->a = a + d * i;
-    task->b = a + d * (i + 1);
+    task->a = a;
     task->delta = delta;
+    task->first_step = first_step + n_steps * i / n_threads;
+    task->n_steps = first_step + n_steps * (i + 1) / n_threads - task->first_step;
     task->f = f;
+    task->options = options;
     tasks[i] = task;
 
-    int create_status = pthread_create(&threads_handles[i], NULL, 
+    cpu_set_t cpu_set;
+    if (cpus) {
+      CPU_ZERO(&cpu_set);
+      CPU_SET(cpus[i], &cpu_set);
+    }
+    int create_status = create_thread(&threads_handles[i], cpus ? &cpu_set : NULL,
       (void * (*)(void *))thread_integrate, (void*)task);
     if (create_status) {
       is_ok = false;
@@ -72,8 +209,13 @@ int integrate(double (*f)(double), double a, double b,
   }
 
   if (!is_ok) {
-    for (int j = 0; j < i; ++j)
-      free(tasks[i]);
+    /* threads free their own tasks; only the failed one is ours */
+    free(tasks[i]);
+    for (int j = 0; j < i; ++j) {
+      double *ans;
+      if (!pthread_join(threads_handles[j], (void**)&ans))
+        free(ans);
+    }
     free(threads_handles);
     return 3;
   }
@@ -101,3 +243,149 @@ int integrate(double (*f)(double), double a, double b,
   free(threads_handles);
   return 0;
 }
+
+/*
+ * Sub-pool of the threads placed on one NUMA node. Its coordinator
+ * thread runs on the node, so everything it allocates for the node
+ * (CPU list, tasks, thread results) is first touched, and therefore
+ * placed, in the node's local memory.
+ */
+struct NodePool {
+  double (*f)(double);
+  double a;
+  double delta;
+  long first_step;
+  long n_steps;
+  const IntegrationOptions *options;
+  int node;
+  int n_threads;
+  cpu_set_t cpu_set;
+  double res;
+  int status;
+};
+typedef struct NodePool NodePool;
+
+static void* node_pool_integrate(NodePool *pool)
+{
+  const IntegrationOptions *options = pool->options;
+  int *cpus = NULL;
+  if (options->cpus) {
+    cpus = (int*) malloc(pool->n_threads * sizeof(int));
+    if (cpus == NULL) {
+      pool->status = 2;
+      return NULL;
+    }
+    int j = 0;
+    for (int i = 0; i < options->n_threads; ++i)
+      if (options->nodes[i] == pool->node)
+        cpus[j++] = options->cpus[i];
+  }
+
+  pool->status = run_threads(pool->f, pool->a, pool->delta, pool->first_step,
+    pool->n_steps, pool->n_threads, cpus, options, &pool->res);
+  free(cpus);
+  return NULL;
+}
+
+static int run_on_nodes(double (*f)(double), double a, double delta, 
+  long n_steps, int n_nodes, const IntegrationOptions *options, double *res)
+{
+  int n_threads = options->n_threads;
+
+  /* Split the steps per node first (proportionally to the node's
+   * threads), then run_threads() splits them per core */
+  NodePool *pools = (NodePool*) calloc(n_nodes, sizeof(NodePool));
+  pthread_t *pools_handles = (pthread_t*) malloc(n_nodes * sizeof(pthread_t));
+  bool *is_started = (bool*) calloc(n_nodes, sizeof(bool));
+  if (pools == NULL || pools_handles == NULL || is_started == NULL) {
+    free(pools);
+    free(pools_handles);
+    free(is_started);
+    return 2;
+  }
+
+  for (int i = 0; i < n_threads; ++i) {
+    NodePool *pool = &pools[options->nodes[i]];
+    pool->n_threads++;
+    if (options->cpus)
+      CPU_SET(options->cpus[i], &pool->cpu_set);
+  }
+
+  int status = 0;
+  int threads_before = 0;
+  for (int node = 0; node < n_nodes; ++node) {
+    NodePool *pool = &pools[node];
+    if (pool->n_threads == 0)
+      continue;
+    pool->f = f;
+    pool->a = a;
+    pool->delta = delta;
+    pool->first_step = n_steps * threads_before / n_threads;
+    pool->n_steps = n_steps * (threads_before + pool->n_threads) / n_threads - pool->first_step;
+    pool->options = options;
+    pool->node = node;
+    threads_before += pool->n_threads;
+
+    if (create_thread(&pools_handles[node], options->cpus ? &pool->cpu_set : NULL,
+        (void * (*)(void *))node_pool_integrate, (void*)pool)) {
+      status = 3;
+      break;
+    }
+    is_started[node] = true;
+  }
+
+  double t_res = 0.0;
+  for (int node = 0; node < n_nodes; ++node) {
+    if (!is_started[node])
+      continue;
+    if (pthread_join(pools_handles[node], NULL) && !status)
+      status = 4;
+    if (pools[node].status && !status)
+      status = pools[node].status;
+    t_res += pools[node].res;
+  }
+  *res = t_res;
+
+  free(pools);
+  free(pools_handles);
+  free(is_started);
+  return status;
+}
+
+int integrate_with_options(double (*f)(double), double a, double b, 
+  double delta, const IntegrationOptions *options, double *res)
+{
+  int n_threads = options->n_threads;
+  if (n_threads < 1) {
+    return 1;
+  }
+
+  /* Whole steps that fit in [a, b]; the slack keeps a step that
+   * fits exactly from being lost to rounding */
+  long n_steps = (long)((b - a) / delta * (1 + 1e-12));
+  if (n_steps < 0)
+    n_steps = 0;
+
+  if (options->progress) {
+    options->progress->total_steps = n_steps;
+    options->progress->steps_done = 0;
+    options->progress->partial_sum = 0.0;
+    options->progress->evaluations_per_step = options->midpoints_only ? 1 : 2;
+  }
+
+  int status;
+  int n_nodes = 0;
+  if (options->nodes) {
+    for (int i = 0; i < n_threads; ++i)
+      if (options->nodes[i] + 1 > n_nodes)
+        n_nodes = options->nodes[i] + 1;
+  }
+  if (n_nodes < 2)
+    status = run_threads(f, a, delta, 0, n_steps, n_threads, options->cpus, options, res);
+  else
+    status = run_on_nodes(f, a, delta, n_steps, n_nodes, options, res);
+
+  if (!status && options->cancellation)
+    status = __atomic_load_n(&options->cancellation->stop_reason, __ATOMIC_RELAXED);
+  return status;
+}
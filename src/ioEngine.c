@@ -0,0 +1,930 @@
+
+/*
+  ioEngine.c
+
+  The server's event loop over its connections, with two engines
+  behind the same calls:
+
+  epoll: readiness events, then one recv() per readable stream and
+  one send() per message; works on any kernel.
+
+  io_uring (Linux 6.0 or later; raw system calls, no liburing): a
+  listening socket gets a multishot accept and a stream a multishot
+  recv that picks its buffers from a ring of provided buffers, so
+  no system call is made per message received. Queued messages go
+  out as SQEs submitted together with the next wait, so a round of
+  requests to many workers costs a single io_uring_enter(). A
+  readable fd gets a one-shot poll, re-armed on every wait, which
+  keeps it level-triggered as with epoll.
+
+  Either way the streams are framed here: the handler only gets
+  whole messages.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "ioEngine.h"
+
+#define IO_FD_NONE      0
+#define IO_FD_LISTENER  1
+#define IO_FD_STREAM    2
+#define IO_FD_READABLE  3
+
+#define MIN_FD_CAPACITY 64
+#define MAX_EPOLL_EVENTS 64
+#define RING_ENTRIES 1024
+#define NUMBER_OF_RECV_BUFFERS 512  // a power of 2
+#define RECV_BUFFER_BYTES 4096
+#define RECV_BUFFER_GROUP 0
+// A partial message, plus what one recv brings in
+#define STASH_BYTES ( sizeof( MessageHeader) + MAX_MESSAGE_LENGTH + RECV_BUFFER_BYTES)
+#define MIN_SEND_BUFFER_BYTES 4096
+#define MAX_DRAIN_MS 1000
+
+// What an SQE is for; its user_data holds that, the fd and the
+// generation of the fd's watch, so that completions for an earlier
+// watch of the same fd are told apart
+#define OP_RECV    1
+#define OP_ACCEPT  2
+#define OP_POLL    3
+#define OP_SEND    4
+#define OP_CANCEL  5
+#define GENERATION_MASK 0xffffffu
+
+struct IoFd
+{
+  int mode;  // IO_FD_*
+  unsigned generation;  // bumped when unwatched
+  char *stash;  // the start of a message that came in part
+  size_t stashLength;
+
+  // io_uring only
+  bool isArmed;  // a recv, accept or poll is in flight
+  bool isPending;  // listed for arming or sending on the next submission
+  bool isSending;  // a send is in flight, from sendBuffer
+  char *sendBuffer;  // bytes [sendOffset, sendLength) are still to go
+  size_t sendOffset;
+  size_t sendLength;
+  size_t sendCapacity;
+  char *queue;  // queued since that send went out
+  size_t queueLength;
+  size_t queueCapacity;
+};
+typedef struct IoFd IoFd;
+
+struct IoUring
+{
+  int ringFd;
+  void *sqRing;
+  size_t sqRingSize;
+  void *cqRing;  // may be sqRing
+  size_t cqRingSize;
+  struct io_uring_sqe *sqes;
+  size_t sqesSize;
+  unsigned *sqHead;
+  unsigned *sqTail;
+  unsigned sqMask;
+  unsigned sqEntries;
+  unsigned sqLocalTail;  // SQEs prepared
+  unsigned *cqHead;
+  unsigned *cqTail;
+  unsigned cqMask;
+  struct io_uring_cqe *cqes;
+
+  struct io_uring_buf_ring *bufferRing;
+  size_t bufferRingSize;
+  char *buffers;
+  unsigned short bufferTail;
+
+  int *pendingFds;
+  int numberOfPendingFds;
+  int pendingCapacity;
+  // user_data of the armed SQEs of unwatched fds, whose cancels
+  // found the SQ ring full
+  uint64_t *pendingCancels;
+  int numberOfPendingCancels;
+  int cancelCapacity;
+  int numberOfSendsInFlight;
+};
+typedef struct IoUring IoUring;
+
+const char *ioEngineName( int kind)
+{
+  return ( kind == IO_ENGINE_URING)? "io_uring" : "epoll";
+}
+
+static bool growFds( IoEngine *engine, int fd)
+{
+  int capacity = ( engine->fdCapacity > 0)? engine->fdCapacity : MIN_FD_CAPACITY;
+  while ( capacity <= fd)
+    capacity *= 2;
+  IoFd *grown = ( IoFd*) realloc( engine->fds, capacity * sizeof( IoFd));
+  if ( !grown)
+    return false;
+  memset( grown + engine->fdCapacity, 0, ( capacity - engine->fdCapacity) * sizeof( IoFd));
+  engine->fds = grown;
+  engine->fdCapacity = capacity;
+  return true;
+}
+
+static bool isWatched( const IoEngine *engine, int fd, unsigned generation)
+{
+  return engine->fds[ fd].mode != IO_FD_NONE && engine->fds[ fd].generation == generation;
+}
+
+// io_uring ------------------------------------------------------------
+
+static uint64_t encodeUserData( int op, int fd, unsigned generation)
+{
+  return ( ( uint64_t) ( generation & GENERATION_MASK) << 40) | ( ( uint64_t) op << 32) |
+    ( uint32_t) fd;
+}
+
+// Submits the prepared SQEs, and with minComplete waits for that
+// many completions or timeoutMs; -1 with errno set on failure
+static int enterRing( IoUring *ring, unsigned minComplete, int timeoutMs)
+{
+  __atomic_store_n( ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+  unsigned toSubmit = ring->sqLocalTail - __atomic_load_n( ring->sqHead, __ATOMIC_ACQUIRE);
+  if ( minComplete == 0)
+    return ( toSubmit > 0)? ( int) syscall( __NR_io_uring_enter, ring->ringFd, toSubmit, 0, 0, NULL, 0) : 0;
+
+  struct __kernel_timespec timeout;
+  timeout.tv_sec = timeoutMs / 1000;
+  timeout.tv_nsec = ( timeoutMs % 1000) * 1000000L;
+  struct io_uring_getevents_arg arg;
+  memset( &arg, 0, sizeof( arg));
+  arg.sigmask_sz = _NSIG / 8;
+  arg.ts = ( uint64_t) ( uintptr_t) &timeout;
+  return ( int) syscall( __NR_io_uring_enter, ring->ringFd, toSubmit, minComplete,
+    IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof( arg));
+}
+
+// Submits what is prepared if the SQ ring is full
+static struct io_uring_sqe *getSqe( IoUring *ring)
+{
+  if ( ring->sqLocalTail - __atomic_load_n( ring->sqHead, __ATOMIC_ACQUIRE) >= ring->sqEntries)
+  {
+    enterRing( ring, 0, 0);
+    if ( ring->sqLocalTail - __atomic_load_n( ring->sqHead, __ATOMIC_ACQUIRE) >= ring->sqEntries)
+      return NULL;
+  }
+  struct io_uring_sqe *sqe = &ring->sqes[ ring->sqLocalTail & ring->sqMask];
+  memset( sqe, 0, sizeof( *sqe));
+  ring->sqLocalTail ++;
+  return sqe;
+}
+
+static bool listPendingFd( IoEngine *engine, int fd)
+{
+  IoUring *ring = engine->ring;
+  IoFd *state = &engine->fds[ fd];
+  if ( state->isPending)
+    return true;
+  if ( ring->numberOfPendingFds == ring->pendingCapacity)
+  {
+    int capacity = ( ring->pendingCapacity > 0)? ring->pendingCapacity * 2 : MIN_FD_CAPACITY;
+    int *grown = ( int*) realloc( ring->pendingFds, capacity * sizeof( int));
+    if ( !grown)
+      return false;
+    ring->pendingFds = grown;
+    ring->pendingCapacity = capacity;
+  }
+  ring->pendingFds[ ring->numberOfPendingFds ++] = fd;
+  state->isPending = true;
+  return true;
+}
+
+static bool listPendingCancel( IoUring *ring, uint64_t target)
+{
+  if ( ring->numberOfPendingCancels == ring->cancelCapacity)
+  {
+    int capacity = ( ring->cancelCapacity > 0)? ring->cancelCapacity * 2 : MIN_FD_CAPACITY;
+    uint64_t *grown = ( uint64_t*) realloc( ring->pendingCancels, capacity * sizeof( uint64_t));
+    if ( !grown)
+      return false;
+    ring->pendingCancels = grown;
+    ring->cancelCapacity = capacity;
+  }
+  ring->pendingCancels[ ring->numberOfPendingCancels ++] = target;
+  return true;
+}
+
+// With the SQ ring full, the cancel is listed for the next submission;
+// it names the SQE, not the fd, so the fd may be closed meanwhile
+static void cancelSqe( IoUring *ring, uint64_t target)
+{
+  struct io_uring_sqe *sqe = getSqe( ring);
+  if ( !sqe)
+  {
+    listPendingCancel( ring, target);
+    return;
+  }
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = target;
+  sqe->user_data = encodeUserData( OP_CANCEL, ( int) ( uint32_t) target,
+    ( unsigned) ( target >> 40));
+}
+
+static void recycleBuffer( IoUring *ring, unsigned short bufferId)
+{
+  struct io_uring_buf *buffer =
+    &ring->bufferRing->bufs[ ring->bufferTail & ( NUMBER_OF_RECV_BUFFERS - 1)];
+  buffer->addr = ( uint64_t) ( uintptr_t) ( ring->buffers + ( size_t) bufferId * RECV_BUFFER_BYTES);
+  buffer->len = RECV_BUFFER_BYTES;
+  buffer->bid = bufferId;
+  ring->bufferTail ++;
+  __atomic_store_n( &ring->bufferRing->tail, ring->bufferTail, __ATOMIC_RELEASE);
+}
+
+static int opOfMode( int mode)
+{
+  return ( mode == IO_FD_LISTENER)? OP_ACCEPT : ( mode == IO_FD_STREAM)? OP_RECV : OP_POLL;
+}
+
+// With the SQ ring full, the fd is listed again for the next submission
+static void armFd( IoEngine *engine, int fd)
+{
+  IoFd *state = &engine->fds[ fd];
+  struct io_uring_sqe *sqe = getSqe( engine->ring);
+  if ( !sqe)
+  {
+    listPendingFd( engine, fd);
+    return;
+  }
+  sqe->fd = fd;
+  sqe->user_data = encodeUserData( opOfMode( state->mode), fd, state->generation);
+  switch ( state->mode)
+  {
+    case IO_FD_LISTENER:
+      sqe->opcode = IORING_OP_ACCEPT;
+      sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+      sqe->accept_flags = SOCK_CLOEXEC;
+      break;
+    case IO_FD_STREAM:
+      sqe->opcode = IORING_OP_RECV;
+      sqe->ioprio = IORING_RECV_MULTISHOT;
+      sqe->flags = IOSQE_BUFFER_SELECT;
+      sqe->buf_group = RECV_BUFFER_GROUP;
+      break;
+    default:
+      sqe->opcode = IORING_OP_POLL_ADD;
+      sqe->poll32_events = POLLIN;
+      break;
+  }
+  state->isArmed = true;
+}
+
+// Sends what is left of the last send, or else everything queued since
+static void startSend( IoEngine *engine, int fd)
+{
+  IoFd *state = &engine->fds[ fd];
+  if ( state->sendOffset == state->sendLength)
+  {
+    char *buffer = state->sendBuffer;
+    size_t capacity = state->sendCapacity;
+    state->sendBuffer = state->queue;
+    state->sendCapacity = state->queueCapacity;
+    state->sendLength = state->queueLength;
+    state->sendOffset = 0;
+    state->queue = buffer;
+    state->queueCapacity = capacity;
+    state->queueLength = 0;
+  }
+  struct io_uring_sqe *sqe = getSqe( engine->ring);
+  if ( !sqe)
+  {
+    listPendingFd( engine, fd);
+    return;
+  }
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = fd;
+  sqe->addr = ( uint64_t) ( uintptr_t) ( state->sendBuffer + state->sendOffset);
+  sqe->len = state->sendLength - state->sendOffset;
+  sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+  sqe->user_data = encodeUserData( OP_SEND, fd, state->generation);
+  state->isSending = true;
+  engine->ring->numberOfSendsInFlight ++;
+}
+
+// SQEs that name an fd are only prepared here, right before they are
+// submitted, so that none of them outlives the fd being closed. An fd
+// that finds the SQ ring full is listed again in place: it lands at or
+// before the entry being read, so the list is compacted as it goes.
+// Cancels left over from a full SQ ring go first, listed the same way
+static void preparePending( IoEngine *engine)
+{
+  IoUring *ring = engine->ring;
+  int numberOfCancels = ring->numberOfPendingCancels;
+  ring->numberOfPendingCancels = 0;
+  for ( int i = 0; i < numberOfCancels; ++i)
+    cancelSqe( ring, ring->pendingCancels[ i]);
+
+  int numberOfFds = ring->numberOfPendingFds;
+  ring->numberOfPendingFds = 0;
+  for ( int i = 0; i < numberOfFds; ++i)
+  {
+    int fd = ring->pendingFds[ i];
+    IoFd *state = &engine->fds[ fd];
+    state->isPending = false;
+    if ( state->mode == IO_FD_NONE)
+      continue;
+    if ( !state->isArmed)
+      armFd( engine, fd);
+    if ( !state->isSending && ( state->sendOffset < state->sendLength || state->queueLength > 0))
+      startSend( engine, fd);
+  }
+}
+
+static void cancelArmed( IoEngine *engine, int fd)
+{
+  IoFd *state = &engine->fds[ fd];
+  cancelSqe( engine->ring, encodeUserData( opOfMode( state->mode), fd, state->generation));
+}
+
+static void destroyRing( IoUring *ring)
+{
+  if ( ring->ringFd >= 0)
+    close( ring->ringFd);
+  if ( ring->sqes)
+    munmap( ring->sqes, ring->sqesSize);
+  if ( ring->cqRing && ring->cqRing != ring->sqRing)
+    munmap( ring->cqRing, ring->cqRingSize);
+  if ( ring->sqRing)
+    munmap( ring->sqRing, ring->sqRingSize);
+  if ( ring->bufferRing)
+    munmap( ring->bufferRing, ring->bufferRingSize);
+  free( ring->buffers);
+  free( ring->pendingFds);
+  free( ring->pendingCancels);
+  free( ring);
+}
+
+static void *mapRing( int ringFd, size_t size, off_t offset)
+{
+  void *memory = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+    ringFd, offset);
+  return ( memory == MAP_FAILED)? NULL : memory;
+}
+
+static bool registerBuffers( IoUring *ring)
+{
+  ring->bufferRingSize = NUMBER_OF_RECV_BUFFERS * sizeof( struct io_uring_buf);
+  void *memory = mmap( NULL, ring->bufferRingSize, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if ( memory == MAP_FAILED)
+    return false;
+  ring->bufferRing = ( struct io_uring_buf_ring*) memory;
+  ring->buffers = ( char*) malloc( ( size_t) NUMBER_OF_RECV_BUFFERS * RECV_BUFFER_BYTES);
+  if ( !ring->buffers)
+    return false;
+
+  struct io_uring_buf_reg registration;
+  memset( &registration, 0, sizeof( registration));
+  registration.ring_addr = ( uint64_t) ( uintptr_t) ring->bufferRing;
+  registration.ring_entries = NUMBER_OF_RECV_BUFFERS;
+  registration.bgid = RECV_BUFFER_GROUP;
+  if ( syscall( __NR_io_uring_register, ring->ringFd, IORING_REGISTER_PBUF_RING,
+         &registration, 1) < 0)
+    return false;
+  for ( int i = 0; i < NUMBER_OF_RECV_BUFFERS; ++i)
+    recycleBuffer( ring, ( unsigned short) i);
+  return true;
+}
+
+static IoUring *createRing()
+{
+  IoUring *ring = ( IoUring*) calloc( 1, sizeof( IoUring));
+  if ( !ring)
+    return NULL;
+  ring->ringFd = -1;
+
+  struct io_uring_params params;
+  memset( &params, 0, sizeof( params));
+  params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+  ring->ringFd = ( int) syscall( __NR_io_uring_setup, RING_ENTRIES, &params);
+  if ( ring->ringFd < 0 || !( params.features & IORING_FEAT_EXT_ARG) ||
+       !( params.features & IORING_FEAT_NODROP))
+  {
+    destroyRing( ring);
+    return NULL;
+  }
+
+  ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof( unsigned);
+  ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof( struct io_uring_cqe);
+  if ( params.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    if ( ring->cqRingSize > ring->sqRingSize)
+      ring->sqRingSize = ring->cqRingSize;
+    ring->sqRing = mapRing( ring->ringFd, ring->sqRingSize, IORING_OFF_SQ_RING);
+    ring->cqRing = ring->sqRing;
+  }
+  else
+  {
+    ring->sqRing = mapRing( ring->ringFd, ring->sqRingSize, IORING_OFF_SQ_RING);
+    ring->cqRing = mapRing( ring->ringFd, ring->cqRingSize, IORING_OFF_CQ_RING);
+  }
+  ring->sqesSize = params.sq_entries * sizeof( struct io_uring_sqe);
+  ring->sqes = ( struct io_uring_sqe*) mapRing( ring->ringFd, ring->sqesSize, IORING_OFF_SQES);
+  if ( !ring->sqRing || !ring->cqRing || !ring->sqes)
+  {
+    destroyRing( ring);
+    return NULL;
+  }
+
+  char *sq = ( char*) ring->sqRing;
+  char *cq = ( char*) ring->cqRing;
+  ring->sqHead = ( unsigned*) ( sq + params.sq_off.head);
+  ring->sqTail = ( unsigned*) ( sq + params.sq_off.tail);
+  ring->sqMask = *( unsigned*) ( sq + params.sq_off.ring_mask);
+  ring->sqEntries = params.sq_entries;
+  ring->sqLocalTail = *ring->sqTail;
+  unsigned *sqArray = ( unsigned*) ( sq + params.sq_off.array);
+  for ( unsigned i = 0; i < params.sq_entries; ++i)
+    sqArray[ i] = i;
+  ring->cqHead = ( unsigned*) ( cq + params.cq_off.head);
+  ring->cqTail = ( unsigned*) ( cq + params.cq_off.tail);
+  ring->cqMask = *( unsigned*) ( cq + params.cq_off.ring_mask);
+  ring->cqes = ( struct io_uring_cqe*) ( cq + params.cq_off.cqes);
+
+  // Provided buffer rings came in 5.19, multishot recv in 6.0
+  if ( !registerBuffers( ring))
+  {
+    destroyRing( ring);
+    return NULL;
+  }
+  return ring;
+}
+
+// Framing -------------------------------------------------------------
+
+static void closeStream( IoEngine *engine, int fd, IoHandler handler, void *context)
+{
+  unwatchFd( engine, fd);
+  IoEvent event;
+  memset( &event, 0, sizeof( event));
+  event.type = IO_EVENT_CLOSED;
+  event.fd = fd;
+  handler( context, &event);
+}
+
+// Hands the whole messages in bytes to the handler; returns the number
+// of bytes they took, or -1 if the stream isn't watched any more
+static long deliverMessages( IoEngine *engine, int fd, const char *bytes, size_t length,
+  IoHandler handler, void *context)
+{
+  unsigned generation = engine->fds[ fd].generation;
+  size_t offset = 0;
+  while ( length - offset >= sizeof( MessageHeader))
+  {
+    IoEvent event;
+    memset( &event, 0, sizeof( event));
+    memcpy( &event.header, bytes + offset, sizeof( MessageHeader));
+    if ( event.header.length < 0 || event.header.length > MAX_MESSAGE_LENGTH)
+    {
+      closeStream( engine, fd, handler, context);
+      return -1;
+    }
+    if ( length - offset < sizeof( MessageHeader) + event.header.length)
+      break;
+    event.type = IO_EVENT_MESSAGE;
+    event.fd = fd;
+    event.payload = bytes + offset + sizeof( MessageHeader);
+    handler( context, &event);
+    offset += sizeof( MessageHeader) + event.header.length;
+    if ( !isWatched( engine, fd, generation))
+      return -1;
+  }
+  return offset;
+}
+
+// Bytes are framed where they came in, and only the start of a
+// message that came in part is copied aside
+static void receiveBytes( IoEngine *engine, int fd, const char *bytes, size_t length,
+  IoHandler handler, void *context)
+{
+  IoFd *state = &engine->fds[ fd];
+  if ( state->stashLength > 0)
+  {
+    memcpy( state->stash + state->stashLength, bytes, length);
+    state->stashLength += length;
+    bytes = state->stash;
+    length = state->stashLength;
+  }
+  long taken = deliverMessages( engine, fd, bytes, length, handler, context);
+  if ( taken < 0)
+    return;
+  state = &engine->fds[ fd];
+  if ( ( size_t) taken == length)
+  {
+    state->stashLength = 0;
+    return;
+  }
+  if ( !state->stash &&
+       !( state->stash = ( char*) malloc( STASH_BYTES)))
+  {
+    closeStream( engine, fd, handler, context);
+    return;
+  }
+  memmove( state->stash, bytes + taken, length - taken);
+  state->stashLength = length - taken;
+}
+
+// Completions ---------------------------------------------------------
+
+static void completeSend( IoEngine *engine, int fd, bool isCurrent, int result)
+{
+  IoFd *state = &engine->fds[ fd];
+  state->isSending = false;
+  engine->ring->numberOfSendsInFlight --;
+  if ( !isCurrent || result < 0)
+  {
+    // Gone; the recv side tells the handler. A new watch of the fd
+    // may have queued messages behind this send meanwhile
+    state->sendOffset = state->sendLength = 0;
+    if ( !isCurrent && state->mode != IO_FD_NONE && state->queueLength > 0)
+      listPendingFd( engine, fd);
+    return;
+  }
+  state->sendOffset += result;
+  if ( state->sendOffset < state->sendLength || state->queueLength > 0)
+    listPendingFd( engine, fd);
+}
+
+// Returns the number of events handed to the handler
+static int complete( IoEngine *engine, const struct io_uring_cqe *cqe, IoHandler handler,
+  void *context)
+{
+  IoUring *ring = engine->ring;
+  int fd = ( int) ( uint32_t) cqe->user_data;
+  int op = ( int) ( ( cqe->user_data >> 32) & 0xff);
+  unsigned generation = ( unsigned) ( cqe->user_data >> 40);
+  if ( op == OP_CANCEL)
+    return 0;
+  IoFd *state = &engine->fds[ fd];
+  // Without a handler, everything is left over from before
+  bool isCurrent = handler && state->mode != IO_FD_NONE &&
+    ( state->generation & GENERATION_MASK) == generation;
+  bool hasMore = ( cqe->flags & IORING_CQE_F_MORE) != 0;
+
+  if ( op == OP_SEND)
+  {
+    completeSend( engine, fd, isCurrent, cqe->res);
+    return 0;
+  }
+
+  if ( op == OP_ACCEPT)
+  {
+    if ( !isCurrent)
+    {
+      if ( cqe->res >= 0)
+        close( cqe->res);
+      return 0;
+    }
+    if ( !hasMore)
+    {
+      state->isArmed = false;
+      listPendingFd( engine, fd);
+    }
+    if ( cqe->res < 0)
+      return 0;
+    IoEvent event;
+    memset( &event, 0, sizeof( event));
+    event.type = IO_EVENT_ACCEPTED;
+    event.fd = fd;
+    event.acceptedSocket = cqe->res;
+    handler( context, &event);
+    return 1;
+  }
+
+  if ( op == OP_POLL)
+  {
+    if ( !isCurrent)
+      return 0;
+    state->isArmed = false;
+    listPendingFd( engine, fd);
+    if ( cqe->res == -ECANCELED)
+      return 0;
+    IoEvent event;
+    memset( &event, 0, sizeof( event));
+    event.type = IO_EVENT_READABLE;
+    event.fd = fd;
+    handler( context, &event);
+    return 1;
+  }
+
+  // OP_RECV
+  bool hasBuffer = ( cqe->flags & IORING_CQE_F_BUFFER) != 0;
+  unsigned short bufferId = ( unsigned short) ( cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+  if ( isCurrent && !hasMore)
+  {
+    state->isArmed = false;
+    listPendingFd( engine, fd);
+  }
+  if ( !isCurrent || cqe->res == -ENOBUFS || cqe->res == -ECANCELED)
+  {
+    // Out of buffers: re-armed once they are back
+    if ( hasBuffer)
+      recycleBuffer( ring, bufferId);
+    return 0;
+  }
+  if ( cqe->res <= 0)
+  {
+    if ( hasBuffer)
+      recycleBuffer( ring, bufferId);
+    closeStream( engine, fd, handler, context);
+    return 1;
+  }
+  receiveBytes( engine, fd, ring->buffers + ( size_t) bufferId * RECV_BUFFER_BYTES, cqe->res,
+    handler, context);
+  recycleBuffer( ring, bufferId);
+  return 1;
+}
+
+static int completeAll( IoEngine *engine, IoHandler handler, void *context)
+{
+  IoUring *ring = engine->ring;
+  int numberOfEvents = 0;
+  unsigned head = *ring->cqHead;
+  while ( head != __atomic_load_n( ring->cqTail, __ATOMIC_ACQUIRE))
+  {
+    struct io_uring_cqe cqe = ring->cqes[ head & ring->cqMask];
+    __atomic_store_n( ring->cqHead, ++ head, __ATOMIC_RELEASE);
+    numberOfEvents += complete( engine, &cqe, handler, context);
+  }
+  return numberOfEvents;
+}
+
+static int pollRing( IoEngine *engine, int timeoutMs, IoHandler handler, void *context)
+{
+  preparePending( engine);
+  if ( enterRing( engine->ring, 1, timeoutMs) < 0 &&
+       errno != ETIME && errno != EINTR && errno != EBUSY)
+    return -1;
+  return completeAll( engine, handler, context);
+}
+
+// epoll ---------------------------------------------------------------
+
+static int pollEpoll( IoEngine *engine, int timeoutMs, IoHandler handler, void *context)
+{
+  struct epoll_event events[ MAX_EPOLL_EVENTS];
+  int numberOfReadyFds = epoll_wait( engine->epollFd, events, MAX_EPOLL_EVENTS, timeoutMs);
+  if ( numberOfReadyFds < 0)
+    return ( errno == EINTR)? 0 : -1;
+
+  int numberOfEvents = 0;
+  for ( int e = 0; e < numberOfReadyFds; ++e)
+  {
+    int fd = events[ e].data.fd;
+    IoFd *state = &engine->fds[ fd];
+    unsigned generation = state->generation;
+    IoEvent event;
+    memset( &event, 0, sizeof( event));
+    event.fd = fd;
+    switch ( state->mode)
+    {
+      case IO_FD_READABLE:
+        event.type = IO_EVENT_READABLE;
+        handler( context, &event);
+        numberOfEvents ++;
+        break;
+      case IO_FD_LISTENER:
+        event.type = IO_EVENT_ACCEPTED;
+        while ( isWatched( engine, fd, generation) &&
+                ( event.acceptedSocket = accept4( fd, NULL, NULL, SOCK_CLOEXEC)) >= 0)
+        {
+          handler( context, &event);
+          numberOfEvents ++;
+        }
+        break;
+      case IO_FD_STREAM:
+      {
+        ssize_t length = recv( fd, engine->scratch, RECV_BUFFER_BYTES, MSG_DONTWAIT);
+        if ( length < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+          break;
+        if ( length <= 0)
+          closeStream( engine, fd, handler, context);
+        else
+          receiveBytes( engine, fd, engine->scratch, length, handler, context);
+        numberOfEvents ++;
+        break;
+      }
+      default:
+        break;  // unwatched by an earlier event of the batch
+    }
+  }
+  return numberOfEvents;
+}
+
+// The engine ----------------------------------------------------------
+
+bool initIoEngine( IoEngine *engine, int kind)
+{
+  memset( engine, 0, sizeof( *engine));
+  engine->epollFd = -1;
+  if ( !growFds( engine, 0))
+    return false;
+  if ( kind == IO_ENGINE_URING && ( engine->ring = createRing()))
+  {
+    engine->kind = IO_ENGINE_URING;
+    return true;
+  }
+  engine->kind = IO_ENGINE_EPOLL;
+  engine->epollFd = epoll_create1( EPOLL_CLOEXEC);
+  engine->scratch = ( char*) malloc( RECV_BUFFER_BYTES);
+  if ( engine->epollFd < 0 || !engine->scratch)
+  {
+    destroyIoEngine( engine);
+    return false;
+  }
+  return true;
+}
+
+static double nowMs()
+{
+  struct timespec now;
+  clock_gettime( CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+void destroyIoEngine( IoEngine *engine)
+{
+  if ( engine->ring)
+  {
+    IoUring *ring = engine->ring;
+    preparePending( engine);
+    double endMs = nowMs() + MAX_DRAIN_MS;
+    while ( ring->numberOfSendsInFlight > 0 && nowMs() < endMs)
+    {
+      if ( enterRing( ring, 1, ( int) ( endMs - nowMs()) + 1) < 0 &&
+           errno != ETIME && errno != EINTR && errno != EBUSY)
+        break;
+      completeAll( engine, NULL, NULL);
+    }
+    destroyRing( ring);
+  }
+  if ( engine->epollFd >= 0)
+    close( engine->epollFd);
+  for ( int i = 0; i < engine->fdCapacity; ++i)
+  {
+    free( engine->fds[ i].stash);
+    free( engine->fds[ i].sendBuffer);
+    free( engine->fds[ i].queue);
+  }
+  free( engine->fds);
+  free( engine->scratch);
+  memset( engine, 0, sizeof( *engine));
+  engine->epollFd = -1;
+}
+
+static bool watchFd( IoEngine *engine, int fd, int mode)
+{
+  if ( fd < 0 || ( fd >= engine->fdCapacity && !growFds( engine, fd)))
+    return false;
+  IoFd *state = &engine->fds[ fd];
+  if ( state->mode != IO_FD_NONE)
+  {
+    errno = EEXIST;
+    return false;
+  }
+  if ( engine->kind == IO_ENGINE_EPOLL)
+  {
+    struct epoll_event event;
+    memset( &event, 0, sizeof( event));
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if ( epoll_ctl( engine->epollFd, EPOLL_CTL_ADD, fd, &event) < 0)
+      return false;
+  }
+  state->mode = mode;
+  state->stashLength = 0;
+  state->queueLength = 0;
+  if ( engine->kind == IO_ENGINE_URING && !listPendingFd( engine, fd))
+  {
+    state->mode = IO_FD_NONE;
+    return false;
+  }
+  return true;
+}
+
+bool watchListener( IoEngine *engine, int listeningSocket)
+{
+  return watchFd( engine, listeningSocket, IO_FD_LISTENER);
+}
+
+bool watchStream( IoEngine *engine, int socket)
+{
+  return watchFd( engine, socket, IO_FD_STREAM);
+}
+
+bool watchReadable( IoEngine *engine, int fd)
+{
+  return watchFd( engine, fd, IO_FD_READABLE);
+}
+
+void unwatchFd( IoEngine *engine, int fd)
+{
+  if ( fd < 0 || fd >= engine->fdCapacity || engine->fds[ fd].mode == IO_FD_NONE)
+    return;
+  IoFd *state = &engine->fds[ fd];
+  if ( engine->kind == IO_ENGINE_EPOLL)
+    epoll_ctl( engine->epollFd, EPOLL_CTL_DEL, fd, NULL);
+  else if ( state->isArmed)
+    cancelArmed( engine, fd);
+  // A send in flight carries on: the kernel holds the socket until it ends
+  state->mode = IO_FD_NONE;
+  state->isArmed = false;
+  state->generation ++;
+  state->stashLength = 0;
+  state->queueLength = 0;
+  if ( !state->isSending)
+    state->sendOffset = state->sendLength = 0;
+}
+
+static bool sendNow( int socket, int type, const void *payload, int length)
+{
+  char message[ sizeof( MessageHeader) + MAX_MESSAGE_LENGTH];
+  MessageHeader header;
+  header.type = type;
+  header.length = length;
+  memcpy( message, &header, sizeof( header));
+  memcpy( message + sizeof( header), payload, length);
+  size_t size = sizeof( header) + length;
+  size_t sent = 0;
+  while ( sent < size)
+  {
+    ssize_t sentBytesCount = send( socket, message + sent, size - sent, MSG_NOSIGNAL);
+    if ( sentBytesCount < 0)
+    {
+      if ( errno == EINTR)
+        continue;
+      return false;
+    }
+    sent += sentBytesCount;
+  }
+  return true;
+}
+
+bool queueIoMessage( IoEngine *engine, int socket, int type, const void *payload, int length)
+{
+  if ( socket < 0 || socket >= engine->fdCapacity || engine->fds[ socket].mode != IO_FD_STREAM ||
+       length < 0 || length > MAX_MESSAGE_LENGTH)
+  {
+    errno = EINVAL;
+    return false;
+  }
+  if ( engine->kind == IO_ENGINE_EPOLL)
+    return sendNow( socket, type, payload, length);
+
+  IoFd *state = &engine->fds[ socket];
+  size_t size = sizeof( MessageHeader) + length;
+  if ( state->queueLength + size > state->queueCapacity)
+  {
+    size_t capacity = ( state->queueCapacity > 0)? state->queueCapacity * 2 : MIN_SEND_BUFFER_BYTES;
+    while ( capacity < state->queueLength + size)
+      capacity *= 2;
+    char *grown = ( char*) realloc( state->queue, capacity);
+    if ( !grown)
+      return false;
+    state->queue = grown;
+    state->queueCapacity = capacity;
+  }
+  MessageHeader header;
+  header.type = type;
+  header.length = length;
+  memcpy( state->queue + state->queueLength, &header, sizeof( header));
+  memcpy( state->queue + state->queueLength + sizeof( header), payload, length);
+  state->queueLength += size;
+  return state->isSending || listPendingFd( engine, socket);
+}
+
+void submitIoEngine( IoEngine *engine)
+{
+  if ( engine->kind != IO_ENGINE_URING)
+    return;
+  preparePending( engine);
+  enterRing( engine->ring, 0, 0);
+}
+
+int pollIoEngine( IoEngine *engine, int timeoutMs, IoHandler handler, void *context)
+{
+  if ( engine->kind == IO_ENGINE_URING)
+    return pollRing( engine, timeoutMs, handler, context);
+  return pollEpoll( engine, timeoutMs, handler, context);
+}
@@ -0,0 +1,82 @@
+
+/*
+  jobQueue.c
+
+  A bounded ring buffer of jobs protected by a mutex. The worker's
+  event loop pushes requests without ever blocking (a full queue
+  is reported back so the loop can refuse more work), while the
+  compute thread blocks in popJob() until a job arrives.
+*/
+
+#include <stdlib.h>
+
+#include "jobQueue.h"
+
+bool initJobQueue( JobQueue *queue, int capacity)
+{
+  queue->jobs = ( Job*) malloc( capacity * sizeof( Job));
+  if ( !queue->jobs)
+    return false;
+  queue->capacity = capacity;
+  queue->head = 0;
+  queue->length = 0;
+  pthread_mutex_init( &queue->mutex, NULL);
+  pthread_cond_init( &queue->notEmpty, NULL);
+  return true;
+}
+
+void destroyJobQueue( JobQueue *queue)
+{
+  pthread_cond_destroy( &queue->notEmpty);
+  pthread_mutex_destroy( &queue->mutex);
+  free( queue->jobs);
+  queue->jobs = NULL;
+}
+
+bool tryPushJob( JobQueue *queue, const Job *job)
+{
+  pthread_mutex_lock( &queue->mutex);
+  bool is_ok = queue->length < queue->capacity;
+  if ( is_ok)
+  {
+    queue->jobs[ ( queue->head + queue->length) % queue->capacity] = *job;
+    queue->length ++;
+    pthread_cond_signal( &queue->notEmpty);
+  }
+  pthread_mutex_unlock( &queue->mutex);
+  return is_ok;
+}
+
+static void takeHeadLocked( JobQueue *queue, Job *jobOut)
+{
+  *jobOut = queue->jobs[ queue->head];
+  queue->head = ( queue->head + 1) % queue->capacity;
+  queue->length --;
+}
+
+bool tryPopJob( JobQueue *queue, Job *jobOut)
+{
+  pthread_mutex_lock( &queue->mutex);
+  bool is_ok = queue->length > 0;
+  if ( is_ok)
+    takeHeadLocked( queue, jobOut);
+  pthread_mutex_unlock( &queue->mutex);
+  return is_ok;
+}
+
+void popJob( JobQueue *queue, Job *jobOut)
+{
+  pthread_mutex_lock( &queue->mutex);
+  while ( queue->length == 0)
+    pthread_cond_wait( &queue->notEmpty, &queue->mutex);
+  takeHeadLocked( queue, jobOut);
+  pthread_mutex_unlock( &queue->mutex);
+}
+
+bool isJobQueueFull( JobQueue *queue)
+{
+  pthread_mutex_lock( &queue->mutex);
+  bool isFull = queue->length >= queue->capacity;
+  pthread_mutex_unlock( &queue->mutex);
+  return isFull;
+}
@@ -0,0 +1,149 @@
+
+/*
+  jobTrace.c
+
+  Gathers the trace spans of a job and writes them as a Chrome trace.
+  A worker's spans are timed on its own CLOCK_MONOTONIC_RAW, which on
+  another host has nothing to do with the server's; they are moved
+  onto the server's clock with the offset the server estimated for
+  the worker (see clockOffsetNs in workerTable.h).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <arpa/inet.h>
+
+#include "jobTrace.h"
+#include "trace.h"
+
+bool initJobTrace( JobTrace *trace, int numberOfWorkers, uint64_t startNs)
+{
+  memset( trace, 0, sizeof( *trace));
+  trace->startNs = startNs;
+  trace->capacity = 1024;
+  trace->records = ( TraceRecord*) malloc( trace->capacity * sizeof( TraceRecord));
+  trace->recordWorkers = ( int*) malloc( trace->capacity * sizeof( int));
+  trace->isWorkerDone = ( bool*) calloc( numberOfWorkers, sizeof( bool));
+  if ( !trace->records || !trace->recordWorkers || !trace->isWorkerDone)
+  {
+    destroyJobTrace( trace);
+    return false;
+  }
+  return true;
+}
+
+void destroyJobTrace( JobTrace *trace)
+{
+  free( trace->records);
+  free( trace->recordWorkers);
+  free( trace->isWorkerDone);
+  memset( trace, 0, sizeof( *trace));
+}
+
+bool addTraceRecords( JobTrace *trace, int worker, const TraceRecord *records, int count)
+{
+  if ( trace->numberOfRecords + count > trace->capacity)
+  {
+    int capacity = trace->capacity;
+    while ( capacity < trace->numberOfRecords + count)
+      capacity *= 2;
+    TraceRecord *grownRecords = ( TraceRecord*) realloc( trace->records,
+      capacity * sizeof( TraceRecord));
+    if ( !grownRecords)
+      return false;
+    trace->records = grownRecords;
+    int *grownWorkers = ( int*) realloc( trace->recordWorkers, capacity * sizeof( int));
+    if ( !grownWorkers)
+      return false;
+    trace->recordWorkers = grownWorkers;
+    trace->capacity = capacity;
+  }
+  for ( int i = 0; i < count; ++i)
+  {
+    trace->records[ trace->numberOfRecords] = records[ i];
+    trace->records[ trace->numberOfRecords].name[ TRACE_NAME_LENGTH - 1] = '\0';
+    trace->recordWorkers[ trace->numberOfRecords] = worker;
+    trace->numberOfRecords ++;
+  }
+  return true;
+}
+
+struct ServerSpans
+{
+  JobTrace *trace;
+  bool isOk;
+};
+typedef struct ServerSpans ServerSpans;
+
+static void addServerSpan( void *context, const TraceSpan *span)
+{
+  ServerSpans *serverSpans = ( ServerSpans*) context;
+  if ( span->endNs < serverSpans->trace->startNs)
+    return;
+  TraceRecord record;
+  makeTraceRecord( span, &record);
+  if ( !addTraceRecords( serverSpans->trace, -1, &record, 1))
+    serverSpans->isOk = false;
+}
+
+bool addServerSpans( JobTrace *trace)
+{
+  ServerSpans serverSpans;
+  serverSpans.trace = trace;
+  serverSpans.isOk = true;
+  visitTraceSpans( addServerSpan, &serverSpans);
+  return serverSpans.isOk;
+}
+
+bool isJobTraceComplete( const JobTrace *trace, const WorkerTable *workers)
+{
+  for ( int i = 0; i < workers->numberOfWorkers; ++i)
+  {
+    if ( workers->isAlive[ i] && !trace->isWorkerDone[ i])
+      return false;
+  }
+  return true;
+}
+
+// The names come from the workers; keep the JSON well-formed whatever they are
+static void writeName( FILE *file, const char *name)
+{
+  for ( ; *name; ++name)
+    fputc( ( isalnum( ( unsigned char) *name) || *name == ' ' || *name == '_' || *name == '-')?
+      *name : '?', file);
+}
+
+bool writeChromeTrace( const JobTrace *trace, const WorkerTable *workers, const char *path)
+{
+  FILE *file = fopen( path, "w");
+  if ( !file)
+    return false;
+  fprintf( file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  fprintf( file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"args\":{\"name\":\"server\"}}");
+  for ( int i = 0; i < workers->numberOfWorkers; ++i)
+  {
+    bool hasOffset = workers->clockRoundTripNs[ i] != UINT64_MAX;
+    fprintf( file, ",\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":"
+      "{\"name\":\"worker %s:%d, clock offset %.3lf us%s\"}}", i + 1,
+      inet_ntoa( workers->addresses[ i].sin_addr), ntohs( workers->addresses[ i].sin_port),
+      workers->clockOffsetNs[ i] / 1e3, ( hasOffset)? "" : " (unknown)");
+    fprintf( file, ",\n{\"name\":\"process_sort_index\",\"ph\":\"M\",\"pid\":%d,"
+      "\"args\":{\"sort_index\":%d}}", i + 1, i + 1);
+  }
+  for ( int i = 0; i < trace->numberOfRecords; ++i)
+  {
+    const TraceRecord *record = &trace->records[ i];
+    int worker = trace->recordWorkers[ i];
+    int64_t offsetNs = ( worker >= 0)? workers->clockOffsetNs[ worker] : 0;
+    double startUs = ( ( int64_t) ( record->startNs - trace->startNs) - offsetNs) / 1e3;
+    double lengthUs = ( record->endNs - record->startNs) / 1e3;
+    fprintf( file, ",\n{\"name\":\"");
+    writeName( file, record->name);
+    fprintf( file, "\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3lf,\"dur\":%.3lf,"
+      "\"args\":{\"arg\":%ld}}", worker + 1, record->threadId, startUs, lengthUs, record->arg);
+  }
+  fprintf( file, "\n]}\n");
+  return fclose( file) == 0;
+}
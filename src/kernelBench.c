@@ -0,0 +1,421 @@
+
+/*
+  kernelBench.c
+
+  Usage:
+  kernelBench [-r <repetitions>] [-w <warmup runs>] [-t <max threads>]
+              [-n <max steps>] [-f polynomial|transcendental|branchy]
+              [-v plain|progress|pinned|counted] [-l error|warn|info|debug]
+
+  Description
+
+  Microbenchmark of the integration kernel (integral.c), to catch
+  regressions in it. The program takes the integral over [0, 1] of
+  every combination of:
+
+  - the integrand: a cheap polynomial (x * x, the worker's), a
+    transcendental one (sin(x) * exp(-x)) and a branchy one that
+    takes one of two ways at random, so the branch predictor can't
+    learn it;
+  - the number of steps: 2^16, 2^20, ... up to <max steps> (2^24 by
+    default), 16 times more each time;
+  - the number of threads: 1, 2, 4, ... up to <max threads> (one per
+    physical core in the CPU affinity mask by default, as the worker
+    chooses them);
+  - the variant of the kernel: plain, as integrate() runs it; with
+    progress and cancellation, as the worker runs its requests; with
+    the threads pinned to the CPUs of the worker's layout (and in
+    per-node sub-pools on NUMA machines); and with the hardware
+    counters on (see perfCounters.c).
+
+  -f and -v keep only the integrand or variant given. Each
+  combination is run <warmup runs> times (1 by default) untimed, then
+  <repetitions> times (5 by default) timed. Every step evaluates the
+  function twice; the program reports the mean and the 95% confidence
+  interval (Student's t) of the ns per evaluation and of the
+  evaluations per second over the repetitions, the fastest run, and
+  with the counters on, the cycles, instructions and misses per
+  evaluation that the kernel allowed counting.
+
+  The results go to the standard output as one JSON document;
+  progress is logged to the standard error. "make bench" builds the
+  program and writes the results to bench.json (BENCH_OUTPUT), with
+  BENCH_ARGS as its arguments.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "common.h"
+#include "integral.h"
+#include "hardware.h"
+#include "trace.h"
+#include "perfCounters.h"
+
+#define MAX_REPETITIONS 1000
+#define MIN_STEPS ( 1L << 16)
+#define DEFAULT_MAX_STEPS ( 1L << 24)
+#define STEPS_FACTOR 16
+
+static double polynomial( double x)
+{
+  return x * x;
+}
+
+static double transcendental( double x)
+{
+  return sin( x) * exp( -x);
+}
+
+// Which way it goes depends on a hash of x; sqrt() may set errno,
+// so the compiler can't compute both ways and pick one without a branch
+static double branchy( double x)
+{
+  uint64_t bits;
+  memcpy( &bits, &x, sizeof( bits));
+  bits *= 0x9e3779b97f4a7c15ull;
+  if ( bits >> 63)
+    return sqrt( x);
+  return x * x;
+}
+
+struct Integrand
+{
+  const char *name;
+  double ( *f)( double);
+};
+typedef struct Integrand Integrand;
+
+static const Integrand integrands[] =
+{
+  { "polynomial", polynomial },
+  { "transcendental", transcendental },
+  { "branchy", branchy }
+};
+#define NUMBER_OF_INTEGRANDS ( int) ( sizeof( integrands) / sizeof( integrands[ 0]))
+
+#define VARIANT_PLAIN 0
+#define VARIANT_PROGRESS 1
+#define VARIANT_PINNED 2
+#define VARIANT_COUNTED 3
+#define NUMBER_OF_VARIANTS 4
+
+static const char *variantNames[ NUMBER_OF_VARIANTS] = { "plain", "progress", "pinned", "counted" };
+
+struct Args
+{
+  int repetitions;
+  int warmups;
+  int maxThreads;  // 0 to choose from the CPU layout
+  long maxSteps;
+  int integrand;   // -1 for all
+  int variant;     // -1 for all
+};
+typedef struct Args Args;
+
+// Mean and 95% confidence interval of some samples
+struct SampleStats
+{
+  double mean;
+  double ci95;
+  double min;
+};
+typedef struct SampleStats SampleStats;
+
+static void printUsageAndDie();
+static void printAndDie( const char *msg);
+static void parseArgumentsOrDie( int argc, char **argv, Args *argsOut);
+static void runSweep( const Args *args, const HardwareInfo *hardware, const CpuLayout *cpuLayout);
+
+int main( int argc, char **argv)
+{
+  Args args;
+  parseArgumentsOrDie( argc, argv, &args);
+
+  HardwareInfo hardware;
+  detectHardware( &hardware);
+  CpuLayout cpuLayout;
+  detectCpuLayout( hardware.cpuQuota, args.maxThreads, &cpuLayout);
+  if ( args.maxThreads == 0)
+    args.maxThreads = cpuLayout.numberOfThreads;
+
+  runSweep( &args, &hardware, &cpuLayout);
+  return 0;
+}
+
+static void printUsageAndDie()
+{
+  flushLog();
+  fprintf( stderr, "Usage: kernelBench [-r <repetitions>] [-w <warmup runs>] [-t <max threads>]\n"
+    "       [-n <max steps>] [-f polynomial|transcendental|branchy]\n"
+    "       [-v plain|progress|pinned|counted] [-l error|warn|info|debug]\n");
+  exit( EXIT_FAILURE);
+}
+
+static void printAndDie( const char *msg)
+{
+  flushLog();
+  fprintf( stderr, "%s\n", msg);
+  exit( EXIT_FAILURE);
+}
+
+static int findName( const char *name, const char **names, int numberOfNames)
+{
+  for ( int i = 0; i < numberOfNames; ++i)
+    if ( strcmp( name, names[ i]) == 0)
+      return i;
+  return -1;
+}
+
+static void parseArgumentsOrDie( int argc, char **argv, Args *argsOut)
+{
+  argsOut->repetitions = 5;
+  argsOut->warmups = 1;
+  argsOut->maxThreads = 0;
+  argsOut->maxSteps = DEFAULT_MAX_STEPS;
+  argsOut->integrand = -1;
+  argsOut->variant = -1;
+
+  const char *integrandNames[ NUMBER_OF_INTEGRANDS];
+  for ( int i = 0; i < NUMBER_OF_INTEGRANDS; ++i)
+    integrandNames[ i] = integrands[ i].name;
+
+  int option;
+  while ( ( option = getopt( argc, argv, "r:w:t:n:f:v:l:")) != -1)
+  {
+    switch ( option)
+    {
+      case 'r':
+        argsOut->repetitions = atoi( optarg);
+        if ( argsOut->repetitions < 2 || argsOut->repetitions > MAX_REPETITIONS)
+          printAndDie( "Error: <repetitions> must be an integer from 2 to 1000");
+        break;
+      case 'w':
+        argsOut->warmups = atoi( optarg);
+        if ( argsOut->warmups < 0)
+          printAndDie( "Error: <warmup runs> must be a non-negative integer");
+        break;
+      case 't':
+        argsOut->maxThreads = atoi( optarg);
+        if ( argsOut->maxThreads < 1 || argsOut->maxThreads > MAX_CPUS)
+          printAndDie( "Error: <max threads> must be a positive integer");
+        break;
+      case 'n':
+        argsOut->maxSteps = atol( optarg);
+        if ( argsOut->maxSteps < MIN_STEPS)
+          printAndDie( "Error: <max steps> must be at least 65536");
+        break;
+      case 'f':
+        argsOut->integrand = findName( optarg, integrandNames, NUMBER_OF_INTEGRANDS);
+        if ( argsOut->integrand < 0)
+          printAndDie( "Error: the integrand must be polynomial, transcendental or branchy");
+        break;
+      case 'v':
+        argsOut->variant = findName( optarg, variantNames, NUMBER_OF_VARIANTS);
+        if ( argsOut->variant < 0)
+          printAndDie( "Error: the variant must be plain, progress, pinned or counted");
+        break;
+      case 'l':
+        if ( !setLogLevel( optarg))
+          printAndDie( "Error: the log level must be error, warn, info or debug");
+        break;
+      default:
+        printUsageAndDie();
+    }
+  }
+  if ( optind != argc)
+    printUsageAndDie();
+}
+
+// Two-sided 95% quantiles of Student's t for 1 to 30 degrees of freedom
+static double studentT95( int degreesOfFreedom)
+{
+  static const double quantiles[] =
+  {
+    12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+    2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+    2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+  };
+  if ( degreesOfFreedom > 30)
+    return 1.960;
+  return quantiles[ degreesOfFreedom - 1];
+}
+
+static void computeStats( const double *samples, int numberOfSamples, SampleStats *statsOut)
+{
+  double sum = 0.0;
+  statsOut->min = samples[ 0];
+  for ( int i = 0; i < numberOfSamples; ++i)
+  {
+    sum += samples[ i];
+    if ( samples[ i] < statsOut->min)
+      statsOut->min = samples[ i];
+  }
+  statsOut->mean = sum / numberOfSamples;
+
+  double squares = 0.0;
+  for ( int i = 0; i < numberOfSamples; ++i)
+    squares += ( samples[ i] - statsOut->mean) * ( samples[ i] - statsOut->mean);
+  double deviation = sqrt( squares / ( numberOfSamples - 1));
+  statsOut->ci95 = studentT95( numberOfSamples - 1) * deviation / sqrt( numberOfSamples);
+}
+
+// Options as the worker makes them for the variant; false if the
+// variant can't run with that many threads here
+static bool makeOptions( int variant, const CpuLayout *cpuLayout, int numberOfThreads,
+  IntegrationProgress *progress, CancellationToken *cancellation, PerfCounts *perfCounts,
+  IntegrationOptions *optionsOut)
+{
+  memset( optionsOut, 0, sizeof( *optionsOut));
+  optionsOut->n_threads = numberOfThreads;
+  switch ( variant)
+  {
+    case VARIANT_PROGRESS:
+      optionsOut->progress = progress;
+      optionsOut->cancellation = cancellation;
+      break;
+    case VARIANT_PINNED:
+      if ( !cpuLayout->isPinned || numberOfThreads > cpuLayout->numberOfThreads)
+        return false;
+      // The first threads of the layout: one per physical core first
+      optionsOut->cpus = cpuLayout->cpus;
+      if ( cpuLayout->numberOfNodes > 1)
+        optionsOut->nodes = cpuLayout->nodes;
+      break;
+    case VARIANT_COUNTED:
+      optionsOut->perf_counts = perfCounts;
+      break;
+  }
+  return true;
+}
+
+static void writePerEval( const char *name, uint64_t count, int validCounters, int counter,
+  double evaluations, bool *isFirstInOut)
+{
+  if ( !( validCounters & counter))
+    return;
+  printf( "%s\"%s\": %.4f", ( *isFirstInOut)? "" : ", ", name, count / evaluations);
+  *isFirstInOut = false;
+}
+
+// Runs one combination and writes its JSON object; false if it didn't run
+static bool runCase( const Args *args, const CpuLayout *cpuLayout, int integrand, int variant,
+  long numberOfSteps, int numberOfThreads, bool isFirst)
+{
+  IntegrationProgress progress;
+  CancellationToken cancellation;
+  PerfCounts perfCounts;
+  IntegrationOptions options;
+  if ( !makeOptions( variant, cpuLayout, numberOfThreads, &progress, &cancellation,
+        &perfCounts, &options))
+    return false;
+
+  double ( *f)( double) = integrands[ integrand].f;
+  double delta = 1.0 / numberOfSteps;
+  double evaluations = 2.0 * numberOfSteps;
+  double result = 0.0;
+  double nsPerEval[ MAX_REPETITIONS];
+  double evaluationsPerSecond[ MAX_REPETITIONS];
+  PerfCounts totalPerfCounts;
+  memset( &totalPerfCounts, 0, sizeof( totalPerfCounts));
+
+  for ( int i = -args->warmups; i < args->repetitions; ++i)
+  {
+    cancellation.stop_reason = 0;
+    cancellation.deadline = 0;
+    memset( &perfCounts, 0, sizeof( perfCounts));
+    uint64_t startNs = traceNowNs();
+    int status = integrate_with_options( f, 0.0, 1.0, delta, &options, &result);
+    uint64_t elapsedNs = traceNowNs() - startNs;
+    if ( status)
+    {
+      LOG_WARN( "Error: integration failed with status %d\n", status);
+      return false;
+    }
+    if ( i < 0)
+      continue;
+    nsPerEval[ i] = elapsedNs / evaluations;
+    evaluationsPerSecond[ i] = evaluations / elapsedNs * 1e9;
+    addPerfCounts( &totalPerfCounts, &perfCounts);
+  }
+
+  SampleStats nsStats, rateStats;
+  computeStats( nsPerEval, args->repetitions, &nsStats);
+  computeStats( evaluationsPerSecond, args->repetitions, &rateStats);
+  LOG( "%s, %s, %ld steps, %d thread(s): %.3f +- %.3f ns/eval\n", integrands[ integrand].name,
+    variantNames[ variant], numberOfSteps, numberOfThreads, nsStats.mean, nsStats.ci95);
+
+  printf( "%s    {\"integrand\": \"%s\", \"variant\": \"%s\", \"steps\": %ld, \"threads\": %d, "
+    "\"evaluations\": %.0f, \"result\": %.15g,\n", ( isFirst)? "" : ",\n",
+    integrands[ integrand].name, variantNames[ variant], numberOfSteps, numberOfThreads,
+    evaluations, result);
+  printf( "     \"nsPerEval\": {\"mean\": %.4f, \"ci95\": %.4f, \"min\": %.4f},\n",
+    nsStats.mean, nsStats.ci95, nsStats.min);
+  printf( "     \"evaluationsPerSecond\": {\"mean\": %.0f, \"ci95\": %.0f}",
+    rateStats.mean, rateStats.ci95);
+  if ( variant == VARIANT_COUNTED)
+  {
+    double measuredEvaluations = evaluations * args->repetitions;
+    bool isFirstCounter = true;
+    printf( ",\n     \"perEval\": {");
+    writePerEval( "cycles", totalPerfCounts.cycles, totalPerfCounts.validCounters, PERF_CYCLES,
+      measuredEvaluations, &isFirstCounter);
+    writePerEval( "instructions", totalPerfCounts.instructions, totalPerfCounts.validCounters,
+      PERF_INSTRUCTIONS, measuredEvaluations, &isFirstCounter);
+    writePerEval( "branchMisses", totalPerfCounts.branchMisses, totalPerfCounts.validCounters,
+      PERF_BRANCH_MISSES, measuredEvaluations, &isFirstCounter);
+    writePerEval( "cacheMisses", totalPerfCounts.cacheMisses, totalPerfCounts.validCounters,
+      PERF_CACHE_MISSES, measuredEvaluations, &isFirstCounter);
+    printf( "}");
+  }
+  printf( "}");
+  return true;
+}
+
+static void runSweep( const Args *args, const HardwareInfo *hardware, const CpuLayout *cpuLayout)
+{
+  printf( "{\n  \"hardware\": {\"cores\": %d, \"physicalCores\": %d, \"simd\": \"%s\", "
+    "\"numaNodes\": %d, \"pinned\": %s},\n", hardware->numberOfCores,
+    cpuLayout->numberOfPhysicalCores, simdLevelName( hardware->simdLevel),
+    cpuLayout->numberOfNodes, ( cpuLayout->isPinned)? "true" : "false");
+  printf( "  \"repetitions\": %d,\n  \"warmups\": %d,\n  \"results\": [\n",
+    args->repetitions, args->warmups);
+
+  bool isFirst = true;
+  for ( int integrand = 0; integrand < NUMBER_OF_INTEGRANDS; ++integrand)
+  {
+    if ( args->integrand >= 0 && integrand != args->integrand)
+      continue;
+    for ( int variant = 0; variant < NUMBER_OF_VARIANTS; ++variant)
+    {
+      if ( args->variant >= 0 && variant != args->variant)
+        continue;
+      for ( long numberOfSteps = MIN_STEPS; numberOfSteps <= args->maxSteps;
+            numberOfSteps *= STEPS_FACTOR)
+      {
+        for ( int numberOfThreads = 1; ; numberOfThreads *= 2)
+        {
+          if ( numberOfThreads > args->maxThreads)
+            numberOfThreads = args->maxThreads;
+          if ( runCase( args, cpuLayout, integrand, variant, numberOfSteps, numberOfThreads,
+                isFirst))
+            isFirst = false;
+          else if ( variant == VARIANT_PINNED)
+            LOG_DEBUG( "Not pinning %d thread(s): the CPU layout has %d\n", numberOfThreads,
+              ( cpuLayout->isPinned)? cpuLayout->numberOfThreads : 0);
+          if ( numberOfThreads == args->maxThreads)
+            break;
+        }
+      }
+    }
+  }
+  printf( "\n  ]\n}\n");
+  fflush( stdout);
+}
@@ -0,0 +1,573 @@
+
+/*
+  logging.c
+
+  LOG() never formats or writes on the calling thread. It copies the
+  format's pointer and the raw arguments (and the text of %s strings,
+  which may not outlive the call: think inet_ntoa()) into a ring of
+  fixed-size records owned by the thread, which costs no lock and no
+  system call. A background thread wakes every LOG_DRAIN_MS, formats
+  the records of all the rings, oldest first, and writes them to
+  stderr in one go. When a ring is full the message is dropped and
+  counted rather than waited for; the count is logged with the rest.
+
+  Rings are kept in a lock-free list and handed on from exiting
+  threads to new ones, like the trace buffers (see threadSlots.c). flushLog()
+  runs at exit(); a process killed by a signal loses at most the last
+  LOG_DRAIN_MS of messages.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "logging.h"
+#include "threadSlots.h"
+
+#define LOG_DRAIN_MS 10
+#define LOG_LINE_LENGTH 1024
+#define LOG_OUTPUT_LENGTH 65536
+#define LOG_SPEC_LENGTH 32
+
+int logLevel = LOG_LEVEL_INFO;
+
+struct LogRecord
+{
+  uint64_t timeNs;
+  const char *format;
+  int argumentsLength;
+  int isTruncated;  // the arguments after the last one kept didn't fit
+  char arguments[ LOG_RECORD_LENGTH];
+};
+typedef struct LogRecord LogRecord;
+
+struct LogRing
+{
+  ThreadSlot slot;
+  LogRecord records[ LOG_RING_RECORDS];
+  uint64_t head;  // the owner's; published with a release store
+  char headPadding[ 56];
+  uint64_t tail;  // the logging thread's
+  uint64_t numberDropped;
+};
+typedef struct LogRing LogRing;
+
+// The kind of argument a conversion takes, as passed through "..."
+enum ArgumentKind
+{
+  ARGUMENT_NONE,  // %%
+  ARGUMENT_INT,
+  ARGUMENT_LONG,
+  ARGUMENT_LONG_LONG,
+  ARGUMENT_SIZE,
+  ARGUMENT_DOUBLE,
+  ARGUMENT_LONG_DOUBLE,
+  ARGUMENT_STRING,
+  ARGUMENT_POINTER,
+  ARGUMENT_UNKNOWN
+};
+typedef enum ArgumentKind ArgumentKind;
+
+// One conversion of a format: its text, and whether its width and
+// precision are '*'s to be taken from the arguments
+struct Conversion
+{
+  const char *start;
+  int length;
+  ArgumentKind kind;
+  bool isWidthStar;
+  bool isPrecisionStar;
+};
+typedef struct Conversion Conversion;
+
+static ThreadSlot *rings;
+static __thread LogRing *threadRing;
+static pthread_key_t releaseKey;
+static pthread_once_t startOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t drainMutex = PTHREAD_MUTEX_INITIALIZER;
+static char output[ LOG_OUTPUT_LENGTH];
+
+bool setLogLevel( const char *name)
+{
+  static const char *names[] = { "error", "warn", "info", "debug" };
+  for ( int i = 0; i < ( int) ( sizeof( names) / sizeof( names[ 0])); ++i)
+  {
+    if ( strcmp( name, names[ i]) == 0)
+    {
+      logLevel = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+static uint64_t nowNs()
+{
+  struct timespec now;
+  clock_gettime( CLOCK_MONOTONIC_RAW, &now);
+  return ( uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// Reads the conversion at *format, which points just past a '%'
+static void parseConversion( const char **format, Conversion *conversionOut)
+{
+  const char *p = *format;
+  conversionOut->start = p - 1;
+  conversionOut->isWidthStar = false;
+  conversionOut->isPrecisionStar = false;
+  while ( *p && strchr( "-+ #0'", *p))
+    ++p;
+  if ( *p == '*')
+  {
+    conversionOut->isWidthStar = true;
+    ++p;
+  }
+  while ( *p >= '0' && *p <= '9')
+    ++p;
+  if ( *p == '.')
+  {
+    ++p;
+    if ( *p == '*')
+    {
+      conversionOut->isPrecisionStar = true;
+      ++p;
+    }
+    while ( *p >= '0' && *p <= '9')
+      ++p;
+  }
+  int longs = 0;
+  bool isSize = false;
+  bool isLongDouble = false;
+  for ( ; *p && strchr( "hlzjtL", *p); ++p)
+  {
+    if ( *p == 'l')
+      longs ++;
+    else if ( *p == 'z' || *p == 't')
+      isSize = true;
+    else if ( *p == 'j')
+      longs = 2;
+    else if ( *p == 'L')
+      isLongDouble = true;
+  }
+  switch ( *p)
+  {
+    case '%':
+      conversionOut->kind = ARGUMENT_NONE;
+      break;
+    case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+      conversionOut->kind = ( isSize)? ARGUMENT_SIZE :
+        ( longs >= 2)? ARGUMENT_LONG_LONG : ( longs == 1)? ARGUMENT_LONG : ARGUMENT_INT;
+      break;
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+      conversionOut->kind = ( isLongDouble)? ARGUMENT_LONG_DOUBLE : ARGUMENT_DOUBLE;
+      break;
+    case 's':
+      conversionOut->kind = ARGUMENT_STRING;
+      break;
+    case 'p':
+      conversionOut->kind = ARGUMENT_POINTER;
+      break;
+    default:
+      conversionOut->kind = ARGUMENT_UNKNOWN;
+      break;
+  }
+  if ( *p)
+    ++p;
+  conversionOut->length = ( int) ( p - conversionOut->start);
+  *format = p;
+}
+
+static bool putArgument( LogRecord *record, const void *value, int length)
+{
+  if ( record->argumentsLength + length > LOG_RECORD_LENGTH)
+  {
+    record->isTruncated = 1;
+    return false;
+  }
+  memcpy( record->arguments + record->argumentsLength, value, length);
+  record->argumentsLength += length;
+  return true;
+}
+
+// A string is kept with its '\0', cut short if it doesn't fit whole
+static bool putString( LogRecord *record, const char *string)
+{
+  if ( !string)
+    string = "(null)";
+  int room = LOG_RECORD_LENGTH - record->argumentsLength;
+  int length = ( int) strnlen( string, room);
+  if ( length == room)
+  {
+    if ( room == 0)
+    {
+      record->isTruncated = 1;
+      return false;
+    }
+    length = room - 1;
+    record->isTruncated = 1;
+  }
+  memcpy( record->arguments + record->argumentsLength, string, length);
+  record->arguments[ record->argumentsLength + length] = '\0';
+  record->argumentsLength += length + 1;
+  return !record->isTruncated;
+}
+
+static void putArguments( LogRecord *record, const char *format, va_list arguments)
+{
+  while ( ( format = strchr( format, '%')))
+  {
+    Conversion conversion;
+    ++format;
+    parseConversion( &format, &conversion);
+    int star;
+    if ( conversion.isWidthStar)
+    {
+      star = va_arg( arguments, int);
+      if ( !putArgument( record, &star, sizeof( star)))
+        return;
+    }
+    if ( conversion.isPrecisionStar)
+    {
+      star = va_arg( arguments, int);
+      if ( !putArgument( record, &star, sizeof( star)))
+        return;
+    }
+    bool isOk = true;
+    switch ( conversion.kind)
+    {
+      case ARGUMENT_INT:
+      {
+        int value = va_arg( arguments, int);
+        isOk = putArgument( record, &value, sizeof( value));
+        break;
+      }
+      case ARGUMENT_LONG:
+      {
+        long value = va_arg( arguments, long);
+        isOk = putArgument( record, &value, sizeof( value));
+        break;
+      }
+      case ARGUMENT_LONG_LONG:
+      {
+        long long value = va_arg( arguments, long long);
+        isOk = putArgument( record, &value, sizeof( value));
+        break;
+      }
+      case ARGUMENT_SIZE:
+      {
+        size_t value = va_arg( arguments, size_t);
+        isOk = putArgument( record, &value, sizeof( value));
+        break;
+      }
+      case ARGUMENT_DOUBLE:
+      {
+        double value = va_arg( arguments, double);
+        isOk = putArgument( record, &value, sizeof( value));
+        break;
+      }
+      case ARGUMENT_LONG_DOUBLE:
+      {
+        long double value = va_arg( arguments, long double);
+        isOk = putArgument( record, &value, sizeof( value));
+        break;
+      }
+      case ARGUMENT_STRING:
+        isOk = putString( record, va_arg( arguments, const char*));
+        break;
+      case ARGUMENT_POINTER:
+      {
+        void *value = va_arg( arguments, void*);
+        isOk = putArgument( record, &value, sizeof( value));
+        break;
+      }
+      case ARGUMENT_NONE:
+        break;
+      case ARGUMENT_UNKNOWN:
+        // The rest of the arguments can't be told apart
+        record->isTruncated = 1;
+        return;
+    }
+    if ( !isOk)
+      return;
+  }
+}
+
+static void *drainLoop( void *unused);
+
+static void startLogging()
+{
+  pthread_key_create( &releaseKey, releaseThreadSlot);
+  atexit( flushLog);
+  pthread_t thread;
+  pthread_attr_t attributes;
+  pthread_attr_init( &attributes);
+  pthread_attr_setdetachstate( &attributes, PTHREAD_CREATE_DETACHED);
+  if ( pthread_create( &thread, &attributes, drainLoop, NULL) != 0)
+    fprintf( stderr, "Can't start the logging thread; messages are written at exit\n");
+  pthread_attr_destroy( &attributes);
+}
+
+static LogRing *getThreadRing()
+{
+  if ( threadRing)
+    return threadRing;
+  pthread_once( &startOnce, startLogging);
+  threadRing = ( LogRing*) claimThreadSlot( &rings, sizeof( LogRing));
+  if ( threadRing)
+    pthread_setspecific( releaseKey, threadRing);
+  return threadRing;
+}
+
+void logRecord( const char *format, ...)
+{
+  LogRing *ring = getThreadRing();
+  if ( !ring)
+    return;
+  uint64_t head = ring->head;
+  if ( head - __atomic_load_n( &ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_RECORDS)
+  {
+    __atomic_add_fetch( &ring->numberDropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  LogRecord *record = &ring->records[ head % LOG_RING_RECORDS];
+  record->timeNs = nowNs();
+  record->format = format;
+  record->argumentsLength = 0;
+  record->isTruncated = 0;
+  va_list arguments;
+  va_start( arguments, format);
+  putArguments( record, format, arguments);
+  va_end( arguments);
+  __atomic_store_n( &ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Takes the next argument of the given size out of a record
+static bool takeArgument( const LogRecord *record, int *offset, void *valueOut, int length)
+{
+  if ( *offset + length > record->argumentsLength)
+    return false;
+  memcpy( valueOut, record->arguments + *offset, length);
+  *offset += length;
+  return true;
+}
+
+// Appends with snprintf(), keeping *length within size
+#define APPEND( text, size, length, ...) \
+  do { \
+    int written = snprintf( ( text) + *( length), ( size) - *( length), __VA_ARGS__); \
+    if ( written > 0) \
+      *( length) += ( written < ( size) - *( length))? written : ( size) - *( length) - 1; \
+  } while ( 0)
+
+// A conversion's text with its '*'s replaced by the values
+static bool makeSpec( const LogRecord *record, int *offset, const Conversion *conversion,
+  char *spec)
+{
+  int length = 0;
+  const char *p = conversion->start;
+  const char *end = conversion->start + conversion->length;
+  for ( ; p < end && length < LOG_SPEC_LENGTH - 12; ++p)
+  {
+    if ( *p != '*')
+    {
+      spec[ length ++] = *p;
+      continue;
+    }
+    int star;
+    if ( !takeArgument( record, offset, &star, sizeof( star)))
+      return false;
+    length += snprintf( spec + length, LOG_SPEC_LENGTH - length, "%d", star);
+  }
+  spec[ length] = '\0';
+  return p == end;
+}
+
+// The format takes its arguments from the record rather than from
+// "...", which the compiler can't check
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+#pragma GCC diagnostic ignored "-Wformat-security"
+
+static int formatRecord( const LogRecord *record, char *text, int size)
+{
+  int length = 0;
+  int offset = 0;
+  const char *format = record->format;
+  while ( *format && length < size - 1)
+  {
+    const char *percent = strchr( format, '%');
+    int literalLength = ( percent)? ( int) ( percent - format) : ( int) strlen( format);
+    if ( literalLength > size - 1 - length)
+      literalLength = size - 1 - length;
+    memcpy( text + length, format, literalLength);
+    length += literalLength;
+    if ( !percent)
+      break;
+    format = percent + 1;
+    Conversion conversion;
+    parseConversion( &format, &conversion);
+    char spec[ LOG_SPEC_LENGTH];
+    bool isOk = makeSpec( record, &offset, &conversion, spec);
+    switch ( conversion.kind)
+    {
+      case ARGUMENT_NONE:
+        APPEND( text, size, &length, "%%");
+        break;
+      case ARGUMENT_INT:
+      {
+        int value;
+        if ( ( isOk = isOk && takeArgument( record, &offset, &value, sizeof( value))))
+          APPEND( text, size, &length, spec, value);
+        break;
+      }
+      case ARGUMENT_LONG:
+      {
+        long value;
+        if ( ( isOk = isOk && takeArgument( record, &offset, &value, sizeof( value))))
+          APPEND( text, size, &length, spec, value);
+        break;
+      }
+      case ARGUMENT_LONG_LONG:
+      {
+        long long value;
+        if ( ( isOk = isOk && takeArgument( record, &offset, &value, sizeof( value))))
+          APPEND( text, size, &length, spec, value);
+        break;
+      }
+      case ARGUMENT_SIZE:
+      {
+        size_t value;
+        if ( ( isOk = isOk && takeArgument( record, &offset, &value, sizeof( value))))
+          APPEND( text, size, &length, spec, value);
+        break;
+      }
+      case ARGUMENT_DOUBLE:
+      {
+        double value;
+        if ( ( isOk = isOk && takeArgument( record, &offset, &value, sizeof( value))))
+          APPEND( text, size, &length, spec, value);
+        break;
+      }
+      case ARGUMENT_LONG_DOUBLE:
+      {
+        long double value;
+        if ( ( isOk = isOk && takeArgument( record, &offset, &value, sizeof( value))))
+          APPEND( text, size, &length, spec, value);
+        break;
+      }
+      case ARGUMENT_STRING:
+      {
+        int stringLength = ( offset < record->argumentsLength)?
+          ( int) strnlen( record->arguments + offset, record->argumentsLength - offset) : -1;
+        if ( ( isOk = isOk && stringLength >= 0 && offset + stringLength < record->argumentsLength))
+        {
+          APPEND( text, size, &length, spec, record->arguments + offset);
+          offset += stringLength + 1;
+        }
+        break;
+      }
+      case ARGUMENT_POINTER:
+      {
+        void *value;
+        if ( ( isOk = isOk && takeArgument( record, &offset, &value, sizeof( value))))
+          APPEND( text, size, &length, spec, value);
+        break;
+      }
+      case ARGUMENT_UNKNOWN:
+        isOk = false;
+        break;
+    }
+    if ( !isOk)
+    {
+      APPEND( text, size, &length, "... (too long for the log)\n");
+      break;
+    }
+  }
+  text[ length] = '\0';
+  return length;
+}
+
+#pragma GCC diagnostic pop
+
+static void writeOutput( int length)
+{
+  if ( length > 0)
+    fwrite( output, 1, length, stderr);
+}
+
+// Formats the records logged up to now, oldest first across the rings;
+// with drainMutex held. True if there were any
+static bool drainRings()
+{
+  uint64_t untilNs = nowNs();
+  int length = 0;
+  bool hasDrained = false;
+  for ( ;;)
+  {
+    LogRing *oldestRing = NULL;
+    for ( ThreadSlot *slot = firstThreadSlot( &rings); slot; slot = slot->next)
+    {
+      LogRing *ring = ( LogRing*) slot;
+      if ( ring->tail == __atomic_load_n( &ring->head, __ATOMIC_ACQUIRE))
+        continue;
+      const LogRecord *record = &ring->records[ ring->tail % LOG_RING_RECORDS];
+      if ( record->timeNs <= untilNs &&
+           ( !oldestRing || record->timeNs < oldestRing->records[ oldestRing->tail % LOG_RING_RECORDS].timeNs))
+        oldestRing = ring;
+    }
+    if ( !oldestRing)
+      break;
+    if ( length > LOG_OUTPUT_LENGTH - LOG_LINE_LENGTH)
+    {
+      writeOutput( length);
+      length = 0;
+    }
+    length += formatRecord( &oldestRing->records[ oldestRing->tail % LOG_RING_RECORDS],
+      output + length, LOG_LINE_LENGTH);
+    __atomic_store_n( &oldestRing->tail, oldestRing->tail + 1, __ATOMIC_RELEASE);
+    hasDrained = true;
+  }
+  for ( ThreadSlot *slot = firstThreadSlot( &rings); slot; slot = slot->next)
+  {
+    LogRing *ring = ( LogRing*) slot;
+    uint64_t numberDropped = __atomic_exchange_n( &ring->numberDropped, 0, __ATOMIC_RELAXED);
+    if ( numberDropped == 0)
+      continue;
+    if ( length > LOG_OUTPUT_LENGTH - LOG_LINE_LENGTH)
+    {
+      writeOutput( length);
+      length = 0;
+    }
+    APPEND( output, LOG_OUTPUT_LENGTH, &length, "(%lu log message(s) dropped: the ring was full)\n",
+      ( unsigned long) numberDropped);
+  }
+  writeOutput( length);
+  return hasDrained;
+}
+
+static void *drainLoop( void *unused)
+{
+  struct timespec pause = { 0, LOG_DRAIN_MS * 1000000L };
+  for ( ;;)
+  {
+    pthread_mutex_lock( &drainMutex);
+    drainRings();
+    pthread_mutex_unlock( &drainMutex);
+    nanosleep( &pause, NULL);
+  }
+  return NULL;
+}
+
+void flushLog()
+{
+  pthread_mutex_lock( &drainMutex);
+  drainRings();
+  pthread_mutex_unlock( &drainMutex);
+}
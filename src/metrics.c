@@ -0,0 +1,299 @@
+
+/*
+  metrics.c
+
+  Counters and gauges are single words updated with relaxed atomic
+  adds and stores. Histograms are HDR-style: a value in ns falls into
+  one of HISTOGRAM_SUB_BUCKETS linear buckets within its power of two,
+  so that any value is known within 12.5% from 1 ns up to an hour
+  with a few hundred buckets. Each thread counts into buckets of its
+  own, kept and handed on like trace.c's buffers (see threadSlots.c),
+  so that recording is a load and a store to memory no other thread writes;
+  a scrape adds the threads' buckets up.
+
+  Prometheus gets the histograms at two boundaries per power of two,
+  from 1 us (2^10 ns) to about a minute (2^36 ns).
+
+  The metrics thread blocks in poll() and accept(), and writes each
+  answer in one go, so a slow scraper holds up only the next one.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "metrics.h"
+#include "threadSlots.h"
+#include "transport.h"
+#include "common.h"
+
+#define METRICS_BACKLOG 16
+#define FIRST_EXPORTED_POWER 10
+#define LAST_EXPORTED_POWER 36
+#define REQUEST_BYTES 4096
+
+struct Metric
+{
+  const char *name;
+  const char *help;
+};
+typedef struct Metric Metric;
+
+struct HistogramShard
+{
+  ThreadSlot slot;
+  uint64_t counts[ MAX_HISTOGRAMS][ HISTOGRAM_BUCKETS];
+  uint64_t sumNs[ MAX_HISTOGRAMS];
+};
+typedef struct HistogramShard HistogramShard;
+
+static Metric counters[ MAX_COUNTERS];
+static int numberOfCounters;
+static uint64_t counterValues[ MAX_COUNTERS];
+static Metric gauges[ MAX_GAUGES];
+static int numberOfGauges;
+static int64_t gaugeValues[ MAX_GAUGES];
+static Metric histograms[ MAX_HISTOGRAMS];
+static int numberOfHistograms;
+
+static ThreadSlot *shards;
+static __thread HistogramShard *threadShard;
+static pthread_key_t releaseKey;
+static pthread_once_t releaseKeyOnce = PTHREAD_ONCE_INIT;
+
+static int defineMetric( Metric *metrics, int *numberOfMetrics, int capacity,
+  const char *name, const char *help)
+{
+  if ( *numberOfMetrics == capacity)
+    return -1;
+  metrics[ *numberOfMetrics].name = name;
+  metrics[ *numberOfMetrics].help = help;
+  return ( *numberOfMetrics) ++;
+}
+
+int defineCounter( const char *name, const char *help)
+{
+  return defineMetric( counters, &numberOfCounters, MAX_COUNTERS, name, help);
+}
+
+int defineGauge( const char *name, const char *help)
+{
+  return defineMetric( gauges, &numberOfGauges, MAX_GAUGES, name, help);
+}
+
+int defineHistogram( const char *name, const char *help)
+{
+  return defineMetric( histograms, &numberOfHistograms, MAX_HISTOGRAMS, name, help);
+}
+
+void addToCounter( int counter, uint64_t value)
+{
+  if ( counter >= 0)
+    __atomic_add_fetch( &counterValues[ counter], value, __ATOMIC_RELAXED);
+}
+
+void setGauge( int gauge, int64_t value)
+{
+  if ( gauge >= 0)
+    __atomic_store_n( &gaugeValues[ gauge], value, __ATOMIC_RELAXED);
+}
+
+void addToGauge( int gauge, int64_t value)
+{
+  if ( gauge >= 0)
+    __atomic_add_fetch( &gaugeValues[ gauge], value, __ATOMIC_RELAXED);
+}
+
+static void createReleaseKey()
+{
+  pthread_key_create( &releaseKey, releaseThreadSlot);
+}
+
+static HistogramShard *getThreadShard()
+{
+  if ( threadShard)
+    return threadShard;
+  pthread_once( &releaseKeyOnce, createReleaseKey);
+  threadShard = ( HistogramShard*) claimThreadSlot( &shards, sizeof( HistogramShard));
+  if ( threadShard)
+    pthread_setspecific( releaseKey, threadShard);
+  return threadShard;
+}
+
+// The exponent picks the power of two, the next bits below the
+// leading one the linear bucket within it
+static int bucketOf( uint64_t valueNs)
+{
+  if ( valueNs < HISTOGRAM_SUB_BUCKETS)
+    return ( int) valueNs;
+  int exponent = 63 - __builtin_clzll( valueNs);
+  int bucket = ( exponent - 2) * HISTOGRAM_SUB_BUCKETS +
+    ( int) ( ( valueNs >> ( exponent - 3)) & ( HISTOGRAM_SUB_BUCKETS - 1));
+  return ( bucket < HISTOGRAM_BUCKETS)? bucket : HISTOGRAM_BUCKETS - 1;
+}
+
+// The smallest value in the bucket
+static uint64_t bucketStartNs( int bucket)
+{
+  if ( bucket < HISTOGRAM_SUB_BUCKETS)
+    return bucket;
+  int exponent = bucket / HISTOGRAM_SUB_BUCKETS + 2;
+  uint64_t subBucket = bucket % HISTOGRAM_SUB_BUCKETS;
+  return ( HISTOGRAM_SUB_BUCKETS + subBucket) << ( exponent - 3);
+}
+
+void recordHistogramNs( int histogram, uint64_t valueNs)
+{
+  if ( histogram < 0)
+    return;
+  HistogramShard *shard = getThreadShard();
+  if ( !shard)
+    return;
+  // Only this thread writes the shard; the atomics keep a scrape from tearing
+  uint64_t *count = &shard->counts[ histogram][ bucketOf( valueNs)];
+  __atomic_store_n( count, __atomic_load_n( count, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+  uint64_t *sumNs = &shard->sumNs[ histogram];
+  __atomic_store_n( sumNs, __atomic_load_n( sumNs, __ATOMIC_RELAXED) + valueNs, __ATOMIC_RELAXED);
+}
+
+static void writeHistogram( FILE *file, int histogram)
+{
+  static uint64_t counts[ HISTOGRAM_BUCKETS];
+  memset( counts, 0, sizeof( counts));
+  uint64_t sumNs = 0;
+  for ( ThreadSlot *slot = firstThreadSlot( &shards); slot; slot = slot->next)
+  {
+    HistogramShard *shard = ( HistogramShard*) slot;
+    for ( int i = 0; i < HISTOGRAM_BUCKETS; ++i)
+      counts[ i] += __atomic_load_n( &shard->counts[ histogram][ i], __ATOMIC_RELAXED);
+    sumNs += __atomic_load_n( &shard->sumNs[ histogram], __ATOMIC_RELAXED);
+  }
+
+  const char *name = histograms[ histogram].name;
+  fprintf( file, "# HELP %s %s\n# TYPE %s histogram\n", name, histograms[ histogram].help, name);
+  uint64_t cumulativeCount = 0;
+  int bucket = 0;
+  for ( int power = FIRST_EXPORTED_POWER; power <= LAST_EXPORTED_POWER; ++power)
+  {
+    for ( int half = 0; half < 2; ++half)
+    {
+      // 2^power and 1.5 * 2^power, both bucket boundaries
+      uint64_t boundaryNs = ( 2ull + half) << ( power - 1);
+      for ( ; bucket < HISTOGRAM_BUCKETS && bucketStartNs( bucket) < boundaryNs; ++bucket)
+        cumulativeCount += counts[ bucket];
+      fprintf( file, "%s_bucket{le=\"%.9g\"} %llu\n", name, boundaryNs / 1e9,
+        ( unsigned long long) cumulativeCount);
+    }
+  }
+  for ( ; bucket < HISTOGRAM_BUCKETS; ++bucket)
+    cumulativeCount += counts[ bucket];
+  fprintf( file, "%s_bucket{le=\"+Inf\"} %llu\n", name, ( unsigned long long) cumulativeCount);
+  fprintf( file, "%s_sum %.9f\n%s_count %llu\n", name, sumNs / 1e9, name,
+    ( unsigned long long) cumulativeCount);
+}
+
+void writeMetrics( FILE *file)
+{
+  for ( int i = 0; i < numberOfCounters; ++i)
+    fprintf( file, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", counters[ i].name,
+      counters[ i].help, counters[ i].name, counters[ i].name,
+      ( unsigned long long) __atomic_load_n( &counterValues[ i], __ATOMIC_RELAXED));
+  for ( int i = 0; i < numberOfGauges; ++i)
+    fprintf( file, "# HELP %s %s\n# TYPE %s gauge\n%s %lld\n", gauges[ i].name,
+      gauges[ i].help, gauges[ i].name, gauges[ i].name,
+      ( long long) __atomic_load_n( &gaugeValues[ i], __ATOMIC_RELAXED));
+  for ( int i = 0; i < numberOfHistograms; ++i)
+    writeHistogram( file, i);
+}
+
+static bool sendAll( int socket, const char *bytes, size_t length)
+{
+  while ( length > 0)
+  {
+    ssize_t sentBytesCount = send( socket, bytes, length, MSG_NOSIGNAL);
+    if ( sentBytesCount < 0 && errno == EINTR)
+      continue;
+    if ( sentBytesCount <= 0)
+      return false;
+    bytes += sentBytesCount;
+    length -= sentBytesCount;
+  }
+  return true;
+}
+
+// Whatever the request, the answer is the metrics
+static void answerScrape( int socket)
+{
+  char request[ REQUEST_BYTES];
+  struct timeval timeout = { 1, 0 };
+  setsockopt( socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof( timeout));
+  if ( recv( socket, request, sizeof( request), 0) <= 0)
+    return;
+
+  char *body = NULL;
+  size_t bodyLength = 0;
+  FILE *file = open_memstream( &body, &bodyLength);
+  if ( !file)
+    return;
+  writeMetrics( file);
+  if ( fclose( file) != 0)
+    return;
+  char header[ 256];
+  int headerLength = snprintf( header, sizeof( header), "HTTP/1.0 200 OK\r\n"
+    "Content-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n"
+    "Connection: close\r\n\r\n", bodyLength);
+  if ( sendAll( socket, header, headerLength))
+    sendAll( socket, body, bodyLength);
+  free( body);
+}
+
+static void *runMetricsThread( void *listeningSocket)
+{
+  struct pollfd listener;
+  listener.fd = ( int) ( intptr_t) listeningSocket;
+  listener.events = POLLIN;
+  for ( ;;)
+  {
+    if ( poll( &listener, 1, -1) < 0 && errno != EINTR)
+    {
+      LOG_ERROR( "Error in the metrics thread: %s\n", strerror( errno));
+      return NULL;
+    }
+    int socket = accept( listener.fd, NULL, NULL);
+    if ( socket < 0)
+      continue;
+    answerScrape( socket);
+    close( socket);
+  }
+  return NULL;
+}
+
+bool serveMetrics( const char *address)
+{
+  int listeningSocket = ( address[ 0] == '/')? listenUnix( address, METRICS_BACKLOG) :
+    listenTcp( atoi( address), METRICS_BACKLOG);
+  if ( listeningSocket < 0)
+    return false;
+  pthread_t thread;
+  pthread_attr_t attributes;
+  pthread_attr_init( &attributes);
+  pthread_attr_setdetachstate( &attributes, PTHREAD_CREATE_DETACHED);
+  int error = pthread_create( &thread, &attributes, runMetricsThread,
+    ( void*) ( intptr_t) listeningSocket);
+  pthread_attr_destroy( &attributes);
+  if ( error)
+  {
+    close( listeningSocket);
+    errno = error;
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,87 @@
+
+/*
+  mpscQueue.c
+
+  A bounded multi-producer single-consumer queue after Dmitry Vyukov's
+  array-based design. Slot i starts with the sequence number i; a
+  producer claims the tail when the sequence of its slot equals the
+  tail, copies the item in and sets the sequence to tail + 1, which
+  hands the slot to the consumer. The consumer copies the item out and
+  sets the sequence to head + capacity, giving the slot back to the
+  producers for the next lap. Neither side ever waits for the other:
+  a full or empty queue is reported, and the caller decides.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mpscQueue.h"
+
+#define SEQUENCE_BYTES sizeof( uint64_t)
+
+static uint64_t *sequenceOf( const MpscQueue *queue, uint64_t position)
+{
+  return ( uint64_t*) ( queue->slots + ( position & queue->mask) * queue->slotSize);
+}
+
+bool initMpscQueue( MpscQueue *queue, int capacity, size_t itemSize)
+{
+  memset( queue, 0, sizeof( *queue));
+  uint64_t roundedCapacity = 2;
+  while ( roundedCapacity < ( uint64_t) capacity)
+    roundedCapacity *= 2;
+  // Keeps the sequence numbers and the items 8-byte aligned
+  queue->slotSize = SEQUENCE_BYTES + ( itemSize + 7) / 8 * 8;
+  queue->itemSize = itemSize;
+  queue->mask = roundedCapacity - 1;
+  queue->slots = ( char*) malloc( roundedCapacity * queue->slotSize);
+  if ( !queue->slots)
+    return false;
+  for ( uint64_t i = 0; i < roundedCapacity; ++i)
+    *sequenceOf( queue, i) = i;
+  return true;
+}
+
+void destroyMpscQueue( MpscQueue *queue)
+{
+  free( queue->slots);
+  queue->slots = NULL;
+}
+
+bool tryPushMpsc( MpscQueue *queue, const void *item)
+{
+  uint64_t tail = __atomic_load_n( &queue->tail, __ATOMIC_RELAXED);
+  while ( true)
+  {
+    uint64_t *sequence = sequenceOf( queue, tail);
+    int64_t lag = ( int64_t) ( __atomic_load_n( sequence, __ATOMIC_ACQUIRE) - tail);
+    if ( lag < 0)
+      return false;  // the consumer hasn't freed the slot from the last lap
+    if ( lag > 0)
+    {
+      // Another producer took this one
+      tail = __atomic_load_n( &queue->tail, __ATOMIC_RELAXED);
+      continue;
+    }
+    if ( __atomic_compare_exchange_n( &queue->tail, &tail, tail + 1, true,
+           __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+      memcpy( ( char*) sequence + SEQUENCE_BYTES, item, queue->itemSize);
+      __atomic_store_n( sequence, tail + 1, __ATOMIC_RELEASE);
+      return true;
+    }
+    // A failed compare-and-swap has reloaded tail
+  }
+}
+
+bool tryPopMpsc( MpscQueue *queue, void *itemOut)
+{
+  uint64_t head = queue->head;
+  uint64_t *sequence = sequenceOf( queue, head);
+  if ( __atomic_load_n( sequence, __ATOMIC_ACQUIRE) != head + 1)
+    return false;
+  memcpy( itemOut, ( char*) sequence + SEQUENCE_BYTES, queue->itemSize);
+  __atomic_store_n( sequence, head + queue->mask + 1, __ATOMIC_RELEASE);
+  queue->head = head + 1;
+  return true;
+}
@@ -0,0 +1,162 @@
+
+/*
+  perfCounters.c
+
+  Hardware counters through perf_event_open(): cycles, instructions,
+  branch misses and cache misses of the calling thread, user space
+  only, so that the default perf_event_paranoid of 2 allows them.
+  They are opened as a group, so the kernel schedules them onto the
+  PMU together and one read() gets them all; if it had to multiplex
+  them with other events, the counts are scaled up by the share of
+  the time they actually ran.
+
+  A counter the CPU or the hypervisor doesn't have is left out of the
+  group and reported as not valid. If none can be opened for a reason
+  that won't go away (no permission, no PMU, no system call), that is
+  logged once and counting stops for the rest of the process.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "perfCounters.h"
+
+static const uint64_t counterEvents[ NUMBER_OF_PERF_COUNTERS] =
+{
+  PERF_COUNT_HW_CPU_CYCLES,
+  PERF_COUNT_HW_INSTRUCTIONS,
+  PERF_COUNT_HW_BRANCH_MISSES,
+  PERF_COUNT_HW_CACHE_MISSES
+};
+
+static const int counterBits[ NUMBER_OF_PERF_COUNTERS] =
+{
+  PERF_CYCLES, PERF_INSTRUCTIONS, PERF_BRANCH_MISSES, PERF_CACHE_MISSES
+};
+
+static int isUnavailable;
+
+// What read() gives for a group
+struct GroupReading
+{
+  uint64_t numberOfCounters;
+  uint64_t timeEnabledNs;
+  uint64_t timeRunningNs;
+  uint64_t values[ NUMBER_OF_PERF_COUNTERS];
+};
+typedef struct GroupReading GroupReading;
+
+static int openCounter( uint64_t event, int groupFd)
+{
+  struct perf_event_attr attributes;
+  memset( &attributes, 0, sizeof( attributes));
+  attributes.size = sizeof( attributes);
+  attributes.type = PERF_TYPE_HARDWARE;
+  attributes.config = event;
+  attributes.disabled = ( groupFd < 0);
+  attributes.exclude_kernel = 1;
+  attributes.exclude_hv = 1;
+  attributes.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+    PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return ( int) syscall( SYS_perf_event_open, &attributes, 0, -1, groupFd, PERF_FLAG_FD_CLOEXEC);
+}
+
+static bool isLastingFailure( int error)
+{
+  return error == EACCES || error == EPERM || error == ENOENT || error == ENOSYS ||
+    error == EOPNOTSUPP || error == ENODEV;
+}
+
+static void closeCounters( PerfSession *session)
+{
+  for ( int i = 0; i < NUMBER_OF_PERF_COUNTERS; ++i)
+  {
+    if ( session->fds[ i] >= 0)
+      close( session->fds[ i]);
+    session->fds[ i] = -1;
+  }
+}
+
+bool startPerfCounters( PerfSession *session)
+{
+  session->groupFd = -1;
+  session->validCounters = 0;
+  for ( int i = 0; i < NUMBER_OF_PERF_COUNTERS; ++i)
+    session->fds[ i] = -1;
+  if ( __atomic_load_n( &isUnavailable, __ATOMIC_RELAXED))
+    return false;
+
+  int error = 0;
+  for ( int i = 0; i < NUMBER_OF_PERF_COUNTERS; ++i)
+  {
+    session->fds[ i] = openCounter( counterEvents[ i], session->groupFd);
+    if ( session->fds[ i] < 0)
+    {
+      error = errno;
+      continue;
+    }
+    if ( session->groupFd < 0)
+      session->groupFd = session->fds[ i];
+    session->validCounters |= counterBits[ i];
+  }
+  if ( session->groupFd < 0)
+  {
+    if ( isLastingFailure( error) && !__atomic_exchange_n( &isUnavailable, 1, __ATOMIC_RELAXED))
+      LOG_WARN( "Hardware counters are not available (%s); not counting\n", strerror( error));
+    return false;
+  }
+  if ( ioctl( session->groupFd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP) < 0 ||
+       ioctl( session->groupFd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP) < 0)
+  {
+    closeCounters( session);
+    session->groupFd = -1;
+    return false;
+  }
+  return true;
+}
+
+void stopPerfCounters( PerfSession *session, PerfCounts *totalsInOut)
+{
+  if ( session->groupFd < 0)
+    return;
+  ioctl( session->groupFd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+  GroupReading reading;
+  ssize_t length = read( session->groupFd, &reading, sizeof( reading));
+  closeCounters( session);
+  if ( length < ( ssize_t) ( 3 * sizeof( uint64_t)) || reading.timeRunningNs == 0)
+    return;
+
+  // The values come in the order the counters joined the group
+  uint64_t counts[ NUMBER_OF_PERF_COUNTERS] = { 0 };
+  int next = 0;
+  for ( int i = 0; i < NUMBER_OF_PERF_COUNTERS && next < ( int) reading.numberOfCounters; ++i)
+  {
+    if ( !( session->validCounters & counterBits[ i]))
+      continue;
+    counts[ i] = reading.values[ next ++];
+    if ( reading.timeRunningNs < reading.timeEnabledNs)
+      counts[ i] = ( uint64_t) ( ( double) counts[ i] * reading.timeEnabledNs / reading.timeRunningNs);
+  }
+  __atomic_add_fetch( &totalsInOut->cycles, counts[ 0], __ATOMIC_RELAXED);
+  __atomic_add_fetch( &totalsInOut->instructions, counts[ 1], __ATOMIC_RELAXED);
+  __atomic_add_fetch( &totalsInOut->branchMisses, counts[ 2], __ATOMIC_RELAXED);
+  __atomic_add_fetch( &totalsInOut->cacheMisses, counts[ 3], __ATOMIC_RELAXED);
+  __atomic_or_fetch( &totalsInOut->validCounters, session->validCounters, __ATOMIC_RELAXED);
+}
+
+void addPerfCounts( PerfCounts *totalsInOut, const PerfCounts *counts)
+{
+  totalsInOut->cycles += counts->cycles;
+  totalsInOut->instructions += counts->instructions;
+  totalsInOut->branchMisses += counts->branchMisses;
+  totalsInOut->cacheMisses += counts->cacheMisses;
+  totalsInOut->validCounters |= counts->validCounters;
+}
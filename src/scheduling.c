@@ -0,0 +1,438 @@
+
+/*
+  scheduling.c
+
+  The server's scheduling decisions: how the interval is split among
+  the workers, and which chunk goes to which worker as they ask for
+  more, are retried after failures, or duplicated speculatively.
+  Nothing here sends or receives anything, so server.c and the
+  discrete-event simulator (simulator.c) share every decision.
+
+  Nothing here walks all the chunks or all the workers either. The
+  running chunks that may get a duplicate sit in a binary heap by how
+  far along they are, so the least done one is on top; the chunks of
+  each worker, and its duplicates, are in doubly linked lists threaded
+  through the chunks, so a failure costs what the worker held; and
+  the workers that found nothing to take wait in a FIFO, so chunks
+  that come back go to them rather than to every worker in turn.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "scheduling.h"
+
+#define AS_WORKER 0
+#define AS_DUPLICATE 1
+
+double estimateWorkerThroughput( const Benchmark *benchmark)
+{
+  int numberOfPoints = benchmark->numberOfThroughputPoints;
+  if ( numberOfPoints < 1)
+    return 1.0 / ( benchmark->timeMs * benchmark->delta);
+
+  // The last point of the curve is measured with the number of threads
+  // the worker will actually use
+  double throughput = benchmark->throughput[ numberOfPoints - 1];
+
+  // A short benchmark can run in a burst above the cgroup quota;
+  // the sustained rate is bounded by quota * single-thread throughput
+  if ( benchmark->cpuQuota > 0 && benchmark->throughputThreads[ 0] == 1)
+  {
+    double sustainedThroughput = benchmark->throughput[ 0] * benchmark->cpuQuota;
+    if ( throughput > sustainedThroughput)
+      throughput = sustainedThroughput;
+  }
+  return throughput;
+}
+
+// The throughput is estimated twice rather than kept in a
+// per-worker array, as it is cheap to compute
+static void computeIntervalsWithLoadBalancing( const Benchmark *benchmarks, int numberOfWorkers,
+  Interval interval, Interval *intervalsOut)
+{
+  double sumOfPerformanceIndeces = 0.0l;
+  for ( int i = 0; i < numberOfWorkers; ++i)
+    sumOfPerformanceIndeces += estimateWorkerThroughput( &benchmarks[ i]);
+
+  double lastEnd = interval.start;
+  double intervalLength = interval.end - interval.start;
+  for ( int i = 0; i < numberOfWorkers; ++i)
+  {
+    double performanceIndex = estimateWorkerThroughput( &benchmarks[ i]);
+    double workerIntervalLength =
+      intervalLength * ( performanceIndex / sumOfPerformanceIndeces);
+    intervalsOut[ i].start = lastEnd;
+    intervalsOut[ i].end = lastEnd + workerIntervalLength;
+    lastEnd += workerIntervalLength;
+  }
+}
+
+void computeIntervalsForWorkers( bool useLoadBalancing, const Benchmark *benchmarks,
+  int numberOfWorkers, Interval interval, Interval *intervalsOut)
+{
+  if ( useLoadBalancing)
+  {
+    computeIntervalsWithLoadBalancing( benchmarks, numberOfWorkers, interval, intervalsOut);
+  }
+  else
+  {
+    double d = ( interval.end - interval.start) / numberOfWorkers;
+    for ( int i = 0; i < numberOfWorkers; ++i)
+    {
+      intervalsOut[ i].start = interval.start + d * i;
+      intervalsOut[ i].end = interval.start + d * (i + 1);
+    }
+  }
+}
+
+bool initSchedule( Schedule *schedule, int numberOfChunks, bool isSpeculative,
+  Interval interval, const Interval *workerIntervals, int numberOfWorkers)
+{
+  memset( schedule, 0, sizeof( *schedule));
+  schedule->isStatic = numberOfChunks == 0;
+  schedule->numberOfChunks = ( schedule->isStatic)? numberOfWorkers : numberOfChunks;
+  schedule->numberOfWorkers = numberOfWorkers;
+  schedule->isSpeculative = isSpeculative;
+  schedule->chunks = ( ScheduledChunk*) calloc( schedule->numberOfChunks, sizeof( ScheduledChunk));
+  schedule->retryChunks = ( int*) calloc( schedule->numberOfChunks, sizeof( int));
+  schedule->runningChunks = ( int*) calloc( schedule->numberOfChunks, sizeof( int));
+  schedule->firstChunks[ AS_WORKER] = ( int*) malloc( numberOfWorkers * sizeof( int));
+  schedule->firstChunks[ AS_DUPLICATE] = ( int*) malloc( numberOfWorkers * sizeof( int));
+  schedule->waitingWorkers = ( int*) calloc( numberOfWorkers, sizeof( int));
+  schedule->isWaiting = ( bool*) calloc( numberOfWorkers, sizeof( bool));
+  if ( !schedule->chunks || !schedule->retryChunks || !schedule->runningChunks ||
+       !schedule->firstChunks[ AS_WORKER] || !schedule->firstChunks[ AS_DUPLICATE] ||
+       !schedule->waitingWorkers || !schedule->isWaiting)
+  {
+    destroySchedule( schedule);
+    return false;
+  }
+
+  if ( schedule->isStatic)
+  {
+    for ( int i = 0; i < numberOfWorkers; ++i)
+      schedule->chunks[ i].interval = workerIntervals[ i];
+  }
+  else
+  {
+    double d = ( interval.end - interval.start) / schedule->numberOfChunks;
+    for ( int i = 0; i < schedule->numberOfChunks; ++i)
+    {
+      schedule->chunks[ i].interval.start = interval.start + d * i;
+      schedule->chunks[ i].interval.end = interval.start + d * (i + 1);
+    }
+    schedule->chunks[ schedule->numberOfChunks - 1].interval.end = interval.end;
+  }
+  for ( int i = 0; i < schedule->numberOfChunks; ++i)
+  {
+    ScheduledChunk *chunk = &schedule->chunks[ i];
+    chunk->worker = chunk->speculativeWorker = chunk->heapPosition = -1;
+  }
+  for ( int i = 0; i < numberOfWorkers; ++i)
+    schedule->firstChunks[ AS_WORKER][ i] = schedule->firstChunks[ AS_DUPLICATE][ i] = -1;
+  return true;
+}
+
+void destroySchedule( Schedule *schedule)
+{
+  free( schedule->chunks);
+  free( schedule->retryChunks);
+  free( schedule->runningChunks);
+  free( schedule->firstChunks[ AS_WORKER]);
+  free( schedule->firstChunks[ AS_DUPLICATE]);
+  free( schedule->waitingWorkers);
+  free( schedule->isWaiting);
+  memset( schedule, 0, sizeof( *schedule));
+}
+
+// The lists of a worker's chunks --------------------------------------
+
+static void linkChunk( Schedule *schedule, int list, int worker, int chunk)
+{
+  ScheduledChunk *scheduled = &schedule->chunks[ chunk];
+  int first = schedule->firstChunks[ list][ worker];
+  scheduled->next[ list] = first;
+  scheduled->previous[ list] = -1;
+  if ( first >= 0)
+    schedule->chunks[ first].previous[ list] = chunk;
+  schedule->firstChunks[ list][ worker] = chunk;
+}
+
+static void unlinkChunk( Schedule *schedule, int list, int worker, int chunk)
+{
+  ScheduledChunk *scheduled = &schedule->chunks[ chunk];
+  int next = scheduled->next[ list];
+  int previous = scheduled->previous[ list];
+  if ( previous >= 0)
+    schedule->chunks[ previous].next[ list] = next;
+  else
+    schedule->firstChunks[ list][ worker] = next;
+  if ( next >= 0)
+    schedule->chunks[ next].previous[ list] = previous;
+}
+
+// The heap of running chunks ------------------------------------------
+
+static bool isLessDone( const Schedule *schedule, int chunk, int otherChunk)
+{
+  double fractionDone = schedule->chunks[ chunk].fractionDone;
+  double otherFractionDone = schedule->chunks[ otherChunk].fractionDone;
+  return fractionDone < otherFractionDone ||
+    ( fractionDone == otherFractionDone && chunk < otherChunk);
+}
+
+static void placeInHeap( Schedule *schedule, int position, int chunk)
+{
+  schedule->runningChunks[ position] = chunk;
+  schedule->chunks[ chunk].heapPosition = position;
+}
+
+// Moves the chunk at the position up or down to where it belongs
+static void siftChunk( Schedule *schedule, int position)
+{
+  int *heap = schedule->runningChunks;
+  int chunk = heap[ position];
+  while ( position > 0 && isLessDone( schedule, chunk, heap[ ( position - 1) / 2]))
+  {
+    placeInHeap( schedule, position, heap[ ( position - 1) / 2]);
+    position = ( position - 1) / 2;
+  }
+  for ( ;;)
+  {
+    int child = 2 * position + 1;
+    if ( child >= schedule->numberOfRunningChunks)
+      break;
+    if ( child + 1 < schedule->numberOfRunningChunks && isLessDone( schedule, heap[ child + 1], heap[ child]))
+      child ++;
+    if ( !isLessDone( schedule, heap[ child], chunk))
+      break;
+    placeInHeap( schedule, position, heap[ child]);
+    position = child;
+  }
+  placeInHeap( schedule, position, chunk);
+}
+
+// Puts the chunk in the heap or takes it out, as its state says, and
+// keeps its place right after its fractionDone changes
+static void updateRunningChunk( Schedule *schedule, int chunk)
+{
+  ScheduledChunk *scheduled = &schedule->chunks[ chunk];
+  bool isCandidate = schedule->isSpeculative && !scheduled->isDone && scheduled->worker >= 0 &&
+    scheduled->speculativeWorker < 0;
+  int position = scheduled->heapPosition;
+  if ( isCandidate && position < 0)
+  {
+    placeInHeap( schedule, schedule->numberOfRunningChunks ++, chunk);
+    siftChunk( schedule, schedule->numberOfRunningChunks - 1);
+  }
+  else if ( isCandidate)
+    siftChunk( schedule, position);
+  else if ( position >= 0)
+  {
+    scheduled->heapPosition = -1;
+    int last = schedule->runningChunks[ -- schedule->numberOfRunningChunks];
+    if ( last != chunk)
+    {
+      placeInHeap( schedule, position, last);
+      siftChunk( schedule, position);
+    }
+  }
+}
+
+// The least done chunk in the subtree at the position that isn't the
+// worker's own, or -1. The top qualifies unless the worker computes
+// it, so this goes below only the few chunks of the worker itself
+static int leastDoneOfOthers( const Schedule *schedule, int position, int worker)
+{
+  if ( position >= schedule->numberOfRunningChunks)
+    return -1;
+  int chunk = schedule->runningChunks[ position];
+  if ( schedule->chunks[ chunk].worker != worker)
+    return chunk;
+  int left = leastDoneOfOthers( schedule, 2 * position + 1, worker);
+  int right = leastDoneOfOthers( schedule, 2 * position + 2, worker);
+  if ( left < 0 || ( right >= 0 && isLessDone( schedule, right, left)))
+    return right;
+  return left;
+}
+
+// The waiting workers -------------------------------------------------
+
+static void addWaitingWorker( Schedule *schedule, int worker)
+{
+  if ( schedule->isWaiting[ worker])
+    return;
+  schedule->isWaiting[ worker] = true;
+  int last = ( schedule->firstWaiting + schedule->numberOfWaitingWorkers) % schedule->numberOfWorkers;
+  schedule->waitingWorkers[ last] = worker;
+  schedule->numberOfWaitingWorkers ++;
+}
+
+static bool hasChunkToTake( const Schedule *schedule)
+{
+  return schedule->numberOfRetryChunks > 0 ||
+    ( !schedule->isStatic && schedule->nextChunk < schedule->numberOfChunks) ||
+    schedule->numberOfRunningChunks > 0;
+}
+
+int nextWaitingWorker( Schedule *schedule)
+{
+  if ( schedule->waitingRoundLeft == 0 || schedule->numberOfWaitingWorkers == 0 ||
+       !hasChunkToTake( schedule))
+  {
+    schedule->waitingRoundLeft = 0;
+    return -1;
+  }
+  schedule->waitingRoundLeft --;
+  int worker = schedule->waitingWorkers[ schedule->firstWaiting];
+  schedule->firstWaiting = ( schedule->firstWaiting + 1) % schedule->numberOfWorkers;
+  schedule->numberOfWaitingWorkers --;
+  schedule->isWaiting[ worker] = false;
+  return worker;
+}
+
+// Decisions -----------------------------------------------------------
+
+int takeChunk( Schedule *schedule, int worker, bool isIdle, bool *isDuplicateOut)
+{
+  *isDuplicateOut = false;
+  if ( schedule->numberOfRetryChunks > 0)
+    return schedule->retryChunks[ -- schedule->numberOfRetryChunks];
+  if ( schedule->isStatic && schedule->chunks[ worker].worker < 0 && !schedule->chunks[ worker].isDone)
+    return worker;
+  if ( !schedule->isStatic && schedule->nextChunk < schedule->numberOfChunks)
+    return schedule->nextChunk ++;
+  int chunk = -1;
+  if ( schedule->isSpeculative && isIdle)
+  {
+    chunk = leastDoneOfOthers( schedule, 0, worker);
+    *isDuplicateOut = chunk >= 0;
+  }
+  if ( chunk < 0)
+    addWaitingWorker( schedule, worker);
+  return chunk;
+}
+
+void assignChunk( Schedule *schedule, int chunk, int worker, bool isDuplicate)
+{
+  ScheduledChunk *scheduled = &schedule->chunks[ chunk];
+  if ( isDuplicate)
+  {
+    scheduled->speculativeWorker = worker;
+    linkChunk( schedule, AS_DUPLICATE, worker, chunk);
+  }
+  else
+  {
+    scheduled->worker = worker;
+    scheduled->fractionDone = 0.0;
+    linkChunk( schedule, AS_WORKER, worker, chunk);
+  }
+  updateRunningChunk( schedule, chunk);
+}
+
+void requeueChunk( Schedule *schedule, int chunk)
+{
+  ScheduledChunk *scheduled = &schedule->chunks[ chunk];
+  if ( scheduled->worker >= 0 && !scheduled->isDone)
+    unlinkChunk( schedule, AS_WORKER, scheduled->worker, chunk);
+  scheduled->worker = -1;
+  scheduled->fractionDone = 0.0;
+  updateRunningChunk( schedule, chunk);
+  schedule->retryChunks[ schedule->numberOfRetryChunks ++] = chunk;
+}
+
+void setChunkProgress( Schedule *schedule, int chunk, int worker, double fractionDone)
+{
+  ScheduledChunk *scheduled = &schedule->chunks[ chunk];
+  if ( scheduled->worker != worker || scheduled->isDone)
+    return;
+  scheduled->fractionDone = fractionDone;
+  if ( scheduled->heapPosition >= 0)
+    siftChunk( schedule, scheduled->heapPosition);
+}
+
+bool completeChunk( Schedule *schedule, int chunk, int worker, int *otherWorkerOut)
+{
+  ScheduledChunk *scheduled = &schedule->chunks[ chunk];
+  *otherWorkerOut = -1;
+  if ( scheduled->isDone)
+    return false;
+  if ( scheduled->worker >= 0)
+    unlinkChunk( schedule, AS_WORKER, scheduled->worker, chunk);
+  if ( scheduled->speculativeWorker >= 0)
+    unlinkChunk( schedule, AS_DUPLICATE, scheduled->speculativeWorker, chunk);
+  scheduled->isDone = true;
+  updateRunningChunk( schedule, chunk);
+  schedule->numberOfChunksDone ++;
+  int otherWorker = ( scheduled->worker == worker)? scheduled->speculativeWorker : scheduled->worker;
+  if ( otherWorker != worker)
+    *otherWorkerOut = otherWorker;
+  return true;
+}
+
+// A running chunk without a duplicate again
+static void dropDuplicate( Schedule *schedule, int chunk, int worker)
+{
+  unlinkChunk( schedule, AS_DUPLICATE, worker, chunk);
+  schedule->chunks[ chunk].speculativeWorker = -1;
+  updateRunningChunk( schedule, chunk);
+}
+
+// The duplicate, if any, carries on in the worker's place
+static void takeBackChunk( Schedule *schedule, int chunk, int worker)
+{
+  ScheduledChunk *scheduled = &schedule->chunks[ chunk];
+  int duplicateWorker = scheduled->speculativeWorker;
+  if ( duplicateWorker < 0)
+  {
+    requeueChunk( schedule, chunk);
+    return;
+  }
+  unlinkChunk( schedule, AS_WORKER, worker, chunk);
+  unlinkChunk( schedule, AS_DUPLICATE, duplicateWorker, chunk);
+  scheduled->speculativeWorker = -1;
+  scheduled->worker = duplicateWorker;
+  scheduled->fractionDone = 0.0;
+  linkChunk( schedule, AS_WORKER, duplicateWorker, chunk);
+  updateRunningChunk( schedule, chunk);
+}
+
+void returnChunk( Schedule *schedule, int chunk, int worker)
+{
+  ScheduledChunk *scheduled = &schedule->chunks[ chunk];
+  if ( scheduled->isDone)
+    return;
+  if ( scheduled->speculativeWorker == worker)
+    dropDuplicate( schedule, chunk, worker);
+  else if ( scheduled->worker == worker)
+    takeBackChunk( schedule, chunk, worker);
+  else
+    return;
+  schedule->waitingRoundLeft = schedule->numberOfWaitingWorkers;
+}
+
+void failScheduledWorker( Schedule *schedule, int worker)
+{
+  // Its duplicates are running chunks without one again
+  int chunk;
+  while ( ( chunk = schedule->firstChunks[ AS_DUPLICATE][ worker]) >= 0)
+    dropDuplicate( schedule, chunk, worker);
+  while ( ( chunk = schedule->firstChunks[ AS_WORKER][ worker]) >= 0)
+    takeBackChunk( schedule, chunk, worker);
+  schedule->waitingRoundLeft = schedule->numberOfWaitingWorkers;
+}
+
+double scheduleFractionDone( const Schedule *schedule)
+{
+  double totalLength = 0.0;
+  double doneLength = 0.0;
+  for ( int i = 0; i < schedule->numberOfChunks; ++i)
+  {
+    const ScheduledChunk *chunk = &schedule->chunks[ i];
+    double length = chunk->interval.end - chunk->interval.start;
+    totalLength += length;
+    doneLength += ( chunk->isDone)? length : length * chunk->fractionDone;
+  }
+  return ( totalLength > 0)? doneLength / totalLength : 0.0;
+}
@@ -5,7 +5,13 @@
   Author: dmitriy.borodiy@gmail.com
 
   Usage:
-  server <server port> 
+  server [-c <number of chunks>] [-t <worker timeout in seconds>]
+         [-d <deadline in seconds>] [-s] [-p] [-e <tolerance>]
+         [-j <reply window in ms>] [-P <parent address>:<parent port>]
+         [-u <local socket path>] [-i epoll|uring] [-T <I/O threads>]
+         [-x <trace file>] [-l error|warn|info|debug]
+         [-m <metrics port>|<metrics socket path>]
+         <server port> 
          <broadcast address> <broadcast port> 
          <start point> <end point> <delta>
          [<use load balancing>]
@@ -17,141 +23,426 @@
   Each worker that receives such a message tries to connect
   to the server on <server port> (which is given to workers as 
   a command line argument), and sends a Benchmark structure,
-  which the server then uses to estimate the worker's performance.
+  which the server then uses to estimate the worker's performance:
+  the throughput measured with the worker's configured number of
+  threads, capped by its cgroup CPU quota.
+
+  <broadcast address> may also be a multicast group, which workers
+  started with -g join. The announcement is repeated with a growing
+  interval (250 ms, doubling up to 4 s) until the pool is formed, so
+  a lost datagram doesn't lose a worker, and it asks each worker to
+  connect after a random delay within <reply window in ms> (by 
+  default 1 ms per expected worker, up to 1 s), so that a large 
+  number of workers doesn't overflow the listen() backlog at once.
+
+  Workers started with -r <server address> register on their own:
+  they connect to the server as soon as it is up, and keep trying
+  while it is not. <broadcast address> may be "none" to rely on
+  registration only. Either way, the pool is formed as soon as 
+  <maximum number of workers> workers have connected, or once no
+  new worker has come for <waiting time in seconds>.
 
   The server divides the work among workers, accordingly
   to their estimated performance, and sends out the 
   tasks to them.
 
+  With -c, the interval is instead cut into <number of chunks>
+  equal chunks that workers pull as they go: each worker is
+  kept <credits> chunks ahead (the number it advertises in its
+  Benchmark), and every result it returns earns it the next chunk.
+
   Then it receives the partial results from the workers, 
   adds them together and prints the overall result of computation.
+  Workers send heartbeats with their progress while they compute;
+  the server uses them to report the overall progress and the 
+  estimated time left, and drops a worker whose connection fails
+  or that stays silent for <worker timeout in seconds> (10 by
+  default), handing its unfinished chunks to the others.
+
+  With -d, the computation has <deadline in seconds> to finish:
+  every request carries the time left, the workers stop at the
+  deadline, and the server cancels what is still running and 
+  exits with an error. With -s, a worker that runs out of chunks
+  gets a speculative duplicate of the chunk that is least done;
+  whichever copy finishes first is used and the other is cancelled.
+
+  With -p (progressive mode), workers compute their chunks with a
+  coarse step first and keep refining them, and the server prints
+  a line "<estimate> <error bound>" every time the estimate of the
+  whole integral improves, before the final answer. With -e (which
+  implies -p) it stops as soon as the error bound is below 
+  <tolerance>; at the deadline it settles for the best estimate.
+
+  With -P, the server is a sub-coordinator: once its own pool is
+  formed, it registers with the parent server as if it were one big
+  worker, advertising the summed throughput of its pool. Every request
+  from the parent is split across the pool the same way, and the
+  combined result goes back as a single Response; the sub-coordinator
+  sends heartbeats and progressive estimates for it and honours the
+  parent's cancels and deadlines. Between the parent's requests it
+  keeps hearing from its pool, and drops the workers that go away or
+  silent. <start point> <end point> <delta> are then unused, as the
+  intervals come from the parent. This
+  gives tree-shaped scaling beyond the fan-in of one server.
+
+  With -u, the server also accepts workers on a Unix socket at 
+  <local socket path>, which workers on the same host register with
+  by giving that path to their -r. A sub-coordinator that takes 
+  only such workers is a host-local combiner: the workers of a host
+  (e.g. one per NUMA node) reach the parent over a single TCP 
+  connection, and their partial sums over a single Response per
+  request. A worker that comes through the Unix socket also hands
+  the server a shared-memory channel (see shmChannel.c), and all 
+  further messages with it skip the socket.
+
+  Connections go through the transport layer (see transport.c),
+  which sets the socket options of each kind of connection. The
+  server waits for them with io_uring where the kernel has it (-i
+  picks epoll or uring, see ioEngine.c), so that a round of
+  requests to the whole pool takes a single system call; it falls
+  back to epoll otherwise.
+
+  Once the pool is formed, the workers are dealt to -T I/O threads
+  (by default one per CPU but one, and no more than the workers),
+  each with its own event loop over its share of the sockets (see
+  workerShards.c). They hand whatever comes in to the scheduler, the
+  main thread, through a lock-free queue; it makes every decision
+  and posts the messages back to the thread that owns the worker.
+
+  Discovery, the handshake, partitioning, dispatch and gathering are
+  timed as trace spans (see trace.c), summed up in the log at the end.
+  With -x, the server then asks every worker for its own spans of the
+  job, moves them onto its clock (the offset is estimated from the
+  timestamps each Response carries, the way NTP does it) and writes
+  the whole timeline to <trace file> in Chrome's trace event format,
+  for chrome://tracing or ui.perfetto.dev. A sub-coordinator writes
+  one file per request of its parent, <trace file>.<request id>, and
+  sends its own spans to a parent that asks for them.
+
+  LOG() only copies its arguments into a per-thread ring; a logging
+  thread formats and writes them (see logging.c). -l sets how much is
+  logged: info by default, debug for every request and response.
+
+  With -m, the server answers HTTP requests on <metrics port> (or on
+  the Unix socket at <metrics socket path>) with its metrics in
+  Prometheus' text format (see metrics.c): jobs, chunks, evaluations,
+  bytes and failures, the workers connected and the chunks queued and
+  in flight, and histograms of the time from a request going out to
+  its result coming back and of the handshake with each worker.
+
+  How the interval is split and which chunk goes to which worker is
+  decided in scheduling.c, which does no I/O, so that the simulator
+  (simulator.c) can try the same policies on pools of any size.
+
+  Every message is preceded by a MessageHeader (see common.h).
 */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/socket.h>
 #include <sys/types.h>
-#include <sys/time.h>
+#include <time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/resource.h>
+#include <netdb.h>
 #include <unistd.h>
 #include <errno.h>
 #include <stdbool.h>
 #include <string.h>
 
 #include "integral.h"
+#include "hardware.h"
+#include "workerTable.h"
+#include "transport.h"
+#include "ioEngine.h"
+#include "workerShards.h"
+#include "trace.h"
+#include "jobTrace.h"
+#include "metrics.h"
+#include "perfCounters.h"
+#include "scheduling.h"
 #include "common.h"
 
 #define DEFAULT_NUMBER_OF_WORKERS 16
 #define DEFAULT_SECONDS_TO_WAIT 5
 #define MAX_SECONDS_TO_WAIT 3600
+#define DEFAULT_WORKER_TIMEOUT_SECONDS 10
+#define LIVENESS_CHECK_INTERVAL_MS 250
+#define PROGRESS_REPORT_INTERVAL_MS 1000
+#define MIN_ANNOUNCEMENT_INTERVAL_MS 250
+#define MAX_ANNOUNCEMENT_INTERVAL_MS 4000
+#define MAX_REPLY_WINDOW_MS 1000
+#define MULTICAST_TTL 16
+#define PARENT_HEARTBEAT_INTERVAL_MS 1000
+#define MIN_PARENT_RETRY_MS 250
+#define MAX_PARENT_RETRY_MS 4000
+#define TRACE_TIMEOUT_MS 2000
 
 struct Args
 {
   int serverPort;
+  bool useBroadcast;  // false: workers register on their own
   struct sockaddr_in broadcastAddress;
+  int replyWindowMs;
   Interval interval;
   double delta;
   bool useLoadBalancing; 
   int maxNumberOfWorkers;
   int waitingTimeSeconds;
+  int numberOfChunks;  // 0: one chunk per worker, sized by load balancing
+  int workerTimeoutSeconds;
+  double deadlineSeconds;  // 0 for no deadline
+  bool isSpeculative;
+  bool isProgressive;
+  double tolerance;  // 0 to refine down to delta
+  bool hasParent;  // a sub-coordinator of the server at parentAddress
+  struct sockaddr_in parentAddress;
+  const char *localSocketPath;  // NULL: TCP only
+  int ioEngineKind;
+  int numberOfIoThreads;  // 0: chosen from the CPUs and the workers
+  const char *tracePath;  // NULL: no trace file
+  const char *metricsAddress;  // NULL: no metrics endpoint
 };
 typedef struct Args Args;
 
+// Ids of the server's metrics (see metrics.h)
+struct ServerMetrics
+{
+  int jobs;
+  int chunksSent;
+  int chunksDone;
+  int chunksStopped;
+  int chunksRejected;
+  int evaluations;
+  int bytesSent;
+  int bytesReceived;
+  int workerFailures;
+  int connectedWorkers;
+  int queuedChunks;
+  int chunksInFlight;
+  int dispatchToResult;
+  int handshake;
+  int cycles;
+  int instructions;
+  int branchMisses;
+  int cacheMisses;
+};
+typedef struct ServerMetrics ServerMetrics;
+
+static ServerMetrics metrics;
+
+// What the server keeps of a chunk besides its schedule (see scheduling.h)
+struct Chunk
+{
+  // When it went to a worker and its duplicate to another, on the trace
+  // clock, and to which; a failover can swap the two in the schedule
+  uint64_t sentNs;
+  int sentWorker;
+  uint64_t speculativeSentNs;
+  int speculativeSentWorker;
+  double result;
+  // Progressive mode: the best estimate so far
+  bool hasEstimate;
+  double estimate;
+  double errorBound;
+  double estimateDelta;
+};
+typedef struct Chunk Chunk;
+
+// The server a sub-coordinator works for, and its request in progress
+struct Parent
+{
+  Transport transport;
+  int requestId;
+  bool isGone;  // closed the connection or sent MESSAGE_DONE
+  PerfCounts perfCounts;  // of the pool's responses to the request
+};
+typedef struct Parent Parent;
+
+// Which chunks are handed out and which results are back.
+// Chunk i goes out as request #firstRequestId + i, so that a 
+// sub-coordinator can tell late responses to an earlier request 
+// of its parent from the current ones
+struct Dispatch
+{
+  Schedule schedule;
+  Chunk *chunks;  // as many as the schedule has
+  int firstRequestId;
+  double deadlineMs;  // CLOCK_MONOTONIC time, 0 for none
+  bool isProgressive;
+  double tolerance;
+  double totalLength;
+  // Running totals of the chunks' best estimates, so that each new
+  // one only swaps its chunk's part
+  int numberOfEstimates;
+  double estimateSum;
+  double errorBoundSum;
+  double estimateSteps;  // each chunk's length over its estimate's step
+  // Sum of the chunks' estimates, once every chunk has one
+  bool hasEstimate;
+  double estimate;
+  double errorBound;
+  int status;  // RESPONSE_OK until cancelled or past the deadline
+  double delta;
+  bool isFinished;  // no more requests go out
+  JobTrace *trace;  // collecting the workers' spans, or NULL
+
+  IoEngine *engine;  // the scheduler's, over the parent and the shards' inbox
+  WorkerShards *shards;
+  WorkerTable *workers;
+  Parent *parent;  // NULL unless a sub-coordinator
+};
+typedef struct Dispatch Dispatch;
+
 static void printUsageAndDie();
 static void printAndDie(const char *msg);
 static void printErrorAndDie(const char *msg);
 static void parseArgumentsOrDie( int argc, char **argv, Args *argsOut);
-static  int createListeningSocketOrDie( int listenPort, int backlog, int timeoutSeconds);
-static bool sendBroadcast( struct sockaddr_in broadcastAddress, 
-  const char *bytes, size_t length);
-static  int recvResponse( int socket, Response *responseOut);
-static  int recvBenchmark( int socket, Benchmark *benchmarkOut);
-static  int sendRequest( int socket, Request request);
-static void computeIntervalsForWorkers( bool useLoadBalancing, Benchmark benchmarks[], 
-  int numberOfWorkers, Interval interval, Interval workerIntervalsOut[]);
-static void populateWorkerPool( int serverSocket, int maxNumberOfWorkers, int workerSocketsOut[], 
-  struct sockaddr_in workerAddressesOut[], int *numberOfWorkersOut);
-static void receiveBenchmarksOrDie( int workerSockets[], struct sockaddr_in workerAddresses[], 
-  int numberOfWorkers, Benchmark benchmarksOut[]);
-static void sendRequestsOrDie( int numberOfWorkers, Interval workerIntervals[], 
-  int workerSockets[], struct sockaddr_in workerAddresses[], double delta);
-static void gatherResultsOrDie( int numberOfWorkers, int workerSockets[], 
-  struct sockaddr_in workerAddresses[], double *answerOut);
+static  int createListeningSocketOrDie( int listenPort, int backlog);
+static  int createLocalListeningSocketOrDie( const char *path, int backlog);
+static  int createAnnouncementSocket( struct sockaddr_in broadcastAddress);
+static bool sendAnnouncement( int announcementSocket, struct sockaddr_in broadcastAddress,
+  int replyWindowMs);
+static  int recvBenchmark( Transport *transport, Benchmark *benchmarkOut);
+static  int sendRequest( WorkerShards *shards, WorkerTable *workers, int worker, Request request);
+static void raiseFileLimit();
+static void populateWorkerPool( const Args *args, IoEngine *engine, int serverSocket, 
+  int localSocket, int announcementSocket, WorkerTable *workers);
+static void receiveBenchmarksOrDie( WorkerTable *workers);
+static void startIoThreadsOrDie( const Args *args, IoEngine *engine, WorkerTable *workers,
+  WorkerShards *shards);
+static  int computeOrDie( const Args *args, IoEngine *engine, WorkerShards *shards,
+  WorkerTable *workers, Parent *parent, int *nextRequestIdInOut, double *answerOut);
+static void serveParentOrDie( const Args *args, IoEngine *engine, WorkerShards *shards,
+  WorkerTable *workers);
+static void failWorkerOrDie( Dispatch *dispatch, int worker, double delta);
+static void releaseWorkers( WorkerShards *shards, WorkerTable *workers);
+static void defineServerMetrics();
+static double nowMs();
 
 int main( int argc, char **argv)
 {
   Args args;
   parseArgumentsOrDie( argc, argv, &args);
+  raiseFileLimit();
+  defineServerMetrics();
+  if ( args.metricsAddress && !serveMetrics( args.metricsAddress))
+    printErrorAndDie( "Error when creating the metrics socket");
 
-  int serverSocket = createListeningSocketOrDie( args.serverPort, 
-    args.maxNumberOfWorkers, args.waitingTimeSeconds);
+  int serverSocket = createListeningSocketOrDie( args.serverPort, args.maxNumberOfWorkers);
+  int localSocket = -1;
+  if ( args.localSocketPath)
+    localSocket = createLocalListeningSocketOrDie( args.localSocketPath, args.maxNumberOfWorkers);
 
-  if ( !sendBroadcast( args.broadcastAddress, "hello", 6))
-    printErrorAndDie( "Error: can't send broadcast message");
+  int announcementSocket = -1;
+  if ( args.useBroadcast)
+  {
+    announcementSocket = createAnnouncementSocket( args.broadcastAddress);
+    if ( announcementSocket < 0)
+      printErrorAndDie( "Error: can't create the broadcast socket");
+  }
 
-  int workerSockets[ args.maxNumberOfWorkers];
-  struct sockaddr_in workerAddresses[ args.maxNumberOfWorkers];
-  int numberOfWorkers = 0;
-  populateWorkerPool( serverSocket, args.maxNumberOfWorkers, workerSockets, workerAddresses, &numberOfWorkers);
-  if ( numberOfWorkers < 1)
-    printAndDie( "Sorry, no workers found. Exiting...");
+  IoEngine engine;
+  if ( !initIoEngine( &engine, args.ioEngineKind))
+    printErrorAndDie( "Error: can't create the I/O engine");
+  if ( engine.kind != args.ioEngineKind)
+    LOG_WARN( "io_uring is not available, using %s\n", ioEngineName( engine.kind));
 
-  Benchmark benchmarks[ args.maxNumberOfWorkers];
-  receiveBenchmarksOrDie( workerSockets, workerAddresses, numberOfWorkers, benchmarks);
+  WorkerTable workers;
+  if ( !initWorkerTable( &workers, args.maxNumberOfWorkers))
+    printErrorAndDie( "Error: can't allocate the worker table");
+  uint64_t discoveryStartNs = traceNowNs();
+  populateWorkerPool( &args, &engine, serverSocket, localSocket, announcementSocket, &workers);
+  traceSpan( "discovery", discoveryStartNs, -1);
+  if ( announcementSocket >= 0)
+    close( announcementSocket);
+  if ( localSocket >= 0)
+  {
+    close( localSocket);
+    unlink( args.localSocketPath);
+  }
+  if ( workers.numberOfWorkers < 1)
+    printAndDie( "Sorry, no workers found. Exiting...");
+  setGauge( metrics.connectedWorkers, workers.numberOfAliveWorkers);
 
-  Interval workerIntervals[ args.maxNumberOfWorkers];
-  computeIntervalsForWorkers( args.useLoadBalancing, benchmarks, numberOfWorkers, 
-    args.interval, workerIntervals);
+  uint64_t handshakeStartNs = traceNowNs();
+  receiveBenchmarksOrDie( &workers);
+  traceSpan( "handshake", handshakeStartNs, -1);
+  WorkerShards shards;
+  startIoThreadsOrDie( &args, &engine, &workers, &shards);
 
-  sendRequestsOrDie( numberOfWorkers, workerIntervals, workerSockets, workerAddresses, args.delta);
+  if ( args.hasParent)
+  {
+    serveParentOrDie( &args, &engine, &shards, &workers);
+    releaseWorkers( &shards, &workers);
+    stopWorkerShards( &shards);
+    destroyIoEngine( &engine);
+    close( serverSocket);
+    destroyWorkerTable( &workers);
+    logTraceSummary();
+    LOG( "Done!\n\n");
+    return 0;
+  }
 
+  int nextRequestId = 0;
   double answer;
-  gatherResultsOrDie( numberOfWorkers, workerSockets, workerAddresses, &answer);
+  int status = computeOrDie( &args, &engine, &shards, &workers, NULL, &nextRequestId, &answer);
+  releaseWorkers( &shards, &workers);
+  stopWorkerShards( &shards);
+  destroyIoEngine( &engine);
 
   close( serverSocket);
+  destroyWorkerTable( &workers);
+  if ( status == RESPONSE_DEADLINE_EXCEEDED)
+    printAndDie( "Error: deadline exceeded");
 
+  logTraceSummary();
   LOG( "Done!\n\n");
   printf( "%.10lf\n", answer);
 }
 
-static int createListeningSocketOrDie( int listeningPort, int backlog, int timeoutSeconds)
+// Every worker takes a socket; make room for as many as the hard limit allows
+static void raiseFileLimit()
 {
-  int listeningSocket = socket( AF_INET, SOCK_STREAM, 0);
-  if ( listeningSocket < 0)
-    printErrorAndDie("Error when creating listening socket");
-
-  struct sockaddr_in listeningAddr;
-  listeningAddr.sin_family = AF_INET;
-  listeningAddr.sin_addr.s_addr = htonl( INADDR_ANY);
-  listeningAddr.sin_port = htons( listeningPort);
-
-  struct timeval timeout;      
-  timeout.tv_sec = timeoutSeconds;
-  timeout.tv_usec = 0;
-
-  if ( setsockopt ( listeningSocket, SOL_SOCKET, SO_RCVTIMEO, ( char *) &timeout,
-        sizeof( timeout)) < 0)
-    printErrorAndDie( "Error when calling setsockopt()");       
-
-  int on = 1;
-  if ( setsockopt ( listeningSocket, SOL_SOCKET, SO_REUSEADDR, ( char *) &on,
-        sizeof( on)) < 0)
-    printErrorAndDie( "Error when calling setsockopt()");       
-
-  if ( bind( listeningSocket, (struct sockaddr*)&listeningAddr, 
-        sizeof(listeningAddr)) < 0)
-    printErrorAndDie( "Error when binding the listening socket");
+  struct rlimit limit;
+  if ( getrlimit( RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+  {
+    limit.rlim_cur = limit.rlim_max;
+    if ( setrlimit( RLIMIT_NOFILE, &limit) < 0)
+      LOG_WARN( "Can't raise the limit of open files\n");
+  }
+}
 
-  if ( listen( listeningSocket, backlog) < 0)
-    printErrorAndDie( "Error when listen() on the listening socket");
+// Non-blocking, so that populateWorkerPool() can wait for workers
+// and repeat the announcement at the same time
+static int createListeningSocketOrDie( int listeningPort, int backlog)
+{
+  int listeningSocket = listenTcp( listeningPort, backlog);
+  if ( listeningSocket < 0)
+    printErrorAndDie( "Error when creating the listening socket");
+  return listeningSocket;
+}
 
+static int createLocalListeningSocketOrDie( const char *path, int backlog)
+{
+  int listeningSocket = listenUnix( path, backlog);
+  if ( listeningSocket < 0)
+    printErrorAndDie( "Error when creating the local listening socket");
   return listeningSocket;
 }
 
 static void printUsageAndDie()
 {
-  fprintf( stderr, "Usage: server <server port> <broadcast address> <broadcast port>\n"
+  flushLog();
+  fprintf( stderr, "Usage: server [-c <number of chunks>] [-t <worker timeout in seconds>]\n"
+    "       [-d <deadline in seconds>] [-s] [-p] [-e <tolerance>] [-j <reply window in ms>]\n"
+    "       [-P <parent address>:<parent port>] [-u <local socket path>] [-i epoll|uring]\n"
+    "       [-T <I/O threads>] [-x <trace file>] [-l error|warn|info|debug]\n"
+    "       [-m <metrics port>|<metrics socket path>]\n"
+    "       <server port> <broadcast address>|none <broadcast port>\n"
     "       <start point> <end point> <delta> [<use load balancing?>]\n"
     "      [<maximum number of workers>] [<waiting time in seconds>]\n");
   exit( EXIT_FAILURE);
@@ -159,18 +450,134 @@ static void printUsageAndDie()
 
 static void printAndDie(const char *msg)
 {
+  flushLog();
   fprintf( stderr, "%s\n", msg);
   exit( EXIT_FAILURE);
 }
 
 static void printErrorAndDie(const char *msg)
 {
-  fprintf( stderr, "%s: %s\n", msg, strerror( errno));
+  int error = errno;
+  flushLog();
+  fprintf( stderr, "%s: %s\n", msg, strerror( error));
   exit( EXIT_FAILURE);
 }
 
+// "<host>:<port>", the host given by name or address
+static bool parseParentAddress( const char *text, struct sockaddr_in *addressOut)
+{
+  char host[ 256];
+  const char *colon = strrchr( text, ':');
+  if ( !colon || colon == text || colon - text >= ( long) sizeof( host) || atoi( colon + 1) <= 0)
+    return false;
+  memcpy( host, text, colon - text);
+  host[ colon - text] = '\0';
+
+  struct addrinfo hints;
+  memset( &hints, 0, sizeof( hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo *addresses;
+  if ( getaddrinfo( host, NULL, &hints, &addresses) || !addresses)
+    return false;
+  memcpy( addressOut, addresses->ai_addr, sizeof( struct sockaddr_in));
+  addressOut->sin_port = htons( atoi( colon + 1));
+  freeaddrinfo( addresses);
+  return true;
+}
+
 static void parseArgumentsOrDie( int argc, char **argv, Args *argsOut)
 {
+  int numberOfChunks = 0;
+  int workerTimeoutSeconds = DEFAULT_WORKER_TIMEOUT_SECONDS;
+  double deadlineSeconds = 0.0;
+  bool isSpeculative = false;
+  bool isProgressive = false;
+  double tolerance = 0.0;
+  int replyWindowMs = -1;  // chosen from the maximum number of workers
+  bool hasParent = false;
+  const char *localSocketPath = NULL;
+  int ioEngineKind = IO_ENGINE_URING;
+  int numberOfIoThreads = 0;
+  const char *tracePath = NULL;
+  const char *metricsAddress = NULL;
+  struct sockaddr_in parentAddress;
+  memset( &parentAddress, 0, sizeof( parentAddress));
+  int option;
+  while ( ( option = getopt( argc, argv, "+c:t:d:spe:j:P:u:i:T:x:l:m:")) != -1)
+  {
+    switch ( option)
+    {
+      case 'x':
+        tracePath = optarg;
+        break;
+      case 'm':
+        metricsAddress = optarg;
+        break;
+      case 'l':
+        if ( !setLogLevel( optarg))
+          printAndDie( "Error: the log level must be error, warn, info or debug");
+        break;
+      case 'T':
+        numberOfIoThreads = atoi( optarg);
+        if ( numberOfIoThreads < 1)
+          printAndDie( "Error: <I/O threads> must be a positive integer");
+        break;
+      case 'i':
+        if ( strcmp( optarg, "epoll") == 0)
+          ioEngineKind = IO_ENGINE_EPOLL;
+        else if ( strcmp( optarg, "uring") == 0)
+          ioEngineKind = IO_ENGINE_URING;
+        else
+          printAndDie( "Error: the I/O engine must be epoll or uring");
+        break;
+      case 'u':
+        localSocketPath = optarg;
+        break;
+      case 'P':
+        if ( !parseParentAddress( optarg, &parentAddress))
+          printAndDie( "Error: <parent address>:<parent port> can't be resolved");
+        hasParent = true;
+        break;
+      case 'j':
+        replyWindowMs = atoi( optarg);
+        if ( replyWindowMs < 0)
+          printAndDie( "Error: <reply window in ms> must be a non-negative integer");
+        break;
+      case 'e':
+        tolerance = atof( optarg);
+        if ( tolerance <= 0)
+          printAndDie( "Error: <tolerance> must be a positive real number");
+        isProgressive = true;
+        break;
+      case 'p':
+        isProgressive = true;
+        break;
+      case 's':
+        isSpeculative = true;
+        break;
+      case 'd':
+        deadlineSeconds = atof( optarg);
+        if ( deadlineSeconds <= 0)
+          printAndDie( "Error: <deadline in seconds> must be a positive real number");
+        break;
+      case 't':
+        workerTimeoutSeconds = atoi( optarg);
+        if ( workerTimeoutSeconds < 1)
+          printAndDie( "Error: <worker timeout in seconds> must be a positive integer");
+        break;
+      case 'c':
+        numberOfChunks = atoi( optarg);
+        if ( numberOfChunks < 1)
+          printAndDie( "Error: <number of chunks> must be a positive integer");
+        break;
+      default:
+        printUsageAndDie();
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+
   if ( argc < 7)
     printUsageAndDie();
 
@@ -178,8 +585,10 @@ static void parseArgumentsOrDie( int argc, char **argv, Args *argsOut)
   int broadcastPort = atoi( argv[3]);
 
   char *broadcastAddr = argv[2];
+  bool useBroadcast = strcmp( broadcastAddr, "none") != 0;
   struct in_addr inAddr;
-  if ( !inet_aton( broadcastAddr, &inAddr))
+  inAddr.s_addr = htonl( INADDR_NONE);
+  if ( useBroadcast && !inet_aton( broadcastAddr, &inAddr))
     printErrorAndDie( "Error: invalid broadcast address");
   struct sockaddr_in broadcastAddress;
   memset( &broadcastAddress, 0, sizeof( broadcastAddress));
@@ -224,210 +633,1265 @@ static void parseArgumentsOrDie( int argc, char **argv, Args *argsOut)
 
   LOG( "Started at port %d with parameters:\n", serverPort);
   LOG( "    load balancing: %s\n", ( ( useLoadBalancing)? "on" : "off"));
+  if ( !useBroadcast)
+    LOG( "    discovery: registration only\n");
+  if ( numberOfChunks > 0)
+    LOG( "    chunks: %d, pulled by workers\n", numberOfChunks);
+  if ( deadlineSeconds > 0)
+    LOG( "    deadline: %.3lf s\n", deadlineSeconds);
+  if ( isSpeculative)
+    LOG( "    speculative duplicates: on\n");
+  if ( isProgressive)
+    LOG( "    progressive, tolerance: %.3lg\n", tolerance);
+  if ( hasParent)
+    LOG( "    sub-coordinator of %s:%d\n", inet_ntoa( parentAddress.sin_addr),
+      ntohs( parentAddress.sin_port));
+  if ( localSocketPath)
+    LOG( "    local workers: %s\n", localSocketPath);
+  LOG( "    I/O engine: %s\n", ioEngineName( ioEngineKind));
+  if ( numberOfIoThreads > 0)
+    LOG( "    I/O threads: %d\n", numberOfIoThreads);
+  if ( tracePath)
+    LOG( "    trace file: %s\n", tracePath);
+  if ( metricsAddress)
+    LOG( "    metrics: %s\n", metricsAddress);
   LOG( "\n");
 
   argsOut->interval.start = startPoint;
   argsOut->interval.end = endPoint;
   argsOut->delta = delta;
+  if ( replyWindowMs < 0)
+    replyWindowMs = ( maxNumberOfWorkers < MAX_REPLY_WINDOW_MS)? maxNumberOfWorkers : MAX_REPLY_WINDOW_MS;
+  argsOut->replyWindowMs = replyWindowMs;
+  argsOut->useBroadcast = useBroadcast;
   argsOut->broadcastAddress = broadcastAddress;
   argsOut->serverPort = serverPort;
   argsOut->useLoadBalancing = useLoadBalancing;
   argsOut->maxNumberOfWorkers = maxNumberOfWorkers;
   argsOut->waitingTimeSeconds = waitingTimeSeconds;
+  argsOut->numberOfChunks = numberOfChunks;
+  argsOut->workerTimeoutSeconds = workerTimeoutSeconds;
+  argsOut->deadlineSeconds = deadlineSeconds;
+  argsOut->isSpeculative = isSpeculative;
+  argsOut->isProgressive = isProgressive;
+  argsOut->tolerance = tolerance;
+  argsOut->hasParent = hasParent;
+  argsOut->parentAddress = parentAddress;
+  argsOut->localSocketPath = localSocketPath;
+  argsOut->ioEngineKind = ioEngineKind;
+  argsOut->numberOfIoThreads = numberOfIoThreads;
+  argsOut->tracePath = tracePath;
+  argsOut->metricsAddress = metricsAddress;
 }
 
-static bool sendBroadcast( struct sockaddr_in broadcastAddress, const char *bytes, size_t length)
+static void defineServerMetrics()
+{
+  metrics.jobs = defineCounter( "integral_jobs_total", "Integrals computed");
+  metrics.chunksSent = defineCounter( "integral_chunks_sent_total",
+    "Requests sent to workers, duplicates included");
+  metrics.chunksDone = defineCounter( "integral_chunks_done_total", "Chunks whose result came back");
+  metrics.chunksStopped = defineCounter( "integral_chunks_stopped_total",
+    "Responses of requests cancelled or past their deadline");
+  metrics.chunksRejected = defineCounter( "integral_chunks_rejected_total",
+    "Requests turned down by workers whose job queue was full");
+  metrics.evaluations = defineCounter( "integral_evaluations_total",
+    "Function evaluations of the chunks done, two per step");
+  metrics.bytesSent = defineCounter( "integral_sent_bytes_total", "Bytes of messages to workers");
+  metrics.bytesReceived = defineCounter( "integral_received_bytes_total",
+    "Bytes of messages from workers");
+  metrics.workerFailures = defineCounter( "integral_worker_failures_total",
+    "Workers lost to a failed connection or a timeout");
+  metrics.connectedWorkers = defineGauge( "integral_connected_workers", "Workers in the pool");
+  metrics.queuedChunks = defineGauge( "integral_queued_chunks", "Chunks of the job not sent yet");
+  metrics.chunksInFlight = defineGauge( "integral_chunks_in_flight",
+    "Requests sent and not answered yet");
+  metrics.dispatchToResult = defineHistogram( "integral_dispatch_to_result_seconds",
+    "From a request going out to its response coming in");
+  metrics.handshake = defineHistogram( "integral_handshake_seconds",
+    "Waiting for a worker's Benchmark once the pool is formed");
+  metrics.cycles = defineCounter( "integral_cpu_cycles_total",
+    "CPU cycles the workers counted (with -e) computing");
+  metrics.instructions = defineCounter( "integral_instructions_total",
+    "Instructions the workers counted (with -e) computing");
+  metrics.branchMisses = defineCounter( "integral_branch_misses_total",
+    "Branch mispredictions the workers counted (with -e) computing");
+  metrics.cacheMisses = defineCounter( "integral_cache_misses_total",
+    "Last-level cache misses the workers counted (with -e) computing");
+}
+
+static int createAnnouncementSocket( struct sockaddr_in broadcastAddress)
 {
-  LOG( "Sending broadcast message...\n"); 
   int broadcastSocket = socket( AF_INET, SOCK_DGRAM, 0);
+  if ( broadcastSocket < 0)
+    return -1;
   int optValue = 1;
   socklen_t optLength = sizeof( optValue);
   if ( setsockopt( broadcastSocket, SOL_SOCKET, SO_BROADCAST, &optValue, optLength) < 0)
   {
     close( broadcastSocket);
-    return false;
+    return -1;
   }
-  if ( sendto( broadcastSocket, bytes, length, 0, (struct sockaddr *) &broadcastAddress, 
-    sizeof( broadcastAddress)) < 0)
+  if ( IN_MULTICAST( ntohl( broadcastAddress.sin_addr.s_addr)))
   {
-    close( broadcastSocket);
-    return false; 
+    unsigned char ttl = MULTICAST_TTL;
+    if ( setsockopt( broadcastSocket, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof( ttl)) < 0)
+    {
+      close( broadcastSocket);
+      return -1;
+    }
   }
-  close( broadcastSocket);
+  return broadcastSocket;
+}
+
+static bool sendAnnouncement( int announcementSocket, struct sockaddr_in broadcastAddress,
+  int replyWindowMs)
+{
+  LOG( "Sending broadcast message...\n"); 
+  Announcement announcement;
+  memset( &announcement, 0, sizeof( announcement));
+  strcpy( announcement.greeting, "hello");
+  announcement.replyWindowMs = replyWindowMs;
+  if ( sendto( announcementSocket, &announcement, sizeof( announcement), 0, 
+    (struct sockaddr *) &broadcastAddress, sizeof( broadcastAddress)) < 0)
+    return false; 
   LOG( "Broadcast message sent. Now waiting for workers...\n");
   return true;
 }
 
-static int acceptWorker( int serverSocket, int *workerSocketOut, 
-  struct sockaddr_in *workerAddressOut)
+static double nowMs()
 {
-  struct sockaddr_in workerAddress;
-  socklen_t workerAddressLength = sizeof( workerAddress);
-  int workerSocket = accept( serverSocket, 
-    (struct sockaddr *) &workerAddress, &workerAddressLength);
+  struct timespec now;
+  clock_gettime( CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+}
 
-  if ( workerSocket < 0)
+static int recvBenchmark( Transport *transport, Benchmark *benchmarkOut)
+{
+  MessageHeader header;
+  char payload[ MAX_MESSAGE_LENGTH];
+  if ( !recvMessage( transport, &header, payload))
     return -1;
+  if ( header.type != MESSAGE_BENCHMARK || header.length != sizeof( Benchmark))
+    return -1;
+  memcpy( benchmarkOut, payload, sizeof( Benchmark));
+  return 0;
+}
+
+// A shared-memory channel bypasses the I/O threads. A socket that
+// fails is reported by its I/O thread later on
+static bool sendToWorker( WorkerShards *shards, WorkerTable *workers, int worker, int type,
+  const void *payload, int length)
+{
+  Transport *transport = &workers->transports[ worker];
+  addToCounter( metrics.bytesSent, sizeof( MessageHeader) + length);
+  if ( transport->kind == TRANSPORT_SHM)
+    return sendMessage( transport, type, payload, length);
+  postToWorker( shards, worker, type, payload, length);
+  return true;
+}
 
-  struct timeval timeout;      
-  timeout.tv_sec = 0;
-  timeout.tv_usec = 0;
-  if ( setsockopt ( workerSocket, SOL_SOCKET, SO_RCVTIMEO, ( char *) &timeout,
-        sizeof( timeout)) < 0)
+static int sendRequest( WorkerShards *shards, WorkerTable *workers, int worker, Request request)
+{
+  if ( !sendToWorker( shards, workers, worker, MESSAGE_REQUEST, &request, sizeof( request)))
     return -1;
+  return 0;
+}
 
-  *workerSocketOut = workerSocket;
-  *workerAddressOut = workerAddress;
+static int sendCancel( WorkerShards *shards, WorkerTable *workers, int worker, int requestId)
+{
+  Cancel cancel;
+  cancel.requestId = requestId;
+  if ( !sendToWorker( shards, workers, worker, MESSAGE_CANCEL, &cancel, sizeof( cancel)))
+    return -1;
   return 0;
 }
 
-static void computeIntervalsForWorkersWithLoadBalancing( Benchmark *benchmarks, int numberOfWorkers,
-    Interval interval, Interval *workerIntervalsOut)
+// A local worker follows its Benchmark with a shared-memory channel
+static void receiveChannelOrDie( WorkerTable *workers, int worker)
+{
+  if ( !acceptShmChannel( &workers->transports[ worker]))
+    printErrorAndDie( "Error: can't receive the channel of a local worker");
+  if ( workers->transports[ worker].kind != TRANSPORT_SHM)
+    return;
+  if ( !trackTransportUpgrade( workers, worker))
+    printErrorAndDie( "Error: can't attach the channel of a local worker");
+  LOG( "    talking through shared memory\n");
+}
+
+// What populateWorkerPool() hands to its event handler
+struct Pool
+{
+  const Args *args;
+  WorkerTable *workers;
+  int localSocket;
+  double lastWorkerMs;
+};
+typedef struct Pool Pool;
+
+static void onWorkerAccepted( void *context, const IoEvent *event)
 {
-  double performanceIndeces[ numberOfWorkers];
-  double sumOfPerformanceIndeces = 0.0l;
-  for ( int i = 0; i < numberOfWorkers; ++i)
+  Pool *pool = ( Pool*) context;
+  Transport workerTransport;
+  struct sockaddr_in workerAddress;
+  if ( event->type != IO_EVENT_ACCEPTED)
+    return;
+  if ( pool->workers->numberOfWorkers >= pool->args->maxNumberOfWorkers)
   {
-    double performanceIndecex = 1e-6 / ( benchmarks[ i].timeMs * benchmarks[ i].delta);
-    sumOfPerformanceIndeces += performanceIndecex;
-    performanceIndeces[ i] = performanceIndecex;
+    close( event->acceptedSocket);  // a registering worker retries on its own
+    return;
   }
-  
-  double lastEnd = interval.start;
-  double intervalLength = interval.end - interval.start;
-  for ( int i = 0; i < numberOfWorkers; ++i) 
+  if ( !adoptTransport( event->acceptedSocket, &workerTransport, &workerAddress))
+  {
+    LOG_ERROR( "Error when accepting a worker: %s\n", strerror( errno));
+    close( event->acceptedSocket);
+    return;
+  } 
+  LOG( "Connected to %sworker %s:%d\n", ( event->fd == pool->localSocket)? "local " : "",
+    inet_ntoa( workerAddress.sin_addr),
+    ntohs( workerAddress.sin_port));
+  if ( addWorker( pool->workers, workerTransport, workerAddress) < 0)
+  {
+    LOG_WARN( "Can't add the worker to the table\n");
+    closeTransport( &workerTransport);
+    return;
+  }
+  pool->lastWorkerMs = nowMs();
+}
+
+// Accepts workers until there are enough of them or none has come for
+// the waiting time, repeating the announcement with a growing interval
+static void populateWorkerPool( const Args *args, IoEngine *engine, int serverSocket, 
+  int localSocket, int announcementSocket, WorkerTable *workers)
+{
+  if ( !watchListener( engine, serverSocket) || 
+       ( localSocket >= 0 && !watchListener( engine, localSocket)))
+    printErrorAndDie( "Error when watching the listening sockets");
+  Pool pool;
+  pool.args = args;
+  pool.workers = workers;
+  pool.localSocket = localSocket;
+  pool.lastWorkerMs = nowMs();
+  double nextAnnouncementMs = pool.lastWorkerMs;
+  int announcementIntervalMs = MIN_ANNOUNCEMENT_INTERVAL_MS;
+  while ( workers->numberOfWorkers < args->maxNumberOfWorkers)
   {
-    double workerIntervalLength = 
-      intervalLength * ( performanceIndeces[ i] / sumOfPerformanceIndeces);
-    workerIntervalsOut[ i].start = lastEnd;
-    workerIntervalsOut[ i].end = lastEnd + workerIntervalLength;
-    lastEnd += workerIntervalLength;
+    double now = nowMs();
+    double waitingEndMs = pool.lastWorkerMs + args->waitingTimeSeconds * 1000.0;
+    if ( now >= waitingEndMs)
+      break;
+    if ( announcementSocket >= 0 && now >= nextAnnouncementMs)
+    {
+      if ( !sendAnnouncement( announcementSocket, args->broadcastAddress, args->replyWindowMs))
+        LOG_ERROR( "Error when sending the broadcast message: %s\n", strerror( errno));
+      nextAnnouncementMs = now + announcementIntervalMs;
+      announcementIntervalMs *= 2;
+      if ( announcementIntervalMs > MAX_ANNOUNCEMENT_INTERVAL_MS)
+        announcementIntervalMs = MAX_ANNOUNCEMENT_INTERVAL_MS;
+    }
+
+    double wakeUpMs = ( announcementSocket >= 0 && nextAnnouncementMs < waitingEndMs)? 
+      nextAnnouncementMs : waitingEndMs;
+    if ( pollIoEngine( engine, ( int) ( wakeUpMs - now) + 1, onWorkerAccepted, &pool) < 0)
+      printErrorAndDie( "Error when waiting for workers");
   }
+  unwatchFd( engine, serverSocket);
+  if ( localSocket >= 0)
+    unwatchFd( engine, localSocket);
 }
 
-static void computeIntervalsForWorkers( bool useLoadBalancing, Benchmark benchmarks[], 
-  int numberOfWorkers, Interval interval, Interval workerIntervalsOut[])
+static void receiveBenchmarksOrDie( WorkerTable *workers)
 {
-  if ( useLoadBalancing)
-  {  
-    computeIntervalsForWorkersWithLoadBalancing( benchmarks, numberOfWorkers, 
-      interval, workerIntervalsOut);
+  for ( int i = 0; i < workers->numberOfWorkers; ++i)
+  {
+    Benchmark benchmark;
+    uint64_t startNs = traceNowNs();
+    if ( recvBenchmark( &workers->transports[ i], &benchmark))
+      printErrorAndDie( "Error: can't receive benchmark from a worker");
+    recordHistogramNs( metrics.handshake, traceNowNs() - startNs);
+    LOG( "Received benchmark from %s:%d:\n    %.12lf ms\n", 
+      inet_ntoa( workers->addresses[ i].sin_addr),
+      ntohs( workers->addresses[ i].sin_port),
+      benchmark.timeMs);
+    LOG( "    %d%s thread(s) on %d physical core(s) x %d SMT (%d of %d CPUs allowed)\n",
+      benchmark.numberOfThreads, ( benchmark.isPinned)? " pinned" : "",
+      benchmark.numberOfPhysicalCores, benchmark.threadsPerCore,
+      benchmark.numberOfAllowedCpus, benchmark.numberOfCores);
+    LOG( "    %d core(s), %s, %d NUMA node(s), L1/L2/L3 %ld/%ld/%ld KiB, CPU quota %.2lf\n",
+      benchmark.numberOfCores, simdLevelName( benchmark.simdLevel),
+      benchmark.numberOfNumaNodes, benchmark.l1CacheBytes / 1024, benchmark.l2CacheBytes / 1024,
+      benchmark.l3CacheBytes / 1024, benchmark.cpuQuota);
+    for ( int j = 0; j < benchmark.numberOfThroughputPoints; ++j)
+      LOG( "    %d thread(s): %.0lf steps/ms\n", benchmark.throughputThreads[ j], benchmark.throughput[ j]);
+    workers->benchmarks[ i] = benchmark;
+    workers->credits[ i] = ( benchmark.credits > 0)? benchmark.credits : 1;
+    if ( workers->transports[ i].kind == TRANSPORT_UNIX)
+      receiveChannelOrDie( workers, i);
   }
-  else
+}
+
+// One I/O thread per CPU, leaving one to the scheduler
+static int chooseNumberOfIoThreads( const Args *args, int numberOfWorkers)
+{
+  int numberOfIoThreads = args->numberOfIoThreads;
+  if ( numberOfIoThreads < 1)
+  {
+    long numberOfCpus = sysconf( _SC_NPROCESSORS_ONLN);
+    numberOfIoThreads = ( numberOfCpus > 2)? ( int) numberOfCpus - 1 : 1;
+  }
+  return ( numberOfIoThreads < numberOfWorkers)? numberOfIoThreads : numberOfWorkers;
+}
+
+// The scheduler's own engine only watches the inbox and the parent from now on
+static void startIoThreadsOrDie( const Args *args, IoEngine *engine, WorkerTable *workers,
+  WorkerShards *shards)
+{
+  int numberOfIoThreads = chooseNumberOfIoThreads( args, workers->numberOfWorkers);
+  if ( !startWorkerShards( shards, numberOfIoThreads, engine->kind, workers))
+    printErrorAndDie( "Error when starting the I/O threads");
+  if ( !watchReadable( engine, shards->wakeFd))
+    printErrorAndDie( "Error when watching the I/O threads");
+  LOG( "%d I/O thread(s) for %d worker(s)\n", numberOfIoThreads, workers->numberOfWorkers);
+  // From now on the scheduler hears from them all the time
+  double now = nowMs();
+  for ( int i = 0; i < workers->numberOfWorkers; ++i)
+    workers->lastHeardMs[ i] = now;
+}
+
+static void initDispatchOrDie( const Args *args, IoEngine *engine, WorkerShards *shards,
+  WorkerTable *workers, Parent *parent, int firstRequestId, Dispatch *dispatchOut)
+{
+  int numberOfWorkers = workers->numberOfWorkers;
+  Dispatch dispatch;
+  dispatch.firstRequestId = firstRequestId;
+  dispatch.status = RESPONSE_OK;
+  dispatch.parent = parent;
+  dispatch.isProgressive = args->isProgressive;
+  dispatch.tolerance = args->tolerance;
+  dispatch.totalLength = args->interval.end - args->interval.start;
+  dispatch.numberOfEstimates = 0;
+  dispatch.estimateSum = 0.0;
+  dispatch.errorBoundSum = 0.0;
+  dispatch.estimateSteps = 0.0;
+  dispatch.hasEstimate = false;
+  dispatch.delta = args->delta;
+  dispatch.engine = engine;
+  dispatch.shards = shards;
+  dispatch.isFinished = false;
+  dispatch.trace = NULL;
+  dispatch.workers = workers;
+  if ( !initSchedule( &dispatch.schedule, args->numberOfChunks, args->isSpeculative,
+        args->interval, workers->intervals, numberOfWorkers))
+    printErrorAndDie( "Error: can't allocate chunks");
+  dispatch.chunks = ( Chunk*) calloc( dispatch.schedule.numberOfChunks, sizeof( Chunk));
+  if ( !dispatch.chunks)
+    printErrorAndDie( "Error: can't allocate chunks");
+  for ( int i = 0; i < dispatch.schedule.numberOfChunks; ++i)
+  {
+    dispatch.chunks[ i].sentWorker = -1;
+    dispatch.chunks[ i].speculativeSentWorker = -1;
+  }
+
+  dispatch.deadlineMs = ( args->deadlineSeconds > 0)? nowMs() + args->deadlineSeconds * 1000.0 : 0.0;
+
+  // A sub-coordinator's pool may have lost workers on earlier requests
+  if ( dispatch.schedule.isStatic)
   {
-    double d = ( interval.end - interval.start) / numberOfWorkers;
     for ( int i = 0; i < numberOfWorkers; ++i)
+      if ( !workers->isAlive[ i])
+        requeueChunk( &dispatch.schedule, i);
+  }
+  *dispatchOut = dispatch;
+}
+
+static void destroyDispatch( Dispatch *dispatch)
+{
+  free( dispatch->chunks);
+  destroySchedule( &dispatch->schedule);
+}
+
+// Tops the worker up to the number of chunks it accepts at a time.
+// False if a request couldn't go out, which over shared memory is
+// known right away; the chunk goes back to the others
+static bool sendRequests( Dispatch *dispatch, int worker, double delta)
+{
+  WorkerTable *workers = dispatch->workers;
+  if ( !workers->isAlive[ worker] || dispatch->isFinished)
+    return true;
+  while ( workers->outstandingChunks[ worker] < workers->credits[ worker])
+  {
+    bool isDuplicate;
+    int chunk = takeChunk( &dispatch->schedule, worker, workers->outstandingChunks[ worker] == 0,
+      &isDuplicate);
+    if ( chunk < 0)
+      break;
+    Request request;
+    request.startPoint = dispatch->schedule.chunks[ chunk].interval.start;
+    request.endPoint = dispatch->schedule.chunks[ chunk].interval.end;
+    request.delta = delta;
+    request.id = dispatch->firstRequestId + chunk;
+    request.deadlineMs = 0.0;
+    // Each chunk gets its share of the tolerance
+    request.isProgressive = dispatch->isProgressive;
+    request.tolerance = ( dispatch->totalLength > 0)? dispatch->tolerance * 
+      ( request.endPoint - request.startPoint) / dispatch->totalLength : 0.0;
+    if ( dispatch->deadlineMs > 0)
+    {
+      // A request sent past the deadline gets stopped right away
+      request.deadlineMs = dispatch->deadlineMs - nowMs();
+      if ( request.deadlineMs < 1e-3)
+        request.deadlineMs = 1e-3;
+    }
+    if ( sendRequest( dispatch->shards, workers, worker, request))
+    {
+      if ( !isDuplicate)
+        requeueChunk( &dispatch->schedule, chunk);
+      return false;
+    }
+    assignChunk( &dispatch->schedule, chunk, worker, isDuplicate);
+    if ( isDuplicate)
     {
-      workerIntervalsOut[ i].start = interval.start + d * i;
-      workerIntervalsOut[ i].end = interval.start + d * (i + 1);
+      dispatch->chunks[ chunk].speculativeSentNs = traceNowNs();
+      dispatch->chunks[ chunk].speculativeSentWorker = worker;
     }
+    else
+    {
+      dispatch->chunks[ chunk].sentNs = traceNowNs();
+      dispatch->chunks[ chunk].sentWorker = worker;
+    }
+    workers->outstandingChunks[ worker] ++;
+    addToCounter( metrics.chunksSent, 1);
+    addToGauge( metrics.chunksInFlight, 1);
+    LOG_DEBUG( "Sent %srequest #%d to worker %s:%d\n", ( isDuplicate)? "a duplicate of " : "", request.id,
+      inet_ntoa( workers->addresses[ worker].sin_addr),
+      ntohs( workers->addresses[ worker].sin_port));
+  }
+  return true;
+}
+
+// Fails the worker over if a request to it couldn't go out
+static void topUpWorkerOrDie( Dispatch *dispatch, int worker, double delta)
+{
+  if ( !sendRequests( dispatch, worker, delta))
+    failWorkerOrDie( dispatch, worker, delta);
+}
+
+// Takes the worker out of the pool; its I/O thread closes the transport
+static void retireLostWorkerOrDie( WorkerTable *workers, WorkerShards *shards, int worker)
+{
+  addToGauge( metrics.chunksInFlight, -workers->outstandingChunks[ worker]);
+  retireWorker( workers, worker);
+  postDropWorker( shards, worker);
+  addToCounter( metrics.workerFailures, 1);
+  setGauge( metrics.connectedWorkers, workers->numberOfAliveWorkers);
+  if ( workers->numberOfAliveWorkers == 0)
+    printAndDie( "Error: all workers failed");
+}
+
+// Drops a worker that failed or went silent and hands its chunks to the others
+static void failWorkerOrDie( Dispatch *dispatch, int worker, double delta)
+{
+  WorkerTable *workers = dispatch->workers;
+  LOG_WARN( "Lost worker %s:%d, reassigning its chunks\n",
+    inet_ntoa( workers->addresses[ worker].sin_addr),
+    ntohs( workers->addresses[ worker].sin_port));
+  retireLostWorkerOrDie( workers, dispatch->shards, worker);
+  failScheduledWorker( &dispatch->schedule, worker);
+  // The others are full up, or have asked and are waiting
+  int waitingWorker;
+  while ( ( waitingWorker = nextWaitingWorker( &dispatch->schedule)) >= 0)
+    topUpWorkerOrDie( dispatch, waitingWorker, delta);
+}
+
+// Prints the sum of the chunks' estimates when it improves. The step
+// it goes up to a parent with is the overall one: the whole length 
+// over the steps of all the chunks
+static void updateEstimate( Dispatch *dispatch)
+{
+  if ( dispatch->numberOfEstimates < dispatch->schedule.numberOfChunks)
+    return;
+  double estimate = dispatch->estimateSum;
+  double errorBound = dispatch->errorBoundSum;
+  double estimateDelta = ( dispatch->estimateSteps > 0)? 
+    dispatch->totalLength / dispatch->estimateSteps : dispatch->delta;
+  if ( dispatch->hasEstimate && errorBound >= dispatch->errorBound)
+    return;
+  dispatch->hasEstimate = true;
+  dispatch->estimate = estimate;
+  dispatch->errorBound = errorBound;
+
+  // A sub-coordinator passes the estimate up instead
+  if ( dispatch->parent)
+  {
+    Estimate message;
+    message.requestId = dispatch->parent->requestId;
+    message.result = estimate;
+    message.errorBound = errorBound;
+    message.delta = estimateDelta;
+    if ( !sendMessage( &dispatch->parent->transport, MESSAGE_ESTIMATE, &message, sizeof( message)))
+      LOG_ERROR( "Error when sending an estimate to the parent\n");
+    return;
+  }
+  printf( "%.10lf %.3le\n", estimate, errorBound);
+  fflush( stdout);
+}
+
+// Swaps the chunk's part of the running totals for the new estimate
+static void setChunkEstimate( Dispatch *dispatch, int chunkIndex, double estimate, 
+  double errorBound, double estimateDelta)
+{
+  Chunk *chunk = &dispatch->chunks[ chunkIndex];
+  const Interval *interval = &dispatch->schedule.chunks[ chunkIndex].interval;
+  double length = interval->end - interval->start;
+  if ( chunk->hasEstimate)
+  {
+    dispatch->estimateSum -= chunk->estimate;
+    dispatch->errorBoundSum -= chunk->errorBound;
+    if ( chunk->estimateDelta > 0)
+      dispatch->estimateSteps -= length / chunk->estimateDelta;
   }
+  else
+    dispatch->numberOfEstimates ++;
+  chunk->hasEstimate = true;
+  chunk->estimate = estimate;
+  chunk->errorBound = errorBound;
+  chunk->estimateDelta = estimateDelta;
+  dispatch->estimateSum += estimate;
+  dispatch->errorBoundSum += errorBound;
+  if ( estimateDelta > 0)
+    dispatch->estimateSteps += length / estimateDelta;
+  updateEstimate( dispatch);
+}
+
+static void receiveEstimate( Dispatch *dispatch, const Estimate *estimate)
+{
+  int chunkIndex = estimate->requestId - dispatch->firstRequestId;
+  Chunk *chunk = &dispatch->chunks[ chunkIndex];
+  LOG_DEBUG( "Estimate of #%d with delta = %.3lg: %.10lf +- %.3lg\n", estimate->requestId,
+    estimate->delta, estimate->result, estimate->errorBound);
+  // Either copy of a duplicated chunk may be ahead
+  if ( dispatch->schedule.chunks[ chunkIndex].isDone ||
+       ( chunk->hasEstimate && estimate->errorBound >= chunk->errorBound))
+    return;
+  setChunkEstimate( dispatch, chunkIndex, estimate->result, estimate->errorBound,
+    estimate->delta);
 }
 
-static int recvResponse( int socket, Response *responseOut)
+// NTP's estimate from one round trip, which doesn't count the time
+// the worker held the request; the shorter the round trip, the
+// tighter the estimate, so the shortest one so far is kept
+static void estimateClockOffset( WorkerTable *workers, int worker, uint64_t requestSentNs,
+  const Response *response)
 {
+  uint64_t responseReceivedNs = traceNowNs();
+  uint64_t heldNs = response->sentNs - response->receivedNs;
+  if ( response->receivedNs == 0 || response->sentNs < response->receivedNs ||
+       heldNs > responseReceivedNs - requestSentNs)
+    return;
+  uint64_t roundTripNs = responseReceivedNs - requestSentNs - heldNs;
+  if ( roundTripNs >= workers->clockRoundTripNs[ worker])
+    return;
+  workers->clockRoundTripNs[ worker] = roundTripNs;
+  workers->clockOffsetNs[ worker] = ( ( int64_t) ( response->receivedNs - requestSentNs) +
+    ( int64_t) ( response->sentNs - responseReceivedNs)) / 2;
+}
+
+// A batch of the worker's spans, the empty one being the last
+static bool receiveTraceRecords( Dispatch *dispatch, int worker, const MessageHeader *header,
+  const void *payload)
+{
+  if ( header->length % sizeof( TraceRecord) != 0)
+    return false;
+  JobTrace *trace = dispatch->trace;
+  if ( !trace)
+    return true;  // too late
+  if ( header->length == 0)
+  {
+    trace->isWorkerDone[ worker] = true;
+    return true;
+  }
+  if ( !addTraceRecords( trace, worker, ( const TraceRecord*) payload, 
+         header->length / sizeof( TraceRecord)))
+    LOG_WARN( "Out of memory for the trace\n");
+  return true;
+}
+
+// The worker's job queue was full, as it serves other servers too:
+// the chunk goes to the others, and the worker is kept no more chunks
+// ahead than it holds. It asks again with its next result or heartbeat
+static void receiveRejection( Dispatch *dispatch, int worker, int chunk, double delta)
+{
+  WorkerTable *workers = dispatch->workers;
+  LOG_DEBUG( "Worker %s:%d turned request #%d down\n",
+    inet_ntoa( workers->addresses[ worker].sin_addr), ntohs( workers->addresses[ worker].sin_port),
+    dispatch->firstRequestId + chunk);
+  addToCounter( metrics.chunksRejected, 1);
+  returnChunk( &dispatch->schedule, chunk, worker);
+  if ( workers->credits[ worker] > workers->outstandingChunks[ worker])
+    workers->credits[ worker] = ( workers->outstandingChunks[ worker] > 0)? 
+      workers->outstandingChunks[ worker] : 1;
+  int waitingWorker;
+  while ( ( waitingWorker = nextWaitingWorker( &dispatch->schedule)) >= 0)
+  {
+    if ( waitingWorker != worker)
+      topUpWorkerOrDie( dispatch, waitingWorker, delta);
+  }
+}
+
+static bool handleWorkerMessage( Dispatch *dispatch, int worker, const MessageHeader *message,
+  const void *payload, double delta)
+{
+  WorkerTable *workers = dispatch->workers;
+  MessageHeader header = *message;
+  workers->lastHeardMs[ worker] = nowMs();
+
+  if ( header.type == MESSAGE_HEARTBEAT && header.length == sizeof( Heartbeat))
+  {
+    Heartbeat heartbeat;
+    memcpy( &heartbeat, payload, sizeof( heartbeat));
+    int chunk = heartbeat.requestId - dispatch->firstRequestId;
+    if ( chunk >= 0 && chunk < dispatch->schedule.numberOfChunks)
+      setChunkProgress( &dispatch->schedule, chunk, worker, heartbeat.fractionDone);
+    if ( heartbeat.requestId >= 0)
+      LOG_DEBUG( "Heartbeat from %s:%d: #%d is %.1lf%% done, partial sum %.10lf, %.3lg evaluations/s\n",
+        inet_ntoa( workers->addresses[ worker].sin_addr), ntohs( workers->addresses[ worker].sin_port),
+        heartbeat.requestId, heartbeat.fractionDone * 100, heartbeat.partialSum,
+        heartbeat.evaluationsPerSecond);
+    // One that turned its last chunk down may have room again
+    if ( workers->outstandingChunks[ worker] == 0)
+      topUpWorkerOrDie( dispatch, worker, delta);
+    return true;
+  }
+
+  if ( header.type == MESSAGE_ESTIMATE && header.length == sizeof( Estimate))
+  {
+    Estimate estimate;
+    memcpy( &estimate, payload, sizeof( estimate));
+    int chunk = estimate.requestId - dispatch->firstRequestId;
+    if ( estimate.requestId < 0 || chunk >= dispatch->schedule.numberOfChunks)
+      return false;
+    if ( chunk >= 0)  // else it is late, for an earlier request
+      receiveEstimate( dispatch, &estimate);
+    return true;
+  }
+
+  if ( header.type == MESSAGE_TRACE)
+    return receiveTraceRecords( dispatch, worker, &header, payload);
+
+  if ( header.type != MESSAGE_RESPONSE || header.length != sizeof( Response))
+    return false;
   Response response;
-  int recvStatus = recv( socket, &response, sizeof( response), 0);
-  if ( recvStatus != sizeof( response))
-    return -1;
-  *responseOut = response;
-  return 0;
+  memcpy( &response, payload, sizeof( response));
+  int chunkIndex = response.id - dispatch->firstRequestId;
+  if ( response.id < 0 || chunkIndex >= dispatch->schedule.numberOfChunks)
+    return false;
+  if ( chunkIndex < 0)
+  {
+    // Cancelled at the end of an earlier request; it still held a credit
+    if ( workers->outstandingChunks[ worker] > 0)
+    {
+      workers->outstandingChunks[ worker] --;
+      addToGauge( metrics.chunksInFlight, -1);
+    }
+    topUpWorkerOrDie( dispatch, worker, delta);
+    return true;
+  }
+  LOG_DEBUG( "Received response #%d from worker %s:%d\n    Result: %.10lf\n    Time: %.3lf ms\n",
+    response.id, inet_ntoa( workers->addresses[ worker].sin_addr), 
+    ntohs( workers->addresses[ worker].sin_port), response.result, response.timeElapsed);
+  const PerfCounts *perfCounts = &response.perfCounts;
+  if ( perfCounts->validCounters)
+  {
+    LOG_DEBUG( "    %.3lf instructions per cycle, %lu branch misses, %lu cache misses\n",
+      ( perfCounts->cycles > 0)? ( double) perfCounts->instructions / perfCounts->cycles : 0.0,
+      ( unsigned long) perfCounts->branchMisses, ( unsigned long) perfCounts->cacheMisses);
+    addToCounter( metrics.cycles, perfCounts->cycles);
+    addToCounter( metrics.instructions, perfCounts->instructions);
+    addToCounter( metrics.branchMisses, perfCounts->branchMisses);
+    addToCounter( metrics.cacheMisses, perfCounts->cacheMisses);
+    if ( dispatch->parent)
+      addPerfCounts( &dispatch->parent->perfCounts, perfCounts);
+  }
+
+  Chunk *chunk = &dispatch->chunks[ chunkIndex];
+  ScheduledChunk *scheduled = &dispatch->schedule.chunks[ chunkIndex];
+  bool isHolder = scheduled->worker == worker || scheduled->speculativeWorker == worker;
+  if ( isHolder)
+  {
+    uint64_t sentNs = ( chunk->sentWorker == worker)? chunk->sentNs : chunk->speculativeSentNs;
+    estimateClockOffset( workers, worker, sentNs, &response);
+    if ( response.status != RESPONSE_REJECTED)
+      recordHistogramNs( metrics.dispatchToResult, traceNowNs() - sentNs);
+    workers->outstandingChunks[ worker] --;
+    addToGauge( metrics.chunksInFlight, -1);
+  }
+  if ( response.status == RESPONSE_REJECTED)
+  {
+    if ( isHolder)
+      receiveRejection( dispatch, worker, chunkIndex, delta);
+    return true;
+  }
+  if ( response.status != RESPONSE_OK)
+    addToCounter( metrics.chunksStopped, 1);
+  // In progressive mode the server settles for the best estimate at the deadline
+  if ( response.status == RESPONSE_DEADLINE_EXCEEDED && !dispatch->isProgressive)
+    dispatch->status = RESPONSE_DEADLINE_EXCEEDED;
+  int otherWorker;
+  if ( response.status == RESPONSE_OK &&
+       completeChunk( &dispatch->schedule, chunkIndex, worker, &otherWorker))
+  {
+    chunk->result = response.result;
+    addToCounter( metrics.chunksDone, 1);
+    if ( delta > 0)
+      addToCounter( metrics.evaluations, 
+        2 * ( uint64_t) ( ( scheduled->interval.end - scheduled->interval.start) / delta));
+    if ( dispatch->isProgressive)
+      setChunkEstimate( dispatch, chunkIndex, response.result, 
+        ( chunk->hasEstimate)? chunk->errorBound : 0.0,
+        ( chunk->hasEstimate)? chunk->estimateDelta : delta);
+
+    // The other copy, if any, is of no use any more
+    if ( otherWorker >= 0 && workers->isAlive[ otherWorker])
+    {
+      LOG_DEBUG( "Cancelling request #%d on worker %s:%d\n", response.id,
+        inet_ntoa( workers->addresses[ otherWorker].sin_addr),
+        ntohs( workers->addresses[ otherWorker].sin_port));
+      if ( sendCancel( dispatch->shards, workers, otherWorker, response.id))
+        LOG_ERROR( "Error when sending a cancel to a worker\n");
+    }
+  }
+  topUpWorkerOrDie( dispatch, worker, delta);
+  return true;
 }
 
-static int recvBenchmark( int socket, Benchmark *benchmarkOut)
+static double reportProgress( Dispatch *dispatch, double startMs)
 {
-  Benchmark benchmark;
-  int recvStatus = recv( socket, &benchmark, sizeof( benchmark), 0);
-  if ( recvStatus != sizeof( benchmark))
-    return recvStatus;
-  *benchmarkOut = benchmark;
-  return 0;
+  const Schedule *schedule = &dispatch->schedule;
+  double fractionDone = scheduleFractionDone( schedule);
+  setGauge( metrics.queuedChunks, schedule->numberOfRetryChunks +
+    ( ( schedule->isStatic)? 0 : schedule->numberOfChunks - schedule->nextChunk));
+  if ( fractionDone > 0)
+    LOG( "Progress: %.1lf%%, about %.1lf s left\n", fractionDone * 100,
+      ( nowMs() - startMs) / 1000.0 * ( 1 - fractionDone) / fractionDone);
+  else
+    LOG( "Progress: 0%%\n");
+  return fractionDone;
 }
 
-static int sendRequest( int socket, Request request)
+static void sendHeartbeatToParent( Dispatch *dispatch, double fractionDone, double startMs,
+  double delta)
 {
-  int sendStatus = send( socket, &request, sizeof( request), MSG_NOSIGNAL);
-  if ( sendStatus != sizeof( request))
-    return sendStatus;
-  return 0;
+  Heartbeat heartbeat;
+  heartbeat.requestId = dispatch->parent->requestId;
+  heartbeat.fractionDone = fractionDone;
+  heartbeat.partialSum = 0.0;
+  for ( int i = 0; i < dispatch->schedule.numberOfChunks; ++i)
+  {
+    if ( dispatch->schedule.chunks[ i].isDone)
+      heartbeat.partialSum += dispatch->chunks[ i].result;
+  }
+  double elapsedSeconds = ( nowMs() - startMs) / 1000.0;
+  heartbeat.evaluationsPerSecond = ( elapsedSeconds > 0)? 
+    fractionDone * dispatch->totalLength / delta / elapsedSeconds : 0.0;
+  if ( !sendMessage( &dispatch->parent->transport, MESSAGE_HEARTBEAT, &heartbeat, sizeof( heartbeat)))
+    LOG_ERROR( "Error when sending a heartbeat to the parent\n");
 }
 
-static void populateWorkerPool( int serverSocket, int maxNumberOfWorkers, int workerSocketsOut[], 
-  struct sockaddr_in workerAddressesOut[], int *numberOfWorkersOut)
+// A cancel for the request in progress, or the parent going away
+static void receiveFromParent( Dispatch *dispatch)
 {
-  int numberOfWorkers = 0;
-  while ( numberOfWorkers < maxNumberOfWorkers)
+  Parent *parent = dispatch->parent;
+  MessageHeader header;
+  char payload[ MAX_MESSAGE_LENGTH];
+  if ( !recvMessage( &parent->transport, &header, payload) || header.type == MESSAGE_DONE)
   {
-    int workerSocket;
-    struct sockaddr_in workerAddress;
-    if ( acceptWorker( serverSocket, &workerSocket, &workerAddress))
+    LOG( "The parent has closed the connection\n");
+    parent->isGone = true;
+    dispatch->status = RESPONSE_CANCELLED;
+    return;
+  }
+  if ( header.type == MESSAGE_CANCEL && header.length == sizeof( Cancel))
+  {
+    Cancel cancel;
+    memcpy( &cancel, payload, sizeof( cancel));
+    if ( cancel.requestId == parent->requestId)
     {
-      if ( errno == EWOULDBLOCK)  // timeout
-        break;
-      LOG( "Error when connecting to worker %s:%d\n", 
-        inet_ntoa( workerAddress.sin_addr),
-        ntohs( workerAddress.sin_port));
-    } 
-    LOG( "Connected to worker %s:%d\n", 
-      inet_ntoa( workerAddress.sin_addr),
-      ntohs( workerAddress.sin_port));
-    workerSocketsOut[ numberOfWorkers] = workerSocket;
-    workerAddressesOut[ numberOfWorkers] = workerAddress;
-    numberOfWorkers ++;
+      LOG( "The parent cancelled request #%d\n", cancel.requestId);
+      dispatch->status = RESPONSE_CANCELLED;
+    }
+    return;
+  }
+  // The pool is advertised with a single credit, so nothing else is expected
+  LOG_WARN( "Unexpected message of type %d from the parent\n", header.type);
+}
+
+// Stops whatever the workers are still computing for us
+static void cancelOutstanding( Dispatch *dispatch)
+{
+  WorkerTable *workers = dispatch->workers;
+  for ( int i = 0; i < dispatch->schedule.numberOfChunks; ++i)
+  {
+    ScheduledChunk *chunk = &dispatch->schedule.chunks[ i];
+    if ( chunk->isDone)
+      continue;
+    int requestId = dispatch->firstRequestId + i;
+    if ( chunk->worker >= 0 && workers->isAlive[ chunk->worker])
+      sendCancel( dispatch->shards, workers, chunk->worker, requestId);
+    if ( chunk->speculativeWorker >= 0 && workers->isAlive[ chunk->speculativeWorker])
+      sendCancel( dispatch->shards, workers, chunk->speculativeWorker, requestId);
   }
+}
 
-  *numberOfWorkersOut = numberOfWorkers;
+static bool isEstimateGoodEnough( const Dispatch *dispatch)
+{
+  return dispatch->hasEstimate && dispatch->tolerance > 0 && 
+    dispatch->errorBound <= dispatch->tolerance;
 }
 
-static void receiveBenchmarksOrDie( int workerSockets[], struct sockaddr_in workerAddresses[], 
-  int numberOfWorkers, Benchmark benchmarksOut[])
+// What came from the workers since the last time, through the I/O threads
+static void receiveFromShards( Dispatch *dispatch)
 {
-  for ( int i = 0; i < numberOfWorkers; ++i)
+  WorkerTable *workers = dispatch->workers;
+  ShardItem item;
+  clearShardsWakeup( dispatch->shards);
+  while ( takeShardItem( dispatch->shards, &item))
   {
-    Benchmark benchmark;
-    if ( recvBenchmark( workerSockets[ i], &benchmark))
-      printErrorAndDie( "Error: can't receive benchmark from a worker");
-    LOG( "Received benchmark from %s:%d:\n    %.12lf ms\n", 
-      inet_ntoa( workerAddresses[ i].sin_addr),
-      ntohs( workerAddresses[ i].sin_port),
-      benchmark.timeMs);
-    benchmarksOut[ i] = benchmark;
+    int worker = item.worker;
+    if ( !workers->isAlive[ worker])
+      continue;  // sent before it was dropped
+    if ( item.kind == SHARD_MESSAGE)
+      addToCounter( metrics.bytesReceived, sizeof( MessageHeader) + item.header.length);
+    if ( item.kind != SHARD_MESSAGE ||
+         !handleWorkerMessage( dispatch, worker, &item.header, item.payload, dispatch->delta))
+      failWorkerOrDie( dispatch, worker, dispatch->delta);
   }
 }
 
-static void sendRequestsOrDie( int numberOfWorkers, Interval workerIntervals[], 
-  int workerSockets[], struct sockaddr_in workerAddresses[], double delta)
+static void onGatherEvent( void *context, const IoEvent *event)
+{
+  Dispatch *dispatch = ( Dispatch*) context;
+  if ( dispatch->parent && event->fd == dispatch->parent->transport.socket)
+    receiveFromParent( dispatch);
+  else if ( event->fd == dispatch->shards->wakeFd)
+    receiveFromShards( dispatch);
+}
+
+// Returns RESPONSE_OK, or why it stopped early
+static int gatherResultsOrDie( const Args *args, Dispatch *dispatch, double *answerOut)
 {
-  for ( int i = 0; i < numberOfWorkers; ++i)
+  WorkerTable *workers = dispatch->workers;
+  int numberOfWorkers = workers->numberOfWorkers;
+  if ( dispatch->parent && !watchReadable( dispatch->engine, dispatch->parent->transport.socket))
+    printErrorAndDie( "Error when watching the parent");
+
+  double startMs = nowMs();
+  double lastReportMs = startMs;
+  double workerTimeoutMs = args->workerTimeoutSeconds * 1000.0;
+  while ( dispatch->schedule.numberOfChunksDone < dispatch->schedule.numberOfChunks && 
+          dispatch->status == RESPONSE_OK && !isEstimateGoodEnough( dispatch))
   {
-    Request request;
-    request.startPoint = workerIntervals[ i].start;
-    request.endPoint = workerIntervals[ i].end;
-    request.delta = delta;
-    if ( sendRequest( workerSockets[ i], request))
-      printErrorAndDie( "Error: can't send request to a worker");
-    LOG( "Sent request to worker %s:%d\n", 
-      inet_ntoa( workerAddresses[ i].sin_addr),
-      ntohs( workerAddresses[ i].sin_port));
+    wakeWorkerShards( dispatch->shards);
+    if ( pollIoEngine( dispatch->engine, LIVENESS_CHECK_INTERVAL_MS, onGatherEvent, dispatch) < 0)
+      printErrorAndDie( "Error when waiting for the workers");
+
+    double now = nowMs();
+    if ( dispatch->deadlineMs > 0 && now >= dispatch->deadlineMs)
+    {
+      if ( !dispatch->hasEstimate)
+        dispatch->status = RESPONSE_DEADLINE_EXCEEDED;
+      else
+        LOG( "Deadline reached, settling for the current estimate\n");
+      break;
+    }
+    for ( int i = 0; i < numberOfWorkers; ++i)
+    {
+      if ( workers->isAlive[ i] && now - workers->lastHeardMs[ i] > workerTimeoutMs)
+        failWorkerOrDie( dispatch, i, args->delta);
+    }
+    if ( now - lastReportMs >= PROGRESS_REPORT_INTERVAL_MS)
+    {
+      double fractionDone = reportProgress( dispatch, startMs);
+      if ( dispatch->parent)
+        sendHeartbeatToParent( dispatch, fractionDone, startMs, args->delta);
+      lastReportMs = now;
+    }
+  }
+  if ( dispatch->parent)
+    unwatchFd( dispatch->engine, dispatch->parent->transport.socket);
+  dispatch->isFinished = true;
+  if ( dispatch->schedule.numberOfChunksDone < dispatch->schedule.numberOfChunks)
+    cancelOutstanding( dispatch);
+  wakeWorkerShards( dispatch->shards);
+
+  // Summing in chunk order keeps the answer independent of arrival order
+  double answer = 0.0f;
+  for ( int i = 0; i < dispatch->schedule.numberOfChunks; ++i)
+    answer += ( dispatch->isProgressive)? dispatch->chunks[ i].estimate : dispatch->chunks[ i].result;
+  *answerOut = answer;
+  return dispatch->status;
+}
+
+// Asks every worker for its spans since the job started, waits for
+// them (up to TRACE_TIMEOUT_MS, handling whatever else comes in the
+// meantime) and writes the job's trace file
+static void writeJobTrace( const Args *args, Dispatch *dispatch, uint64_t jobStartNs)
+{
+  WorkerTable *workers = dispatch->workers;
+  JobTrace trace;
+  if ( !initJobTrace( &trace, workers->numberOfWorkers, jobStartNs))
+  {
+    LOG_WARN( "Out of memory for the trace\n");
+    return;
+  }
+  dispatch->trace = &trace;
+  for ( int i = 0; i < workers->numberOfWorkers; ++i)
+  {
+    if ( !workers->isAlive[ i])
+      continue;
+    TraceQuery query;
+    query.sinceNs = jobStartNs + workers->clockOffsetNs[ i];
+    if ( !sendToWorker( dispatch->shards, workers, i, MESSAGE_TRACE, &query, sizeof( query)))
+      trace.isWorkerDone[ i] = true;
   }
+  double endMs = nowMs() + TRACE_TIMEOUT_MS;
+  while ( !isJobTraceComplete( &trace, workers) && nowMs() < endMs)
+  {
+    wakeWorkerShards( dispatch->shards);
+    if ( pollIoEngine( dispatch->engine, ( int) ( endMs - nowMs()) + 1, onGatherEvent, dispatch) < 0)
+      printErrorAndDie( "Error when waiting for the workers");
+  }
+  dispatch->trace = NULL;
+  if ( !isJobTraceComplete( &trace, workers))
+    LOG_WARN( "Some workers haven't sent their trace in time\n");
+
+  char path[ 4096];
+  if ( dispatch->parent)
+    snprintf( path, sizeof( path), "%s.%d", args->tracePath, dispatch->parent->requestId);
+  else
+    snprintf( path, sizeof( path), "%s", args->tracePath);
+  if ( !addServerSpans( &trace) || !writeChromeTrace( &trace, workers, path))
+    LOG_ERROR( "Error when writing the trace to %s: %s\n", path, strerror( errno));
+  else
+    LOG( "Wrote %d trace span(s) to %s\n", trace.numberOfRecords, path);
+  destroyJobTrace( &trace);
+}
 
+// Splits args->interval across the pool and gathers the results;
+// returns RESPONSE_OK, or why it stopped early
+static int computeOrDie( const Args *args, IoEngine *engine, WorkerShards *shards,
+  WorkerTable *workers, Parent *parent, int *nextRequestIdInOut, double *answerOut)
+{
+  uint64_t jobStartNs = traceNowNs();
+  computeIntervalsForWorkers( args->useLoadBalancing, workers->benchmarks,
+    workers->numberOfWorkers, args->interval, workers->intervals);
+  Dispatch dispatch;
+  initDispatchOrDie( args, engine, shards, workers, parent, *nextRequestIdInOut, &dispatch);
+  traceSpan( "partition", jobStartNs, dispatch.firstRequestId);
+
+  uint64_t dispatchStartNs = traceNowNs();
+  *nextRequestIdInOut += dispatch.schedule.numberOfChunks;
+  for ( int i = 0; i < workers->numberOfWorkers; ++i)
+    topUpWorkerOrDie( &dispatch, i, args->delta);
+  traceSpan( "dispatch", dispatchStartNs, dispatch.firstRequestId);
   LOG( "All requests are sent; now waiting for responses...\n");
+
+  uint64_t gatherStartNs = traceNowNs();
+  int status = gatherResultsOrDie( args, &dispatch, answerOut);
+  traceSpan( "gather", gatherStartNs, dispatch.firstRequestId);
+  addToCounter( metrics.jobs, 1);
+  setGauge( metrics.queuedChunks, 0);
+  if ( args->tracePath)
+    writeJobTrace( args, &dispatch, jobStartNs);
+  destroyDispatch( &dispatch);
+  return status;
 }
 
-static void gatherResultsOrDie( int numberOfWorkers, int workerSockets[], 
-  struct sockaddr_in workerAddresses[], double *answerOut)
+// The I/O threads send the messages out before they close the sockets
+static void releaseWorkers( WorkerShards *shards, WorkerTable *workers)
 {
-  double answer = 0.0f;
-  for ( int i = 0; i < numberOfWorkers; ++i)
+  for ( int i = 0; i < workers->numberOfWorkers; ++i)
+  {
+    if ( !workers->isAlive[ i])
+      continue;
+    sendToWorker( shards, workers, i, MESSAGE_DONE, NULL, 0);
+    retireWorker( workers, i);
+    postDropWorker( shards, i);
+  }
+  wakeWorkerShards( shards);
+  setGauge( metrics.connectedWorkers, 0);
+}
+
+// The pool as one big worker: throughputs and cores add up, and
+// the parent sends one request at a time, which is split further
+static void summarizePool( const WorkerTable *workers, Benchmark *benchmarkOut)
+{
+  Benchmark summary;
+  memset( &summary, 0, sizeof( summary));
+  double throughput = 0.0;
+  bool isFirst = true;
+  for ( int i = 0; i < workers->numberOfWorkers; ++i)
+  {
+    if ( !workers->isAlive[ i])
+      continue;
+    const Benchmark *benchmark = &workers->benchmarks[ i];
+    throughput += estimateWorkerThroughput( benchmark);
+    summary.numberOfCores += benchmark->numberOfCores;
+    summary.numberOfThreads += benchmark->numberOfThreads;
+    summary.numberOfNumaNodes += benchmark->numberOfNumaNodes;
+    summary.numberOfPhysicalCores += benchmark->numberOfPhysicalCores;
+    summary.numberOfAllowedCpus += benchmark->numberOfAllowedCpus;
+    if ( isFirst || benchmark->simdLevel < summary.simdLevel)
+      summary.simdLevel = benchmark->simdLevel;
+    if ( isFirst)
+    {
+      summary.delta = benchmark->delta;
+      summary.threadsPerCore = benchmark->threadsPerCore;
+      summary.l1CacheBytes = benchmark->l1CacheBytes;
+      summary.l2CacheBytes = benchmark->l2CacheBytes;
+      summary.l3CacheBytes = benchmark->l3CacheBytes;
+    }
+    isFirst = false;
+  }
+  summary.timeMs = ( throughput > 0)? 1.0 / ( throughput * summary.delta) : 0.0;
+  summary.numberOfThroughputPoints = 1;
+  summary.throughputThreads[ 0] = summary.numberOfThreads;
+  summary.throughput[ 0] = throughput;
+  summary.credits = 1;
+  *benchmarkOut = summary;
+}
+
+// Like a registering worker, keeps trying while the parent is not up yet
+static Transport connectToParent( const struct sockaddr_in *parentAddress)
+{
+  int retryMs = MIN_PARENT_RETRY_MS;
+  while ( true)
+  {
+    Transport transport;
+    if ( connectTransport( ( const struct sockaddr*) parentAddress, sizeof( *parentAddress),
+           false, &transport))
+      return transport;
+    LOG_WARN( "Can't connect to the parent (%s), retrying in %d ms\n", strerror( errno), retryMs);
+    usleep( retryMs * 1000);
+    retryMs *= 2;
+    if ( retryMs > MAX_PARENT_RETRY_MS)
+      retryMs = MAX_PARENT_RETRY_MS;
+  }
+}
+
+struct ParentTrace
+{
+  Parent *parent;
+  uint64_t sinceNs;
+  TraceRecord records[ MAX_TRACE_RECORDS];
+  int numberOfRecords;
+};
+typedef struct ParentTrace ParentTrace;
+
+static void flushParentTrace( ParentTrace *parentTrace)
+{
+  if ( !sendMessage( &parentTrace->parent->transport, MESSAGE_TRACE, parentTrace->records,
+         parentTrace->numberOfRecords * sizeof( TraceRecord)))
+    LOG_ERROR( "Error when sending the trace to the parent\n");
+  parentTrace->numberOfRecords = 0;
+}
+
+static void addParentTraceRecord( void *context, const TraceSpan *span)
+{
+  ParentTrace *parentTrace = ( ParentTrace*) context;
+  if ( span->endNs < parentTrace->sinceNs)
+    return;
+  makeTraceRecord( span, &parentTrace->records[ parentTrace->numberOfRecords ++]);
+  if ( parentTrace->numberOfRecords == MAX_TRACE_RECORDS)
+    flushParentTrace( parentTrace);
+}
+
+// Like a worker: the spans in batches, then an empty batch
+static void sendTraceToParent( Parent *parent, const TraceQuery *query)
+{
+  static ParentTrace parentTrace;
+  parentTrace.parent = parent;
+  parentTrace.sinceNs = query->sinceNs;
+  parentTrace.numberOfRecords = 0;
+  visitTraceSpans( addParentTraceRecord, &parentTrace);
+  if ( parentTrace.numberOfRecords > 0)
+    flushParentTrace( &parentTrace);
+  flushParentTrace( &parentTrace);
+}
+
+// What the scheduler watches between the parent's requests
+struct ParentWait
+{
+  WorkerTable *workers;
+  WorkerShards *shards;
+  int parentSocket;
+  bool isParentReadable;
+};
+typedef struct ParentWait ParentWait;
+
+// Idle workers only send heartbeats, and responses to the requests
+// cancelled at the end of the last one, which still held a credit
+static void receiveWhileIdle( ParentWait *wait)
+{
+  WorkerTable *workers = wait->workers;
+  ShardItem item;
+  clearShardsWakeup( wait->shards);
+  while ( takeShardItem( wait->shards, &item))
+  {
+    int worker = item.worker;
+    if ( !workers->isAlive[ worker])
+      continue;
+    if ( item.kind != SHARD_MESSAGE)
+    {
+      LOG_WARN( "Lost worker %s:%d\n", inet_ntoa( workers->addresses[ worker].sin_addr),
+        ntohs( workers->addresses[ worker].sin_port));
+      retireLostWorkerOrDie( workers, wait->shards, worker);
+      continue;
+    }
+    addToCounter( metrics.bytesReceived, sizeof( MessageHeader) + item.header.length);
+    workers->lastHeardMs[ worker] = nowMs();
+    if ( item.header.type == MESSAGE_RESPONSE && workers->outstandingChunks[ worker] > 0)
+    {
+      workers->outstandingChunks[ worker] --;
+      addToGauge( metrics.chunksInFlight, -1);
+    }
+  }
+}
+
+static void onParentWaitEvent( void *context, const IoEvent *event)
+{
+  ParentWait *wait = ( ParentWait*) context;
+  if ( event->fd == wait->parentSocket)
+    wait->isParentReadable = true;
+  else if ( event->fd == wait->shards->wakeFd)
+    receiveWhileIdle( wait);
+}
+
+// Until the parent sends something: heartbeats go up to it, and the
+// pool is kept draining its messages and checked for silent workers
+static void waitForParentOrDie( const Args *args, IoEngine *engine, WorkerShards *shards,
+  WorkerTable *workers, Parent *parent)
+{
+  ParentWait wait;
+  wait.workers = workers;
+  wait.shards = shards;
+  wait.parentSocket = parent->transport.socket;
+  wait.isParentReadable = false;
+  if ( !watchReadable( engine, wait.parentSocket))
+    printErrorAndDie( "Error when watching the parent");
+
+  double workerTimeoutMs = args->workerTimeoutSeconds * 1000.0;
+  double lastHeartbeatMs = nowMs();
+  double lastCheckMs = lastHeartbeatMs;
+  while ( !wait.isParentReadable)
   {
+    wakeWorkerShards( shards);
+    if ( pollIoEngine( engine, LIVENESS_CHECK_INTERVAL_MS, onParentWaitEvent, &wait) < 0)
+      printErrorAndDie( "Error when waiting for the parent");
+
+    double now = nowMs();
+    if ( now - lastCheckMs >= LIVENESS_CHECK_INTERVAL_MS)
+    {
+      for ( int i = 0; i < workers->numberOfWorkers; ++i)
+      {
+        if ( workers->isAlive[ i] && now - workers->lastHeardMs[ i] > workerTimeoutMs)
+        {
+          LOG_WARN( "Lost worker %s:%d\n", inet_ntoa( workers->addresses[ i].sin_addr),
+            ntohs( workers->addresses[ i].sin_port));
+          retireLostWorkerOrDie( workers, shards, i);
+        }
+      }
+      lastCheckMs = now;
+    }
+    // Stay alive for the parent while it has nothing for us
+    if ( now - lastHeartbeatMs >= PARENT_HEARTBEAT_INTERVAL_MS)
+    {
+      Heartbeat heartbeat;
+      memset( &heartbeat, 0, sizeof( heartbeat));
+      heartbeat.requestId = -1;
+      sendMessage( &parent->transport, MESSAGE_HEARTBEAT, &heartbeat, sizeof( heartbeat));
+      lastHeartbeatMs = now;
+    }
+  }
+  unwatchFd( engine, wait.parentSocket);
+  wakeWorkerShards( shards);
+}
+
+// Registers with the parent and computes its requests on the pool
+// until the parent is done
+static void serveParentOrDie( const Args *args, IoEngine *engine, WorkerShards *shards,
+  WorkerTable *workers)
+{
+  Parent parent;
+  parent.requestId = -1;
+  parent.isGone = false;
+  parent.transport = connectToParent( &args->parentAddress);
+  LOG( "Connected to the parent %s:%d\n", inet_ntoa( args->parentAddress.sin_addr),
+    ntohs( args->parentAddress.sin_port));
+
+  Benchmark benchmark;
+  summarizePool( workers, &benchmark);
+  if ( !sendMessage( &parent.transport, MESSAGE_BENCHMARK, &benchmark, sizeof( benchmark)))
+    printErrorAndDie( "Error: can't send the benchmark to the parent");
+  LOG( "Advertised %d thread(s), %.0lf steps/ms to the parent\n", 
+    benchmark.numberOfThreads, benchmark.throughput[ 0]);
+
+  // Nothing was read from the workers while connecting
+  double now = nowMs();
+  for ( int i = 0; i < workers->numberOfWorkers; ++i)
+    workers->lastHeardMs[ i] = now;
+
+  int nextRequestId = 0;
+  while ( !parent.isGone)
+  {
+    waitForParentOrDie( args, engine, shards, workers, &parent);
+    MessageHeader header;
+    char payload[ MAX_MESSAGE_LENGTH];
+    if ( !recvMessage( &parent.transport, &header, payload) || header.type == MESSAGE_DONE)
+      break;
+    if ( header.type == MESSAGE_CANCEL)  // for a request already answered
+      continue;
+    if ( header.type == MESSAGE_TRACE && header.length == sizeof( TraceQuery))
+    {
+      TraceQuery query;
+      memcpy( &query, payload, sizeof( query));
+      sendTraceToParent( &parent, &query);
+      continue;
+    }
+    if ( header.type != MESSAGE_REQUEST || header.length != sizeof( Request))
+    {
+      LOG_WARN( "Unexpected message of type %d from the parent\n", header.type);
+      continue;
+    }
+    Request request;
+    memcpy( &request, payload, sizeof( request));
+    LOG_DEBUG( "Received request #%d from the parent: [%.8lf, %.8lf], delta = %.16lf\n",
+      request.id, request.startPoint, request.endPoint, request.delta);
+
+    Args requestArgs = *args;
+    requestArgs.interval.start = request.startPoint;
+    requestArgs.interval.end = request.endPoint;
+    requestArgs.delta = request.delta;
+    requestArgs.deadlineSeconds = ( request.deadlineMs > 0)? request.deadlineMs / 1000.0 : 0.0;
+    requestArgs.isProgressive = request.isProgressive;
+    requestArgs.tolerance = request.tolerance;
+    parent.requestId = request.id;
+
+    double startMs = nowMs();
     Response response;
-    if ( recvResponse( workerSockets[ i], &response))
-      printErrorAndDie( "Error: can't get response from a worker");
-    LOG( "Received response from worker %s:%d\n    Result: %.10lf\n    Time: %.3lf ms\n",
-      inet_ntoa( workerAddresses[ i].sin_addr), ntohs( workerAddresses[ i].sin_port), 
-      response.result, response.timeElapsed);
-    answer += response.result;
-    close( workerSockets[ i]);
+    response.receivedNs = traceNowNs();
+    response.id = request.id;
+    memset( &parent.perfCounts, 0, sizeof( parent.perfCounts));
+    response.status = computeOrDie( &requestArgs, engine, shards, workers, &parent, &nextRequestId, 
+      &response.result);
+    response.timeElapsed = nowMs() - startMs;
+    response.perfCounts = parent.perfCounts;
+    parent.requestId = -1;
+    if ( parent.isGone)
+      break;
+    LOG_DEBUG( "Sending response #%d to the parent: %.10lf\n", response.id, response.result);
+    response.sentNs = traceNowNs();
+    if ( !sendMessage( &parent.transport, MESSAGE_RESPONSE, &response, sizeof( response)))
+      break;
   }
-  *answerOut = answer;
+  LOG( "The parent is done\n");
+  closeTransport( &parent.transport);
 }
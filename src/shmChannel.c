@@ -0,0 +1,239 @@
+
+/*
+  shmChannel.c
+
+  Shared-memory transport between a server and a worker on the
+  same host. The worker creates a memfd with two rings and two
+  eventfds, and passes them to the server over the Unix socket it
+  registered through (SCM_RIGHTS); from then on messages are copied
+  into the rings instead of going through the socket, which only
+  tells either side when the other one goes away.
+
+  A writer signals the eventfd only when the reader may have found
+  the ring empty, so a busy reader is not woken up for every message.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include "shmChannel.h"
+
+#define NUMBER_OF_CHANNEL_FDS 3  // the memfd, then the server -> worker and worker -> server eventfds
+
+static bool mapChannel( ShmChannel *channel, bool isServer)
+{
+  size_t size = 2 * sizeof( ShmRing);
+  channel->memory = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, channel->memoryFd, 0);
+  if ( channel->memory == MAP_FAILED)
+  {
+    channel->memory = NULL;
+    return false;
+  }
+  ShmRing *toWorker = ( ShmRing*) channel->memory;
+  ShmRing *toServer = toWorker + 1;
+  channel->inbound = ( isServer)? toServer : toWorker;
+  channel->outbound = ( isServer)? toWorker : toServer;
+  return true;
+}
+
+bool createShmChannel( ShmChannel *channel)
+{
+  memset( channel, 0, sizeof( *channel));
+  channel->inboundFd = channel->outboundFd = -1;
+  channel->memoryFd = memfd_create( "distributed-integral", MFD_CLOEXEC);
+  if ( channel->memoryFd < 0 || ftruncate( channel->memoryFd, 2 * sizeof( ShmRing)) < 0 ||
+       !mapChannel( channel, false))
+  {
+    destroyShmChannel( channel);
+    return false;
+  }
+  channel->inboundFd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC);
+  channel->outboundFd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if ( channel->inboundFd < 0 || channel->outboundFd < 0)
+  {
+    destroyShmChannel( channel);
+    return false;
+  }
+  return true;
+}
+
+void destroyShmChannel( ShmChannel *channel)
+{
+  if ( channel->memory)
+    munmap( channel->memory, 2 * sizeof( ShmRing));
+  if ( channel->memoryFd >= 0)
+    close( channel->memoryFd);
+  if ( channel->inboundFd >= 0)
+    close( channel->inboundFd);
+  if ( channel->outboundFd >= 0)
+    close( channel->outboundFd);
+  memset( channel, 0, sizeof( *channel));
+  channel->memoryFd = channel->inboundFd = channel->outboundFd = -1;
+}
+
+bool sendShmChannel( int socket, const ShmChannel *channel)
+{
+  MessageHeader header;
+  header.type = MESSAGE_CHANNEL;
+  header.length = 0;
+  struct iovec iov;
+  iov.iov_base = &header;
+  iov.iov_len = sizeof( header);
+
+  int fds[ NUMBER_OF_CHANNEL_FDS] = { channel->memoryFd, channel->inboundFd, channel->outboundFd };
+  char control[ CMSG_SPACE( sizeof( fds))];
+  memset( control, 0, sizeof( control));
+  struct msghdr message;
+  memset( &message, 0, sizeof( message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof( control);
+  struct cmsghdr *controlMessage = CMSG_FIRSTHDR( &message);
+  controlMessage->cmsg_level = SOL_SOCKET;
+  controlMessage->cmsg_type = SCM_RIGHTS;
+  controlMessage->cmsg_len = CMSG_LEN( sizeof( fds));
+  memcpy( CMSG_DATA( controlMessage), fds, sizeof( fds));
+
+  return sendmsg( socket, &message, MSG_NOSIGNAL) == sizeof( header);
+}
+
+bool recvShmChannel( int socket, ShmChannel *channelOut, bool *hasChannelOut)
+{
+  MessageHeader header;
+  struct iovec iov;
+  iov.iov_base = &header;
+  iov.iov_len = sizeof( header);
+  int fds[ NUMBER_OF_CHANNEL_FDS];
+  char control[ CMSG_SPACE( sizeof( fds))];
+  struct msghdr message;
+  memset( &message, 0, sizeof( message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof( control);
+  if ( recvmsg( socket, &message, MSG_WAITALL | MSG_CMSG_CLOEXEC) != sizeof( header) ||
+       header.type != MESSAGE_CHANNEL || header.length != 0)
+    return false;
+
+  *hasChannelOut = false;
+  struct cmsghdr *controlMessage = CMSG_FIRSTHDR( &message);
+  if ( !controlMessage)
+    return true;  // the worker stays on the socket
+  if ( controlMessage->cmsg_level != SOL_SOCKET || controlMessage->cmsg_type != SCM_RIGHTS ||
+       controlMessage->cmsg_len != CMSG_LEN( sizeof( fds)))
+    return false;
+  memcpy( fds, CMSG_DATA( controlMessage), sizeof( fds));
+
+  ShmChannel channel;
+  channel.memoryFd = fds[ 0];
+  channel.outboundFd = fds[ 1];
+  channel.inboundFd = fds[ 2];
+  if ( !mapChannel( &channel, true))
+  {
+    destroyShmChannel( &channel);
+    return false;
+  }
+  *channelOut = channel;
+  *hasChannelOut = true;
+  return true;
+}
+
+static void copyIntoRing( ShmRing *ring, uint64_t position, const void *bytes, size_t length)
+{
+  size_t offset = position % SHM_RING_BYTES;
+  size_t firstPart = ( length < SHM_RING_BYTES - offset)? length : SHM_RING_BYTES - offset;
+  memcpy( ring->data + offset, bytes, firstPart);
+  memcpy( ring->data, ( const char*) bytes + firstPart, length - firstPart);
+}
+
+static void copyOutOfRing( const ShmRing *ring, uint64_t position, void *bytes, size_t length)
+{
+  size_t offset = position % SHM_RING_BYTES;
+  size_t firstPart = ( length < SHM_RING_BYTES - offset)? length : SHM_RING_BYTES - offset;
+  memcpy( bytes, ring->data + offset, firstPart);
+  memcpy( ( char*) bytes + firstPart, ring->data, length - firstPart);
+}
+
+bool sendShmMessage( ShmChannel *channel, int type, const void *payload, int length)
+{
+  ShmRing *ring = channel->outbound;
+  uint64_t tail = ring->tail;  // only this side writes it
+  uint64_t head = __atomic_load_n( &ring->head, __ATOMIC_ACQUIRE);
+  size_t size = sizeof( MessageHeader) + length;
+  if ( SHM_RING_BYTES - ( tail - head) < size)
+    return false;
+
+  MessageHeader header;
+  header.type = type;
+  header.length = length;
+  copyIntoRing( ring, tail, &header, sizeof( header));
+  if ( length > 0)
+    copyIntoRing( ring, tail + sizeof( header), payload, length);
+  __atomic_store_n( &ring->tail, tail + size, __ATOMIC_SEQ_CST);
+
+  // Pairs with the reader storing head and then loading tail: 
+  // either it sees this message, or we see it has caught up
+  if ( __atomic_load_n( &ring->head, __ATOMIC_SEQ_CST) == tail)
+  {
+    uint64_t one = 1;
+    if ( write( channel->outboundFd, &one, sizeof( one)) < 0 && errno != EAGAIN)
+      return false;
+  }
+  return true;
+}
+
+int nextShmMessageSize( const ShmChannel *channel)
+{
+  const ShmRing *ring = channel->inbound;
+  uint64_t head = ring->head;  // only this side writes it
+  uint64_t tail = __atomic_load_n( &ring->tail, __ATOMIC_SEQ_CST);
+  if ( tail == head)
+    return 0;
+
+  // Messages are published whole
+  MessageHeader header;
+  if ( tail - head < sizeof( header))
+    return -1;
+  copyOutOfRing( ring, head, &header, sizeof( header));
+  if ( header.length < 0 || header.length > MAX_MESSAGE_LENGTH || 
+       tail - head < sizeof( header) + header.length)
+    return -1;
+  return sizeof( header) + header.length;
+}
+
+int recvShmMessage( ShmChannel *channel, MessageHeader *headerOut, void *payloadOut)
+{
+  int size = nextShmMessageSize( channel);
+  if ( size <= 0)
+    return size;
+  ShmRing *ring = channel->inbound;
+  uint64_t head = ring->head;
+  MessageHeader header;
+  copyOutOfRing( ring, head, &header, sizeof( header));
+  if ( header.length > 0)
+    copyOutOfRing( ring, head + sizeof( header), payloadOut, header.length);
+  __atomic_store_n( &ring->head, head + size, __ATOMIC_SEQ_CST);
+  *headerOut = header;
+  return 1;
+}
+
+bool hasShmMessage( const ShmChannel *channel)
+{
+  return __atomic_load_n( &channel->inbound->tail, __ATOMIC_SEQ_CST) != channel->inbound->head;
+}
+
+void clearShmWakeup( ShmChannel *channel)
+{
+  uint64_t counter;
+  // EAGAIN only means that no wakeup was pending
+  while ( read( channel->inboundFd, &counter, sizeof( counter)) < 0 && errno == EINTR)
+    ;
+}
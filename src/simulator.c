@@ -0,0 +1,761 @@
+
+/*
+  simulator.c
+
+  Usage:
+  simulator [-w <number of workers>] [-c <number of chunks>] [-p <credits>]
+            [-S] [-B 0|1] [-d <delta>]
+            [-s fixed:<speed>|uniform:<min>:<max>|lognormal:<median>:<sigma>|
+                bimodal:<fast>:<slow>:<fraction slow>]
+            [-b <benchmark error>] [-n <noise>] [-L <latency in ms>]
+            [-J <jitter in ms>] [-F <mean time between failures in s>]
+            [-t <failure detection in ms>] [-m <server time per message in us>]
+            [-r <seed>] [-l error|warn|info|debug]
+
+  Description
+
+  Discrete-event simulation of one job of the server, for trying
+  scheduling policies on pools far larger than there is hardware
+  for. The partitioning and every dispatch decision come from the
+  server's own code (see scheduling.c); only the workers and the
+  network are synthetic.
+
+  <number of workers> (1000 by default) workers compute [0, 1] with
+  <delta> (1e-11 by default). -c, -p, -S and -B mean what the
+  server's -c, the workers' -p, the server's -s and its <use load
+  balancing> mean: <number of chunks> pulled by the workers, or one
+  per worker sized by load balancing if 0 (the default); <credits>
+  chunks outstanding per worker (2 by default); speculative duplicates;
+  load balancing (on by default).
+
+  Each worker computes at a speed in steps per ms drawn from the
+  distribution given with -s (lognormal:200000:0.25 by default,
+  about what one core does on x * x), and benchmarks off by a
+  lognormal factor of sigma <benchmark error> (0.1 by default). Each
+  chunk takes its steps over the speed, times a lognormal factor of
+  sigma <noise> (0.05 by default). A worker computes its chunks one
+  after another, as the worker's compute thread does, and stops one
+  that is cancelled.
+
+  Every message takes <latency in ms> (0.1 by default) plus an
+  exponentially distributed <jitter in ms> (0.05 by default) to
+  arrive, and the server, which makes its decisions on a single
+  thread, spends <server time per message in us> (0.5 by default)
+  on every message it sends or receives. With -F, each worker fails
+  after an exponentially distributed time with that mean; the server
+  notices <failure detection in ms> later (10000 by default, its
+  worker timeout) and hands its chunks to the others. Heartbeats are
+  not simulated one by one: the progress the server sees is brought
+  up to date once per heartbeat interval, when a speculative
+  decision needs it.
+
+  The program writes one JSON document to the standard output: the
+  makespan, the ideal makespan (all the work over the total speed)
+  and their ratio, the utilization (the time the workers spent on
+  the results that were used, over workers times makespan) and the
+  time lost to copies whose result came second, to cancels and to
+  failures, and how long the simulation itself took. The same <seed>
+  gives the same pool and the same run.
+
+  A pool of 100k workers takes a fraction of a second in static mode,
+  and a couple of seconds pulling a million chunks, with speculative
+  duplicates or failures too: no decision of the scheduler walks all
+  the chunks or all the workers (see scheduling.c).
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "common.h"
+#include "scheduling.h"
+#include "trace.h"
+
+#define MAX_CREDITS 64
+#define HEARTBEAT_INTERVAL_MS 1000.0
+
+#define SPEED_FIXED 0
+#define SPEED_UNIFORM 1
+#define SPEED_LOGNORMAL 2
+#define SPEED_BIMODAL 3
+
+#define EVENT_REQUEST_ARRIVES 0   // at the worker
+#define EVENT_COMPUTE_DONE 1
+#define EVENT_RESPONSE_ARRIVES 2  // at the server
+#define EVENT_CANCEL_ARRIVES 3
+#define EVENT_WORKER_FAILS 4
+#define EVENT_FAILURE_DETECTED 5
+
+struct Args
+{
+  int numberOfWorkers;
+  int numberOfChunks;
+  int credits;
+  bool isSpeculative;
+  bool useLoadBalancing;
+  double delta;
+  int speedKind;
+  double speedParameters[ 3];
+  double benchmarkError;
+  double noise;
+  double latencyMs;
+  double jitterMs;
+  double meanTimeToFailureMs;  // 0 for no failures
+  double detectionMs;
+  double messageCostMs;
+  uint64_t seed;
+};
+typedef struct Args Args;
+
+struct Event
+{
+  double timeMs;
+  long sequence;  // ties go in the order the events were made
+  int type;
+  int worker;
+  int chunk;
+  int generation;  // of the worker's computation, for EVENT_COMPUTE_DONE
+  int status;      // of a response
+  double computeMs;  // the response's chunk took
+};
+typedef struct Event Event;
+
+// A binary heap of events, the earliest on top
+struct EventQueue
+{
+  Event *events;
+  long numberOfEvents;
+  long capacity;
+  long nextSequence;
+};
+typedef struct EventQueue EventQueue;
+
+struct SimulatedWorker
+{
+  double speed;  // steps per ms it really computes at
+  bool isFailed;
+  int *queue;    // chunks that arrived and wait, MAX_CREDITS of room
+  int queueStart;
+  int queueLength;
+  int runningChunk;  // -1 if idle
+  double runningStartMs;
+  double runningEndMs;
+  int generation;    // bumped when the running chunk is stopped
+};
+typedef struct SimulatedWorker SimulatedWorker;
+
+struct Simulation
+{
+  const Args *args;
+  EventQueue events;
+  SimulatedWorker *workers;
+  Schedule schedule;
+  double nowMs;
+  // The server's side
+  bool *isAlive;
+  int *outstandingChunks;
+  int numberOfAliveWorkers;
+  double serverFreeMs;  // its thread is busy until then
+  double progressUpdateMs;  // or -1 before the first update
+  int *progressChunks;  // room for a copy of the running chunks
+  // Results
+  double usefulMs;
+  double busyMs;
+  double cancelledMs;
+  double failedMs;
+  long numberOfDuplicates;
+  long numberOfCancels;
+  long numberOfFailures;
+  long numberOfEvents;
+};
+typedef struct Simulation Simulation;
+
+static uint64_t randomState;
+
+static void printUsageAndDie();
+static void printAndDie( const char *msg);
+static void parseArgumentsOrDie( int argc, char **argv, Args *argsOut);
+static void simulate( const Args *args);
+
+int main( int argc, char **argv)
+{
+  Args args;
+  parseArgumentsOrDie( argc, argv, &args);
+  randomState = args.seed;
+  simulate( &args);
+  return 0;
+}
+
+static void printUsageAndDie()
+{
+  flushLog();
+  fprintf( stderr, "Usage: simulator [-w <number of workers>] [-c <number of chunks>] [-p <credits>]\n"
+    "       [-S] [-B 0|1] [-d <delta>]\n"
+    "       [-s fixed:<speed>|uniform:<min>:<max>|lognormal:<median>:<sigma>|\n"
+    "           bimodal:<fast>:<slow>:<fraction slow>]\n"
+    "       [-b <benchmark error>] [-n <noise>] [-L <latency in ms>]\n"
+    "       [-J <jitter in ms>] [-F <mean time between failures in s>]\n"
+    "       [-t <failure detection in ms>] [-m <server time per message in us>]\n"
+    "       [-r <seed>] [-l error|warn|info|debug]\n");
+  exit( EXIT_FAILURE);
+}
+
+static void printAndDie( const char *msg)
+{
+  flushLog();
+  fprintf( stderr, "%s\n", msg);
+  exit( EXIT_FAILURE);
+}
+
+static bool parseSpeeds( const char *text, Args *argsOut)
+{
+  static const char *kinds[] = { "fixed", "uniform", "lognormal", "bimodal" };
+  static const int numberOfParameters[] = { 1, 2, 2, 3 };
+  for ( int kind = 0; kind < 4; ++kind)
+  {
+    size_t length = strlen( kinds[ kind]);
+    if ( strncmp( text, kinds[ kind], length) != 0 || text[ length] != ':')
+      continue;
+    const char *next = text + length;
+    for ( int i = 0; i < numberOfParameters[ kind]; ++i)
+    {
+      char *end;
+      if ( *next != ':')
+        return false;
+      argsOut->speedParameters[ i] = strtod( next + 1, &end);
+      if ( end == next + 1)
+        return false;
+      next = end;
+    }
+    argsOut->speedKind = kind;
+    return *next == '\0';
+  }
+  return false;
+}
+
+static void parseArgumentsOrDie( int argc, char **argv, Args *argsOut)
+{
+  argsOut->numberOfWorkers = 1000;
+  argsOut->numberOfChunks = 0;
+  argsOut->credits = 2;
+  argsOut->isSpeculative = false;
+  argsOut->useLoadBalancing = true;
+  argsOut->delta = 1e-11;
+  argsOut->speedKind = SPEED_LOGNORMAL;
+  argsOut->speedParameters[ 0] = 200000.0;
+  argsOut->speedParameters[ 1] = 0.25;
+  argsOut->benchmarkError = 0.1;
+  argsOut->noise = 0.05;
+  argsOut->latencyMs = 0.1;
+  argsOut->jitterMs = 0.05;
+  argsOut->meanTimeToFailureMs = 0.0;
+  argsOut->detectionMs = 10000.0;
+  argsOut->messageCostMs = 0.5e-3;
+  argsOut->seed = 1;
+
+  int option;
+  while ( ( option = getopt( argc, argv, "w:c:p:SB:d:s:b:n:L:J:F:t:m:r:l:")) != -1)
+  {
+    switch ( option)
+    {
+      case 'w':
+        argsOut->numberOfWorkers = atoi( optarg);
+        if ( argsOut->numberOfWorkers < 1)
+          printAndDie( "Error: <number of workers> must be a positive integer");
+        break;
+      case 'c':
+        argsOut->numberOfChunks = atoi( optarg);
+        if ( argsOut->numberOfChunks < 0)
+          printAndDie( "Error: <number of chunks> must be a non-negative integer");
+        break;
+      case 'p':
+        argsOut->credits = atoi( optarg);
+        if ( argsOut->credits < 1 || argsOut->credits > MAX_CREDITS)
+          printAndDie( "Error: <credits> must be an integer from 1 to 64");
+        break;
+      case 'S':
+        argsOut->isSpeculative = true;
+        break;
+      case 'B':
+        argsOut->useLoadBalancing = atoi( optarg) != 0;
+        break;
+      case 'd':
+        argsOut->delta = atof( optarg);
+        if ( argsOut->delta <= 0)
+          printAndDie( "Error: <delta> must be a positive real number");
+        break;
+      case 's':
+        if ( !parseSpeeds( optarg, argsOut))
+          printAndDie( "Error: invalid speed distribution");
+        break;
+      case 'b':
+        argsOut->benchmarkError = atof( optarg);
+        break;
+      case 'n':
+        argsOut->noise = atof( optarg);
+        break;
+      case 'L':
+        argsOut->latencyMs = atof( optarg);
+        break;
+      case 'J':
+        argsOut->jitterMs = atof( optarg);
+        break;
+      case 'F':
+        argsOut->meanTimeToFailureMs = atof( optarg) * 1000.0;
+        break;
+      case 't':
+        argsOut->detectionMs = atof( optarg);
+        break;
+      case 'm':
+        argsOut->messageCostMs = atof( optarg) / 1000.0;
+        break;
+      case 'r':
+        argsOut->seed = strtoull( optarg, NULL, 10);
+        break;
+      case 'l':
+        if ( !setLogLevel( optarg))
+          printAndDie( "Error: the log level must be error, warn, info or debug");
+        break;
+      default:
+        printUsageAndDie();
+    }
+  }
+  if ( optind != argc)
+    printUsageAndDie();
+  if ( argsOut->benchmarkError < 0 || argsOut->noise < 0 || argsOut->latencyMs < 0 ||
+       argsOut->jitterMs < 0 || argsOut->meanTimeToFailureMs < 0 || argsOut->detectionMs < 0 ||
+       argsOut->messageCostMs < 0)
+    printAndDie( "Error: times, errors and noise can't be negative");
+}
+
+// splitmix64: fast, and the same sequence everywhere for a seed
+static double randomUniform()
+{
+  uint64_t z = ( randomState += 0x9e3779b97f4a7c15ull);
+  z = ( z ^ ( z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = ( z ^ ( z >> 27)) * 0x94d049bb133111ebull;
+  z ^= z >> 31;
+  return ( ( z >> 11) + 0.5) / 9007199254740992.0;  // in (0, 1)
+}
+
+static double randomNormal()
+{
+  return sqrt( -2.0 * log( randomUniform())) * cos( 2.0 * M_PI * randomUniform());
+}
+
+static double randomLognormalFactor( double sigma)
+{
+  return ( sigma > 0)? exp( sigma * randomNormal()) : 1.0;
+}
+
+static double randomExponential( double mean)
+{
+  return -mean * log( randomUniform());
+}
+
+static double randomSpeed( const Args *args)
+{
+  const double *parameters = args->speedParameters;
+  switch ( args->speedKind)
+  {
+    case SPEED_UNIFORM:
+      return parameters[ 0] + ( parameters[ 1] - parameters[ 0]) * randomUniform();
+    case SPEED_LOGNORMAL:
+      return parameters[ 0] * randomLognormalFactor( parameters[ 1]);
+    case SPEED_BIMODAL:
+      return ( randomUniform() < parameters[ 2])? parameters[ 1] : parameters[ 0];
+    default:
+      return parameters[ 0];
+  }
+}
+
+static bool isEarlier( const Event *a, const Event *b)
+{
+  return a->timeMs < b->timeMs || ( a->timeMs == b->timeMs && a->sequence < b->sequence);
+}
+
+static void pushEventOrDie( EventQueue *queue, Event event)
+{
+  if ( queue->numberOfEvents == queue->capacity)
+  {
+    long capacity = ( queue->capacity > 0)? queue->capacity * 2 : 1024;
+    Event *events = ( Event*) realloc( queue->events, capacity * sizeof( Event));
+    if ( !events)
+      printAndDie( "Error: out of memory for events");
+    queue->events = events;
+    queue->capacity = capacity;
+  }
+  event.sequence = queue->nextSequence ++;
+  long i = queue->numberOfEvents ++;
+  while ( i > 0 && isEarlier( &event, &queue->events[ ( i - 1) / 2]))
+  {
+    queue->events[ i] = queue->events[ ( i - 1) / 2];
+    i = ( i - 1) / 2;
+  }
+  queue->events[ i] = event;
+}
+
+static Event popEvent( EventQueue *queue)
+{
+  Event top = queue->events[ 0];
+  Event last = queue->events[ -- queue->numberOfEvents];
+  long i = 0;
+  for ( ;;)
+  {
+    long child = 2 * i + 1;
+    if ( child >= queue->numberOfEvents)
+      break;
+    if ( child + 1 < queue->numberOfEvents &&
+         isEarlier( &queue->events[ child + 1], &queue->events[ child]))
+      child ++;
+    if ( !isEarlier( &queue->events[ child], &last))
+      break;
+    queue->events[ i] = queue->events[ child];
+    i = child;
+  }
+  queue->events[ i] = last;
+  return top;
+}
+
+static double messageDelayMs( const Args *args)
+{
+  return args->latencyMs + ( ( args->jitterMs > 0)? randomExponential( args->jitterMs) : 0.0);
+}
+
+static void scheduleEvent( Simulation *simulation, double timeMs, int type, int worker, int chunk)
+{
+  Event event;
+  memset( &event, 0, sizeof( event));
+  event.timeMs = timeMs;
+  event.type = type;
+  event.worker = worker;
+  event.chunk = chunk;
+  pushEventOrDie( &simulation->events, event);
+}
+
+// The server's thread handles one message at a time; returns when it is done with this one
+static double useServer( Simulation *simulation)
+{
+  if ( simulation->serverFreeMs < simulation->nowMs)
+    simulation->serverFreeMs = simulation->nowMs;
+  simulation->serverFreeMs += simulation->args->messageCostMs;
+  return simulation->serverFreeMs;
+}
+
+// What heartbeats would have told the server by now, of the chunks
+// that may get a duplicate: the others' progress decides nothing
+static void updateProgress( Simulation *simulation)
+{
+  if ( simulation->progressUpdateMs >= 0 &&
+       simulation->nowMs - simulation->progressUpdateMs < HEARTBEAT_INTERVAL_MS)
+    return;
+  simulation->progressUpdateMs = simulation->nowMs;
+  Schedule *schedule = &simulation->schedule;
+  // Each update moves chunks around the heap, so it goes over a copy
+  int numberOfChunks = schedule->numberOfRunningChunks;
+  memcpy( simulation->progressChunks, schedule->runningChunks, numberOfChunks * sizeof( int));
+  for ( int i = 0; i < numberOfChunks; ++i)
+  {
+    int chunk = simulation->progressChunks[ i];
+    int index = schedule->chunks[ chunk].worker;
+    SimulatedWorker *worker = &simulation->workers[ index];
+    if ( worker->isFailed || worker->runningChunk != chunk)
+      continue;
+    setChunkProgress( schedule, chunk, index,
+      ( simulation->nowMs - worker->runningStartMs) / ( worker->runningEndMs - worker->runningStartMs));
+  }
+}
+
+// As sendRequests() in server.c
+static void sendRequests( Simulation *simulation, int worker)
+{
+  Schedule *schedule = &simulation->schedule;
+  if ( !simulation->isAlive[ worker])
+    return;
+  while ( simulation->outstandingChunks[ worker] < simulation->args->credits)
+  {
+    bool isIdle = simulation->outstandingChunks[ worker] == 0;
+    if ( schedule->isSpeculative && isIdle)
+      updateProgress( simulation);
+    bool isDuplicate;
+    int chunk = takeChunk( schedule, worker, isIdle, &isDuplicate);
+    if ( chunk < 0)
+      break;
+    assignChunk( schedule, chunk, worker, isDuplicate);
+    simulation->outstandingChunks[ worker] ++;
+    if ( isDuplicate)
+      simulation->numberOfDuplicates ++;
+    double sentMs = useServer( simulation);
+    scheduleEvent( simulation, sentMs + messageDelayMs( simulation->args), EVENT_REQUEST_ARRIVES,
+      worker, chunk);
+  }
+}
+
+static void startNextChunk( Simulation *simulation, int index)
+{
+  SimulatedWorker *worker = &simulation->workers[ index];
+  if ( worker->runningChunk >= 0 || worker->queueLength == 0)
+    return;
+  int chunk = worker->queue[ worker->queueStart];
+  worker->queueStart = ( worker->queueStart + 1) % MAX_CREDITS;
+  worker->queueLength --;
+
+  const Interval *interval = &simulation->schedule.chunks[ chunk].interval;
+  double steps = ( interval->end - interval->start) / simulation->args->delta;
+  worker->runningChunk = chunk;
+  worker->runningStartMs = simulation->nowMs;
+  worker->runningEndMs = simulation->nowMs +
+    steps / worker->speed * randomLognormalFactor( simulation->args->noise);
+  Event event;
+  memset( &event, 0, sizeof( event));
+  event.timeMs = worker->runningEndMs;
+  event.type = EVENT_COMPUTE_DONE;
+  event.worker = index;
+  event.chunk = chunk;
+  event.generation = worker->generation;
+  pushEventOrDie( &simulation->events, event);
+}
+
+static void respond( Simulation *simulation, int worker, int chunk, int status, double computeMs)
+{
+  Event event;
+  memset( &event, 0, sizeof( event));
+  event.timeMs = simulation->nowMs + messageDelayMs( simulation->args);
+  event.type = EVENT_RESPONSE_ARRIVES;
+  event.worker = worker;
+  event.chunk = chunk;
+  event.status = status;
+  event.computeMs = computeMs;
+  pushEventOrDie( &simulation->events, event);
+}
+
+// Stops the running chunk, as cancel_integration() does
+static void stopRunningChunk( Simulation *simulation, int index, double *lostMsInOut)
+{
+  SimulatedWorker *worker = &simulation->workers[ index];
+  double computeMs = simulation->nowMs - worker->runningStartMs;
+  simulation->busyMs += computeMs;
+  *lostMsInOut += computeMs;
+  worker->runningChunk = -1;
+  worker->generation ++;
+}
+
+static void onCancelArrives( Simulation *simulation, int index, int chunk)
+{
+  SimulatedWorker *worker = &simulation->workers[ index];
+  if ( worker->runningChunk == chunk)
+  {
+    stopRunningChunk( simulation, index, &simulation->cancelledMs);
+    respond( simulation, index, chunk, RESPONSE_CANCELLED, 0.0);
+    startNextChunk( simulation, index);
+    return;
+  }
+  for ( int i = 0; i < worker->queueLength; ++i)
+  {
+    int slot = ( worker->queueStart + i) % MAX_CREDITS;
+    if ( worker->queue[ slot] != chunk)
+      continue;
+    for ( int j = i; j + 1 < worker->queueLength; ++j)
+      worker->queue[ ( worker->queueStart + j) % MAX_CREDITS] =
+        worker->queue[ ( worker->queueStart + j + 1) % MAX_CREDITS];
+    worker->queueLength --;
+    respond( simulation, index, chunk, RESPONSE_CANCELLED, 0.0);
+    return;
+  }
+}
+
+// As handleWorkerMessage() in server.c does with a Response
+static void onResponseArrives( Simulation *simulation, const Event *event)
+{
+  int worker = event->worker;
+  if ( !simulation->isAlive[ worker])
+    return;
+  useServer( simulation);
+  simulation->outstandingChunks[ worker] --;
+  int otherWorker;
+  if ( event->status == RESPONSE_OK &&
+       completeChunk( &simulation->schedule, event->chunk, worker, &otherWorker))
+  {
+    simulation->usefulMs += event->computeMs;
+    if ( otherWorker >= 0 && simulation->isAlive[ otherWorker])
+    {
+      simulation->numberOfCancels ++;
+      double sentMs = useServer( simulation);
+      scheduleEvent( simulation, sentMs + messageDelayMs( simulation->args), EVENT_CANCEL_ARRIVES,
+        otherWorker, event->chunk);
+    }
+  }
+  sendRequests( simulation, worker);
+}
+
+// As failWorkerOrDie() in server.c
+static void onFailureDetected( Simulation *simulation, int worker)
+{
+  if ( !simulation->isAlive[ worker])
+    return;
+  simulation->isAlive[ worker] = false;
+  simulation->numberOfAliveWorkers --;
+  simulation->outstandingChunks[ worker] = 0;
+  failScheduledWorker( &simulation->schedule, worker);
+  if ( simulation->numberOfAliveWorkers == 0)
+    return;
+  int waitingWorker;
+  while ( ( waitingWorker = nextWaitingWorker( &simulation->schedule)) >= 0)
+    sendRequests( simulation, waitingWorker);
+}
+
+static void handleEvent( Simulation *simulation, const Event *event)
+{
+  SimulatedWorker *worker = &simulation->workers[ event->worker];
+  switch ( event->type)
+  {
+    case EVENT_REQUEST_ARRIVES:
+      if ( worker->isFailed)
+        break;
+      worker->queue[ ( worker->queueStart + worker->queueLength) % MAX_CREDITS] = event->chunk;
+      worker->queueLength ++;
+      startNextChunk( simulation, event->worker);
+      break;
+    case EVENT_COMPUTE_DONE:
+      if ( worker->isFailed || event->generation != worker->generation)
+        break;
+      simulation->busyMs += simulation->nowMs - worker->runningStartMs;
+      worker->runningChunk = -1;
+      respond( simulation, event->worker, event->chunk, RESPONSE_OK,
+        simulation->nowMs - worker->runningStartMs);
+      startNextChunk( simulation, event->worker);
+      break;
+    case EVENT_RESPONSE_ARRIVES:
+      onResponseArrives( simulation, event);
+      break;
+    case EVENT_CANCEL_ARRIVES:
+      if ( !worker->isFailed)
+        onCancelArrives( simulation, event->worker, event->chunk);
+      break;
+    case EVENT_WORKER_FAILS:
+      worker->isFailed = true;
+      simulation->numberOfFailures ++;
+      if ( worker->runningChunk >= 0)
+        stopRunningChunk( simulation, event->worker, &simulation->failedMs);
+      scheduleEvent( simulation, simulation->nowMs + simulation->args->detectionMs,
+        EVENT_FAILURE_DETECTED, event->worker, -1);
+      break;
+    case EVENT_FAILURE_DETECTED:
+      onFailureDetected( simulation, event->worker);
+      break;
+  }
+}
+
+static void initSimulationOrDie( const Args *args, Simulation *simulation)
+{
+  int numberOfWorkers = args->numberOfWorkers;
+  memset( simulation, 0, sizeof( *simulation));
+  simulation->args = args;
+  simulation->workers = ( SimulatedWorker*) calloc( numberOfWorkers, sizeof( SimulatedWorker));
+  int *queues = ( int*) malloc( ( size_t) numberOfWorkers * MAX_CREDITS * sizeof( int));
+  simulation->isAlive = ( bool*) malloc( numberOfWorkers * sizeof( bool));
+  simulation->outstandingChunks = ( int*) calloc( numberOfWorkers, sizeof( int));
+  Benchmark *benchmarks = ( Benchmark*) calloc( numberOfWorkers, sizeof( Benchmark));
+  Interval *intervals = ( Interval*) malloc( numberOfWorkers * sizeof( Interval));
+  if ( !simulation->workers || !queues || !simulation->isAlive ||
+       !simulation->outstandingChunks || !benchmarks || !intervals)
+    printAndDie( "Error: out of memory for the workers");
+
+  // What the server would receive in the workers' Benchmarks
+  for ( int i = 0; i < numberOfWorkers; ++i)
+  {
+    SimulatedWorker *worker = &simulation->workers[ i];
+    worker->speed = randomSpeed( args);
+    if ( worker->speed <= 0)
+      printAndDie( "Error: the speed distribution gives a worker no speed");
+    worker->queue = queues + ( size_t) i * MAX_CREDITS;
+    worker->runningChunk = -1;
+    simulation->isAlive[ i] = true;
+    benchmarks[ i].numberOfThroughputPoints = 1;
+    benchmarks[ i].throughputThreads[ 0] = 1;
+    benchmarks[ i].throughput[ 0] = worker->speed * randomLognormalFactor( args->benchmarkError);
+    benchmarks[ i].credits = args->credits;
+    if ( args->meanTimeToFailureMs > 0)
+      scheduleEvent( simulation, randomExponential( args->meanTimeToFailureMs), EVENT_WORKER_FAILS, i, -1);
+  }
+  simulation->numberOfAliveWorkers = numberOfWorkers;
+  simulation->progressUpdateMs = -1.0;
+
+  Interval interval = { 0.0, 1.0 };
+  computeIntervalsForWorkers( args->useLoadBalancing, benchmarks, numberOfWorkers, interval,
+    intervals);
+  if ( !initSchedule( &simulation->schedule, args->numberOfChunks, args->isSpeculative, interval,
+        intervals, numberOfWorkers))
+    printAndDie( "Error: out of memory for the chunks");
+  simulation->progressChunks = ( int*) malloc( simulation->schedule.numberOfChunks * sizeof( int));
+  if ( !simulation->progressChunks)
+    printAndDie( "Error: out of memory for the chunks");
+  free( benchmarks);
+  free( intervals);
+}
+
+static void destroySimulation( Simulation *simulation)
+{
+  free( simulation->workers[ 0].queue);
+  free( simulation->workers);
+  free( simulation->isAlive);
+  free( simulation->outstandingChunks);
+  free( simulation->events.events);
+  free( simulation->progressChunks);
+  destroySchedule( &simulation->schedule);
+}
+
+static void simulate( const Args *args)
+{
+  uint64_t startNs = traceNowNs();
+  static Simulation simulation;
+  initSimulationOrDie( args, &simulation);
+
+  for ( int i = 0; i < args->numberOfWorkers; ++i)
+    sendRequests( &simulation, i);
+  Schedule *schedule = &simulation.schedule;
+  while ( schedule->numberOfChunksDone < schedule->numberOfChunks &&
+          simulation.numberOfAliveWorkers > 0 && simulation.events.numberOfEvents > 0)
+  {
+    Event event = popEvent( &simulation.events);
+    simulation.nowMs = event.timeMs;
+    simulation.numberOfEvents ++;
+    handleEvent( &simulation, &event);
+  }
+  double simulationMs = ( traceNowNs() - startNs) / 1e6;
+  bool isDone = schedule->numberOfChunksDone == schedule->numberOfChunks;
+  if ( !isDone)
+    LOG_WARN( "Every worker failed before the job was done\n");
+
+  double totalSpeed = 0.0;
+  for ( int i = 0; i < args->numberOfWorkers; ++i)
+    totalSpeed += simulation.workers[ i].speed;
+  double makespanMs = simulation.nowMs;
+  double idealMakespanMs = 1.0 / args->delta / totalSpeed;
+  double capacityMs = makespanMs * args->numberOfWorkers;
+  LOG( "%d worker(s), %d chunk(s): makespan %.3f ms, %.1f%% of the ideal, %.1f%% utilization; "
+    "simulated in %.3f ms\n", args->numberOfWorkers, schedule->numberOfChunks, makespanMs,
+    100.0 * idealMakespanMs / makespanMs, 100.0 * simulation.usefulMs / capacityMs, simulationMs);
+
+  printf( "{\n  \"workers\": %d,\n  \"chunks\": %d,\n  \"credits\": %d,\n  \"speculative\": %s,\n"
+    "  \"loadBalancing\": %s,\n  \"delta\": %g,\n  \"seed\": %llu,\n", args->numberOfWorkers,
+    schedule->numberOfChunks, args->credits, ( args->isSpeculative)? "true" : "false",
+    ( args->useLoadBalancing)? "true" : "false", args->delta, ( unsigned long long) args->seed);
+  printf( "  \"done\": %s,\n  \"makespanMs\": %.6f,\n  \"idealMakespanMs\": %.6f,\n"
+    "  \"efficiency\": %.6f,\n  \"utilization\": %.6f,\n  \"busyUtilization\": %.6f,\n",
+    ( isDone)? "true" : "false", makespanMs, idealMakespanMs, idealMakespanMs / makespanMs,
+    simulation.usefulMs / capacityMs, simulation.busyMs / capacityMs);
+  printf( "  \"redundantMs\": %.6f,\n  \"cancelledMs\": %.6f,\n  \"failedMs\": %.6f,\n",
+    simulation.busyMs - simulation.usefulMs - simulation.cancelledMs - simulation.failedMs,
+    simulation.cancelledMs, simulation.failedMs);
+  printf( "  \"duplicates\": %ld,\n  \"cancels\": %ld,\n  \"failures\": %ld,\n  \"events\": %ld,\n"
+    "  \"simulationMs\": %.3f\n}\n", simulation.numberOfDuplicates, simulation.numberOfCancels,
+    simulation.numberOfFailures, simulation.numberOfEvents, simulationMs);
+  destroySimulation( &simulation);
+}
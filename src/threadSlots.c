@@ -0,0 +1,45 @@
+
+/*
+  threadSlots.c
+
+  The per-thread blocks of trace.c, logging.c and metrics.c. A block
+  is claimed with a compare-and-swap on its isOwned flag, so a thread
+  that has claimed it is its only writer; new blocks are pushed onto
+  the head of the list and never taken off, so a reader that loaded
+  the head with acquire sees every block up to it fully built.
+*/
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "threadSlots.h"
+
+ThreadSlot *claimThreadSlot( ThreadSlot **slots, size_t size)
+{
+  for ( ThreadSlot *slot = __atomic_load_n( slots, __ATOMIC_ACQUIRE); slot; slot = slot->next)
+  {
+    int isOwned = 0;
+    if ( __atomic_compare_exchange_n( &slot->isOwned, &isOwned, 1, false,
+           __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      return slot;
+  }
+  ThreadSlot *slot = ( ThreadSlot*) calloc( 1, size);
+  if ( !slot)
+    return NULL;
+  slot->isOwned = 1;
+  slot->next = __atomic_load_n( slots, __ATOMIC_RELAXED);
+  while ( !__atomic_compare_exchange_n( slots, &slot->next, slot, true,
+            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+  return slot;
+}
+
+void releaseThreadSlot( void *slot)
+{
+  __atomic_store_n( &( ( ThreadSlot*) slot)->isOwned, 0, __ATOMIC_RELEASE);
+}
+
+ThreadSlot *firstThreadSlot( ThreadSlot **slots)
+{
+  return __atomic_load_n( slots, __ATOMIC_ACQUIRE);
+}
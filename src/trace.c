@@ -0,0 +1,155 @@
+
+/*
+  trace.c
+
+  Every thread records its spans into a ring buffer of its own, so
+  recording takes no lock and shares no cache line: two clock_gettime()
+  calls (through the vDSO, no system call) and a store. The buffers
+  are kept in a lock-free list for visitTraceSpans() to walk (see
+  threadSlots.c). A thread that exits gives its buffer back (through a
+  pthread key destructor) to the next thread that starts recording,
+  so the short-lived compute threads of the worker don't pile buffers
+  up; the spans stay in it, each tagged with the thread that recorded
+  it.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+#include "threadSlots.h"
+
+#define MAX_SUMMARY_NAMES 64
+
+struct TraceBuffer
+{
+  ThreadSlot slot;
+  TraceSpan spans[ TRACE_BUFFER_SPANS];
+  uint64_t numberOfSpans;  // ever recorded; published with a release store
+};
+typedef struct TraceBuffer TraceBuffer;
+
+static ThreadSlot *buffers;
+static __thread TraceBuffer *threadBuffer;
+static __thread int threadId;
+static pthread_key_t releaseKey;
+static pthread_once_t releaseKeyOnce = PTHREAD_ONCE_INIT;
+
+uint64_t traceNowNs()
+{
+  struct timespec now;
+  clock_gettime( CLOCK_MONOTONIC_RAW, &now);
+  return ( uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static void createReleaseKey()
+{
+  pthread_key_create( &releaseKey, releaseThreadSlot);
+}
+
+static TraceBuffer *getThreadBuffer()
+{
+  if ( threadBuffer)
+    return threadBuffer;
+  pthread_once( &releaseKeyOnce, createReleaseKey);
+  threadBuffer = ( TraceBuffer*) claimThreadSlot( &buffers, sizeof( TraceBuffer));
+  if ( threadBuffer)
+    pthread_setspecific( releaseKey, threadBuffer);
+  threadId = ( int) syscall( SYS_gettid);
+  return threadBuffer;
+}
+
+uint64_t traceSpan( const char *name, uint64_t startNs, long arg)
+{
+  uint64_t endNs = traceNowNs();
+  TraceBuffer *buffer = getThreadBuffer();
+  if ( !buffer)
+    return endNs - startNs;
+  uint64_t index = buffer->numberOfSpans;
+  TraceSpan *span = &buffer->spans[ index % TRACE_BUFFER_SPANS];
+  span->name = name;
+  span->startNs = startNs;
+  span->endNs = endNs;
+  span->arg = arg;
+  span->threadId = threadId;
+  __atomic_store_n( &buffer->numberOfSpans, index + 1, __ATOMIC_RELEASE);
+  return endNs - startNs;
+}
+
+void visitTraceSpans( TraceVisitor visitor, void *context)
+{
+  for ( ThreadSlot *slot = firstThreadSlot( &buffers); slot; slot = slot->next)
+  {
+    TraceBuffer *buffer = ( TraceBuffer*) slot;
+    uint64_t numberOfSpans = __atomic_load_n( &buffer->numberOfSpans, __ATOMIC_ACQUIRE);
+    uint64_t first = ( numberOfSpans > TRACE_BUFFER_SPANS)? numberOfSpans - TRACE_BUFFER_SPANS : 0;
+    for ( uint64_t i = first; i < numberOfSpans; ++i)
+    {
+      TraceSpan span = buffer->spans[ i % TRACE_BUFFER_SPANS];
+      visitor( context, &span);
+    }
+  }
+}
+
+void makeTraceRecord( const TraceSpan *span, TraceRecord *recordOut)
+{
+  memset( recordOut, 0, sizeof( *recordOut));
+  strncpy( recordOut->name, span->name, TRACE_NAME_LENGTH - 1);
+  recordOut->startNs = span->startNs;
+  recordOut->endNs = span->endNs;
+  recordOut->arg = span->arg;
+  recordOut->threadId = span->threadId;
+}
+
+struct SpanTotals
+{
+  const char *names[ MAX_SUMMARY_NAMES];
+  long counts[ MAX_SUMMARY_NAMES];
+  uint64_t totalNs[ MAX_SUMMARY_NAMES];
+  uint64_t maxNs[ MAX_SUMMARY_NAMES];
+  int numberOfNames;
+};
+typedef struct SpanTotals SpanTotals;
+
+// Names are compared by content: the same literal may have several
+// copies across translation units
+static void addToTotals( void *context, const TraceSpan *span)
+{
+  SpanTotals *totals = ( SpanTotals*) context;
+  int i = 0;
+  while ( i < totals->numberOfNames && strcmp( totals->names[ i], span->name) != 0)
+    ++i;
+  if ( i == totals->numberOfNames)
+  {
+    if ( i == MAX_SUMMARY_NAMES)
+      return;
+    totals->names[ i] = span->name;
+    totals->numberOfNames ++;
+  }
+  uint64_t lengthNs = span->endNs - span->startNs;
+  totals->counts[ i] ++;
+  totals->totalNs[ i] += lengthNs;
+  if ( lengthNs > totals->maxNs[ i])
+    totals->maxNs[ i] = lengthNs;
+}
+
+void logTraceSummary()
+{
+  static SpanTotals totals;
+  memset( &totals, 0, sizeof( totals));
+  visitTraceSpans( addToTotals, &totals);
+  if ( totals.numberOfNames == 0)
+    return;
+  LOG( "Trace (last %d spans per thread):\n", TRACE_BUFFER_SPANS);
+  for ( int i = 0; i < totals.numberOfNames; ++i)
+    LOG( "    %-16s %6ld span(s), %12.3lf ms in all, %10.3lf ms at most\n", totals.names[ i],
+      totals.counts[ i], totals.totalNs[ i] / 1e6, totals.maxNs[ i] / 1e6);
+}
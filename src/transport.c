@@ -0,0 +1,349 @@
+
+/*
+  transport.c
+
+  Connections between servers and workers over TCP, a Unix socket,
+  or a shared-memory channel set up through a Unix socket (see 
+  shmChannel.c). Every socket gets its options here, per backend:
+
+  TCP: no Nagle delay, as every message is small and waited for;
+  keepalive, so that an idle connection to a vanished host ends;
+  buffers are left to autotuning.
+
+  Unix sockets: fixed buffers, large enough for many messages in
+  flight. Once upgraded to shared memory the socket carries no data,
+  so its buffers shrink to the minimum.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/un.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "transport.h"
+
+#define KEEPALIVE_IDLE_SECONDS 30
+#define KEEPALIVE_INTERVAL_SECONDS 10
+#define KEEPALIVE_PROBES 3
+#define UNIX_BUFFER_BYTES ( 64 * 1024)
+#define SHM_SOCKET_BUFFER_BYTES 4096
+
+static bool setIntOption( int socket, int level, int name, int value)
+{
+  return setsockopt( socket, level, name, &value, sizeof( value)) == 0;
+}
+
+static bool configureSocket( int socket, int kind)
+{
+  switch ( kind)
+  {
+    case TRANSPORT_TCP:
+      return setIntOption( socket, IPPROTO_TCP, TCP_NODELAY, 1) &&
+        setIntOption( socket, SOL_SOCKET, SO_KEEPALIVE, 1) &&
+        setIntOption( socket, IPPROTO_TCP, TCP_KEEPIDLE, KEEPALIVE_IDLE_SECONDS) &&
+        setIntOption( socket, IPPROTO_TCP, TCP_KEEPINTVL, KEEPALIVE_INTERVAL_SECONDS) &&
+        setIntOption( socket, IPPROTO_TCP, TCP_KEEPCNT, KEEPALIVE_PROBES);
+    case TRANSPORT_UNIX:
+      return setIntOption( socket, SOL_SOCKET, SO_SNDBUF, UNIX_BUFFER_BYTES) &&
+        setIntOption( socket, SOL_SOCKET, SO_RCVBUF, UNIX_BUFFER_BYTES);
+    case TRANSPORT_SHM:
+      return setIntOption( socket, SOL_SOCKET, SO_SNDBUF, SHM_SOCKET_BUFFER_BYTES) &&
+        setIntOption( socket, SOL_SOCKET, SO_RCVBUF, SHM_SOCKET_BUFFER_BYTES);
+    default:
+      return false;
+  }
+}
+
+static void closeKeepingErrno( int socket)
+{
+  int error = errno;
+  close( socket);
+  errno = error;
+}
+
+int listenTcp( int port, int backlog)
+{
+  int listeningSocket = socket( AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if ( listeningSocket < 0)
+    return -1;
+
+  struct sockaddr_in listeningAddress;
+  memset( &listeningAddress, 0, sizeof( listeningAddress));
+  listeningAddress.sin_family = AF_INET;
+  listeningAddress.sin_addr.s_addr = htonl( INADDR_ANY);
+  listeningAddress.sin_port = htons( port);
+
+  if ( !setIntOption( listeningSocket, SOL_SOCKET, SO_REUSEADDR, 1) ||
+       bind( listeningSocket, ( struct sockaddr*) &listeningAddress, sizeof( listeningAddress)) < 0 ||
+       listen( listeningSocket, backlog) < 0)
+  {
+    closeKeepingErrno( listeningSocket);
+    return -1;
+  }
+  return listeningSocket;
+}
+
+int listenUnix( const char *path, int backlog)
+{
+  struct sockaddr_un listeningAddress;
+  memset( &listeningAddress, 0, sizeof( listeningAddress));
+  listeningAddress.sun_family = AF_UNIX;
+  if ( strlen( path) >= sizeof( listeningAddress.sun_path))
+  {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy( listeningAddress.sun_path, path);
+
+  int listeningSocket = socket( AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if ( listeningSocket < 0)
+    return -1;
+  unlink( path);
+  if ( bind( listeningSocket, ( struct sockaddr*) &listeningAddress, sizeof( listeningAddress)) < 0 ||
+       listen( listeningSocket, backlog) < 0)
+  {
+    closeKeepingErrno( listeningSocket);
+    return -1;
+  }
+  return listeningSocket;
+}
+
+bool adoptTransport( int socket, Transport *transportOut, struct sockaddr_in *peerAddressOut)
+{
+  struct sockaddr_storage peerAddress;
+  socklen_t peerAddressLength = sizeof( peerAddress);
+  if ( getpeername( socket, ( struct sockaddr*) &peerAddress, &peerAddressLength) < 0)
+    return false;
+
+  Transport transport;
+  transport.kind = ( peerAddress.ss_family == AF_UNIX)? TRANSPORT_UNIX : TRANSPORT_TCP;
+  transport.socket = socket;
+  transport.channel = NULL;
+  if ( !configureSocket( socket, transport.kind))
+    return false;
+
+  memset( peerAddressOut, 0, sizeof( *peerAddressOut));
+  if ( transport.kind == TRANSPORT_TCP)
+    memcpy( peerAddressOut, &peerAddress, sizeof( *peerAddressOut));
+  else
+  {
+    peerAddressOut->sin_family = AF_INET;
+    peerAddressOut->sin_addr.s_addr = htonl( INADDR_LOOPBACK);
+  }
+  *transportOut = transport;
+  return true;
+}
+
+bool acceptTransport( int listeningSocket, Transport *transportOut, 
+  struct sockaddr_in *peerAddressOut)
+{
+  int peerSocket = accept( listeningSocket, NULL, NULL);
+  if ( peerSocket < 0)
+    return false;
+  if ( !adoptTransport( peerSocket, transportOut, peerAddressOut))
+  {
+    closeKeepingErrno( peerSocket);
+    return false;
+  }
+  return true;
+}
+
+bool connectTransport( const struct sockaddr *address, socklen_t addressLength, 
+  bool isNonBlocking, Transport *transportOut)
+{
+  Transport transport;
+  transport.kind = ( address->sa_family == AF_UNIX)? TRANSPORT_UNIX : TRANSPORT_TCP;
+  transport.channel = NULL;
+  transport.socket = socket( address->sa_family, 
+    SOCK_STREAM | ( ( isNonBlocking)? SOCK_NONBLOCK : 0), 0);
+  if ( transport.socket < 0)
+    return false;
+  if ( !configureSocket( transport.socket, transport.kind) ||
+       ( connect( transport.socket, address, addressLength) < 0 && 
+         !( isNonBlocking && errno == EINPROGRESS)))
+  {
+    closeKeepingErrno( transport.socket);
+    return false;
+  }
+  *transportOut = transport;
+  return true;
+}
+
+static void upgradeToShm( Transport *transport, ShmChannel *channel)
+{
+  transport->kind = TRANSPORT_SHM;
+  transport->channel = channel;
+  configureSocket( transport->socket, TRANSPORT_SHM);  // a failure only costs memory
+}
+
+bool offerShmChannel( Transport *transport)
+{
+  if ( transport->kind != TRANSPORT_UNIX)
+    return false;
+  ShmChannel *channel = ( ShmChannel*) malloc( sizeof( ShmChannel));
+  if ( !channel)
+    return false;
+  if ( !createShmChannel( channel))
+  {
+    free( channel);
+    return false;
+  }
+  if ( !sendShmChannel( transport->socket, channel))
+  {
+    destroyShmChannel( channel);
+    free( channel);
+    return false;
+  }
+  upgradeToShm( transport, channel);
+  return true;
+}
+
+bool acceptShmChannel( Transport *transport)
+{
+  ShmChannel channel;
+  bool hasChannel;
+  if ( transport->kind != TRANSPORT_UNIX || 
+       !recvShmChannel( transport->socket, &channel, &hasChannel))
+    return false;
+  if ( !hasChannel)
+    return true;  // the peer stays on the socket
+  ShmChannel *attached = ( ShmChannel*) malloc( sizeof( ShmChannel));
+  if ( !attached)
+  {
+    destroyShmChannel( &channel);
+    return false;
+  }
+  *attached = channel;
+  upgradeToShm( transport, attached);
+  return true;
+}
+
+int transportEventFd( const Transport *transport)
+{
+  return ( transport->kind == TRANSPORT_SHM)? transport->channel->inboundFd : transport->socket;
+}
+
+bool sendMessage( Transport *transport, int type, const void *payload, int length)
+{
+  if ( transport->kind == TRANSPORT_SHM)
+    return sendShmMessage( transport->channel, type, payload, length);
+
+  MessageHeader header;
+  header.type = type;
+  header.length = length;
+  if ( send( transport->socket, &header, sizeof( header), 
+         MSG_NOSIGNAL | ( ( length)? MSG_MORE : 0)) != sizeof( header))
+    return false;
+  if ( length > 0 && send( transport->socket, payload, length, MSG_NOSIGNAL) != length)
+    return false;
+  return true;
+}
+
+bool recvMessage( Transport *transport, MessageHeader *headerOut, void *payloadOut)
+{
+  if ( transport->kind == TRANSPORT_SHM)
+    return recvShmMessage( transport->channel, headerOut, payloadOut) == 1;
+
+  MessageHeader header;
+  if ( recv( transport->socket, &header, sizeof( header), MSG_WAITALL) != sizeof( header))
+    return false;
+  if ( header.length < 0 || header.length > MAX_MESSAGE_LENGTH)
+    return false;
+  if ( header.length > 0 && 
+       recv( transport->socket, payloadOut, header.length, MSG_WAITALL) != header.length)
+    return false;
+  *headerOut = header;
+  return true;
+}
+
+bool hasBufferedMessage( const Transport *transport)
+{
+  return transport->kind == TRANSPORT_SHM && hasShmMessage( transport->channel);
+}
+
+void clearTransportWakeup( Transport *transport)
+{
+  if ( transport->kind == TRANSPORT_SHM)
+    clearShmWakeup( transport->channel);
+}
+
+ssize_t sendTransport( Transport *transport, const void *bytes, size_t length)
+{
+  if ( transport->kind != TRANSPORT_SHM)
+    return send( transport->socket, bytes, length, MSG_NOSIGNAL);
+
+  size_t sent = 0;
+  while ( length - sent >= sizeof( MessageHeader))
+  {
+    MessageHeader header;
+    memcpy( &header, ( const char*) bytes + sent, sizeof( header));
+    if ( length - sent < sizeof( header) + header.length ||
+         !sendShmMessage( transport->channel, header.type, 
+           ( const char*) bytes + sent + sizeof( header), header.length))
+      break;
+    sent += sizeof( header) + header.length;
+  }
+  if ( sent == 0 && length > 0)
+  {
+    errno = EAGAIN;
+    return -1;
+  }
+  return sent;
+}
+
+ssize_t recvTransport( Transport *transport, void *buffer, size_t capacity)
+{
+  if ( transport->kind != TRANSPORT_SHM)
+    return recv( transport->socket, buffer, capacity, 0);
+
+  size_t received = 0;
+  int size;
+  while ( ( size = nextShmMessageSize( transport->channel)) > 0 && 
+          ( size_t) size <= capacity - received)
+  {
+    MessageHeader header;
+    char *message = ( char*) buffer + received;
+    recvShmMessage( transport->channel, &header, message + sizeof( header));
+    memcpy( message, &header, sizeof( header));
+    received += size;
+  }
+  if ( size < 0)
+  {
+    errno = EPROTO;
+    return -1;
+  }
+  if ( received > 0)
+    return received;
+  if ( size > 0)
+  {
+    errno = EAGAIN;  // no room for the next message; the wakeup is still pending
+    return -1;
+  }
+
+  // Empty: reset the wakeup, then look again, so that a message
+  // written in between isn't left without one
+  clearShmWakeup( transport->channel);
+  if ( hasShmMessage( transport->channel))
+    return recvTransport( transport, buffer, capacity);
+  // Nothing comes through the socket but the peer going away
+  return recv( transport->socket, buffer, capacity, MSG_DONTWAIT);
+}
+
+void closeTransport( Transport *transport)
+{
+  if ( transport->socket >= 0)
+    close( transport->socket);
+  if ( transport->channel)
+  {
+    destroyShmChannel( transport->channel);
+    free( transport->channel);
+  }
+  transport->socket = -1;
+  transport->channel = NULL;
+}
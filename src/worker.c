@@ -5,7 +5,11 @@
   Author: dmitriy.borodiy@gmail.com
 
   Usage:
-  worker <listening port> <server port> [<number of threads>] 
+  worker [-q <job queue size>] [-p <outstanding chunks>]
+         [-b <heartbeat interval in ms>] [-r <server address>|<socket path>]
+         [-g <multicast group>] [-l error|warn|info|debug]
+         [-m <metrics port>|<metrics socket path>] [-e] [-s <slowdown>]
+         <listening port> <server port> [<number of threads>|auto] 
          [<benchmark delta>]
 
   Desription
@@ -15,54 +19,323 @@
   the specified delta <benchmark delta>. 
 
   The program listens to a port <listening port> and waits 
-  for any message to come from a server.
+  for any message to come from a server. With -g it also joins
+  the <multicast group> on that port (several workers on one host
+  may then share the port).
 
   On receiving a message, the program connects to the server
-  to port <server port>. Then, it sends the server the 
-  measured time and <benchmark delta> in a Benchmark structure. 
+  to port <server port>, after a random delay within the reply
+  window the server's Announcement asks for. With -r, the worker doesn't wait for a 
+  broadcast: it registers right away by connecting to 
+  <server address> (a host name or an IPv4 address), and connects
+  again whenever that connection ends or fails, retrying with a 
+  growing interval (up to 4 s) while the server is not up, so it
+  stays in the pool of every server run there. A broadcast from a
+  server the worker is already connected to is ignored. 
+  <server address> may also be the path of a Unix socket (starting
+  with '/') that a server on the same host, such as a host-local 
+  combiner, listens to with -u. The worker then also hands the 
+  server a shared-memory channel (see shmChannel.c) after its
+  Benchmark, and the messages of that connection go through it.
+  Connections are made through the transport layer (see transport.c).
+  Then, it sends the server the 
+  measured time and <benchmark delta> in a Benchmark structure,
+  together with its hardware capabilities (cores, SIMD level, 
+  NUMA nodes, cache sizes, cgroup CPU quota) and the throughput
+  measured for 1, 2, 4, ... up to <number of threads> threads. 
   After that, it receives the starting and ending points of 
   integration interval and the integration step from the 
   server in a Request structure.
 
+  Unless <number of threads> is given (or is 0 or "auto"), the
+  number of threads is one per physical core in the CPU affinity
+  mask, limited by the cgroup CPU quota; threads are pinned to
+  distinct physical cores before SMT siblings are used, and the
+  resulting layout is reported in the Benchmark. On NUMA machines
+  each node gets its own sub-pool of threads and its share of the
+  interval, with the sub-pool's state allocated on the node.
+
   Then the program computes the integral (the function
-  being hard-coded), possibly with many threads,
-  sends the result back to the server in a Response structure 
-  closes the socket to server and waits for another request.
+  being hard-coded), possibly with many threads, and
+  sends the result back to the server in a Response structure.
+  The server may send any number of requests (chunks) on the same
+  connection, keeping up to <outstanding chunks> (2 by default) of
+  them in flight, so the next chunk has already arrived when the
+  current one is done. The connection is closed once the server
+  says it has no more requests.
+
+  Every <heartbeat interval in ms> (1000 by default) the worker
+  sends each server a Heartbeat with the progress of the request
+  it is computing for it, if any: fraction done, partial sum
+  and evaluation rate.
+
+  A server may cancel a request with a Cancel message, and a 
+  request may carry a deadline. A cancelled request is dropped
+  from the queue or stopped at the next block boundary if it is
+  running; either way it is answered with a Response whose status
+  says why it was stopped, together with the partial sum. Closing
+  the connection cancels every request of that server.
+
+  A progressive request is first computed with a coarse step 
+  (1024 steps over the interval), then the step is halved again
+  and again until it is no larger than the requested delta (so
+  it ends up to twice as fine), or until the estimated error is
+  below the request's tolerance. Each refinement only evaluates
+  the function at the new midpoints, so a progressive request
+  costs no more evaluations than computing it once with its
+  delta. After each refinement the worker sends an Estimate: the
+  Richardson extrapolation of the last two results and its 
+  estimated error.
+
+  Every message is preceded by a MessageHeader (see common.h).
+
+  The worker records trace spans (see trace.c) of how each request
+  is received, waits in the queue, is computed (on each thread) and
+  sent back, and of every handshake. A server that asks with 
+  MESSAGE_TRACE gets the spans since the time it gives; every 
+  Response carries the time its request came in and went out, for
+  the server to tell the offset between the two clocks.
+
+  Neither the event loop nor the compute threads format or write
+  their log messages: LOG() copies its arguments into a per-thread
+  ring that a logging thread drains (see logging.c). -l sets how
+  much is logged; debug adds a line for every request and result.
+
+  With -m, the worker answers HTTP requests on <metrics port> (or on
+  the Unix socket at <metrics socket path>) with its metrics in 
+  Prometheus' text format (see metrics.c): requests, evaluations, 
+  bytes and failures, the servers connected, the queue depth and the
+  threads computing, and histograms of the compute time of each 
+  request, of its time from arrival to the response going out, and
+  of the handshake with each server.
+
+  With -e, each thread counts the cycles, instructions, branch misses
+  and cache misses of its share of a request with perf_event_open()
+  (see perfCounters.c); they are summed per request, sent back in the
+  Response and added to the metrics. Where the kernel doesn't allow
+  it, the worker says so once and carries on without them.
+
+  -s makes the worker <slowdown> times slower than its benchmark says,
+  to see how the server copes with a straggler (see clusterBench.c):
+  after every block of steps, each compute thread idles for <slowdown>
+  - 1 times as long as the block took (see integral.c), so heartbeats
+  report the progress of a slow machine and cancels and the deadline
+  still stop it. The benchmark itself runs at full speed, as on a
+  node that something else slows down once the pool is formed.
+
+  All network I/O runs in a single epoll event loop over
+  non-blocking sockets, so the worker keeps answering broadcasts
+  and talking to any number of servers while it computes. 
+  Received requests go to a bounded queue (<job queue size> jobs, 
+  16 by default) served by a compute thread that runs them one
+  after another on the worker's threads; while the queue is full,
+  broadcasts are ignored, and a request is answered right away with
+  a RESPONSE_REJECTED Response for the server to send it elsewhere.
 */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/socket.h>
 #include <sys/types.h>
-#include <sys/time.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netdb.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #include "integral.h"
+#include "hardware.h"
+#include "jobQueue.h"
+#include "transport.h"
+#include "trace.h"
+#include "metrics.h"
+#include "perfCounters.h"
 #include "common.h"
 
+#define DEFAULT_JOB_QUEUE_SIZE 16
+#define MAX_CONNECTIONS 256
+#define MAX_EVENTS 64
+#define OUT_BUFFER_SIZE 16384
+#define DEFAULT_CREDITS 2
+#define DEFAULT_HEARTBEAT_INTERVAL_MS 1000
+#define MAX_CANCELLED_JOBS 256
+#define COARSE_STEPS 1024
+#define MIN_REGISTRATION_RETRY_MS 250
+#define MAX_REGISTRATION_RETRY_MS 4000
+
+// epoll tags of the sockets that are not server connections
+#define DISCOVERY_TAG   MAX_CONNECTIONS
+#define COMPLETION_TAG  ( MAX_CONNECTIONS + 1)
+#define HEARTBEAT_TAG   ( MAX_CONNECTIONS + 2)
+#define REGISTRATION_TAG  ( MAX_CONNECTIONS + 3)
+#define PENDING_TAG       ( MAX_CONNECTIONS + 4)
+#define CHANNEL_TAG       ( MAX_CONNECTIONS + 8)  // + the slot of the connection
+
 struct Args
 {
   int listeningPort; 
   int serverPort; 
   int numberOfThreads;
   double benchmarkDelta;
+  int jobQueueSize;
+  int credits;
+  int heartbeatIntervalMs;
+  const char *registrationHost;  // NULL: wait for broadcasts only
+  const char *multicastGroup;    // NULL: broadcasts only
+  const char *metricsAddress;    // NULL: no metrics endpoint
+  bool usePerfCounters;
+  double slowdown;  // 1 for none
 };
 typedef struct Args Args;
 
+// Ids of the worker's metrics (see metrics.h)
+struct WorkerMetrics
+{
+  int requests;
+  int requestsDone;
+  int requestsStopped;
+  int requestsDropped;
+  int evaluations;
+  int bytesSent;
+  int bytesReceived;
+  int connectionFailures;
+  int computeFailures;
+  int connectedServers;
+  int queuedJobs;
+  int busyThreads;
+  int compute;
+  int requestLatency;
+  int handshake;
+  int cycles;
+  int instructions;
+  int branchMisses;
+  int cacheMisses;
+};
+typedef struct WorkerMetrics WorkerMetrics;
+
+static WorkerMetrics metrics;
+
+enum ConnectionState
+{
+  CONNECTION_FREE,
+  CONNECTION_PENDING,  // to connect at connectAtMs, answering an announcement
+  CONNECTION_CONNECTING,
+  CONNECTION_OPEN,
+  CONNECTION_DONE  // the server has no more requests for us
+};
+
+struct Connection
+{
+  int state;
+  long id;
+  Transport transport;
+  struct sockaddr_in serverAddress;
+  double connectAtMs;
+  int outstandingJobs;
+  bool isRegistration;  // to the server the worker registers with
+  uint64_t connectStartNs;  // for the handshake span
+  // Trace records the server asked for, sent as the buffer empties
+  TraceRecord *traceRecords;  // NULL if none
+  int numberOfTraceRecords;
+  int nextTraceRecord;
+  char inBuffer[ sizeof( MessageHeader) + MAX_MESSAGE_LENGTH];
+  size_t inLength;
+  char outBuffer[ OUT_BUFFER_SIZE];
+  size_t outLength;
+  size_t outOffset;
+};
+typedef struct Connection Connection;
+
+struct CancelledJob
+{
+  int connectionSlot;
+  long connectionId;
+  int requestId;  // -1 for every request of the connection
+};
+typedef struct CancelledJob CancelledJob;
+
+struct Worker
+{
+  int epollFd;
+  int discoverySocket;
+  int completionFd;  // eventfd the compute thread signals
+  int serverPort;
+  const Benchmark *benchmark;
+  const CpuLayout *cpuLayout;
+  bool usePerfCounters;
+  double slowdown;
+  JobQueue pendingJobs;
+  JobQueue completedJobs;
+  JobQueue estimates;  // of running jobs; dropped when it is full
+  Connection connections[ MAX_CONNECTIONS];
+  long nextConnectionId;
+
+  int heartbeatFd;  // timerfd
+  // The job the compute thread is running, for heartbeats
+  pthread_mutex_t runningJobMutex;
+  bool isJobRunning;
+  Job runningJob;
+  double runningJobStartMs;
+  IntegrationProgress progress;
+  CancellationToken cancellation;  // of the running job
+  // Queued jobs to skip, the oldest being overwritten
+  CancelledJob cancelledJobs[ MAX_CANCELLED_JOBS];
+  int numberOfCancelledJobs;
+
+  // Registration with a configured server (-r)
+  bool isRegistering;
+  struct sockaddr_in registrationAddress;  // 127.0.0.1:0 if local
+  bool isLocalRegistration;  // over a Unix socket
+  struct sockaddr_un localRegistrationAddress;
+  int registrationFd;  // one-shot timerfd for the next attempt
+  int registrationRetryMs;
+
+  int pendingFd;  // timerfd for the earliest pending connection
+  unsigned int randomSeed;
+};
+typedef struct Worker Worker;
+
+static void printUsageAndDie();
+static void printErrorAndDie(const char *msg);
 static void parseArgumentsOrDie( int argc, char **argv, Args *argsOut);
-static  int createWorkerSocketOrDie( int listenPort);
-static bool waitForServerAddress( int workerSocket, int serverPort, struct sockaddr_in *serverAddressOut);
-static bool createServerSocket( struct sockaddr_in serverAddress, int *serverSocketOut);
-static bool receiveRequest( int serverSocket, struct sockaddr_in serverAddress, Request *requestOut);
-static bool computeIntegral( Request request, int numberOfThreads, Response *responseOut);
-static bool sendResponse( int serverSocket, struct sockaddr_in serverAddress, Response response);
-static void doBenchmark( int numberOfThreads, double benchmarkDelta, Benchmark *benchmarkOut);
-static bool sendBenchmark( int serverSocket, struct sockaddr_in serverAddress, Benchmark benchmark);
+static  int createWorkerSocketOrDie( int listenPort, const char *multicastGroup);
+static void initWorkerOrDie( Worker *worker, const Args *args, const Benchmark *benchmark, 
+  const CpuLayout *cpuLayout);
+static void runEventLoop( Worker *worker);
+static double nowMs();
+static void *runComputeThread( Worker *worker);
+static bool waitForServerAddress( int workerSocket, int serverPort, struct sockaddr_in *serverAddressOut,
+  int *replyWindowMsOut);
+static void deferConnection( Worker *worker, struct sockaddr_in serverAddress, int replyWindowMs);
+static void onPendingTimer( Worker *worker);
+static bool createServerSocket( Worker *worker, struct sockaddr_in serverAddress);
+static void scheduleRegistration( Worker *worker);
+static void onRegistrationTimer( Worker *worker);
+static void onConnectionEvent( Worker *worker, Connection *connection, uint32_t events);
+static void receiveMessages( Worker *worker, Connection *connection);
+static void onJobsCompleted( Worker *worker);
+static void onHeartbeatTimer( Worker *worker);
+static bool computeIntegral( Request request, const CpuLayout *cpuLayout, double slowdown,
+  IntegrationProgress *progress, CancellationToken *cancellation, PerfCounts *perfCounts,
+  Response *responseOut);
+static bool refineIntegral( Worker *worker, const Job *job, PerfCounts *perfCounts,
+  Response *responseOut);
+static void doBenchmark( const HardwareInfo *hardware, const CpuLayout *cpuLayout,
+  double benchmarkDelta, Benchmark *benchmarkOut);
+static void defineWorkerMetrics();
+static void countPerf( const PerfCounts *perfCounts);
 
 static double functionToIntegrate( double x)
 {
@@ -73,73 +346,63 @@ int main( int argc, char **argv)
 {
   Args args;
   parseArgumentsOrDie( argc, argv, &args);
+  defineWorkerMetrics();
+  if ( args.metricsAddress && !serveMetrics( args.metricsAddress))
+    printErrorAndDie( "Error when creating the metrics socket");
 
-  Benchmark benchmark;
-  doBenchmark( args.numberOfThreads, args.benchmarkDelta, &benchmark);
-
-  int workerSocket = createWorkerSocketOrDie( args.listeningPort);
-
-  for( ;;) 
-  {
-    struct sockaddr_in serverAddress;
-    if ( !waitForServerAddress( workerSocket, args.serverPort, &serverAddress))
-      continue;
-    
-    int serverSocket;
-    if ( !createServerSocket( serverAddress, &serverSocket))
-      continue;
-
-    if ( !sendBenchmark( serverSocket, serverAddress, benchmark)) 
-    {
-      close( serverSocket);
-      continue;    
-    }
-
-    Request request;
-    if ( !receiveRequest( serverSocket, serverAddress, &request)) 
-    {
-      close( serverSocket);
-      continue;
-    }
+  HardwareInfo hardware;
+  detectHardware( &hardware);
+  CpuLayout cpuLayout;
+  detectCpuLayout( hardware.cpuQuota, args.numberOfThreads, &cpuLayout);
 
-    Response response;
-    if ( !computeIntegral( request, args.numberOfThreads, &response)) 
-    {
-      close( serverSocket);
-      continue;
-    }
+  Benchmark benchmark;
+  doBenchmark( &hardware, &cpuLayout, args.benchmarkDelta, &benchmark);
+  benchmark.credits = args.credits;
 
-    if ( !sendResponse( serverSocket, serverAddress, response)) 
-    {
-      close( serverSocket);
-      continue;
-    }
+  static Worker worker;
+  initWorkerOrDie( &worker, &args, &benchmark, &cpuLayout);
+  if ( worker.isRegistering)
+    onRegistrationTimer( &worker);
 
-    close( serverSocket);
-  } 
+  pthread_t computeThread;
+  if ( pthread_create( &computeThread, NULL, ( void * (*)( void *)) runComputeThread, &worker))
+    printErrorAndDie( "Error when starting the compute thread");
 
-  close( workerSocket);
+  runEventLoop( &worker);
 }
 
 static void printUsageAndDie()
 {
-  fprintf( stderr, "Usage: worker <listening port> <server port> "
-    "[<number of threads>]\n");
+  flushLog();
+  fprintf( stderr, "Usage: worker [-q <job queue size>] [-p <outstanding chunks>]\n"
+    "       [-b <heartbeat interval in ms>] [-r <server address>|<socket path>]\n"
+    "       [-g <multicast group>] [-l error|warn|info|debug]\n"
+    "       [-m <metrics port>|<metrics socket path>] [-e] [-s <slowdown>]\n"
+    "       <listening port> <server port> [<number of threads>|auto] [<benchmark delta>]\n");
   exit( EXIT_FAILURE);
 }
 
 static void printErrorAndDie(const char *msg)
 {
-  fprintf( stderr, "%s: %s\n", msg, strerror( errno));
+  int error = errno;
+  flushLog();
+  fprintf( stderr, "%s: %s\n", msg, strerror( error));
   exit( EXIT_FAILURE);
 }
 
-static int createWorkerSocketOrDie( int listeningPort)
+static int createWorkerSocketOrDie( int listeningPort, const char *multicastGroup)
 {
   int workerSocket = socket( AF_INET, SOCK_DGRAM, 0);
   if ( workerSocket < 0)
     printErrorAndDie("Error when creating worker socket");
 
+  if ( multicastGroup)
+  {
+    int on = 1;
+    if ( setsockopt( workerSocket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof( on)) < 0)
+      printErrorAndDie( "Error when calling setsockopt()");
+  }
+
   struct sockaddr_in listeningAddr;
   listeningAddr.sin_family = AF_INET;
   listeningAddr.sin_addr.s_addr = htonl( INADDR_ANY);
@@ -149,33 +412,372 @@ static int createWorkerSocketOrDie( int listeningPort)
         sizeof(listeningAddr)) < 0)
     printErrorAndDie( "Error when binding the worker socket");
 
+  if ( multicastGroup)
+  {
+    struct ip_mreq membership;
+    memset( &membership, 0, sizeof( membership));
+    if ( !inet_pton( AF_INET, multicastGroup, &membership.imr_multiaddr) ||
+         !IN_MULTICAST( ntohl( membership.imr_multiaddr.s_addr)))
+    {
+      fprintf( stderr, "Error: invalid <multicast group> %s\n", multicastGroup);
+      exit( EXIT_FAILURE);
+    }
+    membership.imr_interface.s_addr = htonl( INADDR_ANY);
+    if ( setsockopt( workerSocket, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, 
+          sizeof( membership)) < 0)
+      printErrorAndDie( "Error when joining the multicast group");
+  }
+
   return workerSocket;
 }
 
+static void resolveRegistrationAddressOrDie( Worker *worker, const char *host)
+{
+  struct addrinfo hints;
+  memset( &hints, 0, sizeof( hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo *addresses;
+  if ( getaddrinfo( host, NULL, &hints, &addresses) || !addresses)
+  {
+    fprintf( stderr, "Error: can't resolve <server address> %s\n", host);
+    exit( EXIT_FAILURE);
+  }
+  memcpy( &worker->registrationAddress, addresses->ai_addr, sizeof( struct sockaddr_in));
+  worker->registrationAddress.sin_port = htons( worker->serverPort);
+  freeaddrinfo( addresses);
+}
+
+static void initRegistrationOrDie( Worker *worker, const char *host)
+{
+  if ( host[ 0] == '/')
+  {
+    if ( strlen( host) >= sizeof( worker->localRegistrationAddress.sun_path))
+    {
+      fprintf( stderr, "Error: the socket path %s is too long\n", host);
+      exit( EXIT_FAILURE);
+    }
+    worker->isLocalRegistration = true;
+    worker->localRegistrationAddress.sun_family = AF_UNIX;
+    strcpy( worker->localRegistrationAddress.sun_path, host);
+    // Only tells the connection apart from the TCP ones
+    worker->registrationAddress.sin_family = AF_INET;
+    worker->registrationAddress.sin_addr.s_addr = htonl( INADDR_LOOPBACK);
+    worker->registrationAddress.sin_port = 0;
+  }
+  else
+    resolveRegistrationAddressOrDie( worker, host);
+
+  worker->registrationFd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK);
+  if ( worker->registrationFd < 0)
+    printErrorAndDie( "Error when creating timerfd");
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.u32 = REGISTRATION_TAG;
+  if ( epoll_ctl( worker->epollFd, EPOLL_CTL_ADD, worker->registrationFd, &event) < 0)
+    printErrorAndDie( "Error when adding timerfd to epoll");
+  worker->registrationRetryMs = MIN_REGISTRATION_RETRY_MS;
+  worker->isRegistering = true;
+}
+
+static void initWorkerOrDie( Worker *worker, const Args *args, const Benchmark *benchmark, 
+  const CpuLayout *cpuLayout)
+{
+  memset( worker, 0, sizeof( *worker));
+  worker->serverPort = args->serverPort;
+  worker->benchmark = benchmark;
+  worker->cpuLayout = cpuLayout;
+  worker->usePerfCounters = args->usePerfCounters;
+  worker->slowdown = args->slowdown;
+
+  // The completed queue also holds the job being computed, so it never
+  // overflows; estimates have their own so they can't take its room
+  if ( !initJobQueue( &worker->pendingJobs, args->jobQueueSize) ||
+       !initJobQueue( &worker->completedJobs, args->jobQueueSize + 1) ||
+       !initJobQueue( &worker->estimates, args->jobQueueSize))
+    printErrorAndDie( "Error when allocating the job queues");
+
+  worker->epollFd = epoll_create1( 0);
+  if ( worker->epollFd < 0)
+    printErrorAndDie( "Error when creating epoll instance");
+
+  worker->discoverySocket = createWorkerSocketOrDie( args->listeningPort, args->multicastGroup);
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.u32 = DISCOVERY_TAG;
+  if ( epoll_ctl( worker->epollFd, EPOLL_CTL_ADD, worker->discoverySocket, &event) < 0)
+    printErrorAndDie( "Error when adding the worker socket to epoll");
+
+  worker->completionFd = eventfd( 0, EFD_NONBLOCK);
+  if ( worker->completionFd < 0)
+    printErrorAndDie( "Error when creating eventfd");
+  event.events = EPOLLIN;
+  event.data.u32 = COMPLETION_TAG;
+  if ( epoll_ctl( worker->epollFd, EPOLL_CTL_ADD, worker->completionFd, &event) < 0)
+    printErrorAndDie( "Error when adding eventfd to epoll");
+
+  pthread_mutex_init( &worker->runningJobMutex, NULL);
+  worker->heartbeatFd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK);
+  if ( worker->heartbeatFd < 0)
+    printErrorAndDie( "Error when creating timerfd");
+  struct itimerspec interval;
+  interval.it_interval.tv_sec = args->heartbeatIntervalMs / 1000;
+  interval.it_interval.tv_nsec = ( args->heartbeatIntervalMs % 1000) * 1000000L;
+  interval.it_value = interval.it_interval;
+  if ( timerfd_settime( worker->heartbeatFd, 0, &interval, NULL) < 0)
+    printErrorAndDie( "Error when starting the heartbeat timer");
+  event.events = EPOLLIN;
+  event.data.u32 = HEARTBEAT_TAG;
+  if ( epoll_ctl( worker->epollFd, EPOLL_CTL_ADD, worker->heartbeatFd, &event) < 0)
+    printErrorAndDie( "Error when adding timerfd to epoll");
+
+  worker->pendingFd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK);
+  if ( worker->pendingFd < 0)
+    printErrorAndDie( "Error when creating timerfd");
+  event.events = EPOLLIN;
+  event.data.u32 = PENDING_TAG;
+  if ( epoll_ctl( worker->epollFd, EPOLL_CTL_ADD, worker->pendingFd, &event) < 0)
+    printErrorAndDie( "Error when adding timerfd to epoll");
+  worker->randomSeed = ( unsigned int) time( NULL) ^ ( unsigned int) getpid();
+
+  if ( args->registrationHost)
+    initRegistrationOrDie( worker, args->registrationHost);
+}
+
+static Connection *findConnectionTo( Worker *worker, struct sockaddr_in serverAddress)
+{
+  for ( int i = 0; i < MAX_CONNECTIONS; ++i)
+  {
+    Connection *connection = &worker->connections[ i];
+    if ( connection->state != CONNECTION_FREE && 
+         connection->serverAddress.sin_addr.s_addr == serverAddress.sin_addr.s_addr &&
+         connection->serverAddress.sin_port == serverAddress.sin_port)
+      return connection;
+  }
+  return NULL;
+}
+
+static void runEventLoop( Worker *worker)
+{
+  struct epoll_event events[ MAX_EVENTS];
+  for ( ;;)
+  {
+    int numberOfEvents = epoll_wait( worker->epollFd, events, MAX_EVENTS, -1);
+    if ( numberOfEvents < 0)
+    {
+      if ( errno == EINTR)
+        continue;
+      printErrorAndDie( "Error when calling epoll_wait()");
+    }
+
+    for ( int i = 0; i < numberOfEvents; ++i)
+    {
+      uint32_t tag = events[ i].data.u32;
+      if ( tag == DISCOVERY_TAG)
+      {
+        struct sockaddr_in serverAddress;
+        int replyWindowMs = 0;
+        while ( waitForServerAddress( worker->discoverySocket, worker->serverPort, &serverAddress,
+                  &replyWindowMs))
+        {
+          if ( isJobQueueFull( &worker->pendingJobs))
+          {
+            LOG_WARN( "Job queue is full, ignoring the request\n");
+            continue;
+          }
+          if ( findConnectionTo( worker, serverAddress))
+          {
+            LOG_WARN( "Already connected to the server, ignoring the request\n");
+            continue;
+          }
+          if ( replyWindowMs > 0)
+            deferConnection( worker, serverAddress, replyWindowMs);
+          else
+            createServerSocket( worker, serverAddress);
+        }
+      }
+      else if ( tag == COMPLETION_TAG)
+        onJobsCompleted( worker);
+      else if ( tag == HEARTBEAT_TAG)
+        onHeartbeatTimer( worker);
+      else if ( tag == REGISTRATION_TAG)
+        onRegistrationTimer( worker);
+      else if ( tag == PENDING_TAG)
+        onPendingTimer( worker);
+      else if ( tag >= CHANNEL_TAG)
+        receiveMessages( worker, &worker->connections[ tag - CHANNEL_TAG]);
+      else
+        onConnectionEvent( worker, &worker->connections[ tag], events[ i].events);
+    }
+  }
+}
+
+static bool isCancelledJob( const CancelledJob *cancelled, const Job *job)
+{
+  return cancelled->connectionSlot == job->connectionSlot && 
+    cancelled->connectionId == job->connectionId &&
+    ( cancelled->requestId < 0 || cancelled->requestId == job->request.id);
+}
+
+// Called with runningJobMutex held
+static bool isJobCancelled( const Worker *worker, const Job *job)
+{
+  int numberOfCancelledJobs = ( worker->numberOfCancelledJobs < MAX_CANCELLED_JOBS)?
+    worker->numberOfCancelledJobs : MAX_CANCELLED_JOBS;
+  for ( int i = 0; i < numberOfCancelledJobs; ++i)
+  {
+    if ( isCancelledJob( &worker->cancelledJobs[ i], job))
+      return true;
+  }
+  return false;
+}
+
+// Answers a job that was stopped before it started
+static void stopJob( Job *job, int status)
+{
+  memset( &job->response, 0, sizeof( job->response));
+  job->response.id = job->request.id;
+  job->response.status = status;
+  job->isOk = true;
+}
+
+static void signalCompletion( Worker *worker)
+{
+  uint64_t one = 1;
+  if ( write( worker->completionFd, &one, sizeof( one)) != sizeof( one))
+    LOG_ERROR( "Error when signalling a completed job\n");
+}
+
+// A response is never dropped: should the queue be full after all,
+// waits for the event loop to make room
+static void pushCompletedJob( Worker *worker, const Job *job)
+{
+  bool isWaiting = false;
+  while ( !tryPushJob( &worker->completedJobs, job))
+  {
+    if ( !isWaiting)
+      LOG_WARN( "Too many results waiting, holding the result of task #%d\n", job->request.id);
+    isWaiting = true;
+    signalCompletion( worker);
+    struct timespec pause;
+    pause.tv_sec = 0;
+    pause.tv_nsec = 1000000L;
+    nanosleep( &pause, NULL);
+  }
+  signalCompletion( worker);
+}
+
+static void *runComputeThread( Worker *worker)
+{
+  for ( ;;)
+  {
+    Job job;
+    popJob( &worker->pendingJobs, &job);
+    addToGauge( metrics.queuedJobs, -1);
+    traceSpan( "waiting", job.receivedNs, job.request.id);
+
+    pthread_mutex_lock( &worker->runningJobMutex);
+    bool isCancelled = isJobCancelled( worker, &job);
+    bool isExpired = job.deadlineMs > 0 && nowMs() >= job.deadlineMs;
+    if ( !isCancelled && !isExpired)
+    {
+      worker->isJobRunning = true;
+      worker->runningJob = job;
+      worker->runningJobStartMs = nowMs();
+      memset( &worker->progress, 0, sizeof( worker->progress));
+      worker->cancellation.stop_reason = 0;
+      worker->cancellation.deadline = job.deadlineMs / 1000.0;
+    }
+    pthread_mutex_unlock( &worker->runningJobMutex);
+
+    if ( isCancelled || isExpired)
+    {
+      LOG_DEBUG( "Task #%d was %s before it started\n", job.request.id,
+        ( isCancelled)? "cancelled" : "out of time");
+      stopJob( &job, ( isCancelled)? RESPONSE_CANCELLED : RESPONSE_DEADLINE_EXCEEDED);
+    }
+    else
+    {
+      PerfCounts perfCounts;
+      memset( &perfCounts, 0, sizeof( perfCounts));
+      PerfCounts *countsOrNull = ( worker->usePerfCounters)? &perfCounts : NULL;
+      setGauge( metrics.busyThreads, worker->cpuLayout->numberOfThreads);
+      uint64_t computeStartNs = traceNowNs();
+      if ( job.request.isProgressive)
+        job.isOk = refineIntegral( worker, &job, countsOrNull, &job.response);
+      else
+        job.isOk = computeIntegral( job.request, worker->cpuLayout, worker->slowdown,
+          &worker->progress, &worker->cancellation, countsOrNull, &job.response);
+      recordHistogramNs( metrics.compute, traceNowNs() - computeStartNs);
+      setGauge( metrics.busyThreads, 0);
+      job.response.perfCounts = perfCounts;
+      countPerf( &perfCounts);
+    }
+    if ( !job.isOk)
+      addToCounter( metrics.computeFailures, 1);
+    else if ( job.response.status == RESPONSE_OK)
+      addToCounter( metrics.requestsDone, 1);
+    else
+      addToCounter( metrics.requestsStopped, 1);
+
+    pthread_mutex_lock( &worker->runningJobMutex);
+    worker->isJobRunning = false;
+    pthread_mutex_unlock( &worker->runningJobMutex);
+
+    pushCompletedJob( worker, &job);
+  }
+  return NULL;
+}
+
+// Hands an estimate of a running job to the event loop
+static void publishEstimate( Worker *worker, const Job *job, const Estimate *estimate)
+{
+  Job update = *job;
+  update.estimate = *estimate;
+  if ( !tryPushJob( &worker->estimates, &update))
+  {
+    LOG_WARN( "Too many estimates waiting, dropping one\n");
+    return;
+  }
+  signalCompletion( worker);
+}
+
+static double nowMs()
+{
+  struct timespec now;
+  clock_gettime( CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+}
+
 static int waitForServerAddressHelper( int workerSocket, 
-  struct sockaddr_in *serverAddressOut)
+  struct sockaddr_in *serverAddressOut, int *replyWindowMsOut)
 {
   struct sockaddr_in serverAddress;
   socklen_t addressLength = sizeof( serverAddress);
-  char buf;
+  Announcement announcement;
 
-  ssize_t recvStatus = recvfrom( workerSocket, ( void*) &buf, 1,
-    0, ( struct sockaddr*) &serverAddress, &addressLength);
+  ssize_t recvStatus = recvfrom( workerSocket, ( void*) &announcement, sizeof( announcement),
+    MSG_DONTWAIT, ( struct sockaddr*) &serverAddress, &addressLength);
 
   if ( recvStatus > 0)
+  {
     *serverAddressOut = serverAddress;
+    // Any other datagram asks to connect right away
+    *replyWindowMsOut = ( recvStatus == sizeof( announcement) && announcement.replyWindowMs > 0)?
+      announcement.replyWindowMs : 0;
+  }
 
   return recvStatus;
 }
 
 static bool waitForServerAddress( int workerSocket, int serverPort, 
-  struct sockaddr_in *serverAddressOut)
+  struct sockaddr_in *serverAddressOut, int *replyWindowMsOut)
 {
-  int error;
-  error = waitForServerAddressHelper( workerSocket, serverAddressOut);
-  if ( !error) 
+  int recvStatus = waitForServerAddressHelper( workerSocket, serverAddressOut, replyWindowMsOut);
+  if ( recvStatus <= 0) 
   {
-    LOG( "Error when processing a request");
+    if ( recvStatus < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+      LOG_ERROR( "Error when processing a request\n");
     return false;
   }
   serverAddressOut->sin_port = htons( serverPort);
@@ -183,169 +785,977 @@ static bool waitForServerAddress( int workerSocket, int serverPort,
   return true;
 }
 
-static int createServerSocketHelper( struct sockaddr_in serverAddress, 
-  int *serverSocketOut)
+static Connection *allocateConnection( Worker *worker)
 {
-  int serverSocket = socket( AF_INET, SOCK_STREAM, 0);
-  int connectStatus = connect( serverSocket, (struct sockaddr*) &serverAddress, 
-    sizeof( serverAddress));
-  if ( connectStatus)
-    return connectStatus;
-  *serverSocketOut = serverSocket;
-  return 0;
+  for ( int i = 0; i < MAX_CONNECTIONS; ++i)
+  {
+    Connection *connection = &worker->connections[ i];
+    if ( connection->state != CONNECTION_FREE)
+      continue;
+    connection->id = ++ worker->nextConnectionId;
+    connection->transport.socket = -1;
+    connection->transport.channel = NULL;
+    connection->outstandingJobs = 0;
+    connection->isRegistration = false;
+    connection->inLength = 0;
+    connection->outLength = 0;
+    connection->outOffset = 0;
+    connection->traceRecords = NULL;
+    return connection;
+  }
+  return NULL;
 }
 
-static bool createServerSocket( struct sockaddr_in serverAddress, 
-  int *serverSocketOut)
+// Stops the connection's request (or all of them, for requestId -1)
+// if it is running, and makes the compute thread skip it otherwise
+static void cancelJobs( Worker *worker, Connection *connection, int requestId)
 {
-  int error = createServerSocketHelper( serverAddress, serverSocketOut);
-  if ( error) 
+  CancelledJob cancelled;
+  cancelled.connectionSlot = connection - worker->connections;
+  cancelled.connectionId = connection->id;
+  cancelled.requestId = requestId;
+
+  pthread_mutex_lock( &worker->runningJobMutex);
+  if ( worker->isJobRunning && isCancelledJob( &cancelled, &worker->runningJob))
+    cancel_integration( &worker->cancellation);
+  worker->cancelledJobs[ worker->numberOfCancelledJobs % MAX_CANCELLED_JOBS] = cancelled;
+  worker->numberOfCancelledJobs ++;
+  pthread_mutex_unlock( &worker->runningJobMutex);
+}
+
+static void closeConnection( Worker *worker, Connection *connection)
+{
+  if ( connection->outstandingJobs > 0)
+    cancelJobs( worker, connection, -1);
+  Transport *transport = &connection->transport;
+  if ( transport->socket >= 0)
   {
-    LOG( "Failed to connect to server at %s:%d\n", inet_ntoa( serverAddress.sin_addr),
+    epoll_ctl( worker->epollFd, EPOLL_CTL_DEL, transport->socket, NULL);
+    if ( transportEventFd( transport) != transport->socket)
+      epoll_ctl( worker->epollFd, EPOLL_CTL_DEL, transportEventFd( transport), NULL);
+  }
+  closeTransport( transport);
+  free( connection->traceRecords);
+  connection->traceRecords = NULL;
+  if ( connection->state == CONNECTION_OPEN || connection->state == CONNECTION_DONE)
+    addToGauge( metrics.connectedServers, -1);
+  connection->state = CONNECTION_FREE;
+  if ( connection->isRegistration)
+    scheduleRegistration( worker);
+}
+
+static bool watchConnection( Worker *worker, Connection *connection, int op, uint32_t events)
+{
+  struct epoll_event event;
+  event.events = events;
+  event.data.u32 = connection - worker->connections;
+  return epoll_ctl( worker->epollFd, op, connection->transport.socket, &event) == 0;
+}
+
+// Starts connecting an allocated connection; it stays free on failure
+static bool connectConnection( Worker *worker, Connection *connection, 
+  struct sockaddr_in serverAddress)
+{
+  bool isConnecting = ( connection->isRegistration && worker->isLocalRegistration)?
+    connectTransport( ( struct sockaddr*) &worker->localRegistrationAddress,
+      sizeof( worker->localRegistrationAddress), true, &connection->transport) :
+    connectTransport( ( struct sockaddr*) &serverAddress, sizeof( serverAddress), true,
+      &connection->transport);
+  if ( !isConnecting) 
+  {
+    LOG_WARN( "Failed to connect to server at %s:%d\n", inet_ntoa( serverAddress.sin_addr),
       ntohs( serverAddress.sin_port));
     return false;
   }
-  LOG( "Connected to %s:%d\n", inet_ntoa( serverAddress.sin_addr),
-    ntohs( serverAddress.sin_port));
+  connection->serverAddress = serverAddress;
+  connection->state = CONNECTION_CONNECTING;
+  connection->connectStartNs = traceNowNs();
+  if ( !watchConnection( worker, connection, EPOLL_CTL_ADD, EPOLLOUT))
+  {
+    closeTransport( &connection->transport);
+    connection->state = CONNECTION_FREE;
+    return false;
+  }
   return true;
 }
 
-static void parseArgumentsOrDie( int argc, char **argv, Args *argsOut)
+static bool createServerSocket( Worker *worker, struct sockaddr_in serverAddress)
 {
-  if ( argc < 3)
-    printUsageAndDie();
-  argsOut->listeningPort = atoi( argv[1]);
-  argsOut->serverPort = atoi( argv[2]);
+  Connection *connection = allocateConnection( worker);
+  if ( !connection)
+  {
+    LOG_WARN( "Too many connections, ignoring %s:%d\n", inet_ntoa( serverAddress.sin_addr),
+      ntohs( serverAddress.sin_port));
+    return false;
+  }
+  return connectConnection( worker, connection, serverAddress);
+}
 
-  int numberOfThreads = 1;
-  if ( argc >= 4)
+// Arms the pending timer for the earliest pending connection, if any
+static void armPendingTimer( Worker *worker)
+{
+  double earliestMs = 0.0;
+  for ( int i = 0; i < MAX_CONNECTIONS; ++i)
   {
-    numberOfThreads = atoi( argv[3]);
-    if ( numberOfThreads < 1)
-      printErrorAndDie( "Error: <number of threads> must be a positive integer");
+    Connection *connection = &worker->connections[ i];
+    if ( connection->state == CONNECTION_PENDING && 
+         ( earliestMs == 0.0 || connection->connectAtMs < earliestMs))
+      earliestMs = connection->connectAtMs;
   }
-  argsOut->numberOfThreads = numberOfThreads;
+  struct itimerspec timeout;
+  memset( &timeout, 0, sizeof( timeout));
+  if ( earliestMs > 0.0)
+  {
+    double delayMs = earliestMs - nowMs();
+    if ( delayMs < 1)
+      delayMs = 1;  // a zero it_value would disarm the timer
+    timeout.it_value.tv_sec = ( time_t) ( delayMs / 1000);
+    timeout.it_value.tv_nsec = ( long) ( ( delayMs - timeout.it_value.tv_sec * 1000.0) * 1000000L);
+  }
+  if ( timerfd_settime( worker->pendingFd, 0, &timeout, NULL) < 0)
+    LOG_ERROR( "Error when arming the pending connection timer\n");
+}
 
-  argsOut->benchmarkDelta = 10e-9;
-  if ( argc >= 5)
+// Answers an announcement after a random delay within the reply window
+static void deferConnection( Worker *worker, struct sockaddr_in serverAddress, int replyWindowMs)
+{
+  Connection *connection = allocateConnection( worker);
+  if ( !connection)
   {
-    argsOut->benchmarkDelta = atof( argv[4]);
-    if ( argsOut->benchmarkDelta <= 0)
-      printErrorAndDie( "Error: <benchmark delta> must be a positive real number");
+    LOG_WARN( "Too many connections, ignoring %s:%d\n", inet_ntoa( serverAddress.sin_addr),
+      ntohs( serverAddress.sin_port));
+    return;
+  }
+  double delayMs = ( double) rand_r( &worker->randomSeed) / RAND_MAX * replyWindowMs;
+  connection->serverAddress = serverAddress;
+  connection->connectAtMs = nowMs() + delayMs;
+  connection->state = CONNECTION_PENDING;
+  LOG( "Connecting in %.0lf ms\n", delayMs);
+  armPendingTimer( worker);
+}
+
+static void onPendingTimer( Worker *worker)
+{
+  uint64_t expirations;
+  if ( read( worker->pendingFd, &expirations, sizeof( expirations)) < 0 && errno != EAGAIN)
+    LOG_ERROR( "Error when reading the pending connection timer\n");
+
+  double now = nowMs();
+  for ( int i = 0; i < MAX_CONNECTIONS; ++i)
+  {
+    Connection *connection = &worker->connections[ i];
+    if ( connection->state != CONNECTION_PENDING || connection->connectAtMs > now)
+      continue;
+    connection->state = CONNECTION_FREE;
+    if ( !connectConnection( worker, connection, connection->serverAddress) &&
+         connection->isRegistration)
+      scheduleRegistration( worker);
   }
+  armPendingTimer( worker);
 }
 
-static bool receiveRequestHelper( int serverSocket, Request *requestOut)
+// Appends a message to the connection's output buffer
+static bool queueMessage( Connection *connection, int type, const void *payload, int length)
 {
-  Request request;
-  int recvStatus = recv( serverSocket, &request, sizeof( request), 0);
-  if ( recvStatus != sizeof( request))
+  if ( connection->outOffset > 0)
+  {
+    memmove( connection->outBuffer, connection->outBuffer + connection->outOffset,
+      connection->outLength - connection->outOffset);
+    connection->outLength -= connection->outOffset;
+    connection->outOffset = 0;
+  }
+  if ( connection->outLength + sizeof( MessageHeader) + length > OUT_BUFFER_SIZE)
     return false;
-  *requestOut = request;
+
+  MessageHeader header;
+  header.type = type;
+  header.length = length;
+  memcpy( connection->outBuffer + connection->outLength, &header, sizeof( header));
+  memcpy( connection->outBuffer + connection->outLength + sizeof( header), payload, length);
+  connection->outLength += sizeof( header) + length;
   return true;
 }
 
-static bool receiveRequest( int serverSocket, struct sockaddr_in serverAddress, Request *requestOut)
+// Sends what is left in the connection's output buffer; true when it's all sent.
+// Over shared memory, what doesn't fit in the ring waits for the next heartbeat
+static bool flushConnection( Connection *connection, bool *isFailedOut)
 {
-  int is_ok = receiveRequestHelper( serverSocket, requestOut);
-  if ( !is_ok)
+  *isFailedOut = false;
+  while ( connection->outOffset < connection->outLength)
   {
-    LOG( "Error when receiving task from %s:%d\n", inet_ntoa( serverAddress.sin_addr),
-      ntohs( serverAddress.sin_port));
-    return false;
+    ssize_t sentBytesCount = sendTransport( &connection->transport, 
+      connection->outBuffer + connection->outOffset,
+      connection->outLength - connection->outOffset);
+    if ( sentBytesCount < 0)
+    {
+      if ( errno != EAGAIN && errno != EWOULDBLOCK)
+        *isFailedOut = true;
+      return false;
+    }
+    connection->outOffset += sentBytesCount;
+    addToCounter( metrics.bytesSent, sentBytesCount);
   }
-  LOG( "Received task from %s:%d\n", inet_ntoa( serverAddress.sin_addr),
-    ntohs( serverAddress.sin_port));
-  LOG( "Start point: %.8lf\n", requestOut->startPoint); 
-  LOG( "End point: %.8lf\n", requestOut->endPoint);
-  LOG( "Delta: %.16lf\n", requestOut->delta);
+  connection->outOffset = connection->outLength = 0;
   return true;
 }
 
-static bool sendResponseHelper( int serverSocket, Response response)
+// Queues as many of the trace records as the output buffer takes,
+// and the empty message that ends them once they are all queued
+static void queueTraceRecords( Connection *connection)
 {
-  int bytesCount = sizeof( response);
-  int sentBytesCount = send( serverSocket, &response, bytesCount, MSG_NOSIGNAL);
-  if ( sentBytesCount != bytesCount)
-    return -1;
-  return 0;
+  while ( connection->nextTraceRecord < connection->numberOfTraceRecords)
+  {
+    int count = connection->numberOfTraceRecords - connection->nextTraceRecord;
+    if ( count > MAX_TRACE_RECORDS)
+      count = MAX_TRACE_RECORDS;
+    if ( !queueMessage( connection, MESSAGE_TRACE, 
+           connection->traceRecords + connection->nextTraceRecord, count * sizeof( TraceRecord)))
+      return;
+    connection->nextTraceRecord += count;
+  }
+  if ( !queueMessage( connection, MESSAGE_TRACE, NULL, 0))
+    return;
+  free( connection->traceRecords);
+  connection->traceRecords = NULL;
 }
 
-static bool sendResponse( int serverSocket, struct sockaddr_in serverAddress, Response response)
+// Flushes the output and closes the connection once the server 
+// has no more requests and every result has been sent
+static void finishIo( Worker *worker, Connection *connection)
 {
-  bool is_ok = sendResponseHelper( serverSocket, response);
-  if ( is_ok)
+  bool isFailed;
+  bool isFlushed;
+  do
   {
-    LOG( "Failed to send the result to %s:%d\n", 
-      inet_ntoa( serverAddress.sin_addr),
-      ntohs( serverAddress.sin_port));
-    return false;
+    if ( connection->traceRecords)
+      queueTraceRecords( connection);
+    isFlushed = flushConnection( connection, &isFailed);
+  }
+  while ( isFlushed && connection->traceRecords);
+  if ( isFailed)
+  {
+    addToCounter( metrics.connectionFailures, 1);
+    LOG_WARN( "Failed to send to %s:%d\n", 
+      inet_ntoa( connection->serverAddress.sin_addr),
+      ntohs( connection->serverAddress.sin_port));
+    closeConnection( worker, connection);
+    return;
   }
+  if ( isFlushed && connection->state == CONNECTION_DONE && connection->outstandingJobs == 0)
+  {
+    LOG( "Done with %s:%d\n", 
+      inet_ntoa( connection->serverAddress.sin_addr),
+      ntohs( connection->serverAddress.sin_port));
+    closeConnection( worker, connection);
+    return;
+  }
+  bool isShm = connection->transport.kind == TRANSPORT_SHM;
+  uint32_t events = EPOLLIN | ( ( isFlushed || isShm)? 0 : EPOLLOUT);
+  if ( !watchConnection( worker, connection, EPOLL_CTL_MOD, events))
+    closeConnection( worker, connection);
+}
 
-  LOG( "The result is sent to %s:%d\n", 
-    inet_ntoa( serverAddress.sin_addr),
-    ntohs( serverAddress.sin_port));
+// Over a Unix socket the server is on this host: right after the 
+// Benchmark, hand it a shared-memory channel, or say there is none.
+// False if the connection is no longer usable
+static bool offerChannel( Worker *worker, Connection *connection)
+{
+  bool isFailed;
+  if ( flushConnection( connection, &isFailed) && offerShmChannel( &connection->transport))
+  {
+    // The eventfd is level-triggered, so a wakeup before this isn't lost
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u32 = CHANNEL_TAG + ( connection - worker->connections);
+    if ( epoll_ctl( worker->epollFd, EPOLL_CTL_ADD, transportEventFd( &connection->transport),
+           &event) < 0)
+      return false;
+    LOG( "Talking to the server through shared memory\n");
+    return true;
+  }
+  queueMessage( connection, MESSAGE_CHANNEL, NULL, 0);
   return true;
 }
 
-static void doBenchmark( int numberOfThreads, double benchmarkDelta, Benchmark *benchmarkOut)
+static void onConnected( Worker *worker, Connection *connection)
 {
-  LOG( "Running benchmark with delta = %.12lf...\n", benchmarkDelta);
-  double benchmarkTimeMs;
-  MEASURE_TIME_MS( 
-    benchmarkTimeMs, 
+  int error = 0;
+  socklen_t errorLength = sizeof( error);
+  if ( getsockopt( connection->transport.socket, SOL_SOCKET, SO_ERROR, &error, &errorLength) < 0 || error)
+  {
+    addToCounter( metrics.connectionFailures, 1);
+    LOG_WARN( "Failed to connect to server at %s:%d\n", inet_ntoa( connection->serverAddress.sin_addr),
+      ntohs( connection->serverAddress.sin_port));
+    closeConnection( worker, connection);
+    return;
+  }
+  LOG( "Connected to %s:%d\n", inet_ntoa( connection->serverAddress.sin_addr),
+    ntohs( connection->serverAddress.sin_port));
+  if ( connection->isRegistration)
+    worker->registrationRetryMs = MIN_REGISTRATION_RETRY_MS;
+
+  LOG( "Sending benchmark to %s:%d\n", inet_ntoa( connection->serverAddress.sin_addr),
+    ntohs( connection->serverAddress.sin_port));
+  queueMessage( connection, MESSAGE_BENCHMARK, worker->benchmark, sizeof( Benchmark));
+  if ( connection->isRegistration && worker->isLocalRegistration && 
+       !offerChannel( worker, connection))
+  {
+    closeConnection( worker, connection);
+    return;
+  }
+  connection->state = CONNECTION_OPEN;
+  addToGauge( metrics.connectedServers, 1);
+  recordHistogramNs( metrics.handshake, 
+    traceSpan( "handshake", connection->connectStartNs, connection->id));
+  finishIo( worker, connection);
+}
+
+// Arms the timer for the next attempt to register, backing off
+// while the server can't be reached
+static void scheduleRegistration( Worker *worker)
+{
+  struct itimerspec timeout;
+  memset( &timeout, 0, sizeof( timeout));
+  timeout.it_value.tv_sec = worker->registrationRetryMs / 1000;
+  timeout.it_value.tv_nsec = ( worker->registrationRetryMs % 1000) * 1000000L;
+  if ( timerfd_settime( worker->registrationFd, 0, &timeout, NULL) < 0)
+    LOG_ERROR( "Error when arming the registration timer\n");
+  worker->registrationRetryMs *= 2;
+  if ( worker->registrationRetryMs > MAX_REGISTRATION_RETRY_MS)
+    worker->registrationRetryMs = MAX_REGISTRATION_RETRY_MS;
+}
+
+static void onRegistrationTimer( Worker *worker)
+{
+  uint64_t expirations;
+  if ( read( worker->registrationFd, &expirations, sizeof( expirations)) < 0 && errno != EAGAIN)
+    LOG_ERROR( "Error when reading the registration timer\n");
+
+  // A broadcast may have brought us to the server in the meantime
+  Connection *connection = findConnectionTo( worker, worker->registrationAddress);
+  if ( connection)
+  {
+    connection->isRegistration = true;
+    return;
+  }
+
+  if ( worker->isLocalRegistration)
+    LOG( "Registering with %s\n", worker->localRegistrationAddress.sun_path);
+  else
+    LOG( "Registering with %s:%d\n", inet_ntoa( worker->registrationAddress.sin_addr),
+      ntohs( worker->registrationAddress.sin_port));
+  connection = allocateConnection( worker);
+  if ( !connection)
+  {
+    scheduleRegistration( worker);
+    return;
+  }
+  connection->isRegistration = true;
+  if ( !connectConnection( worker, connection, worker->registrationAddress))
+    scheduleRegistration( worker);
+}
+
+static bool receiveRequest( Worker *worker, Connection *connection, const Request *request)
+{
+  LOG_DEBUG( "Received task #%d from %s:%d\n", request->id, 
+    inet_ntoa( connection->serverAddress.sin_addr),
+    ntohs( connection->serverAddress.sin_port));
+  LOG_DEBUG( "Start point: %.8lf\n", request->startPoint); 
+  LOG_DEBUG( "End point: %.8lf\n", request->endPoint);
+  LOG_DEBUG( "Delta: %.16lf\n", request->delta);
+
+  Job job;
+  memset( &job, 0, sizeof( job));
+  job.receivedNs = traceNowNs();
+  job.connectionSlot = connection - worker->connections;
+  job.connectionId = connection->id;
+  job.request = *request;
+  job.deadlineMs = ( request->deadlineMs > 0)? nowMs() + request->deadlineMs : 0;
+  addToCounter( metrics.requests, 1);
+  if ( !tryPushJob( &worker->pendingJobs, &job))
+  {
+    // Only this request is turned down, for the server to send elsewhere
+    LOG_WARN( "Job queue is full, rejecting the task\n");
+    addToCounter( metrics.requestsDropped, 1);
+    Response response;
+    memset( &response, 0, sizeof( response));
+    response.id = request->id;
+    response.status = RESPONSE_REJECTED;
+    response.receivedNs = job.receivedNs;
+    response.sentNs = traceNowNs();
+    return queueMessage( connection, MESSAGE_RESPONSE, &response, sizeof( response));
+  }
+  addToGauge( metrics.queuedJobs, 1);
+  connection->outstandingJobs ++;
+  traceSpan( "receive", job.receivedNs, request->id);
+  return true;
+}
+
+struct TraceCollection
+{
+  uint64_t sinceNs;
+  TraceRecord *records;
+  int numberOfRecords;
+  int capacity;
+};
+typedef struct TraceCollection TraceCollection;
+
+static void collectTraceRecord( void *context, const TraceSpan *span)
+{
+  TraceCollection *collection = ( TraceCollection*) context;
+  if ( span->endNs < collection->sinceNs || !collection->records)
+    return;
+  if ( collection->numberOfRecords == collection->capacity)
+  {
+    collection->capacity *= 2;
+    TraceRecord *grown = ( TraceRecord*) realloc( collection->records, 
+      collection->capacity * sizeof( TraceRecord));
+    if ( !grown)
     {
-      integrate( functionToIntegrate, 0.0f, 1.0f,
-        numberOfThreads, benchmarkDelta, benchmarkOut);
+      free( collection->records);
+      collection->records = NULL;
+      return;
     }
-  );
-  benchmarkOut->timeMs = benchmarkTimeMs;
-  benchmarkOut->delta = benchmarkDelta;
-  LOG( "Done! Benchmark time is %.6lf ms\n", benchmarkTimeMs);
-  LOG( "Now waiting for requests...\n");
+    collection->records = grown;
+  }
+  makeTraceRecord( span, &collection->records[ collection->numberOfRecords ++]);
 }
 
-static bool sendBenchmarkHelper( int serverSocket, Benchmark benchmark)
+// Takes a snapshot of the spans for queueTraceRecords() to send
+static bool receiveTraceQuery( Connection *connection, const TraceQuery *query)
 {
-  int sendStatus = send( serverSocket, &benchmark, sizeof( benchmark), MSG_NOSIGNAL);
-  if ( sendStatus != sizeof( benchmark))
+  if ( connection->traceRecords)
+    return true;  // still sending the last ones
+  TraceCollection collection;
+  collection.sinceNs = query->sinceNs;
+  collection.numberOfRecords = 0;
+  collection.capacity = 256;
+  collection.records = ( TraceRecord*) malloc( collection.capacity * sizeof( TraceRecord));
+  visitTraceSpans( collectTraceRecord, &collection);
+  if ( !collection.records)
+  {
+    LOG_WARN( "Out of memory for the trace\n");
     return false;
+  }
+  LOG( "Sending %d trace span(s) to %s:%d\n", collection.numberOfRecords,
+    inet_ntoa( connection->serverAddress.sin_addr), ntohs( connection->serverAddress.sin_port));
+  connection->traceRecords = collection.records;
+  connection->numberOfTraceRecords = collection.numberOfRecords;
+  connection->nextTraceRecord = 0;
   return true;
 }
 
-static bool sendBenchmark( int serverSocket, struct sockaddr_in serverAddress, Benchmark benchmark)
+static bool handleMessage( Worker *worker, Connection *connection, 
+  const MessageHeader *header, const void *payload)
 {
-  LOG( "Sending benchmark to %s:%d\n", inet_ntoa( serverAddress.sin_addr),
-    ntohs( serverAddress.sin_port));
-  bool is_ok = sendBenchmarkHelper( serverSocket, benchmark);
-  if ( !is_ok)
+  switch ( header->type)
   {
-    LOG( "Error when sending benchmark to %s:%d\n", inet_ntoa( serverAddress.sin_addr),
-      ntohs( serverAddress.sin_port));
+    case MESSAGE_REQUEST:
+      if ( header->length != sizeof( Request))
+        return false;
+      Request request;
+      memcpy( &request, payload, sizeof( request));
+      return receiveRequest( worker, connection, &request);
+    case MESSAGE_CANCEL:
+      if ( header->length != sizeof( Cancel))
+        return false;
+      Cancel cancel;
+      memcpy( &cancel, payload, sizeof( cancel));
+      LOG_DEBUG( "Task #%d cancelled by %s:%d\n", cancel.requestId,
+        inet_ntoa( connection->serverAddress.sin_addr),
+        ntohs( connection->serverAddress.sin_port));
+      cancelJobs( worker, connection, cancel.requestId);
+      return true;
+    case MESSAGE_DONE:
+      connection->state = CONNECTION_DONE;
+      return true;
+    case MESSAGE_TRACE:
+      if ( header->length != sizeof( TraceQuery))
+        return false;
+      TraceQuery query;
+      memcpy( &query, payload, sizeof( query));
+      return receiveTraceQuery( connection, &query);
+    default:
+      LOG_WARN( "Unknown message %d from %s:%d\n", header->type,
+        inet_ntoa( connection->serverAddress.sin_addr),
+        ntohs( connection->serverAddress.sin_port));
+      return false;
   }
-  return is_ok;
 }
 
-static bool computeIntegral( Request request, int numberOfThreads, Response *responseOut)
+// Reads whatever has arrived and handles every complete message
+static void receiveMessages( Worker *worker, Connection *connection)
 {
-  LOG( "Computing the result using %d thread(s)...\n", numberOfThreads);
-  Response response;
-  double msElapsed;
-  MEASURE_TIME_MS( 
-    msElapsed, 
+  if ( connection->transport.socket < 0)
+    return;  // closed by an earlier event of the same batch
+  for ( ;;)
+  {
+    ssize_t recvStatus = recvTransport( &connection->transport, 
+      connection->inBuffer + connection->inLength, sizeof( connection->inBuffer) - connection->inLength);
+    if ( recvStatus < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if ( recvStatus <= 0)
     {
-      if ( integrate( functionToIntegrate, request.startPoint, request.endPoint,
-              numberOfThreads, request.delta, &response.result)) 
+      if ( connection->state != CONNECTION_DONE || connection->outstandingJobs > 0)
+        LOG( "Server %s:%d closed the connection\n", inet_ntoa( connection->serverAddress.sin_addr),
+          ntohs( connection->serverAddress.sin_port));
+      closeConnection( worker, connection);
+      return;
+    }
+    connection->inLength += recvStatus;
+    addToCounter( metrics.bytesReceived, recvStatus);
+
+    size_t offset = 0;
+    while ( connection->inLength - offset >= sizeof( MessageHeader))
+    {
+      MessageHeader header;
+      memcpy( &header, connection->inBuffer + offset, sizeof( header));
+      if ( header.length < 0 || header.length > MAX_MESSAGE_LENGTH)
       {
-        LOG( "Error when computing integral\n");
-        return false;
+        LOG_WARN( "Malformed message from %s:%d\n", inet_ntoa( connection->serverAddress.sin_addr),
+          ntohs( connection->serverAddress.sin_port));
+        closeConnection( worker, connection);
+        return;
+      }
+      if ( connection->inLength - offset < sizeof( header) + header.length)
+        break;
+      if ( !handleMessage( worker, connection, &header, 
+             connection->inBuffer + offset + sizeof( header)))
+      {
+        closeConnection( worker, connection);
+        return;
       }
+      offset += sizeof( header) + header.length;
     }
-  );
-  response.timeElapsed = msElapsed;
-  LOG( "The result is %.8lf\n", response.result);
-  LOG( "It was computed in %.3lf ms\n", response.timeElapsed);
+    memmove( connection->inBuffer, connection->inBuffer + offset, connection->inLength - offset);
+    connection->inLength -= offset;
+  }
+  finishIo( worker, connection);
+}
+
+static void onConnectionEvent( Worker *worker, Connection *connection, uint32_t events)
+{
+  if ( connection->state == CONNECTION_CONNECTING)
+  {
+    onConnected( worker, connection);
+    return;
+  }
+  if ( events & ( EPOLLIN | EPOLLHUP | EPOLLERR))
+    receiveMessages( worker, connection);
+  else if ( events & EPOLLOUT)
+    finishIo( worker, connection);
+}
+
+static void onJobsCompleted( Worker *worker)
+{
+  uint64_t counter;
+  if ( read( worker->completionFd, &counter, sizeof( counter)) < 0 && errno != EAGAIN)
+    LOG_ERROR( "Error when reading eventfd\n");
+
+  // Estimates first: the server ignores one that comes after its result
+  Job job;
+  while ( tryPopJob( &worker->estimates, &job))
+  {
+    Connection *connection = &worker->connections[ job.connectionSlot];
+    if ( connection->id != job.connectionId || connection->state == CONNECTION_FREE)
+      continue;
+    if ( !queueMessage( connection, MESSAGE_ESTIMATE, &job.estimate, sizeof( Estimate)))
+      closeConnection( worker, connection);
+    else
+      finishIo( worker, connection);
+  }
+  while ( tryPopJob( &worker->completedJobs, &job))
+  {
+    Connection *connection = &worker->connections[ job.connectionSlot];
+    if ( connection->id != job.connectionId || connection->state == CONNECTION_FREE)
+      continue;  // the server has gone away meanwhile
+    connection->outstandingJobs --;
+    uint64_t sendStartNs = traceNowNs();
+    job.response.receivedNs = job.receivedNs;
+    job.response.sentNs = sendStartNs;
+    if ( !job.isOk || 
+         !queueMessage( connection, MESSAGE_RESPONSE, &job.response, sizeof( Response)))
+    {
+      closeConnection( worker, connection);
+      continue;
+    }
+    LOG_DEBUG( "Sending the result of task #%d to %s:%d\n", job.response.id,
+      inet_ntoa( connection->serverAddress.sin_addr),
+      ntohs( connection->serverAddress.sin_port));
+    finishIo( worker, connection);
+    traceSpan( "send", sendStartNs, job.response.id);
+    recordHistogramNs( metrics.requestLatency, traceNowNs() - job.receivedNs);
+  }
+}
+
+static void onHeartbeatTimer( Worker *worker)
+{
+  uint64_t expirations;
+  if ( read( worker->heartbeatFd, &expirations, sizeof( expirations)) < 0)
+    return;
+
+  pthread_mutex_lock( &worker->runningJobMutex);
+  bool isJobRunning = worker->isJobRunning;
+  Job runningJob = worker->runningJob;
+  double elapsedMs = nowMs() - worker->runningJobStartMs;
+  pthread_mutex_unlock( &worker->runningJobMutex);
+
+  Heartbeat running;
+  memset( &running, 0, sizeof( running));
+  if ( isJobRunning)
+  {
+    long totalSteps = __atomic_load_n( &worker->progress.total_steps, __ATOMIC_RELAXED);
+    long stepsDone = __atomic_load_n( &worker->progress.steps_done, __ATOMIC_RELAXED);
+    __atomic_load( &worker->progress.partial_sum, &running.partialSum, __ATOMIC_RELAXED);
+    running.requestId = runningJob.request.id;
+    running.fractionDone = ( totalSteps > 0)? ( double) stepsDone / totalSteps : 0.0;
+    int evaluationsPerStep = __atomic_load_n( &worker->progress.evaluations_per_step, __ATOMIC_RELAXED);
+    running.evaluationsPerSecond = ( elapsedMs > 0)? 
+      ( double) evaluationsPerStep * stepsDone / elapsedMs * 1000.0 : 0.0;
+  }
+
+  for ( int i = 0; i < MAX_CONNECTIONS; ++i)
+  {
+    Connection *connection = &worker->connections[ i];
+    if ( connection->state != CONNECTION_OPEN && connection->state != CONNECTION_DONE)
+      continue;
+
+    Heartbeat heartbeat = running;
+    if ( !isJobRunning || runningJob.connectionSlot != i || 
+         runningJob.connectionId != connection->id)
+    {
+      memset( &heartbeat, 0, sizeof( heartbeat));
+      heartbeat.requestId = -1;
+    }
+    if ( !queueMessage( connection, MESSAGE_HEARTBEAT, &heartbeat, sizeof( heartbeat)))
+    {
+      closeConnection( worker, connection);
+      continue;
+    }
+    finishIo( worker, connection);
+  }
+}
+
+static void parseArgumentsOrDie( int argc, char **argv, Args *argsOut)
+{
+  argsOut->jobQueueSize = DEFAULT_JOB_QUEUE_SIZE;
+  argsOut->credits = DEFAULT_CREDITS;
+  argsOut->heartbeatIntervalMs = DEFAULT_HEARTBEAT_INTERVAL_MS;
+  int option;
+  argsOut->registrationHost = NULL;
+  argsOut->multicastGroup = NULL;
+  argsOut->metricsAddress = NULL;
+  argsOut->usePerfCounters = false;
+  argsOut->slowdown = 1.0;
+  while ( ( option = getopt( argc, argv, "+q:p:b:r:g:l:m:es:")) != -1)
+  {
+    switch ( option)
+    {
+      case 's':
+        argsOut->slowdown = atof( optarg);
+        if ( argsOut->slowdown < 1.0)
+          printErrorAndDie( "Error: <slowdown> must be a real number of at least 1");
+        break;
+      case 'e':
+        argsOut->usePerfCounters = true;
+        break;
+      case 'm':
+        argsOut->metricsAddress = optarg;
+        break;
+      case 'g':
+        argsOut->multicastGroup = optarg;
+        break;
+      case 'r':
+        argsOut->registrationHost = optarg;
+        break;
+      case 'l':
+        if ( !setLogLevel( optarg))
+          printErrorAndDie( "Error: the log level must be error, warn, info or debug");
+        break;
+      case 'b':
+        argsOut->heartbeatIntervalMs = atoi( optarg);
+        if ( argsOut->heartbeatIntervalMs < 1)
+          printErrorAndDie( "Error: <heartbeat interval in ms> must be a positive integer");
+        break;
+      case 'p':
+        argsOut->credits = atoi( optarg);
+        if ( argsOut->credits < 1)
+          printErrorAndDie( "Error: <outstanding chunks> must be a positive integer");
+        break;
+      case 'q':
+        argsOut->jobQueueSize = atoi( optarg);
+        if ( argsOut->jobQueueSize < 1)
+          printErrorAndDie( "Error: <job queue size> must be a positive integer");
+        break;
+      default:
+        printUsageAndDie();
+    }
+  }
+  if ( argsOut->credits > argsOut->jobQueueSize)
+    argsOut->jobQueueSize = argsOut->credits;
+  argc -= optind - 1;
+  argv += optind - 1;
+
+  if ( argc < 3)
+    printUsageAndDie();
+  argsOut->listeningPort = atoi( argv[1]);
+  argsOut->serverPort = atoi( argv[2]);
+
+  int numberOfThreads = 0;  // chosen from the CPU layout
+  if ( argc >= 4 && strcmp( argv[3], "auto") != 0)
+  {
+    numberOfThreads = atoi( argv[3]);
+    if ( numberOfThreads < 0)
+      printErrorAndDie( "Error: <number of threads> must be a positive integer, 0 or \"auto\"");
+  }
+  argsOut->numberOfThreads = numberOfThreads;
+
+  argsOut->benchmarkDelta = 10e-9;
+  if ( argc >= 5)
+  {
+    argsOut->benchmarkDelta = atof( argv[4]);
+    if ( argsOut->benchmarkDelta <= 0)
+      printErrorAndDie( "Error: <benchmark delta> must be a positive real number");
+  }
+}
+
+static void defineWorkerMetrics()
+{
+  metrics.requests = defineCounter( "integral_requests_total", "Requests received");
+  metrics.requestsDone = defineCounter( "integral_requests_done_total",
+    "Requests computed to the end");
+  metrics.requestsStopped = defineCounter( "integral_requests_stopped_total",
+    "Requests cancelled or past their deadline");
+  metrics.requestsDropped = defineCounter( "integral_requests_dropped_total",
+    "Requests rejected as the job queue was full");
+  metrics.evaluations = defineCounter( "integral_evaluations_total",
+    "Function evaluations, counted as in heartbeats");
+  metrics.bytesSent = defineCounter( "integral_sent_bytes_total", "Bytes sent to servers");
+  metrics.bytesReceived = defineCounter( "integral_received_bytes_total",
+    "Bytes received from servers");
+  metrics.connectionFailures = defineCounter( "integral_connection_failures_total",
+    "Connections to servers that failed to open or to send");
+  metrics.computeFailures = defineCounter( "integral_compute_failures_total",
+    "Requests the integration failed on");
+  metrics.connectedServers = defineGauge( "integral_connected_servers", "Open server connections");
+  metrics.queuedJobs = defineGauge( "integral_queued_jobs", "Requests waiting for the compute thread");
+  metrics.busyThreads = defineGauge( "integral_busy_threads", "Threads computing a request");
+  metrics.compute = defineHistogram( "integral_compute_seconds", "Computing a request");
+  metrics.requestLatency = defineHistogram( "integral_request_seconds",
+    "From a request coming in to its response going out");
+  metrics.handshake = defineHistogram( "integral_handshake_seconds",
+    "From connecting to a server to the Benchmark being queued");
+  metrics.cycles = defineCounter( "integral_cpu_cycles_total", "CPU cycles computing (with -e)");
+  metrics.instructions = defineCounter( "integral_instructions_total",
+    "Instructions retired computing (with -e)");
+  metrics.branchMisses = defineCounter( "integral_branch_misses_total",
+    "Branch mispredictions computing (with -e)");
+  metrics.cacheMisses = defineCounter( "integral_cache_misses_total",
+    "Last-level cache misses computing (with -e)");
+}
+
+static void countPerf( const PerfCounts *perfCounts)
+{
+  addToCounter( metrics.cycles, perfCounts->cycles);
+  addToCounter( metrics.instructions, perfCounts->instructions);
+  addToCounter( metrics.branchMisses, perfCounts->branchMisses);
+  addToCounter( metrics.cacheMisses, perfCounts->cacheMisses);
+}
+
+static void makeIntegrationOptions( const CpuLayout *cpuLayout, int numberOfThreads,
+  IntegrationOptions *optionsOut)
+{
+  optionsOut->n_threads = numberOfThreads;
+  optionsOut->cpus = ( cpuLayout->isPinned)? cpuLayout->cpus : NULL;
+  optionsOut->progress = NULL;
+  optionsOut->cancellation = NULL;
+  optionsOut->perf_counts = NULL;
+  optionsOut->slowdown = 0.0;
+  optionsOut->midpoints_only = 0;
+  // Per-node sub-pools only make sense when threads stay on their node
+  optionsOut->nodes = ( cpuLayout->isPinned && cpuLayout->numberOfNodes > 1)? 
+    cpuLayout->nodes : NULL;
+}
+
+static double measureBenchmarkTimeMs( const CpuLayout *cpuLayout, int numberOfThreads, 
+  double benchmarkDelta)
+{
+  IntegrationOptions options;
+  makeIntegrationOptions( cpuLayout, numberOfThreads, &options);
+  double result;
+  uint64_t startNs = traceNowNs();
+  integrate_with_options( functionToIntegrate, 0.0f, 1.0f, benchmarkDelta, &options, &result);
+  return traceSpan( "benchmark", startNs, numberOfThreads) / 1e6;
+}
+
+static void doBenchmark( const HardwareInfo *hardware, const CpuLayout *cpuLayout,
+  double benchmarkDelta, Benchmark *benchmarkOut)
+{
+  int numberOfThreads = cpuLayout->numberOfThreads;
+  LOG( "CPU layout: %d online, %d allowed, %d physical core(s) x %d SMT on %d node(s); "
+    "using %d thread(s)%s\n", cpuLayout->numberOfOnlineCpus, cpuLayout->numberOfAllowedCpus,
+    cpuLayout->numberOfPhysicalCores, cpuLayout->threadsPerCore, cpuLayout->numberOfNodes,
+    numberOfThreads,
+    ( cpuLayout->isPinned)? ", pinned" : "");
+  LOG( "Running benchmark with delta = %.12lf...\n", benchmarkDelta);
+  memset( benchmarkOut, 0, sizeof( *benchmarkOut));
+
+  benchmarkOut->numberOfCores = hardware->numberOfCores;
+  benchmarkOut->numberOfThreads = numberOfThreads;
+  benchmarkOut->simdLevel = hardware->simdLevel;
+  benchmarkOut->numberOfNumaNodes = hardware->numberOfNumaNodes;
+  benchmarkOut->l1CacheBytes = hardware->l1CacheBytes;
+  benchmarkOut->l2CacheBytes = hardware->l2CacheBytes;
+  benchmarkOut->l3CacheBytes = hardware->l3CacheBytes;
+  benchmarkOut->cpuQuota = hardware->cpuQuota;
+  benchmarkOut->numberOfPhysicalCores = cpuLayout->numberOfPhysicalCores;
+  benchmarkOut->numberOfAllowedCpus = cpuLayout->numberOfAllowedCpus;
+  benchmarkOut->threadsPerCore = cpuLayout->threadsPerCore;
+  benchmarkOut->isPinned = cpuLayout->isPinned;
+
+  // Throughput curve over 1, 2, 4, ... threads, always ending 
+  // with the configured number of threads
+  double steps = 1.0 / benchmarkDelta;
+  int numberOfPoints = 0;
+  for ( int threads = 1; numberOfPoints < MAX_THROUGHPUT_POINTS; threads *= 2)
+  {
+    if ( threads >= numberOfThreads || numberOfPoints == MAX_THROUGHPUT_POINTS - 1)
+      threads = numberOfThreads;
+    double timeMs = measureBenchmarkTimeMs( cpuLayout, threads, benchmarkDelta);
+    benchmarkOut->throughputThreads[ numberOfPoints] = threads;
+    benchmarkOut->throughput[ numberOfPoints] = steps / timeMs;
+    numberOfPoints ++;
+    LOG( "    %d thread(s): %.3lf ms\n", threads, timeMs);
+    if ( threads == numberOfThreads)
+    {
+      benchmarkOut->timeMs = timeMs;
+      break;
+    }
+  }
+  benchmarkOut->numberOfThroughputPoints = numberOfPoints;
+  benchmarkOut->delta = benchmarkDelta;
+
+  LOG( "Done! Benchmark time is %.6lf ms\n", benchmarkOut->timeMs);
+  LOG( "Hardware: %d core(s), %s, %d NUMA node(s), L1/L2/L3 %ld/%ld/%ld KiB, CPU quota %.2lf\n",
+    hardware->numberOfCores, simdLevelName( hardware->simdLevel), hardware->numberOfNumaNodes,
+    hardware->l1CacheBytes / 1024, hardware->l2CacheBytes / 1024, hardware->l3CacheBytes / 1024,
+    hardware->cpuQuota);
+  LOG( "Now waiting for requests...\n");
+}
+
+static bool computeIntegral( Request request, const CpuLayout *cpuLayout, double slowdown,
+  IntegrationProgress *progress, CancellationToken *cancellation, PerfCounts *perfCounts,
+  Response *responseOut)
+{
+  LOG_DEBUG( "Computing the result using %d thread(s)...\n", cpuLayout->numberOfThreads);
+  IntegrationOptions options;
+  makeIntegrationOptions( cpuLayout, cpuLayout->numberOfThreads, &options);
+  options.progress = progress;
+  options.cancellation = cancellation;
+  options.perf_counts = perfCounts;
+  options.slowdown = slowdown;
+  Response response;
+  memset( &response, 0, sizeof( response));
+  response.status = RESPONSE_OK;
+  uint64_t startNs = traceNowNs();
+  int status = integrate_with_options( functionToIntegrate, request.startPoint, 
+    request.endPoint, request.delta, &options, &response.result);
+  addToCounter( metrics.evaluations, 2 * progress->steps_done);
+  response.timeElapsed = traceSpan( "compute", startNs, request.id) / 1e6;
+  if ( status == INTEGRATION_CANCELLED)
+    response.status = RESPONSE_CANCELLED;
+  else if ( status == INTEGRATION_DEADLINE_EXCEEDED)
+    response.status = RESPONSE_DEADLINE_EXCEEDED;
+  else if ( status)
+  {
+    LOG_ERROR( "Error when computing integral\n");
+    return false;
+  }
+  response.id = request.id;
+  if ( response.status != RESPONSE_OK)
+    LOG_DEBUG( "Stopped: %s\n", ( response.status == RESPONSE_CANCELLED)? 
+      "cancelled" : "deadline exceeded");
+  LOG_DEBUG( "The result is %.8lf\n", response.result);
+  LOG_DEBUG( "It was computed in %.3lf ms\n", response.timeElapsed);
 
   *responseOut = response;
   return true;
-}
\ No newline at end of file
+}
+
+// Trapezoid results with steps h and 2h differ by about three times the 
+// error of the finer one, which the extrapolation mostly cancels out.
+// T(h) = ( T(2h) + M(2h)) / 2, where the midpoint rule M(2h) only 
+// evaluates the points that step h adds
+static bool refineIntegral( Worker *worker, const Job *job, PerfCounts *perfCounts,
+  Response *responseOut)
+{
+  Request request = job->request;
+  // Steps that divide the interval evenly, so every pass covers all of it
+  double length = request.endPoint - request.startPoint;
+  if ( length <= 0)
+    return computeIntegral( request, worker->cpuLayout, worker->slowdown, &worker->progress,
+      &worker->cancellation, perfCounts, responseOut);
+  double numberOfSteps = COARSE_STEPS;
+  double delta = length / numberOfSteps;
+  LOG_DEBUG( "Refining from delta = %.3lg down to %.3lg or an error below %.3lg...\n",
+    delta, request.delta, request.tolerance);
+
+  IntegrationOptions options;
+  makeIntegrationOptions( worker->cpuLayout, worker->cpuLayout->numberOfThreads, &options);
+  options.progress = &worker->progress;
+  options.cancellation = &worker->cancellation;
+  options.perf_counts = perfCounts;
+  options.slowdown = worker->slowdown;
+
+  Response response;
+  memset( &response, 0, sizeof( response));
+  response.id = request.id;
+  response.status = RESPONSE_OK;
+  Estimate estimate;
+  estimate.requestId = request.id;
+
+  uint64_t startNs = traceNowNs();
+  double coarse;
+  int status = integrate_with_options( functionToIntegrate, request.startPoint,
+    request.endPoint, length / ( numberOfSteps / 2), &options, &coarse);
+  addToCounter( metrics.evaluations, 2 * options.progress->steps_done);
+  options.midpoints_only = 1;
+  while ( !status)
+  {
+    double midpoints;
+    status = integrate_with_options( functionToIntegrate, request.startPoint,
+      request.endPoint, 2 * delta, &options, &midpoints);
+    addToCounter( metrics.evaluations, options.progress->steps_done);
+    if ( status)
+      break;
+    double fine = ( coarse + midpoints) / 2;
+    estimate.result = fine + ( fine - coarse) / 3;
+    estimate.errorBound = fabs( fine - coarse) / 3;
+    estimate.delta = delta;
+    response.result = estimate.result;
+    publishEstimate( worker, job, &estimate);
+    LOG_DEBUG( "Estimate with delta = %.3lg: %.10lf +- %.3lg\n", delta, 
+      estimate.result, estimate.errorBound);
+    if ( estimate.errorBound <= request.tolerance || delta <= request.delta)
+      break;
+    coarse = fine;
+    numberOfSteps *= 2;
+    delta = length / numberOfSteps;
+  }
+  response.timeElapsed = traceSpan( "compute", startNs, request.id) / 1e6;
+
+  if ( status == INTEGRATION_CANCELLED)
+    response.status = RESPONSE_CANCELLED;
+  else if ( status == INTEGRATION_DEADLINE_EXCEEDED)
+    response.status = RESPONSE_DEADLINE_EXCEEDED;
+  else if ( status)
+  {
+    LOG_ERROR( "Error when computing integral\n");
+    return false;
+  }
+  LOG_DEBUG( "The result is %.8lf\n", response.result);
+  LOG_DEBUG( "It was computed in %.3lf ms\n", response.timeElapsed);
+
+  *responseOut = response;
+  return true;
+}
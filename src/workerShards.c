@@ -0,0 +1,376 @@
+
+/*
+  workerShards.c
+
+  The server's workers split across I/O threads. Each shard runs its
+  own IoEngine over the sockets of the workers it owns: it sends what
+  the scheduler posted to its outbox, and pushes every whole message
+  that comes in (or the news that a connection has ended) to the
+  inbox that all the shards share with the scheduler. Both queues are
+  lock-free (see mpscQueue.c) and each side signals an eventfd only
+  once per round of its event loop, so a busy pool costs a wakeup per
+  round rather than per message.
+
+  A shard never blocks on the inbox: what doesn't fit waits in the
+  shard's overflow list and is retried every millisecond. The list
+  is bounded for heartbeats, which keep coming while the scheduler
+  is busy elsewhere: past MAX_OVERFLOW_ITEMS a heartbeat is dropped,
+  as the next one supersedes it. The other messages are bounded by
+  the chunks a worker is given. The scheduler, on the other hand,
+  waits for room in a full outbox, as the shard empties it on every
+  round.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+
+#include "workerShards.h"
+
+#define OUTBOX_CAPACITY 1024
+#define INBOX_CAPACITY 4096
+#define SHARD_POLL_MS 1000
+#define OVERFLOW_RETRY_MS 1
+#define MAX_OVERFLOW_ITEMS INBOX_CAPACITY
+
+static void signalEventFd( int fd)
+{
+  uint64_t one = 1;
+  while ( write( fd, &one, sizeof( one)) < 0 && errno == EINTR)
+    ;
+}
+
+static void clearEventFd( int fd)
+{
+  uint64_t count;
+  while ( read( fd, &count, sizeof( count)) < 0 && errno == EINTR)
+    ;
+}
+
+static void pushToScheduler( WorkerShard *shard, const ShardItem *item)
+{
+  shard->hasPushed = true;
+  if ( shard->numberOfOverflowItems == 0 && tryPushMpsc( &shard->shards->inbox, item))
+    return;
+  if ( shard->numberOfOverflowItems >= MAX_OVERFLOW_ITEMS && item->kind == SHARD_MESSAGE &&
+       item->header.type == MESSAGE_HEARTBEAT)
+    return;
+  if ( shard->numberOfOverflowItems == shard->overflowCapacity)
+  {
+    int capacity = ( shard->overflowCapacity > 0)? shard->overflowCapacity * 2 : 64;
+    ShardItem *grown = ( ShardItem*) realloc( shard->overflow, capacity * sizeof( ShardItem));
+    if ( !grown)
+    {
+      LOG_WARN( "Out of memory for the messages from the workers\n");
+      exit( EXIT_FAILURE);
+    }
+    shard->overflow = grown;
+    shard->overflowCapacity = capacity;
+  }
+  shard->overflow[ shard->numberOfOverflowItems ++] = *item;
+}
+
+// Keeps the order the items came in
+static void flushOverflow( WorkerShard *shard)
+{
+  int pushed = 0;
+  while ( pushed < shard->numberOfOverflowItems &&
+          tryPushMpsc( &shard->shards->inbox, &shard->overflow[ pushed]))
+    pushed ++;
+  if ( pushed == 0)
+    return;
+  shard->numberOfOverflowItems -= pushed;
+  memmove( shard->overflow, shard->overflow + pushed,
+    shard->numberOfOverflowItems * sizeof( ShardItem));
+  shard->hasPushed = true;
+}
+
+static void pushGone( WorkerShard *shard, int worker)
+{
+  Transport *transport = &shard->transports[ worker];
+  unwatchFd( &shard->engine, transport->socket);
+  unwatchFd( &shard->engine, transportEventFd( transport));
+  ShardItem item;
+  item.kind = SHARD_GONE;
+  item.worker = worker;
+  pushToScheduler( shard, &item);
+}
+
+static void pushMessage( WorkerShard *shard, int worker, const MessageHeader *header,
+  const void *payload)
+{
+  ShardItem item;
+  item.kind = SHARD_MESSAGE;
+  item.worker = worker;
+  item.header = *header;
+  memcpy( item.payload, payload, header->length);
+  pushToScheduler( shard, &item);
+}
+
+// A shared-memory channel is drained right here; only its socket
+// going readable means the worker has gone
+static void onShardEvent( void *context, const IoEvent *event)
+{
+  WorkerShard *shard = ( WorkerShard*) context;
+  if ( event->fd == shard->wakeFd)
+  {
+    clearEventFd( shard->wakeFd);
+    return;
+  }
+  int worker = ( event->fd < shard->fdCapacity)? shard->workerOfFd[ event->fd] : -1;
+  if ( worker < 0)
+    return;
+  Transport *transport = &shard->transports[ worker];
+  if ( event->type == IO_EVENT_MESSAGE)
+  {
+    pushMessage( shard, worker, &event->header, event->payload);
+    return;
+  }
+  if ( event->type == IO_EVENT_CLOSED || event->fd == transport->socket)
+  {
+    pushGone( shard, worker);
+    return;
+  }
+  clearTransportWakeup( transport);
+  while ( hasBufferedMessage( transport))
+  {
+    MessageHeader header;
+    char payload[ MAX_MESSAGE_LENGTH];
+    if ( !recvMessage( transport, &header, payload))
+    {
+      pushGone( shard, worker);
+      return;
+    }
+    pushMessage( shard, worker, &header, payload);
+  }
+}
+
+static void dropShardWorker( WorkerShard *shard, int worker)
+{
+  Transport *transport = &shard->transports[ worker];
+  if ( transport->socket < 0)
+    return;
+  // What was queued for it goes out first
+  submitIoEngine( &shard->engine);
+  shard->workerOfFd[ transport->socket] = -1;
+  shard->workerOfFd[ transportEventFd( transport)] = -1;
+  unwatchFd( &shard->engine, transport->socket);
+  unwatchFd( &shard->engine, transportEventFd( transport));
+  closeTransport( transport);
+}
+
+// Returns false once told to stop
+static bool drainOutbox( WorkerShard *shard)
+{
+  ShardItem item;
+  while ( tryPopMpsc( &shard->outbox, &item))
+  {
+    if ( item.kind == SHARD_STOP)
+      return false;
+    if ( item.kind == SHARD_DROP)
+      dropShardWorker( shard, item.worker);
+    else if ( shard->transports[ item.worker].socket >= 0 &&
+              !queueIoMessage( &shard->engine, shard->transports[ item.worker].socket,
+                 item.header.type, item.payload, item.header.length))
+      pushGone( shard, item.worker);
+  }
+  return true;
+}
+
+static void *runShard( void *arg)
+{
+  WorkerShard *shard = ( WorkerShard*) arg;
+  bool isRunning = true;
+  while ( isRunning)
+  {
+    flushOverflow( shard);
+    int timeoutMs = ( shard->numberOfOverflowItems > 0)? OVERFLOW_RETRY_MS : SHARD_POLL_MS;
+    if ( pollIoEngine( &shard->engine, timeoutMs, onShardEvent, shard) < 0 && errno != EINTR)
+    {
+      LOG_ERROR( "Error in an I/O thread: %s\n", strerror( errno));
+      exit( EXIT_FAILURE);
+    }
+    isRunning = drainOutbox( shard);
+    if ( shard->hasPushed)
+    {
+      signalEventFd( shard->shards->wakeFd);
+      shard->hasPushed = false;
+    }
+  }
+  submitIoEngine( &shard->engine);
+  return NULL;
+}
+
+static bool growShardFds( WorkerShard *shard, int fd)
+{
+  if ( fd < shard->fdCapacity)
+    return true;
+  int capacity = ( shard->fdCapacity > 0)? shard->fdCapacity : 64;
+  while ( capacity <= fd)
+    capacity *= 2;
+  int *grown = ( int*) realloc( shard->workerOfFd, capacity * sizeof( int));
+  if ( !grown)
+    return false;
+  for ( int i = shard->fdCapacity; i < capacity; ++i)
+    grown[ i] = -1;
+  shard->workerOfFd = grown;
+  shard->fdCapacity = capacity;
+  return true;
+}
+
+// Over shared memory, the socket only tells that the worker has gone
+static bool adoptWorker( WorkerShard *shard, int worker, Transport transport)
+{
+  shard->transports[ worker] = transport;
+  int eventFd = transportEventFd( &transport);
+  if ( !growShardFds( shard, transport.socket) || !growShardFds( shard, eventFd))
+    return false;
+  shard->workerOfFd[ transport.socket] = worker;
+  shard->workerOfFd[ eventFd] = worker;
+  if ( transport.kind == TRANSPORT_SHM)
+    return watchReadable( &shard->engine, transport.socket) &&
+      watchReadable( &shard->engine, eventFd);
+  return watchStream( &shard->engine, transport.socket);
+}
+
+static bool initShard( WorkerShard *shard, WorkerShards *shards, int engineKind,
+  int numberOfWorkers)
+{
+  memset( shard, 0, sizeof( *shard));
+  shard->shards = shards;
+  shard->wakeFd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC);
+  shard->transports = ( Transport*) malloc( numberOfWorkers * sizeof( Transport));
+  if ( shard->wakeFd < 0 || !shard->transports ||
+       !initMpscQueue( &shard->outbox, OUTBOX_CAPACITY, sizeof( ShardItem)) ||
+       !initIoEngine( &shard->engine, engineKind))
+    return false;
+  for ( int i = 0; i < numberOfWorkers; ++i)
+  {
+    shard->transports[ i].socket = -1;
+    shard->transports[ i].channel = NULL;
+  }
+  return watchReadable( &shard->engine, shard->wakeFd);
+}
+
+bool startWorkerShards( WorkerShards *shards, int numberOfShards, int engineKind,
+  const WorkerTable *workers)
+{
+  int numberOfWorkers = workers->numberOfWorkers;
+  memset( shards, 0, sizeof( *shards));
+  shards->wakeFd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC);
+  shards->shards = ( WorkerShard*) calloc( numberOfShards, sizeof( WorkerShard));
+  shards->shardOfWorker = ( int*) malloc( numberOfWorkers * sizeof( int));
+  if ( shards->wakeFd < 0 || !shards->shards || !shards->shardOfWorker ||
+       !initMpscQueue( &shards->inbox, INBOX_CAPACITY, sizeof( ShardItem)))
+    return false;
+  shards->numberOfShards = numberOfShards;
+  for ( int i = 0; i < numberOfShards; ++i)
+  {
+    if ( !initShard( &shards->shards[ i], shards, engineKind, numberOfWorkers))
+      return false;
+  }
+  for ( int i = 0; i < numberOfWorkers; ++i)
+  {
+    shards->shardOfWorker[ i] = i % numberOfShards;
+    if ( workers->isAlive[ i] &&
+         !adoptWorker( &shards->shards[ i % numberOfShards], i, workers->transports[ i]))
+      return false;
+  }
+  for ( int i = 0; i < numberOfShards; ++i)
+  {
+    if ( pthread_create( &shards->shards[ i].thread, NULL, runShard, &shards->shards[ i]))
+      return false;
+  }
+  return true;
+}
+
+static void postItem( WorkerShards *shards, int shardIndex, const ShardItem *item)
+{
+  WorkerShard *shard = &shards->shards[ shardIndex];
+  shard->hasPosts = true;
+  while ( !tryPushMpsc( &shard->outbox, item))
+  {
+    signalEventFd( shard->wakeFd);
+    sched_yield();
+  }
+}
+
+void postToWorker( WorkerShards *shards, int worker, int type, const void *payload, int length)
+{
+  ShardItem item;
+  item.kind = SHARD_SEND;
+  item.worker = worker;
+  item.header.type = type;
+  item.header.length = length;
+  if ( length > 0)
+    memcpy( item.payload, payload, length);
+  postItem( shards, shards->shardOfWorker[ worker], &item);
+}
+
+void postDropWorker( WorkerShards *shards, int worker)
+{
+  ShardItem item;
+  item.kind = SHARD_DROP;
+  item.worker = worker;
+  postItem( shards, shards->shardOfWorker[ worker], &item);
+}
+
+void wakeWorkerShards( WorkerShards *shards)
+{
+  for ( int i = 0; i < shards->numberOfShards; ++i)
+  {
+    WorkerShard *shard = &shards->shards[ i];
+    if ( !shard->hasPosts)
+      continue;
+    signalEventFd( shard->wakeFd);
+    shard->hasPosts = false;
+  }
+}
+
+void clearShardsWakeup( WorkerShards *shards)
+{
+  clearEventFd( shards->wakeFd);
+}
+
+bool takeShardItem( WorkerShards *shards, ShardItem *itemOut)
+{
+  return tryPopMpsc( &shards->inbox, itemOut);
+}
+
+void stopWorkerShards( WorkerShards *shards)
+{
+  ShardItem stop;
+  stop.kind = SHARD_STOP;
+  for ( int i = 0; i < shards->numberOfShards; ++i)
+    postItem( shards, i, &stop);
+  wakeWorkerShards( shards);
+  for ( int i = 0; i < shards->numberOfShards; ++i)
+  {
+    WorkerShard *shard = &shards->shards[ i];
+    pthread_join( shard->thread, NULL);
+    destroyIoEngine( &shard->engine);
+    for ( int j = 0; j < shard->fdCapacity; ++j)
+    {
+      int worker = shard->workerOfFd[ j];
+      if ( worker >= 0 && shard->transports[ worker].socket == j)
+        closeTransport( &shard->transports[ worker]);
+    }
+    destroyMpscQueue( &shard->outbox);
+    close( shard->wakeFd);
+    free( shard->transports);
+    free( shard->workerOfFd);
+    free( shard->overflow);
+  }
+  destroyMpscQueue( &shards->inbox);
+  close( shards->wakeFd);
+  free( shards->shards);
+  free( shards->shardOfWorker);
+  memset( shards, 0, sizeof( *shards));
+}
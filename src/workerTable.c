@@ -0,0 +1,154 @@
+
+/*
+  workerTable.c
+
+  The server's per-worker state in a struct-of-arrays layout.
+  Every array grows by doubling, so adding a worker is amortized
+  O(1); a socket's worker is found in O(1) through an array
+  indexed by file descriptor, which grows the same way.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "workerTable.h"
+
+#define MIN_CAPACITY 64
+
+static bool growArray( void **array, int oldCapacity, int newCapacity, size_t elementSize)
+{
+  void *grown = realloc( *array, newCapacity * elementSize);
+  if ( !grown)
+    return false;
+  memset( ( char*) grown + oldCapacity * elementSize, 0,
+    ( newCapacity - oldCapacity) * elementSize);
+  *array = grown;
+  return true;
+}
+
+static bool growWorkers( WorkerTable *table, int capacity)
+{
+  int oldCapacity = table->capacity;
+  if ( !growArray( ( void**) &table->transports, oldCapacity, capacity, sizeof( Transport)) ||
+       !growArray( ( void**) &table->isAlive, oldCapacity, capacity, sizeof( bool)) ||
+       !growArray( ( void**) &table->outstandingChunks, oldCapacity, capacity, sizeof( int)) ||
+       !growArray( ( void**) &table->credits, oldCapacity, capacity, sizeof( int)) ||
+       !growArray( ( void**) &table->lastHeardMs, oldCapacity, capacity, sizeof( double)) ||
+       !growArray( ( void**) &table->addresses, oldCapacity, capacity, sizeof( struct sockaddr_in)) ||
+       !growArray( ( void**) &table->benchmarks, oldCapacity, capacity, sizeof( Benchmark)) ||
+       !growArray( ( void**) &table->intervals, oldCapacity, capacity, sizeof( Interval)) ||
+       !growArray( ( void**) &table->clockOffsetNs, oldCapacity, capacity, sizeof( int64_t)) ||
+       !growArray( ( void**) &table->clockRoundTripNs, oldCapacity, capacity, sizeof( uint64_t)))
+    return false;
+  table->capacity = capacity;
+  return true;
+}
+
+static bool growFds( WorkerTable *table, int fd)
+{
+  int capacity = ( table->fdCapacity > 0)? table->fdCapacity : MIN_CAPACITY;
+  while ( capacity <= fd)
+    capacity *= 2;
+  int *grown = ( int*) realloc( table->workerOfFd, capacity * sizeof( int));
+  if ( !grown)
+    return false;
+  for ( int i = table->fdCapacity; i < capacity; ++i)
+    grown[ i] = -1;
+  table->workerOfFd = grown;
+  table->fdCapacity = capacity;
+  return true;
+}
+
+bool initWorkerTable( WorkerTable *table, int capacity)
+{
+  memset( table, 0, sizeof( *table));
+  if ( capacity < MIN_CAPACITY)
+    capacity = MIN_CAPACITY;
+  if ( !growWorkers( table, capacity) || !growFds( table, 0))
+  {
+    destroyWorkerTable( table);
+    return false;
+  }
+  return true;
+}
+
+void destroyWorkerTable( WorkerTable *table)
+{
+  free( table->transports);
+  free( table->isAlive);
+  free( table->outstandingChunks);
+  free( table->credits);
+  free( table->lastHeardMs);
+  free( table->addresses);
+  free( table->benchmarks);
+  free( table->intervals);
+  free( table->clockOffsetNs);
+  free( table->clockRoundTripNs);
+  free( table->workerOfFd);
+  memset( table, 0, sizeof( *table));
+}
+
+int addWorker( WorkerTable *table, Transport transport, struct sockaddr_in address)
+{
+  int socket = transport.socket;
+  if ( table->numberOfWorkers == table->capacity &&
+       !growWorkers( table, table->capacity * 2))
+    return -1;
+  if ( socket >= table->fdCapacity && !growFds( table, socket))
+    return -1;
+
+  int worker = table->numberOfWorkers ++;
+  table->transports[ worker] = transport;
+  table->isAlive[ worker] = true;
+  table->outstandingChunks[ worker] = 0;
+  table->credits[ worker] = 1;
+  table->lastHeardMs[ worker] = 0.0;
+  table->addresses[ worker] = address;
+  table->clockOffsetNs[ worker] = 0;
+  table->clockRoundTripNs[ worker] = UINT64_MAX;
+  table->workerOfFd[ socket] = worker;
+  table->numberOfAliveWorkers ++;
+  return worker;
+}
+
+int findWorkerByFd( const WorkerTable *table, int fd)
+{
+  if ( fd < 0 || fd >= table->fdCapacity)
+    return -1;
+  return table->workerOfFd[ fd];
+}
+
+bool trackTransportUpgrade( WorkerTable *table, int worker)
+{
+  int fd = transportEventFd( &table->transports[ worker]);
+  if ( fd >= table->fdCapacity && !growFds( table, fd))
+    return false;
+  table->workerOfFd[ fd] = worker;
+  return true;
+}
+
+void retireWorker( WorkerTable *table, int worker)
+{
+  if ( !table->isAlive[ worker])
+    return;
+  Transport *transport = &table->transports[ worker];
+  if ( transport->socket >= 0)
+  {
+    table->workerOfFd[ transport->socket] = -1;
+    table->workerOfFd[ transportEventFd( transport)] = -1;
+  }
+  transport->socket = -1;
+  transport->channel = NULL;
+  table->isAlive[ worker] = false;
+  table->outstandingChunks[ worker] = 0;
+  table->numberOfAliveWorkers --;
+}
+
+void dropWorker( WorkerTable *table, int worker)
+{
+  if ( !table->isAlive[ worker])
+    return;
+  Transport transport = table->transports[ worker];
+  retireWorker( table, worker);
+  closeTransport( &transport);
+}